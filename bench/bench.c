@@ -0,0 +1,741 @@
+/*
+ * Throughput and latency benchmark for librnotify.
+ *
+ * Each workload runs in its own child process: a generator thread
+ * performs the filesystem operations while the main thread consumes
+ * events with waitNotify. The generator stamps CLOCK_MONOTONIC right
+ * before each keyed syscall; the consumer matches the first event
+ * carrying that entry's name and records syscall-to-delivery latency.
+ *
+ * Output is one JSON object per workload on stdout:
+ *
+ *     {"workload":"bulk_create","size":10000,"threaded":0,"ops":10000,
+ *      "events":..., "seconds":..., "events_per_sec":...,
+ *      "lat_p50_us":..., "lat_p90_us":..., "lat_p99_us":...,
+ *      "lat_max_us":..., "overflows":..., "queue_peak":...,
+ *      "cpu_ms":..., "peak_rss_kb":..., "allocs_per_event":...,
+ *      "timeout":0}
+ *
+ * cpu_ms is the CPU time of the process minus the generator thread,
+ * i.e. what the library and its consumer cost. peak_rss_kb is the
+ * child's high-water mark. allocs_per_event counts the library's
+ * allocations (NotifyOptions.allocator hooks, alloc and realloc) from
+ * the end of initNotify to the last event. bench/compare.sh diffs two
+ * such outputs.
+ *
+ * -E <n> keeps n event records for reuse (NotifyOptions.event_pool).
+ *
+ * With -R <dir> the workloads run in <dir>/<workload> and each run is
+ * recorded to <dir>/<workload>.cap (NotifyOptions.record). -r <dir>
+ * then replays those captures through the engine alone, no kernel and
+ * no filesystem, and reports them as "replay_<workload>": the same
+ * input every time, for comparing parsing and bookkeeping cost
+ * between commits independently of the machine's I/O.
+ *
+ * Usage: bench [-n size] [-t] [-E n] [-w workload,...] [-R dir | -r dir | dir]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "rnotify.h"
+
+/* milliseconds without any event before a run is declared stuck */
+#define IDLE_TIMEOUT_MS 10000
+
+#define END_MARKER "__end__"
+
+/*
+ * Once the end marker is in, every kernel event of the workload has
+ * been queued; what may still follow are events the lazy crawl makes
+ * up. A run is over when none came for this long.
+ */
+#define DRAIN_MS 200
+
+/* changes only: the crawl's own opendir/readdir would otherwise show up */
+#define BENCH_MASK (IN_ALL_EVENTS & ~(IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE))
+
+struct bench
+{
+    const char* root;
+    unsigned long n;
+    uint64_t* stamp;        /* per keyed op: syscall time, 0 = not yet */
+    unsigned char* seen;    /* per keyed op: latency already taken */
+    unsigned long nops;
+    struct timespec gen_cpu;
+    int gen_errno;
+};
+
+struct workload
+{
+    const char* name;
+    char key;               /* name prefix of keyed entries, 0: none */
+    uint32_t key_mask;      /* event that completes a keyed op */
+    void (*setup)(struct bench* b);     /* before initNotify, may be NULL */
+    void (*run)(struct bench* b);       /* on the generator thread */
+    unsigned long (*ops)(unsigned long n);
+};
+
+/* Allocations made through the library's hooks. */
+static unsigned long g_allocs;
+
+static void* countAlloc(void* ud, size_t size)
+{
+    (void)ud;
+    __atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void* countRealloc(void* ud, void* ptr, size_t size)
+{
+    (void)ud;
+    __atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+static void countFree(void* ud, void* ptr)
+{
+    (void)ud;
+    free(ptr);
+}
+
+static const NotifyAllocator g_counting = { countAlloc, countRealloc, countFree, NULL };
+
+static double perEvent(unsigned long allocs, unsigned long events)
+{
+    return events ? (double)allocs / (double)events : 0.0;
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void stamp(struct bench* b, unsigned long i)
+{
+    if (i < b->nops)
+    {
+        __atomic_store_n(&b->stamp[i], nowNs(), __ATOMIC_RELEASE);
+    }
+}
+
+static void check(struct bench* b, int rc)
+{
+    if (rc == -1 && b->gen_errno == 0)
+    {
+        b->gen_errno = errno;
+    }
+}
+
+static void writeFile(struct bench* b, const char* path, size_t size, int flags)
+{
+    static const char data[4096];
+    int fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+    check(b, fd);
+    if (fd != -1)
+    {
+        check(b, (int)write(fd, data, size < sizeof(data) ? size : sizeof(data)));
+        close(fd);
+    }
+}
+
+static void endMarker(struct bench* b)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" END_MARKER, b->root);
+    writeFile(b, path, 0, 0);
+}
+
+static unsigned long opsN(unsigned long n)
+{
+    return n;
+}
+
+/* mkdir -p storm: chains of 10 nested directories, m0/m1/.../m9, ... */
+static void runMkdir(struct bench* b)
+{
+    char path[PATH_MAX];
+    for (unsigned long i = 0; i < b->n; i++)
+    {
+        size_t len = (i % 10 == 0) ? strlen(b->root) : strlen(path);
+        if (i % 10 == 0)
+        {
+            memcpy(path, b->root, len);
+        }
+        snprintf(path + len, sizeof(path) - len, "/m%lu", i);
+        stamp(b, i);
+        check(b, mkdir(path, 0755));
+    }
+}
+
+/* untar-like: directories of 100 files of 4 KiB each */
+static void runBulkCreate(struct bench* b)
+{
+    char path[PATH_MAX];
+    for (unsigned long i = 0; i < b->n; i++)
+    {
+        if (i % 100 == 0)
+        {
+            snprintf(path, sizeof(path), "%s/b%lu", b->root, i / 100);
+            check(b, mkdir(path, 0755));
+        }
+        snprintf(path, sizeof(path), "%s/b%lu/f%lu", b->root, i / 100, i);
+        stamp(b, i);
+        writeFile(b, path, 4096, 0);
+    }
+}
+
+/* editor-style saves: write a temp file, rename it over the document */
+static void runAtomicSave(struct bench* b)
+{
+    char tmp[PATH_MAX];
+    char doc[PATH_MAX];
+    snprintf(doc, sizeof(doc), "%s/doc", b->root);
+    for (unsigned long i = 0; i < b->n; i++)
+    {
+        snprintf(tmp, sizeof(tmp), "%s/t%lu", b->root, i);
+        writeFile(b, tmp, 1024, 0);
+        stamp(b, i);
+        check(b, rename(tmp, doc));
+    }
+}
+
+/* deep renames: a pre-existing tree of n directories renamed over and over */
+static unsigned long opsRename(unsigned long n)
+{
+    return (n / 100 < 10) ? 10 : n / 100;
+}
+
+static void setupRename(struct bench* b)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/r0", b->root);
+    mkdir(path, 0755);
+    /* breadth-first, fanout 10: directory i lives in directory (i - 1) / 10 */
+    char** dirs = calloc(b->n + 1, sizeof(char*));
+    dirs[0] = strdup(path);
+    for (unsigned long i = 1; i <= b->n && dirs[(i - 1) / 10]; i++)
+    {
+        snprintf(path, sizeof(path), "%s/d%lu", dirs[(i - 1) / 10], i);
+        if (strlen(path) < PATH_MAX - 64 && mkdir(path, 0755) == 0)
+        {
+            dirs[i] = strdup(path);
+        }
+    }
+    for (unsigned long i = 0; i <= b->n; i++)
+    {
+        free(dirs[i]);
+    }
+    free(dirs);
+}
+
+static void runRename(struct bench* b)
+{
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    for (unsigned long i = 1; i < b->nops; i++)
+    {
+        snprintf(from, sizeof(from), "%s/r%lu", b->root, i - 1);
+        snprintf(to, sizeof(to), "%s/r%lu", b->root, i);
+        stamp(b, i);
+        check(b, rename(from, to));
+    }
+}
+
+/* rm -rf of a pre-existing tree of n files in directories of 100 */
+static void setupRemove(struct bench* b)
+{
+    char path[PATH_MAX];
+    for (unsigned long i = 0; i < b->n; i++)
+    {
+        if (i % 100 == 0)
+        {
+            snprintf(path, sizeof(path), "%s/g%lu", b->root, i / 100);
+            mkdir(path, 0755);
+        }
+        snprintf(path, sizeof(path), "%s/g%lu/f%lu", b->root, i / 100, i);
+        writeFile(b, path, 0, 0);
+    }
+}
+
+static struct bench* removing;
+
+static int removeOne(const char* path, const struct stat* sb, int type, struct FTW* ftw)
+{
+    (void)sb;
+    if (ftw->level == 0)
+    {
+        return 0;
+    }
+    const char* name = path + ftw->base;
+    if (name[0] == 'f')
+    {
+        stamp(removing, strtoul(name + 1, NULL, 10));
+    }
+    check(removing, (type == FTW_DP) ? rmdir(path) : unlink(path));
+    return 0;
+}
+
+static void runRemove(struct bench* b)
+{
+    removing = b;
+    check(b, nftw(b->root, removeOne, 64, FTW_DEPTH | FTW_PHYS));
+}
+
+/* append flood: n small appends to one file (the kernel coalesces) */
+static void setupAppend(struct bench* b)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/log", b->root);
+    writeFile(b, path, 0, 0);
+}
+
+static void runAppend(struct bench* b)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/log", b->root);
+    int fd = open(path, O_WRONLY | O_APPEND);
+    check(b, fd);
+    static const char line[64] = "0123456789012345678901234567890123456789012345678901234567890\n";
+    for (unsigned long i = 0; fd != -1 && i < b->n; i++)
+    {
+        check(b, (int)write(fd, line, sizeof(line)));
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+static unsigned long opsNone(unsigned long n)
+{
+    (void)n;
+    return 0;
+}
+
+static const struct workload workloads[] = {
+    { "mkdir_storm",  'm', IN_CREATE,     NULL,        runMkdir,      opsN },
+    { "bulk_create",  'f', IN_CREATE,     NULL,        runBulkCreate, opsN },
+    { "atomic_save",  't', IN_MOVED_FROM, NULL,        runAtomicSave, opsN },
+    { "deep_rename",  'r', IN_MOVED_TO,   setupRename, runRename,     opsRename },
+    { "rm_rf",        'f', IN_DELETE,     setupRemove, runRemove,     opsN },
+    { "append_flood", 0,   0,             setupAppend, runAppend,     opsNone },
+};
+
+struct genArgs
+{
+    struct bench* b;
+    const struct workload* w;
+};
+
+static void* genMain(void* arg)
+{
+    struct genArgs* g = (struct genArgs*)arg;
+    g->w->run(g->b);
+    endMarker(g->b);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &g->b->gen_cpu);
+    return NULL;
+}
+
+static int cmpU64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentileUs(const uint64_t* v, size_t n, double p)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return (double)v[i] / 1000.0;
+}
+
+/* Index of a keyed entry from its path, or -1. */
+static long keyIndex(const char* path, char key)
+{
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (key == 0 || name[0] != key || name[1] < '0' || name[1] > '9')
+    {
+        return -1;
+    }
+    char* end = NULL;
+    unsigned long i = strtoul(name + 1, &end, 10);
+    return (*end == '\0') ? (long)i : -1;
+}
+
+static int removeAll(const char* path, const struct stat* sb, int type, struct FTW* ftw)
+{
+    (void)sb;
+    (void)ftw;
+    return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+/* Run one workload in the current (child) process and print its line. */
+static int runWorkload(const struct workload* w, const char* base, unsigned long n, int threaded, int record, unsigned int pool)
+{
+    char capture[PATH_MAX];
+    snprintf(capture, sizeof(capture), "%s/%s.cap", base, w->name);
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/%s", base, w->name);
+    if (mkdir(root, 0755) == -1)
+    {
+        perror(root);
+        return 1;
+    }
+
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.root = root;
+    b.n = n;
+    b.nops = w->ops(n);
+    b.stamp = calloc(b.nops + 1, sizeof(uint64_t));
+    b.seen = calloc(b.nops + 1, 1);
+    uint64_t* lat = calloc(b.nops + 1, sizeof(uint64_t));
+    if (b.stamp == NULL || b.seen == NULL || lat == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    if (w->setup)
+    {
+        w->setup(&b);
+    }
+
+    NotifyOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.scan = NOTIFY_SCAN_WATCHES;
+    opts.threaded = threaded;
+    opts.record = record ? capture : NULL;
+    opts.allocator = &g_counting;
+    opts.event_pool = pool;
+    Notify* ntf = initNotifyOpts(root, BENCH_MASK, NULL, &opts);
+    if (ntf == NULL)
+    {
+        fprintf(stderr, "initNotify(%s): %s\n", root, strerror(errno));
+        return 1;
+    }
+    unsigned long allocs0 = __atomic_load_n(&g_allocs, __ATOMIC_RELAXED);
+
+    struct timespec cpu0;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    uint64_t t0 = nowNs();
+
+    pthread_t gen;
+    struct genArgs ga = { &b, w };
+    pthread_create(&gen, NULL, genMain, &ga);
+
+    unsigned long events = 0;
+    unsigned long overflows = 0;
+    size_t nlat = 0;
+    int timed_out = 0;
+    int ending = 0;
+    uint64_t t1 = t0;
+    for (;;)
+    {
+        char* path = NULL;
+        uint32_t mask = 0;
+        uint32_t cookie = 0;
+        int rc = waitNotify(ntf, &path, &mask, ending ? DRAIN_MS : IDLE_TIMEOUT_MS, &cookie);
+        if (rc != 0 && ending && rc != -1)
+        {
+            break;
+        }
+        if (rc != 0)
+        {
+            if (rc == -1)
+            {
+                fprintf(stderr, "%s: waitNotify: %s\n", w->name, strerror(errno));
+            }
+            timed_out = 1;
+            notifyFree(ntf, path);
+            break;
+        }
+        uint64_t t = nowNs();
+        t1 = t;
+        events++;
+        if (mask & IN_Q_OVERFLOW)
+        {
+            overflows++;
+        }
+        long i = (mask & w->key_mask) ? keyIndex(path, w->key) : -1;
+        if (i >= 0 && (unsigned long)i < b.nops && !b.seen[i])
+        {
+            uint64_t s = __atomic_load_n(&b.stamp[i], __ATOMIC_ACQUIRE);
+            if (s != 0 && t >= s)
+            {
+                b.seen[i] = 1;
+                lat[nlat++] = t - s;
+            }
+        }
+        const char* name = strrchr(path, '/');
+        if ((mask & IN_CREATE) && name && !strcmp(name + 1, END_MARKER))
+        {
+            ending = 1;
+        }
+        notifyFree(ntf, path);
+    }
+    unsigned long allocs = __atomic_load_n(&g_allocs, __ATOMIC_RELAXED) - allocs0;
+    pthread_join(gen, NULL);
+
+    struct timespec cpu1;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+    double cpu_ms = (double)(cpu1.tv_sec - cpu0.tv_sec) * 1e3
+        + (double)(cpu1.tv_nsec - cpu0.tv_nsec) / 1e6
+        - ((double)b.gen_cpu.tv_sec * 1e3 + (double)b.gen_cpu.tv_nsec / 1e6);
+
+    NotifyStats st;
+    notifyStats(ntf, &st);
+    freeNotify(ntf);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    qsort(lat, nlat, sizeof(uint64_t), cmpU64);
+    double seconds = (double)(t1 - t0) / 1e9;
+    printf("{\"workload\":\"%s\",\"size\":%lu,\"threaded\":%d,\"ops\":%lu,"
+           "\"events\":%lu,\"seconds\":%.3f,\"events_per_sec\":%.0f,"
+           "\"lat_p50_us\":%.1f,\"lat_p90_us\":%.1f,\"lat_p99_us\":%.1f,\"lat_max_us\":%.1f,"
+           "\"overflows\":%lu,\"queue_peak\":%lu,\"cpu_ms\":%.1f,\"peak_rss_kb\":%ld,"
+           "\"allocs_per_event\":%.2f,\"timeout\":%d}\n",
+           w->name, n, threaded, b.nops ? b.nops : n,
+           events, seconds, seconds > 0 ? (double)events / seconds : 0.0,
+           percentileUs(lat, nlat, 0.50), percentileUs(lat, nlat, 0.90),
+           percentileUs(lat, nlat, 0.99), nlat ? (double)lat[nlat - 1] / 1000.0 : 0.0,
+           overflows, st.queue_peak, cpu_ms < 0 ? 0.0 : cpu_ms, ru.ru_maxrss,
+           perEvent(allocs, events), timed_out);
+    if (b.gen_errno)
+    {
+        fprintf(stderr, "%s: generator: %s\n", w->name, strerror(b.gen_errno));
+    }
+
+    nftw(root, removeAll, 64, FTW_DEPTH | FTW_PHYS);
+    free(lat);
+    free(b.seen);
+    free(b.stamp);
+    return (timed_out || b.gen_errno) ? 1 : 0;
+}
+
+/* Replay <base>/<workload>.cap, recorded by -R, and print its line. */
+static int runReplay(const struct workload* w, const char* base, unsigned int pool)
+{
+    char root[PATH_MAX];
+    char capture[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/%s", base, w->name);
+    snprintf(capture, sizeof(capture), "%s/%s.cap", base, w->name);
+    if (access(capture, R_OK) == -1)
+    {
+        /* not recorded: nothing to report */
+        return 0;
+    }
+
+    struct timespec cpu0;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    uint64_t t0 = nowNs();
+
+    NotifyOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.scan = NOTIFY_SCAN_WATCHES;
+    opts.replay = capture;
+    opts.allocator = &g_counting;
+    opts.event_pool = pool;
+    Notify* ntf = initNotifyOpts(root, BENCH_MASK, NULL, &opts);
+    if (ntf == NULL)
+    {
+        fprintf(stderr, "replay %s: %s\n", capture, strerror(errno));
+        return 1;
+    }
+    unsigned long allocs0 = __atomic_load_n(&g_allocs, __ATOMIC_RELAXED);
+
+    unsigned long events = 0;
+    unsigned long overflows = 0;
+    int rc = 0;
+    for (;;)
+    {
+        char* path = NULL;
+        uint32_t mask = 0;
+        rc = waitNotify(ntf, &path, &mask, 0, NULL);
+        notifyFree(ntf, path);
+        if (rc != 0)
+        {
+            break;
+        }
+        events++;
+        if (mask & IN_Q_OVERFLOW)
+        {
+            overflows++;
+        }
+    }
+    unsigned long allocs = __atomic_load_n(&g_allocs, __ATOMIC_RELAXED) - allocs0;
+    int failed = !(rc == -1 && errno == ENODATA);
+    if (failed)
+    {
+        fprintf(stderr, "replay %s: %s\n", capture, rc == -1 ? strerror(errno) : "stopped early");
+    }
+
+    NotifyStats st;
+    notifyStats(ntf, &st);
+    freeNotify(ntf);
+    uint64_t t1 = nowNs();
+    struct timespec cpu1;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    double seconds = (double)(t1 - t0) / 1e9;
+    printf("{\"workload\":\"replay_%s\",\"size\":0,\"threaded\":0,\"ops\":0,"
+           "\"events\":%lu,\"seconds\":%.3f,\"events_per_sec\":%.0f,"
+           "\"lat_p50_us\":0.0,\"lat_p90_us\":0.0,\"lat_p99_us\":0.0,\"lat_max_us\":0.0,"
+           "\"overflows\":%lu,\"queue_peak\":%lu,\"cpu_ms\":%.1f,\"peak_rss_kb\":%ld,"
+           "\"allocs_per_event\":%.2f,\"timeout\":0}\n",
+           w->name, events, seconds, seconds > 0 ? (double)events / seconds : 0.0,
+           overflows, st.queue_peak,
+           (double)(cpu1.tv_sec - cpu0.tv_sec) * 1e3 + (double)(cpu1.tv_nsec - cpu0.tv_nsec) / 1e6,
+           ru.ru_maxrss, perEvent(allocs, events));
+    return failed;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-n size] [-t] [-E n] [-w workload,...] [-R dir | -r dir | dir]\nworkloads:", prog);
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+    fputc('\n', stderr);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long n = 10000;
+    int threaded = 0;
+    unsigned int pool = 0;
+    const char* only = NULL;
+    const char* record = NULL;
+    const char* replay = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:tE:w:R:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            threaded = 1;
+            break;
+        case 'E':
+            pool = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        case 'R':
+            record = optarg;
+            break;
+        case 'r':
+            replay = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc - 1
+        || n == 0
+        || (record && replay)
+        || ((record || replay) && optind != argc))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char base[PATH_MAX];
+    if (record || replay)
+    {
+        /* captures hold absolute paths: replay must see the same ones */
+        if (record)
+        {
+            mkdir(record, 0755);
+        }
+        if (realpath(record ? record : replay, base) == NULL)
+        {
+            perror(record ? record : replay);
+            return 1;
+        }
+    }
+    else if (optind == argc - 1)
+    {
+        snprintf(base, sizeof(base), "%s/rnotify-bench.XXXXXX", argv[optind]);
+    }
+    else
+    {
+        snprintf(base, sizeof(base), "/tmp/rnotify-bench.XXXXXX");
+    }
+    if (!record && !replay
+        && mkdtemp(base) == NULL)
+    {
+        perror(base);
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        const struct workload* w = &workloads[i];
+        if (only)
+        {
+            const char* hit = strstr(only, w->name);
+            size_t len = strlen(w->name);
+            if (hit == NULL
+                || (hit != only && hit[-1] != ',')
+                || (hit[len] != '\0' && hit[len] != ','))
+            {
+                continue;
+            }
+        }
+        /* a child per workload: peak RSS and leaks stay per workload */
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            _exit(replay ? runReplay(w, base, pool) : runWorkload(w, base, n, threaded, record != NULL, pool));
+        }
+        int status = 0;
+        if (pid == -1
+            || waitpid(pid, &status, 0) == -1
+            || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "%s: failed\n", w->name);
+            failed = 1;
+        }
+    }
+
+    if (!record && !replay)
+    {
+        rmdir(base);
+    }
+    return failed;
+}
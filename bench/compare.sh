@@ -0,0 +1,56 @@
+#!/bin/sh
+# Compare two `bench` outputs (one JSON object per line), e.g.
+#
+#     git checkout old && make bench > old.jsonl
+#     git checkout new && make bench > new.jsonl
+#     bench/compare.sh old.jsonl new.jsonl
+#
+# Prints each metric of every workload present in both files with the
+# relative change. Only the flat objects bench itself emits are parsed.
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 old.jsonl new.jsonl" >&2
+    exit 2
+fi
+
+awk '
+function parse(line, kv,    n, i, f, k, v) {
+    gsub(/[{}"]/, "", line)
+    n = split(line, f, ",")
+    for (i = 1; i <= n; i++) {
+        k = substr(f[i], 1, index(f[i], ":") - 1)
+        v = substr(f[i], index(f[i], ":") + 1)
+        kv[k] = v
+    }
+}
+BEGIN {
+    nm = split("events_per_sec lat_p50_us lat_p90_us lat_p99_us lat_max_us overflows queue_peak cpu_ms peak_rss_kb allocs_per_event", metric, " ")
+}
+FNR == 1 { file++ }
+/^\{/ {
+    delete kv
+    parse($0, kv)
+    id = kv["workload"] (kv["threaded"] == 1 ? "/threaded" : "")
+    if (file == 1) {
+        for (m = 1; m <= nm; m++) old[id, metric[m]] = kv[metric[m]]
+        seen[id] = 1
+    } else if (id in seen) {
+        if (!(id in printed)) { order[++nid] = id; printed[id] = 1 }
+        for (m = 1; m <= nm; m++) new[id, metric[m]] = kv[metric[m]]
+    }
+}
+END {
+    printf "%-24s %-15s %14s %14s %9s\n", "workload", "metric", "old", "new", "change"
+    for (i = 1; i <= nid; i++) {
+        id = order[i]
+        for (m = 1; m <= nm; m++) {
+            o = old[id, metric[m]]; n = new[id, metric[m]]
+            if (o + 0 != 0)
+                ch = sprintf("%+.1f%%", (n - o) * 100 / o)
+            else
+                ch = (n + 0 == 0) ? "=" : "new"
+            printf "%-24s %-15s %14s %14s %9s\n", id, metric[m], o, n, ch
+        }
+    }
+}
+' "$1" "$2"
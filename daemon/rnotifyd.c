@@ -0,0 +1,533 @@
+/*
+ * rnotifyd: one recursive watcher per host, shared over a Unix socket.
+ *
+ * Watches <dir> with initNotifyOpts (every watch in place before the
+ * socket opens, no events for what already exists) and serves the
+ * events to the clients of NotifyClient (notifyConnect), each with its
+ * own subscription: a path prefix, a mask and a regex filter. The
+ * protocol is in rnotify_daemon.h.
+ *
+ * One thread, one poll loop. Each round delivers what the library has
+ * queued through notifyDispatch, appending every event to the output
+ * of the clients it matches, then writes to each client once: all it
+ * has pending, as one DAEMON_EVENTS frame (more when it would pass
+ * DAEMON_FRAME_MAX, which clients refuse). A client whose unsent
+ * output reaches the -b limit gets nothing more until it has read
+ * what is pending; then it gets IN_Q_OVERFLOW (empty path), as the
+ * library's own consumers do when events were lost, and the stream
+ * goes on.
+ *
+ * Usage: rnotifyd [-x exclude] [-m rename_window] [-b bytes] <socket> <dir>
+ *
+ * "READY" goes to stderr once the socket listens. On SIGTERM or SIGINT
+ * the daemon removes the socket, writes "STATS clients=<n> events=<n>
+ * frames=<n> overflows=<n>" (clients served, events and frames sent,
+ * clients told about lost events) to stderr and exits 0.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rnotify.h"
+#include "rnotify_daemon.h"
+
+/*
+ * A connection. `in` collects its DAEMON_SUBSCRIBE; `out[off..len)`
+ * is still to be written; `batch` is the offset in `out` of the
+ * DAEMON_EVENTS frame being filled, SIZE_MAX when none is.
+ */
+struct client
+{
+    int fd;
+    int subscribed;
+    uint32_t mask;
+    char* prefix;
+    size_t prefix_len;
+    regex_t filter;
+    int has_filter;
+    char* in;
+    size_t in_len;
+    char* out;
+    size_t off;
+    size_t len;
+    size_t cap;
+    size_t batch;
+    int lost;
+    struct client* next;
+};
+
+static volatile sig_atomic_t g_stop = 0;
+static void onTerm(int sig) { (void)sig; g_stop = 1; }
+
+static struct client* g_clients = NULL;
+static size_t g_limit = 4u << 20;
+static unsigned long g_served = 0;
+static unsigned long g_events = 0;
+static unsigned long g_frames = 0;
+static unsigned long g_overflows = 0;
+
+static void freeClient(struct client* c)
+{
+    close(c->fd);
+    if (c->has_filter)
+    {
+        regfree(&c->filter);
+    }
+    free(c->prefix);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/* Append `len` bytes to c's output. -1 on allocation failure. */
+static int put(struct client* c, const void* data, size_t len)
+{
+    if (c->len + len > c->cap)
+    {
+        size_t cap = c->cap ? c->cap : 65536;
+        while (cap < c->len + len)
+        {
+            cap *= 2;
+        }
+        char* out = (char*)realloc(c->out, cap);
+        if (out == NULL)
+        {
+            return -1;
+        }
+        c->out = out;
+        c->cap = cap;
+    }
+    memcpy(c->out + c->len, data, len);
+    c->len += len;
+    return 0;
+}
+
+/*
+ * Add one event to the DAEMON_EVENTS frame being filled for `c`, or to
+ * a new one when it would pass DAEMON_FRAME_MAX: the -b limit is
+ * checked before an event is added, not against the frame.
+ */
+static int putEvent(struct client* c, const char* path, size_t path_len, uint32_t mask, uint32_t cookie)
+{
+    if (c->batch != SIZE_MAX
+        && c->len - c->batch - sizeof(struct daemonFrame) + sizeof(struct daemonEvent) + path_len > DAEMON_FRAME_MAX)
+    {
+        c->batch = SIZE_MAX;
+        g_frames++;
+    }
+    if (c->batch == SIZE_MAX)
+    {
+        struct daemonFrame f = { 0, DAEMON_EVENTS };
+        c->batch = c->len;
+        if (put(c, &f, sizeof(f)) == -1)
+        {
+            return -1;
+        }
+    }
+    struct daemonEvent ev = { mask, cookie, (uint32_t)path_len };
+    if (put(c, &ev, sizeof(ev)) == -1
+        || put(c, path, path_len) == -1)
+    {
+        return -1;
+    }
+    uint32_t frame = (uint32_t)(c->len - c->batch - sizeof(struct daemonFrame));
+    memcpy(c->out + c->batch, &frame, sizeof(frame));
+    g_events++;
+    return 0;
+}
+
+/* Does `c` subscribe to `path` with `mask`? */
+static int matches(const struct client* c, const char* path, uint32_t mask)
+{
+    if (path[0] == '\0')
+    {
+        return 1;
+    }
+    if (!(mask & c->mask))
+    {
+        return 0;
+    }
+    if (c->prefix_len
+        && (strncmp(path, c->prefix, c->prefix_len)
+            || (path[c->prefix_len] != '\0'
+                && path[c->prefix_len] != '/'
+                && c->prefix[c->prefix_len - 1] != '/')))
+    {
+        return 0;
+    }
+    return !c->has_filter || regexec(&c->filter, path, 0, NULL, 0) == 0;
+}
+
+/* notifyDispatch handler: queue the event for every client it matches. */
+static void route(const char* path, uint32_t mask, uint32_t cookie, void* arg)
+{
+    (void)arg;
+    size_t path_len = strlen(path) + 1;
+    if (mask & NOTIFY_RENAME)
+    {
+        path_len += strlen(path + path_len) + 1;
+    }
+    for (struct client* c = g_clients; c; c = c->next)
+    {
+        if (!c->subscribed
+            || c->lost
+            || !matches(c, path, mask))
+        {
+            continue;
+        }
+        if (c->len - c->off >= g_limit
+            || putEvent(c, path, path_len, mask, cookie) == -1)
+        {
+            c->lost = 1;
+        }
+    }
+}
+
+/*
+ * Parse the DAEMON_SUBSCRIBE in c->in once it is all there and answer
+ * it. Returns 0 (also while incomplete), -1 to hang up.
+ */
+static int subscribe(struct client* c)
+{
+    struct daemonFrame f;
+    struct daemonSub sub;
+    if (c->in_len < sizeof(f))
+    {
+        return 0;
+    }
+    memcpy(&f, c->in, sizeof(f));
+    if (f.type != DAEMON_SUBSCRIBE
+        || f.len < sizeof(sub)
+        || f.len > DAEMON_FRAME_MAX)
+    {
+        return -1;
+    }
+    if (c->in_len < sizeof(f) + f.len)
+    {
+        return 0;
+    }
+    memcpy(&sub, c->in + sizeof(f), sizeof(sub));
+    if ((uint64_t)sub.prefix_len + sub.filter_len != f.len - sizeof(sub))
+    {
+        return -1;
+    }
+
+    const char* prefix = c->in + sizeof(f) + sizeof(sub);
+    int32_t err = 0;
+    c->mask = sub.mask;
+    c->prefix = strndup(prefix, sub.prefix_len);
+    c->prefix_len = sub.prefix_len;
+    if (c->prefix == NULL)
+    {
+        return -1;
+    }
+    if (sub.filter_len)
+    {
+        char* filter = strndup(prefix + sub.prefix_len, sub.filter_len);
+        if (filter == NULL)
+        {
+            return -1;
+        }
+        c->has_filter = (regcomp(&c->filter, filter, REG_EXTENDED | REG_NOSUB) == 0);
+        err = c->has_filter ? 0 : EINVAL;
+        free(filter);
+    }
+
+    struct daemonFrame ack = { sizeof(err), DAEMON_ACK };
+    if (put(c, &ack, sizeof(ack)) == -1
+        || put(c, &err, sizeof(err)) == -1)
+    {
+        return -1;
+    }
+    c->subscribed = (err == 0);
+    g_served += c->subscribed;
+    return 0;
+}
+
+/* Read what `c` sent. Returns -1 to hang up. */
+static int readClient(struct client* c)
+{
+    char buf[4096];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == -1)
+    {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    if (n == 0
+        || c->prefix != NULL)
+    {
+        /* once answered there is nothing to say but goodbye */
+        return n ? 0 : -1;
+    }
+    char* in = (char*)realloc(c->in, c->in_len + (size_t)n);
+    if (in == NULL)
+    {
+        return -1;
+    }
+    memcpy(in + c->in_len, buf, (size_t)n);
+    c->in = in;
+    c->in_len += (size_t)n;
+    return subscribe(c);
+}
+
+/*
+ * Close the frame being filled and write what `c` has pending, as far
+ * as the socket takes it. A client that lost events hears about it
+ * once everything before the loss is out. Returns -1 to hang up.
+ */
+static int writeClient(struct client* c)
+{
+    do
+    {
+        if (c->lost
+            && c->off == c->len)
+        {
+            c->lost = 0;
+            g_overflows++;
+            if (putEvent(c, "", 1, IN_Q_OVERFLOW, 0) == -1)
+            {
+                return -1;
+            }
+        }
+        if (c->batch != SIZE_MAX)
+        {
+            c->batch = SIZE_MAX;
+            g_frames++;
+        }
+        while (c->off < c->len)
+        {
+            ssize_t n = send(c->fd, c->out + c->off, c->len - c->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n == -1)
+            {
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+            }
+            c->off += (size_t)n;
+        }
+        c->off = c->len = 0;
+    } while (c->lost);
+
+    /* whatever a slow client made us hold, do not keep it */
+    if (c->cap > (1u << 20))
+    {
+        free(c->out);
+        c->out = NULL;
+        c->cap = 0;
+    }
+    return 0;
+}
+
+static int listenOn(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || listen(fd, 64) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+static void acceptClients(int lfd)
+{
+    for (;;)
+    {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd == -1)
+        {
+            return;
+        }
+        struct client* c = (struct client*)calloc(1, sizeof(struct client));
+        if (c == NULL)
+        {
+            close(fd);
+            return;
+        }
+        c->fd = fd;
+        c->batch = SIZE_MAX;
+        c->next = g_clients;
+        g_clients = c;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* exclude = NULL;
+    NotifyOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.scan = NOTIFY_SCAN_WATCHES;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:m:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            exclude = optarg;
+            break;
+        case 'm':
+            opts.rename_window = atoi(optarg);
+            break;
+        case 'b':
+            g_limit = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 2
+        || g_limit == 0)
+    {
+        fprintf(stderr, "usage: %s [-x exclude] [-m rename_window] [-b bytes] <socket> <dir>\n", argv[0]);
+        return 2;
+    }
+    const char* sock = argv[optind];
+    const char* dir = argv[optind + 1];
+
+    struct sigaction sa = { .sa_handler = onTerm };
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    Notify* ntf = initNotifyOpts(dir, IN_ALL_EVENTS, exclude, &opts);
+    if (ntf == NULL)
+    {
+        fprintf(stderr, "initNotify(%s) failed: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    notifyOn(ntf, 0xffffffff, route, NULL);
+    int lfd = listenOn(sock);
+    if (lfd == -1)
+    {
+        fprintf(stderr, "listen(%s) failed: %s\n", sock, strerror(errno));
+        freeNotify(ntf);
+        return 1;
+    }
+    fprintf(stderr, "READY\n");
+    fflush(stderr);
+
+    struct pollfd* fds = NULL;
+    size_t nfds_cap = 0;
+    int exitcode = 0;
+    while (!g_stop)
+    {
+        /* deliver everything queued, then write each client once */
+        int n;
+        do
+        {
+            n = notifyDispatch(ntf, 256, 0);
+        } while (n == 256);
+        if (n == -1
+            && errno != EINTR)
+        {
+            fprintf(stderr, "notifyDispatch error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+        for (struct client** p = &g_clients; *p; )
+        {
+            struct client* c = *p;
+            if (writeClient(c) == -1)
+            {
+                *p = c->next;
+                freeClient(c);
+                continue;
+            }
+            p = &c->next;
+        }
+
+        size_t nfds = 2;
+        for (struct client* c = g_clients; c; c = c->next)
+        {
+            nfds++;
+        }
+        if (nfds > nfds_cap)
+        {
+            struct pollfd* grown = (struct pollfd*)realloc(fds, nfds * sizeof(*fds));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                exitcode = 1;
+                break;
+            }
+            fds = grown;
+            nfds_cap = nfds;
+        }
+        fds[0] = (struct pollfd){ notifyFd(ntf), POLLIN, 0 };
+        fds[1] = (struct pollfd){ lfd, POLLIN, 0 };
+        size_t i = 2;
+        for (struct client* c = g_clients; c; c = c->next, i++)
+        {
+            fds[i] = (struct pollfd){ c->fd, (short)(POLLIN | ((c->off < c->len) ? POLLOUT : 0)), 0 };
+        }
+        /* a held IN_MOVED_FROM is only released by the next dispatch */
+        if (poll(fds, nfds, notifyTimeout(ntf)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "poll error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+
+        i = 2;
+        for (struct client** p = &g_clients; *p; i++)
+        {
+            struct client* c = *p;
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                && readClient(c) == -1)
+            {
+                *p = c->next;
+                freeClient(c);
+                continue;
+            }
+            p = &c->next;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            acceptClients(lfd);
+        }
+    }
+
+    close(lfd);
+    unlink(sock);
+    while (g_clients)
+    {
+        struct client* next = g_clients->next;
+        freeClient(g_clients);
+        g_clients = next;
+    }
+    free(fds);
+    freeNotify(ntf);
+    fprintf(stderr, "STATS clients=%lu events=%lu frames=%lu overflows=%lu\n",
+            g_served, g_events, g_frames, g_overflows);
+    return exitcode;
+}
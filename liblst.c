@@ -17,13 +17,70 @@
 #include <ctype.h>
 #include <limits.h>
 
+#include "liblst.h"
+
+/* malloc, or the allocator's alloc hook. errno is ENOMEM on failure. */
+void* lstAlloc(const lstAllocator* a, size_t size)
+{
+    void* p = (a && a->alloc) ? a->alloc(a->ud, size) : malloc(size);
+    if (p == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+/* Zeroed array of `n` elements, with calloc's overflow check. */
+void* lstCalloc(const lstAllocator* a, size_t n, size_t size)
+{
+    if (size && n > (size_t)-1 / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* p = lstAlloc(a, n * size);
+    if (p != NULL)
+    {
+        memset(p, 0, n * size);
+    }
+    return p;
+}
+
+/* realloc, or the allocator's realloc hook. */
+void* lstRealloc(const lstAllocator* a, void* ptr, size_t size)
+{
+    void* p = (a && a->alloc) ? a->realloc(a->ud, ptr, size) : realloc(ptr, size);
+    if (p == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+/* free, or the allocator's free hook. Safe to pass NULL. */
+void lstRelease(const lstAllocator* a, void* ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    if (a && a->alloc)
+    {
+        a->free(a->ud, ptr);
+    }
+    else
+    {
+        free(ptr);
+    }
+}
+
 /*
  * Append a strdup'd copy of `str` to the NULL-terminated `**lst`.
  * Allocates the list on first call if `*lst` is NULL. Returns the
  * index of the inserted element on success, or -1 on allocation
  * failure / NULL input (errno set to EINVAL or ENOMEM).
  */
-ssize_t lstPush(char*** lst, const char* str)
+ssize_t lstPush(const lstAllocator* a, char*** lst, const char* str)
 {
     if (lst == NULL
         || str == NULL)
@@ -37,7 +94,7 @@ ssize_t lstPush(char*** lst, const char* str)
 
     if (*lst == NULL)
     {
-        *lst = (char**)malloc(len_ptr);
+        *lst = (char**)lstAlloc(a, len_ptr);
         if (*lst == NULL)
         {
             return -1;
@@ -53,17 +110,17 @@ ssize_t lstPush(char*** lst, const char* str)
     }
 
     size_t str_size = strlen(str) + 1;
-    (*lst)[i] = (char*)malloc(str_size);
+    (*lst)[i] = (char*)lstAlloc(a, str_size);
     if ((*lst)[i] == NULL)
     {
         return -1;
     }
     memcpy((*lst)[i], str, str_size);
 
-    char** t = (char**)realloc(*lst, len_ptr*(i + 2));
+    char** t = (char**)lstRealloc(a, *lst, len_ptr*(i + 2));
     if (t == NULL)
     {
-        free((*lst)[i]);
+        lstRelease(a, (*lst)[i]);
         (*lst)[i] = NULL;
         return -1;
     }
@@ -76,7 +133,7 @@ ssize_t lstPush(char*** lst, const char* str)
 
 /* Release a NULL-terminated string list built by lstPush/lstReadDir.
  * Safe to pass NULL. */
-void lstFree(char** lst)
+void lstFree(const lstAllocator* a, char** lst)
 {
     if (lst == NULL)
     {
@@ -86,10 +143,10 @@ void lstFree(char** lst)
     size_t i = 0;
     while (lst[i])
     {
-        free(lst[i]);
+        lstRelease(a, lst[i]);
         i++;
     }
-    free(lst);
+    lstRelease(a, lst);
 }
 
 /*
@@ -100,7 +157,7 @@ void lstFree(char** lst)
  * Returns NULL on opendir failure, readdir error, or allocation
  * failure (errno set; opendir/readdir/malloc errnos as is).
  */
-char** lstReadDir(const char* path)
+char** lstReadDir(const lstAllocator* a, const char* path)
 {
     if (path == NULL)
     {
@@ -124,7 +181,7 @@ char** lstReadDir(const char* path)
             if (errno != 0)
             {
                 perror("Error reading directory");
-                lstFree(lst);
+                lstFree(a, lst);
                 closedir(dp);
                 return NULL;
             }
@@ -137,9 +194,9 @@ char** lstReadDir(const char* path)
             continue;
         }
 
-        if (-1 == lstPush(&lst, result->d_name))
+        if (-1 == lstPush(a, &lst, result->d_name))
         {
-            lstFree(lst);
+            lstFree(a, lst);
             closedir(dp);
             return NULL;
         }
@@ -151,14 +208,14 @@ char** lstReadDir(const char* path)
 }
 
 /*
- * printf-style format that returns a freshly malloc'd string sized
+ * printf-style format that returns a freshly allocated string sized
  * by the same formatting (uses vsnprintf twice: once to measure,
- * once to write). Caller frees with free().
+ * once to write). Caller releases it with lstRelease(a, ...).
  *
  * Returns NULL on EINVAL (NULL format), encoding error from
  * vsnprintf, or allocation failure.
  */
-char* lstString(const char* format, ...)
+char* lstString(const lstAllocator* a, const char* format, ...)
 {
     if(format == NULL)
     {
@@ -179,11 +236,10 @@ char* lstString(const char* format, ...)
     }
 
     size_t size = (size_t)needed + 1;
-    char* rval = (char*)malloc(size);
+    char* rval = (char*)lstAlloc(a, size);
     if(rval == NULL)
     {
         va_end(ap);
-        errno = ENOMEM;
         return NULL;
     }
     vsnprintf(rval, size, format, ap);
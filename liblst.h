@@ -19,10 +19,28 @@ extern "C" {
 
 #endif
 
-ssize_t lstPush(char*** lst, const char* str);
-void lstFree(char** lst);
-char** lstReadDir(const char* path);
-char* lstString(const char* format, ...);
+/*
+ * Allocation hooks. Every function below takes one; NULL (or a NULL
+ * `alloc`) means malloc/realloc/free. Memory a function returns must
+ * be released through the same allocator.
+ */
+typedef struct lstAllocator
+{
+    void* (*alloc)(void* ud, size_t size);
+    void* (*realloc)(void* ud, void* ptr, size_t size);
+    void (*free)(void* ud, void* ptr);
+    void* ud;
+} lstAllocator;
+
+void* lstAlloc(const lstAllocator* a, size_t size);
+void* lstCalloc(const lstAllocator* a, size_t n, size_t size);
+void* lstRealloc(const lstAllocator* a, void* ptr, size_t size);
+void lstRelease(const lstAllocator* a, void* ptr);
+
+ssize_t lstPush(const lstAllocator* a, char*** lst, const char* str);
+void lstFree(const lstAllocator* a, char** lst);
+char** lstReadDir(const lstAllocator* a, const char* path);
+char* lstString(const lstAllocator* a, const char* format, ...);
 
 #ifdef __cplusplus
 
@@ -11,22 +11,114 @@
 #include <sys/inotify.h>
 #include <regex.h>
 #include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 
 #include "liblst.h"
 #include "rnotify.h"
+#include "rnotify_trace.h"
+#include "rnotify_replay.h"
+#include "rnotify_state.h"
+#include "rnotify_stat.h"
+#include "rnotify_hot.h"
+#include "rnotify_journal.h"
+
+/* One notifyOn registration. */
+struct handlerReg
+{
+    uint32_t mask;
+    NotifyHandler fn;
+    void* arg;
+};
 
 /*
- * FIFO node holding one already-decoded inotify_event. The queue is
- * singly linked: ntf->head is the next event to be pulled (oldest),
- * ntf->tail is where new events are appended (newest), and `next`
- * always points further from head toward tail.
+ * Bytes of a queue record kept for its event: names of up to 47 bytes
+ * fit, so the record is the event's only allocation. See chainInline.
+ */
+#define CHAIN_INLINE 64
+
+/*
+ * Queue node holding one already-decoded inotify_event, in `event`
+ * unless the name is too long for it (then `e` is allocated on its
+ * own). All records have the same size, which is what lets
+ * NotifyOptions.event_pool recycle them.
  */
 struct chainEvent
 {
     struct inotify_event* e;
+    unsigned int flags;     /* CHAIN_* */
+    int prio;               /* class it is queued in, see chainClass */
+    uint32_t hash;          /* of (wd, name), for chainIndex */
+    uint64_t seq;           /* NotifyEventInfo.seq */
+    uint64_t time_ns;       /* NotifyEventInfo.time_ns */
+    NotifyStat* st;         /* NotifyEventInfo.stat once looked up, else NULL */
     struct chainEvent* next;
+    _Alignas(struct inotify_event) char event[CHAIN_INLINE];
+};
+
+/*
+ * One class of the event queue, singly linked: head is the next event
+ * to be pulled (oldest), tail is where new events are appended
+ * (newest), and `next` always points further from head toward tail.
+ */
+struct chainQueue
+{
+    struct chainEvent* head;
+    struct chainEvent* tail;
+};
+
+/*
+ * Delivery classes with NotifyOptions.priority: structural events,
+ * other changes, then access/open events and library markers. Without
+ * it everything goes into the first.
+ */
+#define CHAIN_CLASSES 3
+
+/*
+ * The newest queued event for each (wd, name), kept for
+ * NOTIFY_QUEUE_COALESCE and NotifyOptions.priority. Laid out like
+ * entrySet.
+ */
+struct chainIndex
+{
+    struct chainEvent** slots;
+    size_t cap;
+    size_t count;
+};
+
+/* chainEvent flags */
+#define CHAIN_SCAN    0x1   /* synthetic event from the initial scan */
+#define CHAIN_WATCHED 0x2   /* directory already watched: no addNotify on delivery */
+#define CHAIN_SYNTHETIC 0x4 /* made by the library (pushSynthetic), not read from the fd */
+#define CHAIN_RESCAN  0x8   /* synthetic event from the overflow rescan */
+
+/* Events NotifyOptions.stat looks up: those whose entry should exist. */
+#define STAT_EVENTS (IN_ACCESS | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CLOSE_NOWRITE | IN_OPEN | IN_MOVED_TO | IN_CREATE)
+
+/* Directory fds kept open for NotifyOptions.stat, see statDir(). */
+#define STAT_DIRS 64
+
+/* One of them: an O_PATH fd on the directory watched by `wd`. */
+struct statDir
+{
+    int wd;
+    int fd;
 };
 
+/* What load shedding takes off the watches: reads, not changes. */
+#define SHED_EVENTS (IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE)
+
+/* What NOTIFY_QUEUE_COALESCE may fold into an event already queued. */
+#define CONTENT_EVENTS (IN_ACCESS | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CLOSE_NOWRITE | IN_OPEN)
+
+/* addNotify flags */
+#define ADD_SCAN      0x1   /* part of the initial scan: count it, tag its events */
+#define ADD_QUIET     0x2   /* record existing entries without queueing events */
+
 /*
  * One pending IN_MOVED_FROM. Kept in a doubly-linked list so we can
  * delete by wd (dropCookiesForWd) without re-walking from head. The
@@ -42,34 +134,303 @@ struct Cookie
     struct Cookie* next;
 };
 
+/*
+ * One queued IN_MOVED_FROM waiting for its IN_MOVED_TO, with
+ * NotifyOptions.rename_window. Matched by cookie: the kernel pairs the
+ * two halves of a rename with it, and only a handful of moves are ever
+ * in flight, so a list in arrival order is all the lookup needs.
+ */
+struct moveWait
+{
+    uint32_t cookie;
+    uint64_t due;              /* CLOCK_MONOTONIC ms the FROM is held until; 0: no longer */
+    struct inotify_event* to;  /* the IN_MOVED_TO once read, NULL until then */
+    struct moveWait* next;
+};
+
+/*
+ * One directory entry the consumer has been told about. `seen` is
+ * scratch space for the mark-and-sweep in rescanWatch(). In a
+ * Watch's `decided` set, `verdict` holds 1 + NOTIFY_RECURSE_* instead.
+ */
+struct Entry
+{
+    uint32_t hash;
+    unsigned char is_dir;
+    unsigned char seen;
+    unsigned char verdict;
+    char name[];
+};
+
+/*
+ * Set of Entry pointers keyed by name: open addressing with linear
+ * probing. cap is 0 or a power of two; removal shifts the following
+ * cluster back instead of leaving tombstones, so create/delete churn
+ * in a long-lived directory does not degrade lookups.
+ */
+struct entrySet
+{
+    struct Entry** slots;
+    size_t cap;
+    size_t count;
+};
+
+/*
+ * Per-directory watch record, one per installed wd.
+ *   wd       : the watch descriptor, key of the record in ntf->w.
+ *   path     : absolute path as last known (patched by renameWatches).
+ *   dev/ino  : identity of the directory when the watch was installed;
+ *              rescanWatches uses it to spot stale or replaced watches.
+ *   mtime    : directory st_mtim when `entries` was last in sync with
+ *              the directory; zero when it was too recent to trust.
+ *   entries  : names delivered to the consumer and not yet deleted
+ *              or moved away, maintained by waitNotify.
+ *   dirty    : NotifyOptions.dirty, the events folded in since the
+ *              last notifyTakeDirty; 0 while clean.
+ *   dirty_at : while dirty, its slot in ntf->dirty_set.
+ *   depth    : levels below the root when it was last watched.
+ *   shallow  : NOTIFY_RECURSE_SHALLOW, its subdirectories stay unwatched.
+ *   decided  : the recursion policy's verdicts on its subdirectories,
+ *              by name; see recursePolicy().
+ */
+struct Watch
+{
+    int wd;
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct entrySet entries;
+    uint32_t dirty;
+    size_t dirty_at;
+    int depth;
+    int shallow;
+    struct entrySet decided;
+};
+
+/*
+ * Set of Watch pointers keyed by wd, laid out like entrySet. It also
+ * shrinks when it falls below 1/8 full, so a burst of watches does not
+ * pin its peak size.
+ */
+struct watchSet
+{
+    struct Watch** slots;
+    size_t cap;
+    size_t count;
+};
+
+/*
+ * Node of the threaded-mode handoff queue: one finished event (or a
+ * reader error, err != 0) passed from the reader thread to the
+ * consumer. See handoffPush / handoffPop.
+ */
+struct handoff
+{
+    char* path;
+    uint32_t mask;
+    uint32_t cookie;
+    int err;
+    size_t size;        /* counted in ho_bytes; 0 when unbounded */
+    NotifyEventInfo info;
+    struct handoff* next;
+};
+
+/*
+ * Counters written only by the thread running the event engine (the
+ * consumer, or the reader thread in threaded mode) and readable from
+ * any thread. Relaxed loads and stores: no locked read-modify-write
+ * on the hot path.
+ */
+#define COUNTER_ADD(var, n) \
+    __atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define COUNTER_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
 /*
  * Internal Notify state. Opaque to consumers — they hold it through
  * the public Notify typedef.
  *   fd                : inotify fd from inotify_init().
- *   w / size_w        : sparse path table indexed by wd-1. size_w is
- *                       capacity; entries are NULL for unused slots.
- *                       See watchPath() and addNotify().
+ *   w                 : Watch records keyed by wd. A hash rather than an
+ *                       array indexed by wd: the kernel hands wds out
+ *                       in increasing order and only wraps at INT_MAX,
+ *                       so churn would make an array grow for ever.
+ *                       See watchFind() and addNotify().
  *   max_name          : pathconf(_PC_NAME_MAX), updated on watch add.
  *   max_queued_events : snapshot of /proc/sys/fs/inotify/max_queued_events
  *                       read at init time; used to sanity-check FIONREAD.
- *   exclude           : optional compiled regex; entries whose name
- *                       matches are filtered out of the chain.
+ *   exclude / exclude_src : optional compiled regex, and the pattern
+ *                       it was compiled from (for notifyExport); entries
+ *                       whose name matches are filtered out of the chain.
  *   mask              : event mask to install on every watch.
- *   head / tail       : FIFO queue of decoded inotify_event copies.
+ *   q                 : FIFO queues of decoded inotify_event copies, one
+ *                       per delivery class; see chainClass().
+ *   priority          : NotifyOptions.priority, classes are in use.
  *   cookies           : pending IN_MOVED_FROM entries awaiting their TO.
+ *   scan              : NOTIFY_SCAN_* mode the Notify was created with.
+ *   scan_pending      : directories found by the initial scan whose
+ *                       IN_CREATE|IN_ISDIR is queued but not yet
+ *                       delivered (background scan only).
+ *   scan_dirs / scan_entries : initial scan progress, see
+ *                       notifyScanProgress().
+ *   scan_done         : NOTIFY_SCAN_DONE has been queued.
+ *   threaded          : events are produced by `reader`, a thread that
+ *                       runs the engine (nextEvent) and hands finished
+ *                       events over through the lock-free single-
+ *                       producer/single-consumer list ho_head..ho_tail.
+ *                       ho_head is a consumed stub owned by the
+ *                       consumer; ho_tail belongs to the reader.
+ *   ready_fd          : eventfd the reader bumps after each batch; what
+ *                       notifyFd returns in threaded mode.
+ *   wake_fd           : eventfd that interrupts the reader's wait for
+ *                       shutdown (-1 when not threaded).
+ *   reader_stop / reader_errno : shutdown request, and the error that
+ *                       made the reader give up (0 while it runs).
+ *   handlers / n_handlers : callbacks registered with notifyOn, in
+ *                       registration order.
+ *   by_bit            : for each of the 32 mask bits, the set of
+ *                       handlers (bit i = handlers[i]) interested in it.
+ *   dispatch_errno    : error notifyDispatch hit after it had already
+ *                       delivered events; returned by the next call.
+ *   external_read     : the caller reads the fd and hands us the bytes
+ *                       through notifyFeed; the engine never touches it.
+ *   stats             : see notifyStats(); all COUNTER_* fields.
+ *   trace             : span ring (RNOTIFY_TRACE builds, NULL when
+ *                       tracing was not requested).
+ *   record / replay   : capture being written (NotifyOptions.record),
+ *                       or being played back instead of the kernel
+ *                       and filesystem (NotifyOptions.replay; fd is
+ *                       -1 then). See the fs* wrappers.
+ *   pulled            : events dequeued so far; positions each
+ *                       capture record in the event stream.
+ *   queue_events / queue_bytes / queue_policy : NotifyOptions limits on
+ *                       the chain (plus, in threaded mode, the events
+ *                       handed over and not yet taken, ho_events and
+ *                       ho_bytes); see queueOver().
+ *   queued            : chainIndex, NOTIFY_QUEUE_COALESCE and priority
+ *                       only.
+ *   drop_marked       : a NOTIFY_EVENTS_DROPPED marker is queued and
+ *                       not yet delivered.
+ *   reader_paused     : the reader waits on wake_fd for the consumer
+ *                       to take events (threaded, bounded queue).
+ *   shed / shedding   : NotifyOptions.shed, and whether the watches
+ *                       currently carry the reduced mask; see shedLoad().
+ *   mem               : NotifyOptions.allocator; everything the Notify
+ *                       allocates, including the paths it returns,
+ *                       goes through it.
+ *   spare / n_spare / event_pool : freed queue records kept for reuse,
+ *                       at most NotifyOptions.event_pool of them; see
+ *                       chainAlloc().
+ *   rename_window / moves / moves_tail : NotifyOptions.rename_window,
+ *                       and the queued IN_MOVED_FROM events waiting for
+ *                       their IN_MOVED_TO, oldest first; see pairMove().
+ *   resumed / resumed_tail : finished events carried over by
+ *                       notifyImport, delivered before anything else;
+ *                       see takeEvent().
+ *   seq               : NotifyEventInfo.seq of the last event queued,
+ *                       or dropped by NOTIFY_QUEUE_DROP.
+ *   batch_ns          : monotonicNs() when the engine started on what
+ *                       it is queueing now (a kernel read, a crawl, a
+ *                       rescan); the events' time_ns.
+ *   dispatching       : the info of the event notifyDispatch is
+ *                       handing to its handlers, NULL otherwise; see
+ *                       notifyEventInfo().
+ *   stat_mode / stat_ring : NotifyOptions.stat, and the io_uring its
+ *                       lookups go through (NULL: plain statx).
+ *   stored            : the record the last pushChainEvent stored or
+ *                       folded into, NULL if none; how feedEvents and
+ *                       pushFound find the record to attach metadata to.
+ *   stat_batch / stat_count / stat_cap : records of the current read
+ *                       waiting for their lookup; see statFlush().
+ *   stat_dirs         : directory fds the lookups are made relative
+ *                       to, a small cache indexed by wd.
+ *   dirty / dirty_set / dirty_count / dirty_cap : NotifyOptions.dirty,
+ *                       and the watches with a non-zero dirty mask, in
+ *                       the order they became dirty; see dirtyMark().
+ *   hot               : NotifyOptions.hot activity tracker, fed by
+ *                       takeEvent; NULL when off.
+ *   journal           : NotifyOptions.journal, appended to by
+ *                       takeEvent; NULL when off.
+ *   max_depth / same_dev / recurse / recurse_arg : the recursion
+ *                       policy of NotifyOptions; see recursePolicy().
+ *   root_dev          : st_dev of the root, for same_dev.
  */
 struct _rnotify
 {
     int fd;
-    unsigned int size_w;
-    char** w;
+    struct watchSet w;
     long max_name;
     unsigned long max_queued_events;
     regex_t* exclude;
+    char* exclude_src;
     uint32_t mask;
-    struct chainEvent* head;
-    struct chainEvent* tail;
+    struct chainQueue q[CHAIN_CLASSES];
+    int priority;
     struct Cookie* cookies;
+    int scan;
+    unsigned long scan_pending;
+    unsigned long scan_dirs;
+    unsigned long scan_entries;
+    int scan_done;
+    int threaded;
+    pthread_t reader;
+    struct handoff* ho_head;
+    struct handoff* ho_tail;
+    int ready_fd;
+    int wake_fd;
+    int reader_stop;
+    int reader_errno;
+    struct handlerReg handlers[NOTIFY_MAX_HANDLERS];
+    unsigned int n_handlers;
+    uint64_t by_bit[32];
+    int dispatch_errno;
+    int external_read;
+    NotifyStats stats;
+#ifdef RNOTIFY_TRACE
+    struct traceRing* trace;
+#endif
+    struct replayLog* record;
+    struct replayLog* replay;
+    unsigned long pulled;
+    unsigned long queue_events;
+    unsigned long queue_bytes;
+    int queue_policy;
+    struct chainIndex queued;
+    int drop_marked;
+    unsigned long ho_events;
+    unsigned long ho_bytes;
+    int reader_paused;
+    int shed;
+    int shedding;
+    lstAllocator mem;
+    struct chainEvent* spare;
+    unsigned int n_spare;
+    unsigned int event_pool;
+    int rename_window;
+    struct moveWait* moves;
+    struct moveWait* moves_tail;
+    struct handoff* resumed;
+    struct handoff* resumed_tail;
+    uint64_t seq;
+    uint64_t batch_ns;
+    const NotifyEventInfo* dispatching;
+    int stat_mode;
+    struct statRing* stat_ring;
+    struct chainEvent* stored;
+    struct chainEvent** stat_batch;
+    size_t stat_count;
+    size_t stat_cap;
+    struct statDir stat_dirs[STAT_DIRS];
+    int dirty;
+    struct Watch** dirty_set;
+    size_t dirty_count;
+    size_t dirty_cap;
+    struct hotTracker* hot;
+    struct journalWriter* journal;
+    int max_depth;
+    int same_dev;
+    NotifyRecurse recurse;
+    void* recurse_arg;
+    dev_t root_dev;
 };
 
 #define PATH_MAX_QUEUED_EVENTS "/proc/sys/fs/inotify/max_queued_events"
@@ -80,9 +441,9 @@ struct _rnotify
  *
  * Returns 0 on success, -1 on allocation failure (errno set).
  */
-static int addCookie(struct Cookie** p, int wd, const char* path, const char* name, uint32_t cookie)
+static int addCookie(const lstAllocator* mem, struct Cookie** p, int wd, const char* path, const char* name, uint32_t cookie)
 {
-    struct Cookie* new_p = (struct Cookie*)malloc(sizeof(struct Cookie));
+    struct Cookie* new_p = (struct Cookie*)lstAlloc(mem, sizeof(struct Cookie));
     if (new_p == NULL)
     {
         return -1;
@@ -90,18 +451,18 @@ static int addCookie(struct Cookie** p, int wd, const char* path, const char* na
     memset(new_p, 0, sizeof(struct Cookie));
     new_p->wd = wd;
 
-    new_p->path = lstString("%s", path);
+    new_p->path = lstString(mem, "%s", path);
     if (new_p->path == NULL)
     {
-        free(new_p);
+        lstRelease(mem, new_p);
         return -1;
     }
 
-    new_p->name = lstString("%s", name);
+    new_p->name = lstString(mem, "%s", name);
     if (new_p->name == NULL)
     {
-        free(new_p->path);
-        free(new_p);
+        lstRelease(mem, new_p->path);
+        lstRelease(mem, new_p);
         return -1;
     }
 
@@ -109,11 +470,10 @@ static int addCookie(struct Cookie** p, int wd, const char* path, const char* na
 
     /* Head insertion: typical workload pairs IN_MOVED_FROM with the
      * immediately-following IN_MOVED_TO, so most lookups hit the head
-     * after one step. Orphan cookies (FROM with no matching TO — move
-     * out of watched scope, or a buffer overflow) accumulate towards
-     * the tail and live until freeNotify; on a stable watch set this
-     * is a few entries at most, but a hostile workload could pile up
-     * arbitrarily many. */
+     * after one step. A cookie whose TO never comes because the
+     * directory left the watched scope is dropped by dropMovedAway on
+     * the directory's IN_MOVE_SELF; one orphaned by a buffer overflow
+     * lives until its wd is retired or until freeNotify. */
     new_p->prev = NULL;
     new_p->next = *p;
     if (*p != NULL)
@@ -125,6 +485,23 @@ static int addCookie(struct Cookie** p, int wd, const char* path, const char* na
     return 0;
 }
 
+/* Detach `c` from the pending list; the caller owns it afterwards. */
+static void unlinkCookie(struct Cookie** head, struct Cookie* c)
+{
+    if (c->prev)
+    {
+        c->prev->next = c->next;
+    }
+    else
+    {
+        *head = c->next;
+    }
+    if (c->next)
+    {
+        c->next->prev = c->prev;
+    }
+}
+
 /*
  * Find and detach a pending cookie by its uint32 value. Returns the
  * detached Cookie (caller owns it and must freeCookie) or NULL when
@@ -139,18 +516,7 @@ static struct Cookie* getCookie(struct Cookie** head, uint32_t cookie)
     {
         if (c->cookie == cookie)
         {
-            if (c->prev)
-            {
-                c->prev->next = c->next;
-            }
-            else
-            {
-                *head = c->next;
-            }
-            if (c->next)
-            {
-                c->next->prev = c->prev;
-            }
+            unlinkCookie(head, c);
             return c;
         }
         c = c->next;
@@ -160,11 +526,11 @@ static struct Cookie* getCookie(struct Cookie** head, uint32_t cookie)
 }
 
 /* Release a Cookie detached from the list. */
-static void freeCookie(struct Cookie* p)
+static void freeCookie(const lstAllocator* mem, struct Cookie* p)
 {
-    free(p->name);
-    free(p->path);
-    free(p);
+    lstRelease(mem, p->name);
+    lstRelease(mem, p->path);
+    lstRelease(mem, p);
 }
 
 /*
@@ -172,859 +538,5215 @@ static void freeCookie(struct Cookie* p)
  * Called when IN_IGNORED retires that wd: any matching IN_MOVED_TO
  * is now impossible, and leaving the cookies around would let a
  * later wd-recycle collide with a stale entry (kernel reuses wd
- * numbers via IDR after inotify_rm_watch).
+ * numbers via IDR after inotify_rm_watch). Returns how many were
+ * dropped.
  */
-static void dropCookiesForWd(struct Cookie** head, int wd)
+static unsigned long dropCookiesForWd(const lstAllocator* mem, struct Cookie** head, int wd)
 {
+    unsigned long dropped = 0;
     struct Cookie* c = *head;
     while (c != NULL)
     {
         struct Cookie* next = c->next;
         if (c->wd == wd)
         {
-            if (c->prev)
-            {
-                c->prev->next = c->next;
-            }
-            else
-            {
-                *head = c->next;
-            }
-            if (c->next)
-            {
-                c->next->prev = c->prev;
-            }
-            freeCookie(c);
+            unlinkCookie(head, c);
+            freeCookie(mem, c);
+            dropped++;
         }
         c = next;
     }
+    return dropped;
+}
+
+/* FNV-1a over a NUL-terminated name. */
+static uint32_t hashName(const char* name)
+{
+    uint32_t h = 2166136261u;
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
 /*
- * Release an inotify_event obtained from pullChainEvent (or constructed
- * locally for a pushChainEvent call). Defined as a single-step wrapper
- * around free() so the pull-event lifecycle is greppable and so the
- * single free site is easy to extend when the event ever grows
- * non-trivial owned data.
+ * Locate `name` in a non-empty set. Returns the slot holding it, or
+ * the empty slot where it would be inserted.
  */
-static void freeChainEvent(struct inotify_event* event)
+static struct Entry** entrySlot(const struct entrySet* set, const char* name, uint32_t hash)
 {
-    free(event);
+    size_t mask = set->cap - 1;
+    size_t i = hash & mask;
+    while (set->slots[i] != NULL)
+    {
+        if (set->slots[i]->hash == hash
+            && !strcmp(set->slots[i]->name, name))
+        {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &set->slots[i];
 }
 
 /*
- * Append a deep-copy of `e` to the tail of the event FIFO. Returns 0
- * on success, 0 (silently) when the event's name matches the configured
- * exclude regex, and -1 on allocation failure (errno set).
+ * Add `name` to the set, or refresh its is_dir flag when already
+ * present. Keeps the load factor at or below 1/2.
  *
- * Ownership: a successful push transfers a freshly malloc'd copy of `e`
- * into the queue; the caller still owns and releases `e` itself
- * (freeChainEvent). The eventual pullChainEvent returns that internal
- * copy and the puller becomes responsible for freeChainEvent on it.
+ * Returns 0 on success, -1 on allocation failure (errno set).
  */
-static int pushChainEvent(Notify* ntf, struct inotify_event* e)
+static int entryAdd(const lstAllocator* mem, struct entrySet* set, const char* name, int is_dir)
 {
-    if (ntf == NULL || e == NULL)
+    if (2 * (set->count + 1) > set->cap)
     {
-        errno = EINVAL;
-        return -1;
+        size_t new_cap = set->cap ? set->cap * 2 : 8;
+        struct Entry** t = (struct Entry**)lstCalloc(mem, new_cap, sizeof(struct Entry*));
+        if (t == NULL)
+        {
+            return -1;
+        }
+        struct entrySet grown = { t, new_cap, set->count };
+        for (size_t i = 0; i < set->cap; i++)
+        {
+            if (set->slots[i] != NULL)
+            {
+                *entrySlot(&grown, set->slots[i]->name, set->slots[i]->hash) = set->slots[i];
+            }
+        }
+        lstRelease(mem, set->slots);
+        *set = grown;
     }
 
-    if (ntf->exclude && !regexec(ntf->exclude, e->name, 0, NULL, 0))
+    uint32_t hash = hashName(name);
+    struct Entry** slot = entrySlot(set, name, hash);
+    if (*slot == NULL)
     {
-        return 0;
+        size_t name_size = strlen(name) + 1;
+        struct Entry* entry = (struct Entry*)lstAlloc(mem, sizeof(struct Entry) + name_size);
+        if (entry == NULL)
+        {
+            return -1;
+        }
+        entry->hash = hash;
+        entry->seen = 0;
+        entry->verdict = 0;
+        memcpy(entry->name, name, name_size);
+        *slot = entry;
+        set->count++;
     }
+    (*slot)->is_dir = is_dir ? 1 : 0;
 
-    size_t e_size = sizeof(struct inotify_event) + e->len;
+    return 0;
+}
 
-    struct inotify_event* event = (struct inotify_event*)malloc(e_size);
-    if (event == NULL)
+/* Remove `name` from the set; a missing name is not an error. */
+static void entryDel(const lstAllocator* mem, struct entrySet* set, const char* name)
+{
+    if (set->count == 0)
     {
-        return -1;
+        return;
     }
-    memcpy(event, e, e_size);
 
-    struct chainEvent* element = (struct chainEvent*)malloc(sizeof(struct chainEvent));
-    if (element == NULL)
+    struct Entry** slot = entrySlot(set, name, hashName(name));
+    if (*slot == NULL)
     {
-        freeChainEvent(event);
-        return -1;
+        return;
     }
-    element->e = event;
-    element->next = NULL;
+    lstRelease(mem, *slot);
+    *slot = NULL;
+    set->count--;
 
-    if (ntf->tail != NULL)
+    /* Backward-shift: pull later members of the probe cluster into the
+     * hole unless their home slot lies cyclically in (hole, j]. */
+    size_t mask = set->cap - 1;
+    size_t hole = (size_t)(slot - set->slots);
+    size_t j = hole;
+    for (;;)
     {
-        ntf->tail->next = element;
+        j = (j + 1) & mask;
+        if (set->slots[j] == NULL)
+        {
+            break;
+        }
+        size_t home = set->slots[j]->hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            set->slots[hole] = set->slots[j];
+            set->slots[j] = NULL;
+            hole = j;
+        }
     }
-    else
+}
+
+static void entryFree(const lstAllocator* mem, struct entrySet* set)
+{
+    for (size_t i = 0; i < set->cap; i++)
     {
-        ntf->head = element;
+        lstRelease(mem, set->slots[i]);
     }
-    ntf->tail = element;
+    lstRelease(mem, set->slots);
+    memset(set, 0, sizeof(struct entrySet));
+}
 
-    return 0;
+static void freeWatch(const lstAllocator* mem, struct Watch* watch)
+{
+    entryFree(mem, &watch->entries);
+    entryFree(mem, &watch->decided);
+    lstRelease(mem, watch->path);
+    lstRelease(mem, watch);
+}
+
+/* Fibonacci hashing: consecutive wds land far apart. */
+static size_t hashWd(int wd)
+{
+    return (size_t)((uint32_t)wd * 2654435769u);
 }
 
 /*
- * Remove and return the oldest pending inotify_event, or NULL if the
- * queue is empty. The returned pointer is owned by the caller and
- * must be released with freeChainEvent() once consumed.
+ * Locate `wd` in a non-empty set. Returns the slot holding it, or the
+ * empty slot where it would be inserted.
  */
-static struct inotify_event* pullChainEvent(Notify* ntf)
+static struct Watch** watchSlot(const struct watchSet* set, int wd)
 {
-    if (ntf->head == NULL)
+    size_t mask = set->cap - 1;
+    size_t i = hashWd(wd) & mask;
+    while (set->slots[i] != NULL
+           && set->slots[i]->wd != wd)
     {
-        return NULL;
+        i = (i + 1) & mask;
     }
+    return &set->slots[i];
+}
 
-    struct chainEvent* element = ntf->head;
-    struct inotify_event* event = element->e;
-    ntf->head = element->next;
-    if (ntf->head == NULL)
+/*
+ * Move every member into a fresh table of `new_cap` slots.
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int watchResize(const lstAllocator* mem, struct watchSet* set, size_t new_cap)
+{
+    struct Watch** t = (struct Watch**)lstCalloc(mem, new_cap, sizeof(struct Watch*));
+    if (t == NULL)
+    {
+        return -1;
+    }
+    struct watchSet resized = { t, new_cap, set->count };
+    for (size_t i = 0; i < set->cap; i++)
     {
-        ntf->tail = NULL;
+        if (set->slots[i] != NULL)
+        {
+            *watchSlot(&resized, set->slots[i]->wd) = set->slots[i];
+        }
     }
-    free(element);
+    lstRelease(mem, set->slots);
+    *set = resized;
+    return 0;
+}
 
-    return event;
+/* The record for `wd`, or NULL. */
+static struct Watch* watchFind(const Notify* ntf, int wd)
+{
+    if (ntf->w.count == 0)
+    {
+        return NULL;
+    }
+    return *watchSlot(&ntf->w, wd);
 }
 
 /*
- * Track the maximum NAME_MAX across all watched paths; the FIONREAD
- * size sanity check in waitNotify multiplies this by max_queued_events
- * to bound an acceptable buffer size.
+ * Resolve a watch descriptor to its stored path, or NULL if the wd is
+ * unknown or its record has already been retired (e.g. by a
+ * prior IN_IGNORED). IN_Q_OVERFLOW carries wd = -1 from the kernel,
+ * which is the original reason this guard exists.
  */
-static void updateMaxName(Notify* ntf, char* path)
+static char* watchPath(const Notify* ntf, int wd)
 {
-    if (!access(path, F_OK))
+    if (wd <= 0)
     {
-        long max_name = pathconf(path, _PC_NAME_MAX);
-        ntf->max_name = (max_name > ntf->max_name) ? max_name : ntf->max_name;
+        return NULL;
     }
+    struct Watch* watch = watchFind(ntf, wd);
+    return watch ? watch->path : NULL;
 }
 
-/**
- * Install an inotify watch on `path` and synthesise IN_CREATE events
- * for entries already present in the directory (so the caller never
- * misses files that appeared between mkdir(2) and our watch).
+/*
+ * Add a record whose wd is not in the set yet. Keeps the load factor
+ * at or below 1/2.
  *
- * Returns:
- *    1 — watch installed.
- *    0 — path no longer exists (ENOENT from inotify_add_watch); a
- *        benign no-op so callers can ignore racing deletions.
- *   -1 — error (errno set).
+ * Returns 0 on success, -1 on allocation failure (errno set).
  */
-static int addNotify(Notify* ntf, const char* path, uint32_t cookie)
+static int watchAdd(const lstAllocator* mem, struct watchSet* set, struct Watch* watch)
 {
-    errno = 0;
-    /*
-     * IN_DONT_FOLLOW is always set: if `path` is a symlink, watch the
-     * link itself rather than dereferencing it. Without this flag an
-     * attacker with write access to a watched directory could plant a
-     * symlink and steer the recursive descent into an arbitrary path
-     * (e.g. /etc). Coupled with the lstat() check on directory entries
-     * elsewhere in this file, this is the no-follow guarantee.
-     */
-    int wd = inotify_add_watch(ntf->fd, path, ntf->mask | IN_DONT_FOLLOW);
-    if (-1 == wd)
+    if (2 * (set->count + 1) > set->cap
+        && -1 == watchResize(mem, set, set->cap ? set->cap * 2 : 16))
     {
-        if (errno == ENOENT)
-        {
-            return 0;
-        }
         return -1;
     }
+    *watchSlot(set, watch->wd) = watch;
+    set->count++;
+    return 0;
+}
 
-    if (wd > (int)ntf->size_w)
+/*
+ * Detach the record for `wd` and return it (caller frees), or NULL.
+ * Never call it while iterating over the slots: the backward shift and
+ * the shrink both move members around.
+ */
+static struct Watch* watchDel(const lstAllocator* mem, struct watchSet* set, int wd)
+{
+    if (set->count == 0)
     {
-        unsigned int new_cap = ntf->size_w ? ntf->size_w : 16;
-        while (new_cap < (unsigned int)wd)
-        {
-            if (new_cap > UINT_MAX / 2)
-            {
-                new_cap = (unsigned int)wd;
-                break;
-            }
-            new_cap *= 2;
-        }
+        return NULL;
+    }
 
-        char** t = (char**)realloc(ntf->w, sizeof(void*) * new_cap);
-        if (t == NULL)
+    struct Watch** slot = watchSlot(set, wd);
+    struct Watch* watch = *slot;
+    if (watch == NULL)
+    {
+        return NULL;
+    }
+    *slot = NULL;
+    set->count--;
+
+    /* Backward-shift, as in entryDel. */
+    size_t mask = set->cap - 1;
+    size_t hole = (size_t)(slot - set->slots);
+    size_t j = hole;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (set->slots[j] == NULL)
         {
-            /* realloc(3) leaves the original block intact on failure;
-             * do not clobber ntf->w or freeNotify will dereference NULL.
-             */
-            return -1;
+            break;
         }
-        ntf->w = t;
-        for (size_t i = ntf->size_w; i < new_cap; i++)
+        size_t home = hashWd(set->slots[j]->wd) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask))
         {
-            ntf->w[i] = NULL;
+            set->slots[hole] = set->slots[j];
+            set->slots[j] = NULL;
+            hole = j;
         }
-        ntf->size_w = new_cap;
     }
 
-    if (ntf->w[wd - 1] != NULL)
+    /* Failing to shrink only keeps the larger table. */
+    if (set->cap > 16
+        && 8 * set->count < set->cap)
     {
-        free(ntf->w[wd - 1]);
+        watchResize(mem, set, set->cap / 2);
     }
+    return watch;
+}
 
-    ntf->w[wd - 1] = lstString("%s", path);
-    if (ntf->w[wd - 1] == NULL)
+/* Release every Watch record and the table itself. */
+static void freeWatches(Notify* ntf)
+{
+    for (size_t i = 0; i < ntf->w.cap; i++)
     {
-        return -1;
+        if (ntf->w.slots[i] != NULL)
+        {
+            freeWatch(&ntf->mem, ntf->w.slots[i]);
+        }
     }
+    lstRelease(&ntf->mem, ntf->w.slots);
+    memset(&ntf->w, 0, sizeof(struct watchSet));
+}
 
-    char** elems = lstReadDir(path);
-    if (elems == NULL)
+/*
+ * Record the identity and mtime of the watched directory from `sb`.
+ * An mtime from the last second or so is not trusted: a change that
+ * lands within the same filesystem timestamp tick leaves it unchanged,
+ * so such directories are zeroed and always re-read by rescanWatch.
+ */
+static void stampWatch(struct Watch* watch, const struct stat* sb)
+{
+    watch->dev = sb->st_dev;
+    watch->ino = sb->st_ino;
+    watch->mtime = sb->st_mtim;
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_REALTIME, &now)
+        || now.tv_sec - sb->st_mtim.tv_sec <= 1)
     {
-        /* watch is in place; we just couldn't enumerate existing
-         * entries (path is a regular file, or permission denied) */
-        return 1;
+        watch->mtime.tv_sec = 0;
+        watch->mtime.tv_nsec = 0;
     }
+}
 
-    const size_t event_size = sizeof(struct inotify_event);
-    size_t i = 0;
-    while (elems[i])
+static int pushSynthetic(Notify* ntf, int wd, uint32_t mask, uint32_t cookie, const char* name, unsigned int flags);
+
+/* Whether an event with a name of `len` bytes fits in its record. */
+static int chainInline(uint32_t len)
+{
+    return sizeof(struct inotify_event) + len <= CHAIN_INLINE;
+}
+
+/* Memory one queued event holds. */
+static size_t chainBytes(const struct inotify_event* e)
+{
+    return sizeof(struct chainEvent) + (chainInline(e->len) ? 0 : sizeof(struct inotify_event) + e->len);
+}
+
+static const char* chainName(const struct inotify_event* e)
+{
+    return e->len ? e->name : "";
+}
+
+/*
+ * Locate the event queued for (wd, name) in a non-empty index. Returns
+ * the slot holding it, or the empty slot where it would be inserted.
+ */
+static struct chainEvent** indexSlot(const struct chainIndex* idx, int wd, const char* name, uint32_t hash)
+{
+    size_t mask = idx->cap - 1;
+    size_t i = hash & mask;
+    while (idx->slots[i] != NULL)
     {
-        char* path_elem = lstString("%s/%s", path, elems[i]);
-        if (path_elem == NULL)
+        const struct inotify_event* e = idx->slots[i]->e;
+        if (idx->slots[i]->hash == hash
+            && e->wd == wd
+            && !strcmp(chainName(e), name))
         {
-            lstFree(elems);
-            return -1;
+            break;
         }
+        i = (i + 1) & mask;
+    }
+    return &idx->slots[i];
+}
 
-        struct stat sb;
-        /* lstat — never dereference a symlink here. A symlink-to-dir
-         * must not be reported as IN_ISDIR or the recursive descent
-         * would follow it (IN_DONT_FOLLOW on inotify_add_watch already
-         * refuses to install the watch, but emitting IN_ISDIR for a
-         * symlink is still semantically wrong). */
-        int is_dir = (!lstat(path_elem, &sb) && S_ISDIR(sb.st_mode)) ? 1 : 0;
-
-        size_t name_size = strlen(elems[i]) + 1;
-        struct inotify_event* e = (struct inotify_event*)malloc(event_size + name_size);
-        if (e == NULL)
-        {
-            free(path_elem);
-            lstFree(elems);
-            return -1;
-        }
-        memset(e, 0, event_size);
-
-        e->wd = wd;
-        if (is_dir)
-        {
-            e->mask = IN_CREATE | IN_ISDIR;
-            updateMaxName(ntf, path_elem);
-        }
-        else
-        {
-            e->mask = IN_CREATE;
-        }
-        e->len = name_size;
-        e->cookie = cookie;
-        memcpy(e->name, elems[i], name_size);
-        if (-1 == pushChainEvent(ntf, e))
-        {
-            freeChainEvent(e);
-            free(path_elem);
-            lstFree(elems);
-            return -1;
-        }
-        freeChainEvent(e);
-
-        if (!is_dir)
+/*
+ * Move every member into a fresh index of `new_cap` slots.
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int indexResize(const lstAllocator* mem, struct chainIndex* idx, size_t new_cap)
+{
+    struct chainEvent** t = (struct chainEvent**)lstCalloc(mem, new_cap, sizeof(struct chainEvent*));
+    if (t == NULL)
+    {
+        return -1;
+    }
+    struct chainIndex resized = { t, new_cap, idx->count };
+    for (size_t i = 0; i < idx->cap; i++)
+    {
+        struct chainEvent* c = idx->slots[i];
+        if (c != NULL)
         {
-            e = (struct inotify_event*)malloc(event_size + name_size);
-            if (e == NULL)
-            {
-                free(path_elem);
-                lstFree(elems);
-                return -1;
-            }
-            memset(e, 0, event_size);
-
-            e->wd = wd;
-            e->mask = IN_CLOSE_WRITE;
-            e->len = name_size;
-            memcpy(e->name, elems[i], name_size);
-
-            if (-1 == pushChainEvent(ntf, e))
-            {
-                freeChainEvent(e);
-                free(path_elem);
-                lstFree(elems);
-                return -1;
-            }
-            freeChainEvent(e);
+            *indexSlot(&resized, c->e->wd, chainName(c->e), c->hash) = c;
         }
-        free(path_elem);
-        i++;
     }
-
-    lstFree(elems);
-
-    return 1;
+    lstRelease(mem, idx->slots);
+    *idx = resized;
+    return 0;
 }
 
 /*
- * Public API.
- *
- * Initialise a Notify watching `path`. `mask` is the inotify event
- * mask installed on every watch in the tree; IN_DONT_FOLLOW is added
- * unconditionally. `exclude`, if non-NULL, is compiled as POSIX
- * extended regex; events whose `name` matches are dropped before they
- * reach the chain.
- *
- * The path is descended recursively: existing entries are surfaced
- * as synthetic IN_CREATE events (and IN_CLOSE_WRITE for regular
- * files) so the caller never has to do an initial scan separately.
- *
- * To watch multiple roots, create one Notify per root and integrate
- * notifyFd() into the caller's own select()/epoll() loop.
- *
- * Returns a Notify* on success. Returns NULL with errno set on
- * failure: EINVAL for a NULL path; ENOENT when the path does not
- * exist at install time; or any errno from inotify_init,
- * inotify_add_watch, regcomp, or malloc.
+ * Make `c` the newest event for its path. Not being able to grow the
+ * index only costs a coalescing opportunity, so there is no error.
  */
-Notify* initNotify(const char* path, const uint32_t mask, const char* exclude)
+static void indexPut(const lstAllocator* mem, struct chainIndex* idx, struct chainEvent* c)
 {
-    if (path == NULL)
+    if (2 * (idx->count + 1) > idx->cap
+        && -1 == indexResize(mem, idx, idx->cap ? idx->cap * 2 : 64))
     {
-        errno = EINVAL;
-        return NULL;
+        return;
     }
-
-    Notify* ntf = (Notify*)malloc(sizeof(Notify));
-    if (ntf == NULL)
+    struct chainEvent** slot = indexSlot(idx, c->e->wd, chainName(c->e), c->hash);
+    if (*slot == NULL)
     {
-        return NULL;
+        idx->count++;
     }
-    memset(ntf, 0, sizeof(Notify));
-    ntf->mask = mask;
+    *slot = c;
+}
 
-    updateMaxName(ntf, (char*)path);
+/* Forget `c` if it is still the newest event for its path. */
+static void indexDel(const lstAllocator* mem, struct chainIndex* idx, const struct chainEvent* c)
+{
+    if (idx->count == 0)
+    {
+        return;
+    }
+    struct chainEvent** slot = indexSlot(idx, c->e->wd, chainName(c->e), c->hash);
+    if (*slot != c)
+    {
+        return;
+    }
+    *slot = NULL;
+    idx->count--;
 
-    if (exclude)
+    /* Backward-shift, as in entryDel. */
+    size_t mask = idx->cap - 1;
+    size_t hole = (size_t)(slot - idx->slots);
+    size_t j = hole;
+    for (;;)
     {
-        regex_t* preg = (regex_t*)malloc(sizeof(regex_t));
-        if (preg == NULL)
+        j = (j + 1) & mask;
+        if (idx->slots[j] == NULL)
         {
-            free(ntf);
-            return NULL;
+            break;
         }
-        memset(preg, 0, sizeof(regex_t));
-        if (0 != regcomp(preg, exclude, REG_EXTENDED))
+        size_t home = idx->slots[j]->hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask))
         {
-            free(preg);
-            free(ntf);
-            errno = EINVAL;
-            return NULL;
+            idx->slots[hole] = idx->slots[j];
+            idx->slots[j] = NULL;
+            hole = j;
         }
-        ntf->exclude = preg;
     }
 
-    unsigned long max_queued_events = 0;
-    FILE* f = fopen(PATH_MAX_QUEUED_EVENTS, "r");
-    if (f == NULL)
+    /* Failing to shrink only keeps the larger index. */
+    if (idx->cap > 64
+        && 8 * idx->count < idx->cap)
     {
-        if (ntf->exclude)
-        {
-            regfree(ntf->exclude);
-            free(ntf->exclude);
-        }
-        free(ntf);
-        return NULL;
+        indexResize(mem, idx, idx->cap / 2);
     }
+}
+
+/*
+ * Events the recursion cannot do without; the queue policies never
+ * drop or fold them. File events only cost the entry sets accuracy,
+ * which the next overflow rescan restores.
+ */
+static int isStructural(const struct inotify_event* e)
+{
+    return e->wd < 0
+        || (e->mask & (IN_IGNORED | IN_Q_OVERFLOW | IN_MOVE_SELF | IN_DELETE_SELF | IN_UNMOUNT))
+        || ((e->mask & IN_ISDIR)
+            && (e->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)));
+}
 
-    if (1 != fscanf(f, "%10lu", &max_queued_events))
+/*
+ * Delivery class of `e`. Structural events come first so they reach
+ * the consumer ahead of a crawl's backlog; access and open events,
+ * which only say something was looked at, come last. Overflow, markers
+ * and IN_IGNORED (which retires its wd on delivery) go last too: each
+ * must stay behind everything queued before it.
+ */
+static int chainClass(const Notify* ntf, const struct inotify_event* e)
+{
+    if (!ntf->priority)
     {
-        int saved_errno = errno ? errno : EIO;
-        fclose(f);
-        if (ntf->exclude)
-        {
-            regfree(ntf->exclude);
-            free(ntf->exclude);
-        }
-        free(ntf);
-        errno = saved_errno;
-        return NULL;
+        return 0;
     }
-    ntf->max_queued_events = max_queued_events;
-    fclose(f);
-
-    ntf->fd = inotify_init();
-    if (-1 == ntf->fd)
+    if (e->wd < 0
+        || (e->mask & IN_IGNORED))
     {
-        if (ntf->exclude)
-        {
-            regfree(ntf->exclude);
-            free(ntf->exclude);
-        }
-        free(ntf);
-        return NULL;
+        return CHAIN_CLASSES - 1;
     }
-
-    int rc = addNotify(ntf, path, 0);
-    if (rc < 0)
+    if (isStructural(e))
     {
-        int saved_errno = errno;
-        close(ntf->fd);
-        if (ntf->exclude)
-        {
-            regfree(ntf->exclude);
-            free(ntf->exclude);
-        }
-        free(ntf->w);
-        free(ntf);
-        errno = saved_errno;
-        return NULL;
+        return 0;
     }
-    if (rc == 0)
+    if (!(e->mask & ~(IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE | IN_ISDIR)))
     {
-        /* addNotify swallowed ENOENT as a no-op; for a single-path
-         * init that means the caller asked us to watch a path that
-         * does not exist. Surface it instead of returning a Notify
-         * that will block on waitNotify forever. */
-        close(ntf->fd);
-        if (ntf->exclude)
-        {
-            regfree(ntf->exclude);
-            free(ntf->exclude);
-        }
-        free(ntf->w);
-        free(ntf);
-        errno = ENOENT;
-        return NULL;
+        return 2;
     }
+    return 1;
+}
 
-    return ntf;
+/* Whether `events` or `bytes` reach either limit shifted right by `shift`. */
+static int overLimit(const Notify* ntf, unsigned long events, unsigned long bytes, unsigned int shift)
+{
+    return (ntf->queue_events
+            && events > 0
+            && events >= (ntf->queue_events >> shift))
+        || (ntf->queue_bytes
+            && bytes > 0
+            && bytes >= (ntf->queue_bytes >> shift));
 }
 
 /*
- * Public API.
- *
- * Expose the underlying inotify file descriptor so the caller can
- * integrate it into their own select()/poll()/epoll() loop. The fd
- * is owned by the Notify and stays valid until freeNotify; do not
- * close it or read from it directly — always go through waitNotify.
- *
- * Returns the fd on success; returns -1 with EINVAL on NULL input.
+ * Whether the queue is at its limit. In threaded mode what the reader
+ * handed over and the consumer has not taken yet counts too.
  */
-int notifyFd(const Notify* ntf)
+static int queueOver(const Notify* ntf)
 {
-    if (ntf == NULL)
+    unsigned long events = COUNTER_GET(ntf->stats.queue_depth);
+    unsigned long bytes = COUNTER_GET(ntf->stats.queue_bytes);
+    if (ntf->threaded)
     {
-        errno = EINVAL;
-        return -1;
+        events += __atomic_load_n(&ntf->ho_events, __ATOMIC_SEQ_CST);
+        bytes += __atomic_load_n(&ntf->ho_bytes, __ATOMIC_SEQ_CST);
     }
-    return ntf->fd;
+    return overLimit(ntf, events, bytes, 0);
 }
 
 /*
- * Rewrite every path in ntf->w[] that lives under `oldpath` so the
- * prefix becomes `newpath`. Called when a watched directory is moved
- * inside the watch set: the kernel keeps the wd, but our cached path
- * for that wd (and for any descendant watch) becomes stale and needs
- * to be patched up. Whole-prefix replacement, including a guard that
- * we only match `oldpath` itself or `oldpath/`-something — not a path
- * that merely begins with the same characters (e.g. /foo vs /foobar).
- *
- * Returns 0 on success, -1 on allocation failure (errno set).
+ * Whether the handed-over backlog alone reaches the limit (shift 0),
+ * or half of it (shift 1, what a paused reader waits for).
  */
-static int renameWatches(Notify* ntf, const char* oldpath, const char* newpath)
+static int handoffOver(const Notify* ntf, unsigned int shift)
+{
+    return overLimit(ntf,
+                     __atomic_load_n(&ntf->ho_events, __ATOMIC_SEQ_CST),
+                     __atomic_load_n(&ntf->ho_bytes, __ATOMIC_SEQ_CST),
+                     shift);
+}
+
+/* Reading more would overrun the limit: leave the backlog to the kernel. */
+static int queueBlocked(const Notify* ntf)
+{
+    return (ntf->queue_events || ntf->queue_bytes)
+        && ntf->queue_policy != NOTIFY_QUEUE_DROP
+        && queueOver(ntf);
+}
+
+/*
+ * Apply the queue policy to `e` arriving at a full queue. Returns 1
+ * when it was dropped or folded into a queued event, 0 when it must be
+ * queued anyway, -1 on allocation failure (errno set).
+ */
+static int queuePolicy(Notify* ntf, const struct inotify_event* e)
 {
-    unsigned int i = 0;
-    for (; i < ntf->size_w; ++i)
+    if (ntf->queue_policy == NOTIFY_QUEUE_DROP)
     {
-        if (ntf->w[i] == NULL)
-        {
-            continue;
-        }
-        if (ntf->w[i] == strstr(ntf->w[i], oldpath)
-            && (strlen(ntf->w[i]) == strlen(oldpath)
-                || *(ntf->w[i] + strlen(oldpath)) == '/' ))
+        COUNTER_ADD(ntf->stats.events_dropped, 1);
+        ntf->seq++;     /* the gap tells a consumer what it missed */
+        if (!ntf->drop_marked)
         {
-            char* p = lstString("%s%s", newpath, ntf->w[i] + strlen(oldpath));
-            if (p == NULL)
+            ntf->drop_marked = 1;
+            if (-1 == pushSynthetic(ntf, -1, NOTIFY_EVENTS_DROPPED, 0, NULL, 0))
             {
                 return -1;
             }
-            free(ntf->w[i]);
-            ntf->w[i] = p;
+            ntf->stored = NULL;
         }
+        return 1;
     }
 
+    /* COALESCE: content changes go into the newest event for the path,
+     * which keeps the order of that path's events */
+    if (ntf->queue_policy == NOTIFY_QUEUE_COALESCE
+        && ntf->queued.count
+        && !(e->mask & ~(CONTENT_EVENTS | IN_ISDIR)))
+    {
+        const char* name = chainName(e);
+        struct chainEvent* c = *indexSlot(&ntf->queued, e->wd, name, hashName(name) ^ (uint32_t)hashWd(e->wd));
+        if (c != NULL)
+        {
+            c->e->mask |= e->mask;
+            ntf->stored = c;    /* its metadata is looked up again */
+            COUNTER_ADD(ntf->stats.events_coalesced, 1);
+            return 1;
+        }
+    }
     return 0;
 }
 
+/* Nanoseconds on CLOCK_MONOTONIC. */
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 /*
- * Read exactly `len` bytes from `fd` into `*buf`, looping over short
- * reads and retrying on EINTR/EAGAIN. Returns the total number read
- * (which may be < len at EOF) or -1 on a non-recoverable read error
- * (errno set). The `buf` is a pointer-to-pointer only to keep the
- * caller's existing variable mutable through the call; the function
- * does not realloc.
+ * A queue record: one from the spare list, or a new allocation.
+ * Returns NULL on allocation failure (errno set).
  */
-static ssize_t totalRead(int fd, char** buf, size_t len)
+static struct chainEvent* chainAlloc(Notify* ntf)
 {
-    ssize_t total_read = 0;
-    ssize_t done = 0;
-
-    while ((ssize_t)len > total_read)
+    struct chainEvent* c = ntf->spare;
+    if (c == NULL)
     {
-        done = read(fd, *buf + total_read, len - total_read);
-        if (done > 0)
-        {
-            total_read += (size_t)done;
-        }
-        else if (0 == done)
-        {
-            break;
-        }
-        else
-        {
-            if (errno != EINTR && errno != EAGAIN)
-            {
-                total_read = -1;
-                break;
-            }
-        }
+        return (struct chainEvent*)lstAlloc(&ntf->mem, sizeof(struct chainEvent));
     }
-
-    return total_read;
+    ntf->spare = c->next;
+    ntf->n_spare--;
+    return c;
 }
 
-/*
- * Non-blocking probe: does `fd` have data ready right now?
- *
- *   > 0  data ready (select() reported fd readable)
- *   = 0  no data ready
- *   < 0  error (errno set; typically EBADF)
- *
- * Used by waitNotify to decide whether to skip select() and read
- * immediately, vs. fall through to the blocking wait.
- */
-static int checkFd(int fd)
+/* Keep a record for reuse while the spare list is short of event_pool. */
+static void chainRelease(Notify* ntf, struct chainEvent* c)
 {
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(fd, &set);
-    struct timeval t = { 0, 0 };
-    return select(fd + 1, &set, NULL, NULL, &t);
+    if (ntf->n_spare < ntf->event_pool)
+    {
+        c->next = ntf->spare;
+        ntf->spare = c;
+        ntf->n_spare++;
+        return;
+    }
+    lstRelease(&ntf->mem, c);
 }
 
 /*
- * Wait for `fd` to become readable, up to `timeout` milliseconds.
- *
- *   timeout < 0   block indefinitely
- *   timeout = 0   non-blocking poll
- *   timeout > 0   wait at most that many milliseconds
- *
- *   > 0  fd is readable
- *   = 0  timeout expired with no activity
- *   < 0  error (errno set)
+ * Release an inotify_event obtained from pullChainEvent: one stored in
+ * its record goes back with the record, a long-named one was detached
+ * from its record at pull time.
  */
-static int Select(int fd, int timeout)
+static void freeChainEvent(Notify* ntf, struct inotify_event* event)
 {
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(fd, &set);
-    struct timeval t;
-    t.tv_sec  = timeout / 1000;
-    t.tv_usec = (timeout % 1000) * 1000;
-    return select(fd + 1, &set, NULL, NULL, (timeout < 0) ? NULL : &t);
+    if (!chainInline(event->len))
+    {
+        lstRelease(&ntf->mem, event);
+        return;
+    }
+    chainRelease(ntf, (struct chainEvent*)((char*)event - offsetof(struct chainEvent, event)));
 }
 
 /*
- * Resolve a watch descriptor to its stored path, or NULL if the wd is
- * out of range or the slot has already been invalidated (e.g. by a
- * prior IN_IGNORED). IN_Q_OVERFLOW carries wd = -1 from the kernel,
- * which is the original reason this guard exists.
+ * An O_PATH fd on the directory watched by `wd`, for the lookups of
+ * NotifyOptions.stat: from the cache, or opened and checked to be the
+ * watched inode still. Returns -1 with errno set (ENOENT when the
+ * directory is gone or replaced).
  */
-static char* watchPath(const Notify* ntf, int wd)
+static int statDir(Notify* ntf, int wd)
 {
-    if (wd <= 0 || (unsigned int)wd > ntf->size_w)
+    struct statDir* slot = &ntf->stat_dirs[(unsigned int)wd % STAT_DIRS];
+    if (slot->fd != -1
+        && slot->wd == wd)
     {
-        return NULL;
+        return slot->fd;
+    }
+
+    const struct Watch* watch = watchFind(ntf, wd);
+    if (watch == NULL)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    int fd = statOpenDir(watch->path, watch->dev, watch->ino);
+    if (fd == -1)
+    {
+        return -1;
     }
-    return ntf->w[wd - 1];
+    if (slot->fd != -1)
+    {
+        close(slot->fd);
+    }
+    slot->wd = wd;
+    slot->fd = fd;
+    return fd;
 }
 
-/*
- * Public API.
+/* Close the cached fd of a retired watch: its wd may come back. */
+static void statForget(Notify* ntf, int wd)
+{
+    struct statDir* slot = &ntf->stat_dirs[(unsigned int)wd % STAT_DIRS];
+    if (slot->fd != -1
+        && slot->wd == wd)
+    {
+        close(slot->fd);
+        slot->fd = -1;
+    }
+}
+
+/*
+ * Have ntf->stored, the record just queued for `e`, looked up by the
+ * next statFlush. Best effort: without memory the event goes without
+ * metadata.
+ */
+static void statQueue(Notify* ntf, const struct inotify_event* e)
+{
+    if (ntf->stored == NULL
+        || e->wd < 0
+        || !(e->mask & STAT_EVENTS))
+    {
+        return;
+    }
+    if (ntf->stat_count == ntf->stat_cap)
+    {
+        size_t cap = ntf->stat_cap ? ntf->stat_cap * 2 : 64;
+        struct chainEvent** batch = (struct chainEvent**)lstRealloc(&ntf->mem, ntf->stat_batch, cap * sizeof(struct chainEvent*));
+        if (batch == NULL)
+        {
+            return;
+        }
+        ntf->stat_batch = batch;
+        ntf->stat_cap = cap;
+    }
+    ntf->stat_batch[ntf->stat_count++] = ntf->stored;
+}
+
+/*
+ * Give ntf->stored, a record the crawl just queued, what the crawl's
+ * lstat found instead of looking it up again.
+ */
+static void statKeep(Notify* ntf, const struct stat* sb)
+{
+    struct chainEvent* c = ntf->stored;
+    if (c == NULL)
+    {
+        return;
+    }
+    if (c->st == NULL)
+    {
+        c->st = (NotifyStat*)lstAlloc(&ntf->mem, sizeof(NotifyStat));
+        if (c->st == NULL)
+        {
+            return;
+        }
+    }
+    statFromStat(c->st, sb);
+    COUNTER_ADD(ntf->stats.stat_crawl, 1);
+}
+
+/*
+ * Look up every record statQueue collected, all at once: through
+ * ntf->stat_ring when there is one, statx by statx otherwise. Runs
+ * before anything of the read is delivered.
+ */
+static void statFlush(Notify* ntf)
+{
+    size_t n = ntf->stat_count;
+    ntf->stat_count = 0;
+    if (n == 0)
+    {
+        return;
+    }
+    int saved_errno = errno;
+    struct statReq* reqs = (struct statReq*)lstAlloc(&ntf->mem, n * sizeof(struct statReq));
+    if (reqs == NULL)
+    {
+        errno = saved_errno;
+        return;
+    }
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        struct chainEvent* c = ntf->stat_batch[i];
+        if (c->st == NULL)
+        {
+            c->st = (NotifyStat*)lstAlloc(&ntf->mem, sizeof(NotifyStat));
+            if (c->st == NULL)
+            {
+                continue;
+            }
+        }
+        memset(c->st, 0, sizeof(NotifyStat));
+        int dirfd = statDir(ntf, c->e->wd);
+        if (dirfd == -1)
+        {
+            c->st->err = errno;
+            continue;
+        }
+        reqs[k].dirfd = dirfd;
+        reqs[k].name = c->e->len ? c->e->name : "";
+        reqs[k].out = c->st;
+        k++;
+    }
+
+    size_t via_ring = statRun(ntf->stat_ring, reqs, k);
+    COUNTER_ADD(ntf->stats.stat_lookups, k);
+    COUNTER_ADD(ntf->stats.stat_uring, via_ring);
+    lstRelease(&ntf->mem, reqs);
+    errno = saved_errno;
+}
+
+/* Whether the exclude regex filters `e` out. */
+static int chainExcluded(Notify* ntf, const struct inotify_event* e)
+{
+    /* len == 0: the event is about the watched directory itself (or
+     * carries no wd at all, like IN_Q_OVERFLOW) and has no name. */
+    if (ntf->exclude == NULL
+        || e->len == 0)
+    {
+        return 0;
+    }
+    TRACE_BEGIN(ntf, t_exclude);
+    int excluded = !regexec(ntf->exclude, e->name, 0, NULL, 0);
+    TRACE_END(ntf, t_exclude, TRACE_EXCLUDE);
+    return excluded;
+}
+
+/*
+ * Store a deep-copy of `e` at the tail of class `prio`, or of a later
+ * one so that it is never delivered ahead of the newest event queued
+ * for the same (wd, name): one path's events keep their order. It
+ * takes the next sequence number and the current batch's time.
+ *
+ * Returns the record, or NULL on allocation failure (errno set).
+ */
+static struct chainEvent* chainStore(Notify* ntf, const struct inotify_event* e, unsigned int flags, int prio)
+{
+    size_t e_size = sizeof(struct inotify_event) + e->len;
+
+    struct chainEvent* element = chainAlloc(ntf);
+    if (element == NULL)
+    {
+        return NULL;
+    }
+    struct inotify_event* event = (struct inotify_event*)element->event;
+    if (!chainInline(e->len))
+    {
+        event = (struct inotify_event*)lstAlloc(&ntf->mem, e_size);
+        if (event == NULL)
+        {
+            chainRelease(ntf, element);
+            return NULL;
+        }
+    }
+    memcpy(event, e, e_size);
+    element->e = event;
+    element->flags = flags;
+    element->prio = prio;
+    element->hash = 0;
+    element->seq = ++ntf->seq;
+    element->time_ns = ntf->batch_ns ? ntf->batch_ns : monotonicNs();
+    element->st = NULL;
+    element->next = NULL;
+    ntf->stored = element;
+
+    if (e->wd >= 0
+        && (ntf->priority
+            || (ntf->queue_policy == NOTIFY_QUEUE_COALESCE
+                && (ntf->queue_events || ntf->queue_bytes))))
+    {
+        element->hash = hashName(chainName(e)) ^ (uint32_t)hashWd(e->wd);
+        if (ntf->priority
+            && ntf->queued.count)
+        {
+            const struct chainEvent* newest = *indexSlot(&ntf->queued, e->wd, chainName(e), element->hash);
+            if (newest != NULL
+                && newest->prio > element->prio)
+            {
+                element->prio = newest->prio;
+            }
+        }
+        indexPut(&ntf->mem, &ntf->queued, element);
+    }
+
+    struct chainQueue* q = &ntf->q[element->prio];
+    if (q->tail != NULL)
+    {
+        q->tail->next = element;
+    }
+    else
+    {
+        q->head = element;
+    }
+    q->tail = element;
+
+    COUNTER_ADD(ntf->stats.queue_bytes, chainBytes(event));
+    COUNTER_ADD(ntf->stats.queue_depth, 1);
+    if (ntf->stats.queue_depth > ntf->stats.queue_peak)
+    {
+        COUNTER_ADD(ntf->stats.queue_peak, ntf->stats.queue_depth - ntf->stats.queue_peak);
+    }
+
+    return element;
+}
+
+/*
+ * Add `mask` to `watch`'s dirty mask, entering it into the dirty set
+ * the first time. Returns 0, or -1 on allocation failure (errno set).
+ */
+static int dirtyMark(Notify* ntf, struct Watch* watch, uint32_t mask)
+{
+    if (!watch->dirty)
+    {
+        if (ntf->dirty_count == ntf->dirty_cap)
+        {
+            size_t cap = ntf->dirty_cap ? ntf->dirty_cap * 2 : 64;
+            struct Watch** set = (struct Watch**)lstRealloc(&ntf->mem, ntf->dirty_set, cap * sizeof(struct Watch*));
+            if (set == NULL)
+            {
+                return -1;
+            }
+            ntf->dirty_set = set;
+            ntf->dirty_cap = cap;
+        }
+        watch->dirty_at = ntf->dirty_count;
+        ntf->dirty_set[ntf->dirty_count++] = watch;
+        COUNTER_ADD(ntf->stats.dirty_dirs, 1);
+    }
+    watch->dirty |= mask;
+    return 0;
+}
+
+/* Take a watch about to be retired out of the dirty set. */
+static void dirtyForget(Notify* ntf, struct Watch* watch)
+{
+    if (watch == NULL
+        || !watch->dirty)
+    {
+        return;
+    }
+    struct Watch* last = ntf->dirty_set[--ntf->dirty_count];
+    ntf->dirty_set[watch->dirty_at] = last;
+    last->dirty_at = watch->dirty_at;
+    watch->dirty = 0;
+    COUNTER_ADD(ntf->stats.dirty_dirs, -1);
+}
+
+/*
+ * NotifyOptions.dirty: fold `e` into its directory's mask instead of
+ * queueing it, keeping the entry set in step as delivery would.
+ * Returns 0, or -1 on allocation failure (errno set).
+ */
+static int dirtyFold(Notify* ntf, const struct inotify_event* e)
+{
+    struct Watch* watch = watchFind(ntf, e->wd);
+    if (watch == NULL)
+    {
+        return 0;
+    }
+    if (e->len)
+    {
+        if ((e->mask & (IN_CREATE | IN_MOVED_TO))
+            && -1 == entryAdd(&ntf->mem, &watch->entries, e->name, e->mask & IN_ISDIR))
+        {
+            return -1;
+        }
+        if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            entryDel(&ntf->mem, &watch->entries, e->name);
+        }
+    }
+    COUNTER_ADD(ntf->stats.events_folded, 1);
+    return dirtyMark(ntf, watch, e->mask);
+}
+
+/*
+ * Append a deep-copy of `e` to the tail of its class of the event
+ * queue, tagged with CHAIN_* `flags`. Returns 1 when it was queued, 0 (silently)
+ * when the event's name matches the configured exclude regex or the
+ * queue is full and its policy dropped or folded the event, and -1 on
+ * allocation failure (errno set).
+ *
+ * Ownership: a successful push stores a copy of `e` in a queue record;
+ * the caller still owns `e`. The eventual pullChainEvent returns that
+ * copy and the puller becomes responsible for freeChainEvent on it.
+ */
+static int pushChainEvent(Notify* ntf, const struct inotify_event* e, unsigned int flags)
+{
+    if (ntf == NULL || e == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ntf->stored = NULL;
+
+    if (chainExcluded(ntf, e))
+    {
+        COUNTER_ADD(ntf->stats.events_excluded, 1);
+        return 0;
+    }
+
+    /* the recursion still needs what isStructural picks out */
+    if (ntf->dirty
+        && !isStructural(e))
+    {
+        return (-1 == dirtyFold(ntf, e)) ? -1 : 0;
+    }
+
+    if ((ntf->queue_events || ntf->queue_bytes)
+        && !isStructural(e)
+        && queueOver(ntf))
+    {
+        int rc = queuePolicy(ntf, e);
+        if (rc != 0)
+        {
+            return (rc == 1) ? 0 : -1;
+        }
+    }
+
+    if (chainStore(ntf, e, flags, chainClass(ntf, e)) == NULL)
+    {
+        return -1;
+    }
+
+    /* Counted here rather than by the caller so that directories the
+     * exclude regex dropped above never hold the scan open. */
+    if ((flags & (CHAIN_SCAN | CHAIN_WATCHED)) == CHAIN_SCAN
+        && (e->mask & IN_ISDIR))
+    {
+        ntf->scan_pending++;
+    }
+
+    return 1;
+}
+
+/*
+ * Remove and return the oldest pending inotify_event of the first
+ * non-empty class, or NULL if the queue is empty; its CHAIN_* flags go
+ * to `*flags` and its sequence number, time and metadata to `*info`
+ * when non-NULL. The returned pointer is owned by the caller and must be
+ * released with freeChainEvent() once consumed.
+ */
+static struct inotify_event* pullChainEvent(Notify* ntf, unsigned int* flags, NotifyEventInfo* info)
+{
+    struct chainQueue* q = ntf->q;
+    while (q->head == NULL)
+    {
+        if (++q == ntf->q + CHAIN_CLASSES)
+        {
+            return NULL;
+        }
+    }
+
+    struct chainEvent* element = q->head;
+    struct inotify_event* event = element->e;
+    if (flags)
+    {
+        *flags = element->flags;
+    }
+    if (info)
+    {
+        info->seq = element->seq;
+        info->time_ns = element->time_ns;
+        if (element->st != NULL)
+        {
+            info->stat = *element->st;
+        }
+        else
+        {
+            memset(&info->stat, 0, sizeof(info->stat));
+            info->stat.err = ENODATA;
+        }
+    }
+    lstRelease(&ntf->mem, element->st);
+    element->st = NULL;
+    q->head = element->next;
+    if (q->head == NULL)
+    {
+        q->tail = NULL;
+    }
+    indexDel(&ntf->mem, &ntf->queued, element);
+    if (!chainInline(event->len))
+    {
+        chainRelease(ntf, element);
+    }
+    if (event->wd < 0
+        && (event->mask & NOTIFY_EVENTS_DROPPED))
+    {
+        ntf->drop_marked = 0;
+    }
+    COUNTER_ADD(ntf->stats.queue_bytes, -(unsigned long)chainBytes(event));
+    COUNTER_ADD(ntf->stats.queue_depth, -1);
+    ntf->pulled++;
+
+    return event;
+}
+
+/* Milliseconds on CLOCK_MONOTONIC. */
+static uint64_t monotonicMs(void)
+{
+    return monotonicNs() / 1000000;
+}
+
+/* The waiting IN_MOVED_FROM with `cookie`, or NULL. */
+static struct moveWait* moveFind(const Notify* ntf, uint32_t cookie)
+{
+    struct moveWait* m = ntf->moves;
+    while (m != NULL
+           && m->cookie != cookie)
+    {
+        m = m->next;
+    }
+    return m;
+}
+
+/*
+ * Detach the waiting IN_MOVED_FROM with `cookie`. Returns it (the
+ * caller releases it with freeMove) or NULL when there is none.
+ */
+static struct moveWait* moveTake(Notify* ntf, uint32_t cookie)
+{
+    struct moveWait* prev = NULL;
+    struct moveWait* m = ntf->moves;
+    while (m != NULL
+           && m->cookie != cookie)
+    {
+        prev = m;
+        m = m->next;
+    }
+    if (m == NULL)
+    {
+        return NULL;
+    }
+    if (prev != NULL)
+    {
+        prev->next = m->next;
+    }
+    else
+    {
+        ntf->moves = m->next;
+    }
+    if (ntf->moves_tail == m)
+    {
+        ntf->moves_tail = prev;
+    }
+    return m;
+}
+
+static void freeMove(const lstAllocator* mem, struct moveWait* m)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+    lstRelease(mem, m->to);
+    lstRelease(mem, m);
+}
+
+/*
+ * Queue a kernel IN_MOVED_FROM or IN_MOVED_TO with rename pairing on
+ * (NotifyOptions.rename_window). A FROM is queued as usual and starts
+ * waiting for its TO; a TO whose FROM is still waiting is kept with it
+ * instead of being queued, so the pair goes out as one NOTIFY_RENAME
+ * event from the FROM's place in the queue. A TO the exclude regex
+ * filters out releases its FROM at once (as an IN_DELETE).
+ *
+ * Returns as pushChainEvent; a TO kept with its FROM counts as queued.
+ * An allocation failure after the FROM was queued leaves it queued,
+ * to be delivered unpaired.
+ */
+static int pairMove(Notify* ntf, const struct inotify_event* e)
+{
+    if (e->mask & IN_MOVED_TO)
+    {
+        struct moveWait* m = moveFind(ntf, e->cookie);
+        if (m != NULL
+            && m->to == NULL)
+        {
+            if (chainExcluded(ntf, e))
+            {
+                m->due = 0;
+            }
+            else
+            {
+                size_t size = sizeof(struct inotify_event) + e->len;
+                m->to = (struct inotify_event*)lstAlloc(&ntf->mem, size);
+                if (m->to == NULL)
+                {
+                    return -1;
+                }
+                memcpy(m->to, e, size);
+                return 1;
+            }
+        }
+        return pushChainEvent(ntf, e, 0);
+    }
+
+    int rc = pushChainEvent(ntf, e, 0);
+    if (rc != 1)
+    {
+        return rc;
+    }
+    struct moveWait* m = (struct moveWait*)lstAlloc(&ntf->mem, sizeof(struct moveWait));
+    if (m == NULL)
+    {
+        return -1;
+    }
+    m->cookie = e->cookie;
+    m->due = monotonicMs() + (uint64_t)ntf->rename_window;
+    m->to = NULL;
+    m->next = NULL;
+    if (ntf->moves_tail != NULL)
+    {
+        ntf->moves_tail->next = m;
+    }
+    else
+    {
+        ntf->moves = m;
+    }
+    ntf->moves_tail = m;
+    return 1;
+}
+
+/*
+ * Milliseconds the next event to deliver must still be held, when it
+ * is an IN_MOVED_FROM whose IN_MOVED_TO has not been read yet: 0 once
+ * its window has passed, -1 when nothing is held. Never in replay,
+ * where the reads that ended the live run's waits are recorded where
+ * they happened, nor while the queue is blocked, which would keep the
+ * TO from being read anyway.
+ */
+static int moveHold(const Notify* ntf)
+{
+    if (ntf->moves == NULL
+        || ntf->replay
+        || queueBlocked(ntf))
+    {
+        return -1;
+    }
+    const struct chainQueue* q = ntf->q;
+    while (q->head == NULL)
+    {
+        if (++q == ntf->q + CHAIN_CLASSES)
+        {
+            return -1;
+        }
+    }
+    const struct inotify_event* e = q->head->e;
+    if (!(e->mask & IN_MOVED_FROM))
+    {
+        return -1;
+    }
+    const struct moveWait* m = moveFind(ntf, e->cookie);
+    if (m == NULL
+        || m->to != NULL)
+    {
+        return -1;
+    }
+    uint64_t now = monotonicMs();
+    return (m->due > now) ? (int)(m->due - now) : 0;
+}
+
+/*
+ * The engine's only ways of asking the kernel or the filesystem
+ * anything. Each wrapper makes the call and, when recording, appends
+ * its outcome to the capture; when replaying it returns the recorded
+ * outcome instead, without making the call.
+ */
+
+/*
+ * Log the outcome `rc` (-1: failed with errno) of a call on `key`.
+ * Returns rc with errno preserved, or -1 with errno set when the
+ * capture could not be written.
+ */
+static int recordCall(Notify* ntf, enum replayType type, const char* key, int rc, const void* data, size_t len)
+{
+    if (ntf->record == NULL)
+    {
+        return rc;
+    }
+    int saved_errno = errno;
+    if (-1 == replayPut(ntf->record, type, ntf->pulled, (rc == -1) ? -saved_errno : rc, key, data, len))
+    {
+        return -1;
+    }
+    errno = saved_errno;
+    return rc;
+}
+
+/*
+ * Take the next recorded call, which must be `type` on `key`.
+ * Returns its result (-1 with its errno when it had failed), or -1
+ * with EPROTO/ENODATA when the capture does not match.
+ */
+static int replayCall(Notify* ntf, enum replayType type, const char* key, const void** data, size_t* len)
+{
+    int32_t rc = 0;
+    if (-1 == replayGet(ntf->replay, type, ntf->pulled, key, &rc, data, len))
+    {
+        return -1;
+    }
+    if (rc < 0)
+    {
+        errno = -rc;
+        return -1;
+    }
+    return rc;
+}
+
+static int fsAddWatch(Notify* ntf, const char* path)
+{
+    if (ntf->replay)
+    {
+        return replayCall(ntf, REPLAY_WATCH, path, NULL, NULL);
+    }
+    /* IN_MOVE_SELF tells dropMovedAway a directory left the tree */
+    uint32_t mask = (ntf->shedding ? ntf->mask & ~SHED_EVENTS : ntf->mask) | IN_DONT_FOLLOW;
+    if (mask & IN_MOVED_FROM)
+    {
+        mask |= IN_MOVE_SELF;
+    }
+    int wd = inotify_add_watch(ntf->fd, path, mask);
+    return recordCall(ntf, REPLAY_WATCH, path, wd, NULL, 0);
+}
+
+/* `path` is the watch's path, recorded to validate the replay. */
+static int fsRmWatch(Notify* ntf, int wd, const char* path)
+{
+    if (ntf->replay)
+    {
+        return replayCall(ntf, REPLAY_UNWATCH, path, NULL, NULL);
+    }
+    int rc = inotify_rm_watch(ntf->fd, wd);
+    return recordCall(ntf, REPLAY_UNWATCH, path, rc, NULL, 0);
+}
+
+/* Only st_dev, st_ino, st_mode and st_mtim are meaningful in `sb`. */
+static int fsLstat(Notify* ntf, const char* path, struct stat* sb)
+{
+    struct replayStat rs;
+    if (ntf->replay)
+    {
+        const void* data = NULL;
+        size_t len = 0;
+        int rc = replayCall(ntf, REPLAY_STAT, path, &data, &len);
+        if (rc == 0)
+        {
+            if (len != sizeof(rs))
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(&rs, data, sizeof(rs));
+            memset(sb, 0, sizeof(*sb));
+            sb->st_dev = (dev_t)rs.dev;
+            sb->st_ino = (ino_t)rs.ino;
+            sb->st_mode = (mode_t)rs.mode;
+            sb->st_mtim.tv_sec = (time_t)rs.mtime_sec;
+            sb->st_mtim.tv_nsec = (long)rs.mtime_nsec;
+        }
+        return rc;
+    }
+
+    int rc = lstat(path, sb);
+    if (rc == 0 && ntf->record)
+    {
+        memset(&rs, 0, sizeof(rs));
+        rs.dev = sb->st_dev;
+        rs.ino = sb->st_ino;
+        rs.mode = sb->st_mode;
+        rs.mtime_sec = sb->st_mtim.tv_sec;
+        rs.mtime_nsec = sb->st_mtim.tv_nsec;
+    }
+    return recordCall(ntf, REPLAY_STAT, path, rc, &rs, (rc == 0) ? sizeof(rs) : 0);
+}
+
+/*
+ * lstReadDir, which also answers NULL for an empty directory (errno
+ * untouched then); a replay reproduces that errno too.
+ */
+static char** fsReadDir(Notify* ntf, const char* path)
+{
+    if (ntf->replay)
+    {
+        int32_t rc = 0;
+        const void* data = NULL;
+        size_t len = 0;
+        if (-1 == replayGet(ntf->replay, REPLAY_READDIR, ntf->pulled, path, &rc, &data, &len))
+        {
+            return NULL;
+        }
+        if (rc <= 0)
+        {
+            errno = -rc;
+            return NULL;
+        }
+        char** elems = NULL;
+        for (const char* name = (const char*)data; name < (const char*)data + len; name += strlen(name) + 1)
+        {
+            if (-1 == lstPush(&ntf->mem, &elems, name))
+            {
+                lstFree(&ntf->mem, elems);
+                return NULL;
+            }
+        }
+        return elems;
+    }
+
+    char** elems = lstReadDir(&ntf->mem, path);
+    if (ntf->record == NULL)
+    {
+        return elems;
+    }
+    int saved_errno = errno;
+    int rc = 0;
+    if (elems == NULL)
+    {
+        rc = replayPut(ntf->record, REPLAY_READDIR, ntf->pulled, -saved_errno, path, NULL, 0);
+    }
+    else
+    {
+        size_t len = 0;
+        for (size_t i = 0; elems[i]; i++)
+        {
+            len += strlen(elems[i]) + 1;
+        }
+        char* names = (char*)lstAlloc(&ntf->mem, len ? len : 1);
+        if (names == NULL)
+        {
+            lstFree(&ntf->mem, elems);
+            return NULL;
+        }
+        char* p = names;
+        for (size_t i = 0; elems[i]; i++)
+        {
+            size_t n = strlen(elems[i]) + 1;
+            memcpy(p, elems[i], n);
+            p += n;
+        }
+        rc = replayPut(ntf->record, REPLAY_READDIR, ntf->pulled, 1, path, names, len);
+        lstRelease(&ntf->mem, names);
+    }
+    if (rc == -1)
+    {
+        lstFree(&ntf->mem, elems);
+        return NULL;
+    }
+    errno = saved_errno;
+    return elems;
+}
+
+/*
+ * Track the maximum NAME_MAX across all watched paths; the FIONREAD
+ * size sanity check in waitNotify multiplies this by max_queued_events
+ * to bound an acceptable buffer size.
+ */
+static void updateMaxName(Notify* ntf, char* path)
+{
+    if (ntf->replay == NULL
+        && !access(path, F_OK))
+    {
+        long max_name = pathconf(path, _PC_NAME_MAX);
+        ntf->max_name = (max_name > ntf->max_name) ? max_name : ntf->max_name;
+    }
+}
+
+/*
+ * Queue a library-made event for `name` inside the directory watched
+ * by `wd` (name may be NULL for an event about the directory itself,
+ * or for a marker with wd = -1). Goes through pushChainEvent, so the
+ * exclude regex applies.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int pushSynthetic(Notify* ntf, int wd, uint32_t mask, uint32_t cookie, const char* name, unsigned int flags)
+{
+    const size_t event_size = sizeof(struct inotify_event);
+    size_t name_size = name ? strlen(name) + 1 : 0;
+    _Alignas(struct inotify_event) char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    if (name_size > NAME_MAX + 1)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    struct inotify_event* e = (struct inotify_event*)buf;
+    memset(e, 0, event_size);
+
+    e->wd = wd;
+    e->mask = mask;
+    e->cookie = cookie;
+    e->len = name_size;
+    if (name_size)
+    {
+        memcpy(e->name, name, name_size);
+    }
+
+    int rc = pushChainEvent(ntf, e, flags | CHAIN_SYNTHETIC);
+    if (rc == -1)
+    {
+        return -1;
+    }
+    COUNTER_ADD(ntf->stats.events_synthetic, 1);
+    return 0;
+}
+
+/*
+ * Synthesise the events that announce an entry found by readdir
+ * rather than reported by the kernel: IN_CREATE (with IN_ISDIR for a
+ * directory), plus IN_CLOSE_WRITE for anything else, since the entry
+ * is already complete by the time we see it. `sb` is the entry's
+ * lstat when one was made, their metadata for NotifyOptions.stat.
+ */
+static int pushFound(Notify* ntf, int wd, const char* name, int is_dir, const struct stat* sb, uint32_t cookie, unsigned int flags)
+{
+    sb = ntf->stat_mode ? sb : NULL;
+    if (-1 == pushSynthetic(ntf, wd, IN_CREATE | (is_dir ? IN_ISDIR : 0), cookie, name, flags))
+    {
+        return -1;
+    }
+    if (sb)
+    {
+        statKeep(ntf, sb);
+    }
+    if (is_dir)
+    {
+        return 0;
+    }
+    if (-1 == pushSynthetic(ntf, wd, IN_CLOSE_WRITE, 0, name, flags))
+    {
+        return -1;
+    }
+    if (sb)
+    {
+        statKeep(ntf, sb);
+    }
+    return 0;
+}
+
+/* An owned directory path and the wd of the directory it is in. */
+struct pathItem
+{
+    char* path;
+    int parent;
+};
+
+/* Growable stack of pathItems, for scanTree. */
+struct pathStack
+{
+    struct pathItem* items;
+    size_t count;
+    size_t cap;
+};
+
+/*
+ * Push `path` onto the stack, taking ownership of it.
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int pathPush(const lstAllocator* mem, struct pathStack* stack, char* path, int parent)
+{
+    if (stack->count == stack->cap)
+    {
+        size_t new_cap = stack->cap ? stack->cap * 2 : 64;
+        struct pathItem* t = (struct pathItem*)lstRealloc(mem, stack->items, sizeof(struct pathItem) * new_cap);
+        if (t == NULL)
+        {
+            return -1;
+        }
+        stack->items = t;
+        stack->cap = new_cap;
+    }
+    stack->items[stack->count].path = path;
+    stack->items[stack->count].parent = parent;
+    stack->count++;
+    return 0;
+}
+
+/*
+ * Whether `path`, a directory in the one `above` watches, is to be
+ * watched (NotifyOptions.max_depth, same_dev and recurse). Depth and a
+ * NOTIFY_RECURSE_SHALLOW parent decide without asking; the rest is
+ * asked once and kept in above->decided until the directory is
+ * deleted or moved (policyForget).
+ *
+ * Returns a NOTIFY_RECURSE_* verdict, or -1 on allocation failure
+ * (errno set).
+ */
+static int recursePolicy(Notify* ntf, struct Watch* above, const char* path)
+{
+    int depth = above->depth + 1;
+    if (above->shallow
+        || (ntf->max_depth && depth > ntf->max_depth))
+    {
+        return NOTIFY_RECURSE_SKIP;
+    }
+    if (!ntf->same_dev
+        && ntf->recurse == NULL)
+    {
+        return NOTIFY_RECURSE_ACCEPT;
+    }
+
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    uint32_t hash = hashName(name);
+    struct Entry* known = above->decided.count
+        ? *entrySlot(&above->decided, name, hash)
+        : NULL;
+    if (known != NULL)
+    {
+        return known->verdict - 1;
+    }
+
+    int verdict = NOTIFY_RECURSE_ACCEPT;
+    struct stat sb;
+    if (ntf->same_dev
+        && !fsLstat(ntf, path, &sb)
+        && sb.st_dev != ntf->root_dev)
+    {
+        verdict = NOTIFY_RECURSE_SKIP;
+    }
+    if (verdict == NOTIFY_RECURSE_ACCEPT
+        && ntf->recurse)
+    {
+        verdict = ntf->recurse(path, depth, ntf->recurse_arg);
+        if (verdict != NOTIFY_RECURSE_SKIP
+            && verdict != NOTIFY_RECURSE_SHALLOW)
+        {
+            verdict = NOTIFY_RECURSE_ACCEPT;
+        }
+    }
+
+    if (-1 == entryAdd(&ntf->mem, &above->decided, name, 1))
+    {
+        return -1;
+    }
+    (*entrySlot(&above->decided, name, hash))->verdict = (unsigned char)(verdict + 1);
+    return verdict;
+}
+
+/* Forget the verdict on `name` in the directory `wd` watches. */
+static void policyForget(Notify* ntf, int wd, const char* name)
+{
+    struct Watch* watch = watchFind(ntf, wd);
+    if (watch != NULL)
+    {
+        entryDel(&ntf->mem, &watch->decided, name);
+    }
+}
+
+/**
+ * Install an inotify watch on `path` and synthesise IN_CREATE events
+ * for entries already present in the directory (so the caller never
+ * misses files that appeared between mkdir(2) and our watch).
+ *
+ * `flags` (ADD_*) adapt this for the initial scan: ADD_SCAN counts
+ * the directory towards notifyScanProgress and tags its events with
+ * CHAIN_SCAN; ADD_QUIET records the entries as already known instead
+ * of queueing events for them. When `subdirs` is non-NULL the paths
+ * of subdirectories are pushed onto it for the caller to descend
+ * into, and their events are marked CHAIN_WATCHED accordingly.
+ *
+ * `parent` is the wd of the watched directory `path` is in, -1 for
+ * the root; the recursion policy is applied to all but the root.
+ *
+ * Returns:
+ *    1 — watch installed.
+ *    0 — path no longer exists (ENOENT from inotify_add_watch), or the
+ *        recursion policy skips it; a benign no-op so callers can
+ *        ignore racing deletions.
+ *   -1 — error (errno set).
+ */
+static int crawlDir(Notify* ntf, const char* path, int parent, uint32_t cookie, unsigned int flags, struct pathStack* subdirs)
+{
+    struct Watch* above = (parent == -1) ? NULL : watchFind(ntf, parent);
+    int verdict = above ? recursePolicy(ntf, above, path) : NOTIFY_RECURSE_ACCEPT;
+    if (verdict == -1)
+    {
+        return -1;
+    }
+    if (verdict == NOTIFY_RECURSE_SKIP)
+    {
+        COUNTER_ADD(ntf->stats.dirs_skipped, 1);
+        return 0;
+    }
+    int depth = above ? above->depth + 1 : 0;
+
+    errno = 0;
+    /*
+     * IN_DONT_FOLLOW is always set: if `path` is a symlink, watch the
+     * link itself rather than dereferencing it. Without this flag an
+     * attacker with write access to a watched directory could plant a
+     * symlink and steer the recursive descent into an arbitrary path
+     * (e.g. /etc). Coupled with the lstat() check on directory entries
+     * elsewhere in this file, this is the no-follow guarantee.
+     */
+    int wd = fsAddWatch(ntf, path);
+    if (-1 == wd)
+    {
+        if (errno == ENOENT)
+        {
+            return 0;
+        }
+        return -1;
+    }
+
+    char* watch_path = lstString(&ntf->mem, "%s", path);
+    if (watch_path == NULL)
+    {
+        return -1;
+    }
+
+    /* A known wd means the same directory again (e.g. re-added after a
+     * move): keep its entry set, which still describes its contents. */
+    struct Watch* watch = watchFind(ntf, wd);
+    if (watch == NULL)
+    {
+        watch = (struct Watch*)lstCalloc(&ntf->mem, 1, sizeof(struct Watch));
+        if (watch == NULL)
+        {
+            lstRelease(&ntf->mem, watch_path);
+            return -1;
+        }
+        watch->wd = wd;
+        if (-1 == watchAdd(&ntf->mem, &ntf->w, watch))
+        {
+            lstRelease(&ntf->mem, watch);
+            lstRelease(&ntf->mem, watch_path);
+            return -1;
+        }
+        COUNTER_ADD(ntf->stats.watches, 1);
+        COUNTER_ADD(ntf->stats.watches_added, 1);
+    }
+    lstRelease(&ntf->mem, watch->path);
+    watch->path = watch_path;
+    watch->depth = depth;
+    watch->shallow = (verdict == NOTIFY_RECURSE_SHALLOW);
+    if (flags & ADD_SCAN)
+    {
+        COUNTER_ADD(ntf->scan_dirs, 1);
+    }
+
+    /* Stamp before readdir: an entry created in between bumps mtime
+     * past the stamp, which only makes a later rescan re-read us. */
+    struct stat sb;
+    if (!fsLstat(ntf, path, &sb))
+    {
+        stampWatch(watch, &sb);
+        if (parent == -1)
+        {
+            ntf->root_dev = sb.st_dev;
+        }
+    }
+
+    char** elems = fsReadDir(ntf, path);
+    if (elems == NULL)
+    {
+        /* watch is in place; we just couldn't enumerate existing
+         * entries (path is a regular file, or permission denied) */
+        return 1;
+    }
+
+    size_t i = 0;
+    while (elems[i])
+    {
+        char* path_elem = lstString(&ntf->mem, "%s/%s", path, elems[i]);
+        if (path_elem == NULL)
+        {
+            lstFree(&ntf->mem, elems);
+            return -1;
+        }
+
+        /* lstat — never dereference a symlink here. A symlink-to-dir
+         * must not be reported as IN_ISDIR or the recursive descent
+         * would follow it (IN_DONT_FOLLOW on inotify_add_watch already
+         * refuses to install the watch, but emitting IN_ISDIR for a
+         * symlink is still semantically wrong). */
+        int found = !fsLstat(ntf, path_elem, &sb);
+        int is_dir = (found && S_ISDIR(sb.st_mode)) ? 1 : 0;
+        if (is_dir)
+        {
+            updateMaxName(ntf, path_elem);
+        }
+
+        int rc = 0;
+        if (flags & ADD_QUIET)
+        {
+            rc = entryAdd(&ntf->mem, &watch->entries, elems[i], is_dir);
+        }
+        else
+        {
+            unsigned int chain_flags = (flags & ADD_SCAN) ? CHAIN_SCAN : 0;
+            if (subdirs)
+            {
+                chain_flags |= CHAIN_WATCHED;
+            }
+            rc = pushFound(ntf, wd, elems[i], is_dir, found ? &sb : NULL, cookie, chain_flags);
+        }
+
+        if (rc == 0 && is_dir && subdirs && !watch->shallow)
+        {
+            rc = pathPush(&ntf->mem, subdirs, path_elem, wd);
+            if (rc == 0)
+            {
+                path_elem = NULL;
+            }
+        }
+        lstRelease(&ntf->mem, path_elem);
+        if (rc == -1)
+        {
+            lstFree(&ntf->mem, elems);
+            return -1;
+        }
+        i++;
+    }
+
+    if (flags & ADD_SCAN)
+    {
+        COUNTER_ADD(ntf->scan_entries, i);
+    }
+    lstFree(&ntf->mem, elems);
+
+    return 1;
+}
+
+/*
+ * crawlDir, with its time accounted to the "crawl" trace phase. The
+ * events it makes up are stamped with when it started; a read it runs
+ * in the middle of (trackEvent) keeps its own time.
+ */
+static int addNotify(Notify* ntf, const char* path, int parent, uint32_t cookie, unsigned int flags, struct pathStack* subdirs)
+{
+    uint64_t batch_ns = ntf->batch_ns;
+    ntf->batch_ns = monotonicNs();
+    TRACE_BEGIN(ntf, t_crawl);
+    int rc = crawlDir(ntf, path, parent, cookie, flags, subdirs);
+    TRACE_END(ntf, t_crawl, TRACE_CRAWL);
+    ntf->batch_ns = batch_ns;
+    return rc;
+}
+
+/*
+ * Synchronous initial scan (NOTIFY_SCAN_FULL, NOTIFY_SCAN_WATCHES):
+ * watch `root` and every directory below it before returning. Depth
+ * first over an explicit stack, so tree depth never costs C stack.
+ * Subdirectories that vanish mid-walk are skipped.
+ *
+ * Returns addNotify's result for the root, or -1 on error (errno set).
+ */
+static int scanTree(Notify* ntf, const char* root, unsigned int flags)
+{
+    struct pathStack stack = { NULL, 0, 0 };
+    int rc = addNotify(ntf, root, -1, 0, flags, &stack);
+    while (rc == 1 && stack.count)
+    {
+        struct pathItem dir = stack.items[--stack.count];
+        if (-1 == addNotify(ntf, dir.path, dir.parent, 0, flags, &stack))
+        {
+            rc = -1;
+        }
+        lstRelease(&ntf->mem, dir.path);
+    }
+
+    int saved_errno = errno;
+    while (stack.count)
+    {
+        lstRelease(&ntf->mem, stack.items[--stack.count].path);
+    }
+    lstRelease(&ntf->mem, stack.items);
+    errno = saved_errno;
+
+    return rc;
+}
+
+/* Queue the NOTIFY_SCAN_DONE marker; the initial scan is complete. */
+static int finishScan(Notify* ntf)
+{
+    COUNTER_ADD(ntf->scan_done, 1);
+    return pushSynthetic(ntf, -1, NOTIFY_SCAN_DONE, 0, NULL, 0);
+}
+
+/*
+ * Read /proc/sys/fs/inotify/max_queued_events into `*value`.
+ * Returns 0, or -1 with errno set.
+ */
+static int readMaxQueued(unsigned long* value)
+{
+    FILE* f = fopen(PATH_MAX_QUEUED_EVENTS, "r");
+    if (f == NULL)
+    {
+        return -1;
+    }
+    if (1 != fscanf(f, "%10lu", value))
+    {
+        int saved_errno = errno ? errno : EIO;
+        fclose(f);
+        errno = saved_errno;
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Open what events come from: a fresh inotify instance, sized by
+ * /proc/sys/fs/inotify/max_queued_events, or with `opts->replay` the
+ * capture alone (ntf->fd stays -1). With `opts->record` the capture
+ * file is created next to the inotify instance.
+ *
+ * Returns 0, or -1 with errno set, ntf->fd -1 and nothing left open.
+ */
+static int openSource(Notify* ntf, const NotifyOptions* opts)
+{
+    if (opts && opts->replay)
+    {
+        ntf->fd = -1;
+        ntf->replay = replayOpen(opts->replay, &ntf->max_queued_events);
+        return (ntf->replay == NULL) ? -1 : 0;
+    }
+
+    if (-1 == readMaxQueued(&ntf->max_queued_events))
+    {
+        return -1;
+    }
+
+    ntf->fd = inotify_init();
+    if (-1 == ntf->fd)
+    {
+        return -1;
+    }
+
+    if (opts && opts->record)
+    {
+        ntf->record = replayCreate(opts->record, ntf->max_queued_events);
+        if (ntf->record == NULL)
+        {
+            int saved_errno = errno;
+            close(ntf->fd);
+            ntf->fd = -1;
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether `opts` (NULL: defaults) is inconsistent in itself, whatever
+ * the tree and mask: conflicting modes, an unknown queue policy, a
+ * shed percentage outside 0..100, a negative depth limit or a partial
+ * allocator.
+ */
+static int badOptions(const NotifyOptions* opts)
+{
+    return opts
+        && ((opts->threaded && opts->external_read)
+            || (opts->replay
+                && (opts->threaded || opts->external_read || opts->record))
+            || (opts->queue_policy != NOTIFY_QUEUE_BLOCK
+                && opts->queue_policy != NOTIFY_QUEUE_COALESCE
+                && opts->queue_policy != NOTIFY_QUEUE_DROP)
+            || opts->shed < 0
+            || opts->shed > 100
+            || opts->stat < NOTIFY_STAT_OFF
+            || opts->stat > NOTIFY_STAT_URING
+            || (opts->stat && opts->replay)
+            || (opts->dirty
+                && (opts->threaded || opts->rename_window || opts->stat || opts->hot || opts->journal))
+            || opts->hot > NOTIFY_HOT_MAX
+            || opts->hot_halflife < 0
+            || opts->max_depth < 0
+            || (opts->allocator
+                && (!opts->allocator->alloc
+                    || !opts->allocator->realloc
+                    || !opts->allocator->free)));
+}
+
+/*
+ * A blank Notify (no fd, no watches) with the settings of `opts` that
+ * belong to the process using it: allocator, queue limits and policy,
+ * priority, shedding, record pool, external reads, the activity
+ * tracker, the journal and the recursion policy (the callback cannot
+ * travel with a handoff, so neither does the rest of it). What
+ * describes the tree and the event stream (mask, scan mode, exclude,
+ * rename window) is up to the caller.
+ *
+ * Returns NULL on allocation failure or when the journal cannot be
+ * opened (errno set).
+ */
+static Notify* newNotify(const NotifyOptions* opts)
+{
+    lstAllocator mem = { NULL, NULL, NULL, NULL };
+    if (opts && opts->allocator)
+    {
+        mem.alloc = opts->allocator->alloc;
+        mem.realloc = opts->allocator->realloc;
+        mem.free = opts->allocator->free;
+        mem.ud = opts->allocator->ud;
+    }
+
+    Notify* ntf = (Notify*)lstAlloc(&mem, sizeof(Notify));
+    if (ntf == NULL)
+    {
+        return NULL;
+    }
+    memset(ntf, 0, sizeof(Notify));
+    ntf->mem = mem;
+    ntf->fd = -1;
+    ntf->ready_fd = -1;
+    ntf->wake_fd = -1;
+    if (opts)
+    {
+        ntf->external_read = (opts->external_read != 0);
+        ntf->priority = (opts->priority != 0);
+        ntf->queue_events = opts->queue_events;
+        ntf->queue_bytes = opts->queue_bytes;
+        ntf->queue_policy = opts->queue_policy;
+        ntf->shed = opts->shed;
+        ntf->event_pool = opts->event_pool;
+        ntf->stat_mode = opts->stat;
+        ntf->dirty = (opts->dirty != 0);
+        ntf->max_depth = opts->max_depth;
+        ntf->same_dev = (opts->same_dev != 0);
+        ntf->recurse = opts->recurse;
+        ntf->recurse_arg = opts->recurse_arg;
+    }
+    if (opts && opts->hot)
+    {
+        ntf->hot = hotNew(&ntf->mem, opts->hot, opts->hot_halflife);
+        if (ntf->hot == NULL)
+        {
+            lstRelease(&mem, ntf);
+            return NULL;
+        }
+    }
+    if (opts && opts->journal)
+    {
+        ntf->journal = journalCreate(opts->journal, opts->journal_size);
+        if (ntf->journal == NULL)
+        {
+            int saved_errno = errno;
+            hotFree(ntf->hot);
+            lstRelease(&mem, ntf);
+            errno = saved_errno;
+            return NULL;
+        }
+    }
+    for (int i = 0; i < STAT_DIRS; i++)
+    {
+        ntf->stat_dirs[i].fd = -1;
+    }
+    /* without io_uring the lookups are plain statx calls */
+    if (ntf->stat_mode == NOTIFY_STAT_URING)
+    {
+        ntf->stat_ring = statRingOpen(64);
+    }
+    return ntf;
+}
+
+/*
+ * Compile `exclude` as POSIX extended regex into ntf->exclude and keep
+ * the pattern. Returns 0, or -1 with errno set (EINVAL for a pattern
+ * regcomp rejects); nothing is kept on failure.
+ */
+static int setExclude(Notify* ntf, const char* exclude)
+{
+    regex_t* preg = (regex_t*)lstAlloc(&ntf->mem, sizeof(regex_t));
+    if (preg == NULL)
+    {
+        return -1;
+    }
+    memset(preg, 0, sizeof(regex_t));
+    if (0 != regcomp(preg, exclude, REG_EXTENDED))
+    {
+        lstRelease(&ntf->mem, preg);
+        errno = EINVAL;
+        return -1;
+    }
+    ntf->exclude_src = lstString(&ntf->mem, "%s", exclude);
+    if (ntf->exclude_src == NULL)
+    {
+        regfree(preg);
+        lstRelease(&ntf->mem, preg);
+        return -1;
+    }
+    ntf->exclude = preg;
+    return 0;
+}
+
+/* Threaded mode, defined with the reader further down. */
+static int startReader(Notify* ntf);
+
+/*
+ * Public API.
+ *
+ * Initialise a Notify watching `path`. `mask` is the inotify event
+ * mask installed on every watch in the tree; IN_DONT_FOLLOW is added
+ * unconditionally. `exclude`, if non-NULL, is compiled as POSIX
+ * extended regex; events whose `name` matches are dropped before they
+ * reach the chain.
+ *
+ * The path is descended recursively: existing entries are surfaced
+ * as synthetic IN_CREATE events (and IN_CLOSE_WRITE for regular
+ * files) so the caller never has to do an initial scan separately.
+ * How and when that happens is chosen by `opts->scan` (NULL opts
+ * means all defaults):
+ *   NOTIFY_SCAN_BACKGROUND  only the root is read here; deeper
+ *                           directories are watched and read as the
+ *                           consumer drains their IN_CREATE events.
+ *   NOTIFY_SCAN_FULL        the whole tree is watched before return;
+ *                           its synthetic events are all queued.
+ *   NOTIFY_SCAN_WATCHES     the whole tree is watched before return;
+ *                           no events for entries that already exist.
+ * In every mode NOTIFY_SCAN_DONE is delivered once the pre-existing
+ * tree has been covered.
+ *
+ * With `opts->threaded` a reader thread owned by the Notify drains the
+ * inotify fd and runs all the bookkeeping as events arrive, so a
+ * consumer that stalls between waitNotify calls no longer leaves the
+ * kernel queue to overflow; waitNotify then only dequeues.
+ *
+ * With `opts->trace` (in a library built with RNOTIFY_TRACE) the
+ * engine records the duration of each processing phase into a ring of
+ * that many spans, see notifyTraceDump. Other builds ignore it.
+ *
+ * With `opts->external_read` the caller reads the inotify fd itself
+ * (e.g. through io_uring) and passes the bytes to notifyFeed;
+ * waitNotify and notifyDispatch then only drain what was fed and
+ * report a timeout as soon as the queue is empty. It cannot be
+ * combined with `threaded`.
+ *
+ * With `opts->record` everything the engine learns from the kernel and
+ * the filesystem (each read of the inotify fd or buffer passed to
+ * notifyFeed, and the result of every watch, lstat and readdir) is
+ * logged to that file; it is flushed by freeNotify. A Notify created
+ * with `opts->replay` naming such a capture, and the same path, mask,
+ * exclude and scan mode, reproduces the recorded run through the same
+ * parsing and bookkeeping code without touching the kernel or the
+ * filesystem. waitNotify then fails with ENODATA at the end of the
+ * capture and with EPROTO if the replay stops matching it (e.g.
+ * different options). Replay cannot be combined with `threaded`,
+ * `external_read` or `record`.
+ *
+ * By default the events queued inside the library are unbounded.
+ * `opts->queue_events` and `opts->queue_bytes` cap them (in threaded
+ * mode together with those handed to the consumer and not yet taken);
+ * `opts->queue_policy` says what happens at the cap:
+ *   NOTIFY_QUEUE_BLOCK     the fd is not read until the queue drains,
+ *                          so the backlog stays in the kernel (where
+ *                          it may end in IN_Q_OVERFLOW and a rescan);
+ *                          notifyFeed fails with EAGAIN instead.
+ *   NOTIFY_QUEUE_COALESCE  content events (IN_MODIFY, IN_ATTRIB,
+ *                          IN_CLOSE_*, IN_OPEN, IN_ACCESS) are OR-ed
+ *                          into the newest queued event for the same
+ *                          path; anything else blocks as above.
+ *   NOTIFY_QUEUE_DROP      other events are discarded and counted; a
+ *                          NOTIFY_EVENTS_DROPPED marker is queued at
+ *                          the first of them.
+ * Events the recursion depends on (directory create/move/delete,
+ * IN_IGNORED, IN_MOVE_SELF, IN_DELETE_SELF, overflow and markers) are
+ * queued in every case. So are, under BLOCK and COALESCE, the events
+ * of a crawl or rescan, which do not come from the fd: there the caps
+ * bound what is read rather than what is queued.
+ *
+ * Directory creates and moves from the kernel, and IN_MOVE_SELF,
+ * update the watch table as soon as they are read, however much is
+ * queued ahead of them; paths are resolved on delivery, so an event
+ * still queued when its directory moved comes out under the new path.
+ * By default events are delivered in the order they were queued. With
+ * `opts->priority` the queue is split into classes delivered in turn:
+ * structural events (directory creates, moves and deletes, self
+ * events), then other changes, then IN_ACCESS, IN_OPEN and
+ * IN_CLOSE_NOWRITE. Events for the same path keep their order, and
+ * markers, IN_Q_OVERFLOW and IN_IGNORED stay behind everything queued
+ * before them; events for different paths may be reordered (a
+ * directory's IN_DELETE may come before its last file's).
+ *
+ * With `opts->shed` (a percentage) the library sheds load before the
+ * kernel queue overflows: when one read of the fd returns at least
+ * that share of max_queued_events, or an IN_Q_OVERFLOW, every watch is
+ * re-added without IN_ACCESS, IN_OPEN and IN_CLOSE_NOWRITE until a read
+ * returns less than a quarter of it. NOTIFY_SHED_BEGIN and
+ * NOTIFY_SHED_END mark the window. Re-adding costs one syscall per
+ * watch each way.
+ *
+ * With `opts->rename_window` (milliseconds; `mask` must then include
+ * IN_MOVED_FROM and IN_MOVED_TO) a move within the tree, of a file or
+ * a directory, is delivered as one IN_MOVED_TO | NOTIFY_RENAME event
+ * whose path is the new one; notifyRenameSource gives the old one. An
+ * IN_MOVED_FROM is held at the head of the queue until its IN_MOVED_TO
+ * has been read or the window has passed, and then goes out as an
+ * IN_DELETE (moved out of the tree). An IN_MOVED_TO without a waiting
+ * IN_MOVED_FROM (moved in) goes out as an IN_CREATE. Both carry cookie
+ * 0. The kernel queues the two halves of a rename together, so only
+ * moves out of the tree wait out the window. Nothing on notifyFd()
+ * announces the end of a window: a consumer polling it bounds its wait
+ * by notifyTimeout.
+ *
+ * With `opts->journal` every event waitNotify or notifyDispatch
+ * delivers is also appended, with its NotifyEventInfo, to a ring of
+ * `opts->journal_size` bytes in that file, which other processes read
+ * with notifyJournalOpen, each at its own pace. The oldest events are
+ * overwritten to make room, whatever the readers: one that falls that
+ * far behind is told so. One Notify may write a given journal at a
+ * time; a later one carries on where it stopped. Not with `dirty`.
+ *
+ * `opts->max_depth`, `opts->same_dev` and `opts->recurse` limit the
+ * recursion: before a directory below the root is watched, one more
+ * than max_depth levels down, on another st_dev than the root (a
+ * mount point), or refused by the callback is skipped, and nothing
+ * under it is watched; NOTIFY_RECURSE_SHALLOW watches a directory but
+ * none of its subdirectories. A skipped directory's own IN_CREATE
+ * still comes from its parent. The verdict on a directory is kept
+ * until it is deleted or moved, so the callback is not asked again
+ * when events re-add it; one moved within the tree is asked about
+ * under its new path, and stays watched if it already was.
+ *
+ * To watch multiple roots, create one Notify per root and integrate
+ * notifyFd() into the caller's own select()/epoll() loop.
+ *
+ * Returns a Notify* on success. Returns NULL with errno set on
+ * failure: EINVAL for a NULL path, an unknown scan mode or queue
+ * policy, a shed percentage outside 0..100, a negative rename window
+ * or one without both move events in `mask`, a negative max_depth, or
+ * conflicting options; ENOENT when the path does not exist at install
+ * time; EPROTO for a replay file that is not a capture of this tree;
+ * or any errno from inotify_init, inotify_add_watch, regcomp, the
+ * allocator or the capture or journal file's open.
+ */
+Notify* initNotifyOpts(const char* path, const uint32_t mask, const char* exclude, const NotifyOptions* opts)
+{
+    int scan = opts ? opts->scan : NOTIFY_SCAN_BACKGROUND;
+    if (path == NULL
+        || (scan != NOTIFY_SCAN_BACKGROUND
+            && scan != NOTIFY_SCAN_FULL
+            && scan != NOTIFY_SCAN_WATCHES)
+        || badOptions(opts)
+        || (opts && opts->rename_window
+            && (opts->rename_window < 0 || (mask & IN_MOVE) != IN_MOVE)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Notify* ntf = newNotify(opts);
+    if (ntf == NULL)
+    {
+        return NULL;
+    }
+    ntf->mask = mask;
+    ntf->scan = scan;
+    ntf->rename_window = opts ? opts->rename_window : 0;
+
+    updateMaxName(ntf, (char*)path);
+
+    if ((exclude
+            && -1 == setExclude(ntf, exclude))
+        || -1 == openSource(ntf, opts))
+    {
+        freeNotify(ntf);
+        return NULL;
+    }
+
+#ifdef RNOTIFY_TRACE
+    if (opts && opts->trace)
+    {
+        ntf->trace = traceNew(opts->trace);
+        if (ntf->trace == NULL)
+        {
+            freeNotify(ntf);
+            return NULL;
+        }
+    }
+#endif
+
+    int rc = 0;
+    switch (scan)
+    {
+    case NOTIFY_SCAN_FULL:
+        rc = scanTree(ntf, path, ADD_SCAN);
+        break;
+    case NOTIFY_SCAN_WATCHES:
+        rc = scanTree(ntf, path, ADD_SCAN | ADD_QUIET);
+        break;
+    default:
+        rc = addNotify(ntf, path, -1, 0, ADD_SCAN, NULL);
+        break;
+    }
+    if (rc < 0)
+    {
+        freeNotify(ntf);
+        return NULL;
+    }
+    if (rc == 0)
+    {
+        /* addNotify swallowed ENOENT as a no-op; for a single-path
+         * init that means the caller asked us to watch a path that
+         * does not exist. Surface it instead of returning a Notify
+         * that will block on waitNotify forever. */
+        freeNotify(ntf);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    /* A background scan finishes in waitNotify, when the last
+     * directory it found has been read. */
+    if (ntf->scan_pending == 0
+        && -1 == finishScan(ntf))
+    {
+        freeNotify(ntf);
+        return NULL;
+    }
+
+    if (opts && opts->threaded
+        && -1 == startReader(ntf))
+    {
+        freeNotify(ntf);
+        return NULL;
+    }
+
+    return ntf;
+}
+
+/*
+ * Public API.
+ *
+ * initNotifyOpts with default options.
+ */
+Notify* initNotify(const char* path, const uint32_t mask, const char* exclude)
+{
+    return initNotifyOpts(path, mask, exclude, NULL);
+}
+
+/*
+ * Public API.
+ *
+ * Report initial scan progress: `*dirs` directories watched and
+ * `*entries` directory entries enumerated by the scan so far (either
+ * pointer may be NULL). Counts only cover the tree that existed at
+ * initNotify time, not directories created later.
+ *
+ * Returns 1 once NOTIFY_SCAN_DONE has been queued, 0 while the scan
+ * is still in progress, -1 with EINVAL on NULL ntf.
+ */
+int notifyScanProgress(const Notify* ntf, unsigned long* dirs, unsigned long* entries)
+{
+    if (ntf == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (dirs)
+    {
+        *dirs = COUNTER_GET(ntf->scan_dirs);
+    }
+    if (entries)
+    {
+        *entries = COUNTER_GET(ntf->scan_entries);
+    }
+    return COUNTER_GET(ntf->scan_done) ? 1 : 0;
+}
+
+/*
+ * Public API.
+ *
+ * Expose the underlying inotify file descriptor so the caller can
+ * integrate it into their own select()/poll()/epoll() loop. The fd
+ * is owned by the Notify and stays valid until freeNotify; do not
+ * close it or read from it directly — always go through waitNotify.
+ * In threaded mode this is instead an eventfd that polls readable
+ * while handed-off events may be waiting.
+ *
+ * With NotifyOptions.rename_window an IN_MOVED_FROM may be held back
+ * while the fd stays quiet; poll it for at most notifyTimeout() ms,
+ * then call waitNotify again whether it became readable or not.
+ *
+ * Returns the fd on success; returns -1 with EINVAL on NULL input,
+ * with ENOTSUP for a Notify replaying a capture (there is no fd).
+ */
+int notifyFd(const Notify* ntf)
+{
+    if (ntf == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ntf->replay)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return ntf->threaded ? ntf->ready_fd : ntf->fd;
+}
+
+/*
+ * Public API.
+ *
+ * How long a caller waiting on notifyFd() may wait before calling
+ * waitNotify (or notifyDispatch) again although the fd did not become
+ * readable: the ms left of the rename window of an IN_MOVED_FROM held
+ * at the head of the queue (NotifyOptions.rename_window), 0 when it
+ * is due now. -1 when nothing is held, so poll(2) can take the value
+ * as it is; always -1 in threaded mode, where the reader releases
+ * held events itself, and for a NULL Notify (errno EINVAL).
+ */
+int notifyTimeout(const Notify* ntf)
+{
+    if (ntf == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ntf->threaded)
+    {
+        return -1;
+    }
+    return moveHold(ntf);
+}
+
+/*
+ * Rewrite every path in ntf->w that lives under `oldpath` so the
+ * prefix becomes `newpath`. Called when a watched directory is moved
+ * inside the watch set: the kernel keeps the wd, but our cached path
+ * for that wd (and for any descendant watch) becomes stale and needs
+ * to be patched up. Whole-prefix replacement, including a guard that
+ * we only match `oldpath` itself or `oldpath/`-something — not a path
+ * that merely begins with the same characters (e.g. /foo vs /foobar).
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int renameWatches(Notify* ntf, const char* oldpath, const char* newpath)
+{
+    COUNTER_ADD(ntf->stats.renames, 1);
+
+    for (size_t i = 0; i < ntf->w.cap; ++i)
+    {
+        struct Watch* watch = ntf->w.slots[i];
+        if (watch == NULL)
+        {
+            continue;
+        }
+        char* wpath = watch->path;
+        if (wpath == strstr(wpath, oldpath)
+            && (strlen(wpath) == strlen(oldpath)
+                || *(wpath + strlen(oldpath)) == '/' ))
+        {
+            char* p = lstString(&ntf->mem, "%s%s", newpath, wpath + strlen(oldpath));
+            if (p == NULL)
+            {
+                return -1;
+            }
+            lstRelease(&ntf->mem, watch->path);
+            watch->path = p;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Read exactly `len` bytes from `fd` into `*buf`, looping over short
+ * reads and retrying on EINTR/EAGAIN. Returns the total number read
+ * (which may be < len at EOF) or -1 on a non-recoverable read error
+ * (errno set). The `buf` is a pointer-to-pointer only to keep the
+ * caller's existing variable mutable through the call; the function
+ * does not realloc.
+ */
+static ssize_t totalRead(int fd, char** buf, size_t len)
+{
+    ssize_t total_read = 0;
+    ssize_t done = 0;
+
+    while ((ssize_t)len > total_read)
+    {
+        done = read(fd, *buf + total_read, len - total_read);
+        if (done > 0)
+        {
+            total_read += (size_t)done;
+        }
+        else if (0 == done)
+        {
+            break;
+        }
+        else
+        {
+            if (errno != EINTR && errno != EAGAIN)
+            {
+                total_read = -1;
+                break;
+            }
+        }
+    }
+
+    return total_read;
+}
+
+/*
+ * Non-blocking probe: does `fd` have data ready right now?
+ *
+ *   > 0  data ready (select() reported fd readable)
+ *   = 0  no data ready
+ *   < 0  error (errno set; typically EBADF)
+ *
+ * Used by waitNotify to decide whether to skip select() and read
+ * immediately, vs. fall through to the blocking wait.
+ */
+static int checkFd(int fd)
+{
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    struct timeval t = { 0, 0 };
+    return select(fd + 1, &set, NULL, NULL, &t);
+}
+
+/*
+ * Wait for `fd` to become readable, up to `timeout` milliseconds.
+ * `wake_fd`, when not -1, is watched too and cuts the wait short as
+ * if the timeout had expired (the reader thread's shutdown signal).
+ *
+ *   timeout < 0   block indefinitely
+ *   timeout = 0   non-blocking poll
+ *   timeout > 0   wait at most that many milliseconds
+ *
+ *   > 0  fd is readable
+ *   = 0  timeout expired with no activity, or woken through wake_fd
+ *   < 0  error (errno set)
+ */
+static int Select(int fd, int wake_fd, int timeout)
+{
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    if (wake_fd != -1)
+    {
+        FD_SET(wake_fd, &set);
+    }
+    struct timeval t;
+    t.tv_sec  = timeout / 1000;
+    t.tv_usec = (timeout % 1000) * 1000;
+    int nfds = ((wake_fd > fd) ? wake_fd : fd) + 1;
+    int rc = select(nfds, &set, NULL, NULL, (timeout < 0) ? NULL : &t);
+    if (rc > 0 && !FD_ISSET(fd, &set))
+    {
+        return 0;
+    }
+    return rc;
+}
+
+/*
+ * Is `path` one of the watches rescanWatches just found stale? Such
+ * a directory may have been replaced under the same name, which the
+ * parent's name-only diff cannot see.
+ */
+static int isStale(char** stale, const char* path)
+{
+    for (size_t i = 0; stale && stale[i]; i++)
+    {
+        if (!strcmp(stale[i], path))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Bring one directory's entry set back in line with the filesystem
+ * by queueing synthetic events for the difference: IN_CREATE (and
+ * IN_CLOSE_WRITE) for names that appeared, IN_DELETE for names that
+ * vanished, and both for a subdirectory that was replaced. A
+ * directory whose mtime still matches its stamp is left unread.
+ *
+ * The entry set itself is not touched here; waitNotify updates it as
+ * the synthetic events are delivered, like any other event.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int rescanWatch(Notify* ntf, int wd, struct Watch* watch, const struct stat* sb, char** stale)
+{
+    if (watch->mtime.tv_sec == sb->st_mtim.tv_sec
+        && watch->mtime.tv_nsec == sb->st_mtim.tv_nsec)
+    {
+        return 0;
+    }
+    stampWatch(watch, sb);
+
+    /* NULL with errno untouched is an empty directory: still sweep */
+    errno = 0;
+    char** elems = fsReadDir(ntf, watch->path);
+    if (elems == NULL
+        && errno != 0)
+    {
+        return (errno == ENOMEM) ? -1 : 0;
+    }
+
+    struct entrySet* set = &watch->entries;
+    for (size_t i = 0; i < set->cap; i++)
+    {
+        if (set->slots[i] != NULL)
+        {
+            set->slots[i]->seen = 0;
+        }
+    }
+
+    for (size_t i = 0; elems && elems[i]; i++)
+    {
+        struct Entry* known = set->count
+            ? *entrySlot(set, elems[i], hashName(elems[i]))
+            : NULL;
+
+        char* path_elem = lstString(&ntf->mem, "%s/%s", watch->path, elems[i]);
+        if (path_elem == NULL)
+        {
+            lstFree(&ntf->mem, elems);
+            return -1;
+        }
+
+        int rc = 0;
+        if (known != NULL)
+        {
+            known->seen = 1;
+            if (known->is_dir && isStale(stale, path_elem))
+            {
+                entryDel(&ntf->mem, &watch->decided, elems[i]);
+                rc = pushSynthetic(ntf, wd, IN_DELETE | IN_ISDIR, 0, elems[i], CHAIN_RESCAN);
+                if (rc == 0)
+                {
+                    rc = pushFound(ntf, wd, elems[i], 1, NULL, 0, CHAIN_RESCAN);
+                }
+            }
+        }
+        else
+        {
+            struct stat esb;
+            int found = !fsLstat(ntf, path_elem, &esb);
+            int is_dir = (found && S_ISDIR(esb.st_mode)) ? 1 : 0;
+            rc = pushFound(ntf, wd, elems[i], is_dir, found ? &esb : NULL, 0, CHAIN_RESCAN);
+        }
+        lstRelease(&ntf->mem, path_elem);
+
+        if (rc == -1)
+        {
+            lstFree(&ntf->mem, elems);
+            return -1;
+        }
+    }
+    lstFree(&ntf->mem, elems);
+
+    for (size_t i = 0; i < set->cap; i++)
+    {
+        struct Entry* entry = set->slots[i];
+        if (entry == NULL || entry->seen)
+        {
+            continue;
+        }
+        entryDel(&ntf->mem, &watch->decided, entry->name);
+        if (-1 == pushSynthetic(ntf, wd, IN_DELETE | (entry->is_dir ? IN_ISDIR : 0), 0, entry->name, CHAIN_RESCAN))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Ask the kernel to drop `watch` and forget the cookies it left. The
+ * record normally stays until IN_IGNORED retires it; when the kernel
+ * had already dropped the wd (its IN_IGNORED lost or still queued)
+ * nobody else would free it, so it goes here. Must not be called
+ * while walking ntf->w.
+ */
+static void unwatch(Notify* ntf, struct Watch* watch)
+{
+    COUNTER_ADD(ntf->stats.cookies_pending, -dropCookiesForWd(&ntf->mem, &ntf->cookies, watch->wd));
+    if (-1 == fsRmWatch(ntf, watch->wd, watch->path))
+    {
+        statForget(ntf, watch->wd);
+        dirtyForget(ntf, watch);
+        freeWatch(&ntf->mem, watchDel(&ntf->mem, &ntf->w, watch->wd));
+        COUNTER_ADD(ntf->stats.watches, -1);
+        COUNTER_ADD(ntf->stats.watches_retired, 1);
+    }
+    else
+    {
+        /* keep the record until IN_IGNORED, but never rescan it */
+        watch->dev = 0;
+        watch->ino = 0;
+    }
+}
+
+/*
+ * IN_MOVE_SELF for the watched directory at `path`. The kernel sends
+ * it after IN_MOVED_FROM and IN_MOVED_TO, so a cookie still pending for
+ * this very directory means the move took it out of the tree: drop the
+ * cookie, and unwatch the directory and everything below it instead of
+ * following it to wherever it went.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int dropMovedAway(Notify* ntf, const char* path)
+{
+    struct Cookie* c = ntf->cookies;
+    for (; c != NULL; c = c->next)
+    {
+        size_t len = strlen(c->path);
+        if (!strncmp(path, c->path, len)
+            && path[len] == '/'
+            && !strcmp(path + len + 1, c->name))
+        {
+            break;
+        }
+    }
+    if (c == NULL)
+    {
+        return 0;
+    }
+
+    size_t n_gone = 0;
+    size_t len = strlen(path);
+    struct Watch** gone = (struct Watch**)lstAlloc(&ntf->mem, sizeof(struct Watch*) * (ntf->w.count + 1));
+    if (gone == NULL)
+    {
+        return -1;
+    }
+    unlinkCookie(&ntf->cookies, c);
+    freeCookie(&ntf->mem, c);
+    COUNTER_ADD(ntf->stats.cookies_pending, -1);
+
+    for (size_t i = 0; i < ntf->w.cap; i++)
+    {
+        struct Watch* watch = ntf->w.slots[i];
+        if (watch != NULL
+            && !strncmp(watch->path, path, len)
+            && (watch->path[len] == '\0' || watch->path[len] == '/'))
+        {
+            gone[n_gone++] = watch;
+        }
+    }
+    for (size_t i = 0; i < n_gone; i++)
+    {
+        unwatch(ntf, gone[i]);
+    }
+    lstRelease(&ntf->mem, gone);
+    return 0;
+}
+
+/*
+ * Recover from IN_Q_OVERFLOW without a full re-crawl.
+ *
+ * First every watch is re-validated: one whose path is gone or now
+ * names a different directory is removed (its IN_IGNORED, if the
+ * kernel still has one to send, retires the record as usual). Then
+ * every surviving directory is diffed against its entry set by
+ * rescanWatch. New subdirectories come out as IN_CREATE|IN_ISDIR and
+ * get watched and crawled on delivery, exactly like a crawl's.
+ *
+ * The resulting events, followed by a NOTIFY_RESCAN_END marker, are
+ * queued ahead of whatever was already pending in their class, so the
+ * consumer sees the repair right after the overflow event that
+ * triggered it.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int rescanWatches(Notify* ntf)
+{
+    ntf->batch_ns = monotonicNs();
+    struct chainQueue pending[CHAIN_CLASSES];
+    memcpy(pending, ntf->q, sizeof(pending));
+    memset(ntf->q, 0, sizeof(ntf->q));
+
+    /* stale records are unwatched after the scan: removing one from
+     * ntf->w while walking it would move others past the cursor */
+    char** stale = NULL;
+    size_t n_gone = 0;
+    struct Watch** gone = (struct Watch**)lstAlloc(&ntf->mem, sizeof(struct Watch*) * (ntf->w.count + 1));
+    int rc = (gone == NULL) ? -1 : 0;
+    for (size_t i = 0; i < ntf->w.cap && rc == 0; i++)
+    {
+        struct Watch* watch = ntf->w.slots[i];
+        struct stat sb;
+        if (watch == NULL
+            || (!fsLstat(ntf, watch->path, &sb)
+                && sb.st_dev == watch->dev
+                && sb.st_ino == watch->ino))
+        {
+            continue;
+        }
+
+        if (-1 == lstPush(&ntf->mem, &stale, watch->path))
+        {
+            rc = -1;
+            break;
+        }
+        gone[n_gone++] = watch;
+    }
+    for (size_t i = 0; i < n_gone; i++)
+    {
+        unwatch(ntf, gone[i]);
+    }
+    lstRelease(&ntf->mem, gone);
+
+    for (size_t i = 0; i < ntf->w.cap && rc == 0; i++)
+    {
+        struct Watch* watch = ntf->w.slots[i];
+        struct stat sb;
+        if (watch == NULL
+            || fsLstat(ntf, watch->path, &sb)
+            || sb.st_dev != watch->dev
+            || sb.st_ino != watch->ino)
+        {
+            continue;
+        }
+        rc = rescanWatch(ntf, watch->wd, watch, &sb, stale);
+    }
+    lstFree(&ntf->mem, stale);
+
+    if (rc == 0)
+    {
+        rc = pushSynthetic(ntf, -1, NOTIFY_RESCAN_END, 0, NULL, 0);
+    }
+
+    for (int i = 0; i < CHAIN_CLASSES; i++)
+    {
+        struct chainQueue* q = &ntf->q[i];
+        if (q->tail != NULL)
+        {
+            q->tail->next = pending[i].head;
+        }
+        else
+        {
+            q->head = pending[i].head;
+        }
+        if (pending[i].tail != NULL)
+        {
+            q->tail = pending[i].tail;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * Bookkeeping for a kernel event the moment it is read, before it
+ * waits in the queue behind anything: watch and crawl a directory that
+ * appeared, pair directory moves and apply them to the watch table,
+ * unwatch a directory moved out of the tree. Paths are resolved on
+ * delivery, so events still queued from before a move come out under
+ * the directory's new path.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int trackEvent(Notify* ntf, const struct inotify_event* e)
+{
+    char* path_watch = watchPath(ntf, e->wd);
+
+    /* a directory of that name later on is asked about afresh */
+    if ((e->mask & (IN_DELETE | IN_MOVED_FROM))
+        && (e->mask & IN_ISDIR)
+        && e->len)
+    {
+        policyForget(ntf, e->wd, e->name);
+    }
+
+    if ((e->mask & (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO))
+        && (e->mask & IN_ISDIR)
+        && e->len)
+    {
+        char* path = path_watch ? lstString(&ntf->mem, "%s/%s", path_watch, e->name) : NULL;
+        if (path_watch && path == NULL)
+        {
+            return -1;
+        }
+
+        int rc = 0;
+        if (e->mask & IN_CREATE)
+        {
+            rc = path ? addNotify(ntf, path, e->wd, 0, 0, NULL) : 0;
+        }
+        else if (e->mask & IN_MOVED_FROM)
+        {
+            rc = path ? addCookie(&ntf->mem, &ntf->cookies, e->wd, path_watch, e->name, e->cookie) : 0;
+            if (path && rc == 0)
+            {
+                COUNTER_ADD(ntf->stats.cookies_pending, 1);
+            }
+        }
+        else
+        {
+            struct Cookie* C = getCookie(&ntf->cookies, e->cookie);
+            if (C)
+            {
+                COUNTER_ADD(ntf->stats.cookies_pending, -1);
+            }
+            if (C && path)
+            {
+                char* oldpath = lstString(&ntf->mem, "%s/%s", C->path, C->name);
+                rc = (oldpath == NULL) ? -1 : 0;
+                if (rc == 0)
+                {
+                    TRACE_BEGIN(ntf, t_rename);
+                    rc = renameWatches(ntf, oldpath, path);
+                    TRACE_END(ntf, t_rename, TRACE_RENAME);
+                }
+                /* DO NOT REMOVE - this is absolutely necessary */
+                if (rc == 0)
+                {
+                    rc = addNotify(ntf, path, e->wd, 0, 0, NULL);
+                }
+                lstRelease(&ntf->mem, oldpath);
+            }
+            else if (path)
+            {
+                /* moved in from outside the tree */
+                rc = addNotify(ntf, path, e->wd, 0, 0, NULL);
+            }
+            /* a cookie matched without a live wd is just dropped */
+            if (C)
+            {
+                freeCookie(&ntf->mem, C);
+            }
+        }
+        lstRelease(&ntf->mem, path);
+        return rc;
+    }
+
+    if (e->mask & IN_MOVE_SELF
+        && path_watch)
+    {
+        return dropMovedAway(ntf, path_watch);
+    }
+    return 0;
+}
+
+/*
+ * Re-add every live watch, so it takes the mask fsAddWatch uses now.
+ * Best effort: a watch that cannot be re-added keeps its mask, and one
+ * whose path now names another, unwatched directory is removed from
+ * that directory again.
+ */
+static void remaskWatches(Notify* ntf)
+{
+    for (size_t i = 0; i < ntf->w.cap; i++)
+    {
+        struct Watch* watch = ntf->w.slots[i];
+        if (watch == NULL
+            || (watch->dev == 0 && watch->ino == 0))
+        {
+            continue;
+        }
+        int wd = fsAddWatch(ntf, watch->path);
+        if (wd != -1
+            && wd != watch->wd
+            && watchFind(ntf, wd) == NULL)
+        {
+            fsRmWatch(ntf, wd, watch->path);
+        }
+    }
+}
+
+/*
+ * Load shedding (NotifyOptions.shed). One read drains the kernel
+ * queue, so the `events` it returned tell how full the queue was. At
+ * the high-water mark, or when it overflowed, the watches are re-added
+ * without SHED_EVENTS and NOTIFY_SHED_BEGIN is queued; once a read
+ * comes back under a quarter of the mark the full mask is restored and
+ * NOTIFY_SHED_END queued. Deciding on reads alone keeps a replay on
+ * the recorded course.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int shedLoad(Notify* ntf, unsigned long events, int overflow)
+{
+    unsigned long high = ntf->max_queued_events * (unsigned long)ntf->shed / 100;
+    if (!ntf->shedding
+        && (overflow || events >= high))
+    {
+        ntf->shedding = 1;
+        remaskWatches(ntf);
+        COUNTER_ADD(ntf->stats.shed_windows, 1);
+        COUNTER_ADD(ntf->stats.shed_active, 1);
+        return pushSynthetic(ntf, -1, NOTIFY_SHED_BEGIN, 0, NULL, 0);
+    }
+    if (ntf->shedding
+        && !overflow
+        && events < high / 4)
+    {
+        ntf->shedding = 0;
+        remaskWatches(ntf);
+        COUNTER_ADD(ntf->stats.shed_active, -1);
+        return pushSynthetic(ntf, -1, NOTIFY_SHED_END, 0, NULL, 0);
+    }
+    return 0;
+}
+
+/*
+ * Queue the packed inotify events in buffer[0..length), as returned by
+ * one read(2) of the inotify fd. Two invariants keep the pointer-cast
+ * read of e->len safe:
+ *  - the buffer is aligned to alignof(struct inotify_event) (== 4):
+ *    the allocator guarantees it for our own reads (hooks must align
+ *    like malloc(3)), notifyFeed requires it of its callers;
+ *  - the kernel rounds e->len up so successive events stay aligned to
+ *    alignof(struct inotify_event); see fs/notify/inotify/inotify_user.c
+ *    in the kernel tree.
+ * Bound-check anyway in case the read came back truncated or the event
+ * header was corrupted in flight.
+ *
+ * Returns 0 on success, -1 with errno set (EPROTO on a torn event).
+ * Events before a torn one stay queued.
+ */
+static int feedEvents(Notify* ntf, const char* buffer, size_t length)
+{
+    size_t event_size = sizeof(struct inotify_event);
+    size_t i = 0;
+    ntf->batch_ns = monotonicNs();
+    unsigned long events = 0;
+    int overflow = 0;
+    while (i + event_size <= length)
+    {
+        const struct inotify_event* e = (const struct inotify_event*)&buffer[i];
+        if (e->len > length - i - event_size)
+        {
+            statFlush(ntf);
+            errno = EPROTO;
+            return -1;
+        }
+        /* IN_MOVE_SELF is only queued when the consumer asked for it;
+         * the library watches for it for dropMovedAway */
+        int queued = 1;
+        ntf->stored = NULL;
+        if (!(e->mask & IN_MOVE_SELF)
+            || (ntf->mask & IN_MOVE_SELF))
+        {
+            /* a new directory is watched by trackEvent, not on delivery */
+            queued = (ntf->rename_window && (e->mask & IN_MOVE))
+                ? pairMove(ntf, e)
+                : pushChainEvent(ntf, e, ((e->mask & IN_ISDIR) && (e->mask & IN_CREATE)) ? CHAIN_WATCHED : 0);
+        }
+        if (ntf->stat_mode)
+        {
+            statQueue(ntf, e);
+        }
+        if (queued == -1
+            || (queued == 1 && -1 == trackEvent(ntf, e)))
+        {
+            statFlush(ntf);
+            return -1;
+        }
+        COUNTER_ADD(ntf->stats.events_read, 1);
+        events++;
+        overflow |= (e->mask & IN_Q_OVERFLOW) != 0;
+        i += event_size + e->len;
+    }
+    statFlush(ntf);
+    COUNTER_ADD(ntf->stats.bytes_read, i);
+    if (i != length)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (ntf->shed
+        && (ntf->mask & SHED_EVENTS))
+    {
+        return shedLoad(ntf, events, overflow);
+    }
+    return 0;
+}
+
+/*
+ * Pass through an engine result, counting allocation failures on the
+ * way (every entry point into the engine goes through here).
+ */
+static int noteFailure(Notify* ntf, int rc)
+{
+    if (rc == -1
+        && errno == ENOMEM)
+    {
+        COUNTER_ADD(ntf->stats.alloc_failures, 1);
+    }
+    return rc;
+}
+
+/*
+ * NotifyEventInfo for the event `e` just pulled with CHAIN_* `flags`;
+ * pullChainEvent filled seq and time_ns.
+ */
+static void eventInfo(const Notify* ntf, const struct inotify_event* e, unsigned int flags, NotifyEventInfo* info)
+{
+    const struct Watch* watch = (e->wd >= 0) ? watchFind(ntf, e->wd) : NULL;
+    info->wd = (e->wd >= 0) ? e->wd : -1;
+    info->dir_ino = watch ? (uint64_t)watch->ino : 0;
+    info->origin = !(flags & CHAIN_SYNTHETIC) ? NOTIFY_ORIGIN_KERNEL
+        : (e->wd < 0) ? NOTIFY_ORIGIN_MARKER
+        : (flags & CHAIN_RESCAN) ? NOTIFY_ORIGIN_RESCAN
+        : NOTIFY_ORIGIN_CRAWL;
+}
+
+/*
+ * Queue the IN_Q_OVERFLOW a read failing with EINVAL stands for, as if
+ * the kernel had put it in the stream: its delivery counts it and runs
+ * the rescan like any other.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int queueOverflow(Notify* ntf)
+{
+    struct inotify_event e = { .wd = -1, .mask = IN_Q_OVERFLOW };
+    return (-1 == pushChainEvent(ntf, &e, 0)) ? -1 : 0;
+}
+
+/*
+ * Replay counterpart of one read of the inotify fd in nextEvent:
+ * queue the recorded bytes, or reproduce the recorded failure.
+ *
+ * Returns 0 when the bytes (or the overflow of a read that failed
+ * with EINVAL) were queued, -1 on error.
+ */
+static int replayRead(Notify* ntf)
+{
+    const void* data = NULL;
+    size_t len = 0;
+    int rc = replayCall(ntf, REPLAY_READ, NULL, &data, &len);
+    if (rc == -1)
+    {
+        return (errno == EINVAL) ? queueOverflow(ntf) : -1;
+    }
+
+    TRACE_BEGIN(ntf, t_parse);
+    rc = feedEvents(ntf, (const char*)data, len);
+    TRACE_END(ntf, t_parse, TRACE_PARSE);
+    return rc;
+}
+
+/*
+ * The event engine behind waitNotify: read the inotify fd, queue, pull
+ * the next event and run what is left of the recursive bookkeeping for
+ * it at delivery (trackEvent did the rest as it was read). Runs on the
+ * consumer's thread, or on the reader thread in threaded mode. Same
+ * contract as waitNotifyInfo except that a timeout (or a wake-up
+ * through ntf->wake_fd) returns 1.
+ */
+static int nextEvent(Notify* ntf, char** const path, uint32_t* mask, int timeout, uint32_t* cookie, NotifyEventInfo* info)
+{
+    if (mask)
+    {
+        *mask = 0;
+    }
+
+    int rd = 0;
+    int held = 0;
+    uint64_t at = 0;
+    struct inotify_event* e = NULL;
+    unsigned int flags = 0;
+    while ((ntf->replay && REPLAY_READ == (rd = replayPeek(ntf->replay, &at)) && at == ntf->pulled)
+        || (!ntf->external_read && !ntf->replay
+            && !(ntf->stats.queue_depth && queueBlocked(ntf))
+            && 0 < (rd = checkFd(ntf->fd)))
+        || 0 < (held = moveHold(ntf))
+        || NULL == (e = pullChainEvent(ntf, &flags, info)))
+    {
+        if (ntf->replay)
+        {
+            /* a read was recorded exactly here, or the queue ran dry:
+             * anything but a read due now means the runs diverged */
+            if (rd != REPLAY_READ
+                || at != ntf->pulled)
+            {
+                errno = (rd == 0) ? ENODATA : EPROTO;
+                return -1;
+            }
+            if (-1 == replayRead(ntf))
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (ntf->external_read)
+        {
+            /* the caller reads the fd: an empty queue is all there is */
+            return 1;
+        }
+        if (!rd)
+        {
+            /* a held IN_MOVED_FROM goes out unpaired when its window ends */
+            int wait = (held > 0 && (timeout < 0 || held < timeout)) ? held : timeout;
+            TRACE_BEGIN(ntf, t_wait);
+            rd = Select(ntf->fd, ntf->wake_fd, wait);
+            TRACE_END(ntf, t_wait, TRACE_WAIT);
+            if (!rd)
+            {
+                if (wait != timeout)
+                {
+                    continue;
+                }
+                return 1;
+            }
+        }
+        if (-1 == rd)
+        {
+            return -1;
+        }
+
+        size_t length = 0;
+        if (-1 == ioctl(ntf->fd, FIONREAD, &length))
+        {
+            return -1;
+        }
+
+        if (length == 0)
+        {
+            /* Spurious wake-up: select() reported readable but the
+             * queue is empty by the time we look. Avoid malloc(0)
+             * (implementation-defined: may return NULL and be mistaken
+             * for an allocation failure) and go back to waiting.
+             */
+            continue;
+        }
+
+        int event_size = sizeof(struct inotify_event);
+        if (length > (ntf->max_queued_events * (event_size + ntf->max_name + 1)))
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        char* buffer = (char*)lstAlloc(&ntf->mem, length);
+        if (buffer == NULL)
+        {
+            return -1;
+        }
+        memset(buffer, 0, length);
+
+        TRACE_BEGIN(ntf, t_read);
+        ssize_t total_read = totalRead(ntf->fd, &buffer, length);
+        TRACE_END(ntf, t_read, TRACE_READ);
+        if ((ssize_t)length != total_read)
+        {
+            int saved_errno = errno;
+            if (ntf->record
+                && -1 == replayPut(ntf->record, REPLAY_READ, ntf->pulled, -saved_errno, NULL, NULL, 0))
+            {
+                lstRelease(&ntf->mem, buffer);
+                return -1;
+            }
+            lstRelease(&ntf->mem, buffer);
+            errno = saved_errno;
+            if (errno != EINVAL
+                || -1 == queueOverflow(ntf))
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        TRACE_BEGIN(ntf, t_parse);
+        int rc = recordCall(ntf, REPLAY_READ, NULL, 0, buffer, length);
+        if (rc == 0)
+        {
+            rc = feedEvents(ntf, buffer, length);
+        }
+        TRACE_END(ntf, t_parse, TRACE_PARSE);
+        lstRelease(&ntf->mem, buffer);
+        if (rc == -1)
+        {
+            return -1;
+        }
+        e = NULL;
+    }
+
+    if (info)
+    {
+        eventInfo(ntf, e, flags, info);
+    }
+
+    /* Rename pairing: an IN_MOVED_FROM brings the IN_MOVED_TO read
+     * while it was held, if any. */
+    struct moveWait* move = NULL;
+    if (ntf->rename_window
+        && (e->mask & IN_MOVED_FROM))
+    {
+        move = moveTake(ntf, e->cookie);
+    }
+
+    /* One allocation per delivered path; markers and events for a
+     * retired wd get an empty string. A paired move carries the old
+     * path after the new one's terminator, see notifyRenameSource. */
+    char* path_watch = watchPath(ntf, e->wd);
+    const struct inotify_event* to = (move && path_watch) ? move->to : NULL;
+    char* to_watch = to ? watchPath(ntf, to->wd) : NULL;
+    TRACE_BEGIN(ntf, t_path);
+    *path = !path_watch
+        ? lstString(&ntf->mem, "")
+        : to_watch
+            ? lstString(&ntf->mem, "%s/%s%c%s/%s", to_watch, to->name, '\0', path_watch, e->name)
+            : e->len
+                ? lstString(&ntf->mem, "%s/%s", path_watch, e->name)
+                : lstString(&ntf->mem, "%s", path_watch);
+    TRACE_END(ntf, t_path, TRACE_PATH);
+    if (*path == NULL
+        || (to_watch
+            && -1 == entryAdd(&ntf->mem, &watchFind(ntf, to->wd)->entries, to->name, to->mask & IN_ISDIR)))
+    {
+        lstRelease(&ntf->mem, *path);
+        *path = NULL;
+        freeMove(&ntf->mem, move);
+        freeChainEvent(ntf, e);
+        return -1;
+    }
+    freeMove(&ntf->mem, move);
+
+    /* With pairing on a move is a rename, or else a delete or a create. */
+    uint32_t delivered = e->mask;
+    uint32_t delivered_cookie = e->cookie;
+    if (ntf->rename_window
+        && (e->mask & IN_MOVE))
+    {
+        if (to_watch)
+        {
+            delivered = IN_MOVED_TO | NOTIFY_RENAME | (e->mask & IN_ISDIR);
+            COUNTER_ADD(ntf->stats.moves_paired, 1);
+            if (info)
+            {
+                /* the lookup was of the old name; the new one had none */
+                info->stat.err = ENODATA;
+            }
+        }
+        else
+        {
+            delivered = ((e->mask & IN_MOVED_FROM) ? IN_DELETE : IN_CREATE) | (e->mask & IN_ISDIR);
+            delivered_cookie = 0;
+            COUNTER_ADD(ntf->stats.moves_unpaired, 1);
+        }
+    }
+    if (mask)
+    {
+        *mask = delivered;
+    }
+
+    /* Keep the directory's entry set in step with what the consumer
+     * has now been told; rescanWatch diffs against it after overflow. */
+    if (path_watch && e->len)
+    {
+        struct Watch* watch = watchFind(ntf, e->wd);
+        if (e->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            if (-1 == entryAdd(&ntf->mem, &watch->entries, e->name, e->mask & IN_ISDIR))
+            {
+                lstRelease(&ntf->mem, *path);
+                *path = NULL;
+                freeChainEvent(ntf, e);
+                return -1;
+            }
+        }
+        else if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            entryDel(&ntf->mem, &watch->entries, e->name);
+        }
+    }
+
+    if (e->mask & IN_CREATE
+        && e->mask & IN_ISDIR
+        && !(flags & CHAIN_WATCHED))
+    {
+        if (-1 == addNotify(ntf, *path, e->wd, 0, (flags & CHAIN_SCAN) ? ADD_SCAN : 0, NULL))
+        {
+            lstRelease(&ntf->mem, *path);
+            *path = NULL;
+            freeChainEvent(ntf, e);
+            return -1;
+        }
+        /* addNotify above queued this directory's own contents (and
+         * counted its subdirectories), so the marker lands after them */
+        if ((flags & CHAIN_SCAN)
+            && 0 == --ntf->scan_pending
+            && -1 == finishScan(ntf))
+        {
+            lstRelease(&ntf->mem, *path);
+            *path = NULL;
+            freeChainEvent(ntf, e);
+            return -1;
+        }
+    }
+
+    if (e->mask & IN_IGNORED && path_watch)
+    {
+        /* Drop any pending cookies tied to this wd before the kernel
+         * recycles it (IDR may hand the same wd back on the next
+         * inotify_add_watch). A stale cookie surviving recycle could
+         * collide on cookie value and produce a phantom rename match. */
+        COUNTER_ADD(ntf->stats.cookies_pending, -dropCookiesForWd(&ntf->mem, &ntf->cookies, e->wd));
+        statForget(ntf, e->wd);
+        dirtyForget(ntf, watchFind(ntf, e->wd));
+        freeWatch(&ntf->mem, watchDel(&ntf->mem, &ntf->w, e->wd));
+        COUNTER_ADD(ntf->stats.watches, -1);
+        COUNTER_ADD(ntf->stats.watches_retired, 1);
+    }
+
+    if (e->mask & IN_Q_OVERFLOW)
+    {
+        COUNTER_ADD(ntf->stats.overflows, 1);
+        TRACE_BEGIN(ntf, t_rescan);
+        int rescanned = rescanWatches(ntf);
+        TRACE_END(ntf, t_rescan, TRACE_RESCAN);
+        if (-1 == rescanned)
+        {
+            lstRelease(&ntf->mem, *path);
+            *path = NULL;
+            freeChainEvent(ntf, e);
+            return -1;
+        }
+        if (mask)
+        {
+            *mask |= NOTIFY_RESCAN_BEGIN;
+        }
+    }
+
+    if (cookie)
+    {
+        *cookie = delivered_cookie;
+    }
+    freeChainEvent(ntf, e);
+
+    return 0;
+}
+
+/* Events the reader hands over before it bumps ready_fd. */
+#define HANDOFF_BATCH 256
+
+/*
+ * Reader side of the handoff queue: append one finished event (path
+ * ownership moves into the queue) or, with err != 0, an error report.
+ * Only the reader thread calls this; the release store on `next`
+ * publishes the node's contents to the consumer.
+ *
+ * Returns 0 on success, -1 on allocation failure (errno set).
+ */
+static int handoffPush(Notify* ntf, char* path, uint32_t mask, uint32_t cookie, const NotifyEventInfo* info, int err)
+{
+    struct handoff* node = (struct handoff*)lstAlloc(&ntf->mem, sizeof(struct handoff));
+    if (node == NULL)
+    {
+        return -1;
+    }
+    node->path = path;
+    node->mask = mask;
+    node->cookie = cookie;
+    node->err = err;
+    node->size = 0;
+    if (info)
+    {
+        node->info = *info;
+    }
+    else
+    {
+        memset(&node->info, 0, sizeof(node->info));
+    }
+    node->next = NULL;
+    if (ntf->queue_events || ntf->queue_bytes)
+    {
+        node->size = sizeof(struct handoff) + (path ? strlen(path) + 1 : 0);
+        __atomic_add_fetch(&ntf->ho_events, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&ntf->ho_bytes, node->size, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_store_n(&ntf->ho_tail->next, node, __ATOMIC_RELEASE);
+    ntf->ho_tail = node;
+
+    return 0;
+}
+
+/*
+ * Consumer side: move the oldest handed-off event into the out
+ * parameters. The node it came from becomes the new stub at ho_head
+ * and the old stub is freed.
+ *
+ * Returns 1 if an event (or error report) was taken, 0 when empty.
+ */
+static int handoffPop(Notify* ntf, char** path, uint32_t* mask, uint32_t* cookie, NotifyEventInfo* info, int* err)
+{
+    struct handoff* stub = ntf->ho_head;
+    struct handoff* node = __atomic_load_n(&stub->next, __ATOMIC_ACQUIRE);
+    if (node == NULL)
+    {
+        return 0;
+    }
+
+    *path = node->path;
+    node->path = NULL;
+    if (mask)
+    {
+        *mask = node->mask;
+    }
+    if (cookie)
+    {
+        *cookie = node->cookie;
+    }
+    if (info)
+    {
+        *info = node->info;
+    }
+    *err = node->err;
+
+    if (node->size)
+    {
+        __atomic_sub_fetch(&ntf->ho_events, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&ntf->ho_bytes, node->size, __ATOMIC_SEQ_CST);
+        /* pairs with readerPause: one of us sees the other's store */
+        if (__atomic_load_n(&ntf->reader_paused, __ATOMIC_SEQ_CST)
+            && !handoffOver(ntf, 1))
+        {
+            eventfd_write(ntf->wake_fd, 1);
+        }
+    }
+
+    ntf->ho_head = node;
+    lstRelease(&ntf->mem, stub);
+
+    return 1;
+}
+
+/* Release a list of handoff nodes and the paths they hold. */
+static void freeHandoffs(Notify* ntf, struct handoff* h)
+{
+    while (h != NULL)
+    {
+        struct handoff* next = h->next;
+        lstRelease(&ntf->mem, h->path);
+        lstRelease(&ntf->mem, h);
+        h = next;
+    }
+}
+
+/*
+ * Errors after which the reader carries on: they cost the event being
+ * processed (as they would a waitNotify caller) but leave the Notify
+ * usable. Anything else stops the reader for good.
+ */
+static int readerRecoverable(int err)
+{
+    return err == ENOSPC
+        || err == ENOMEM
+        || err == EACCES
+        || err == ENAMETOOLONG
+        || err == ELOOP
+        || err == ENOTDIR
+        || err == EINTR;
+}
+
+/*
+ * Threaded mode with a bounded queue: the consumer holds a full
+ * backlog. Wait until it has taken half of it (handoffPop wakes us) or
+ * shutdown is requested; meanwhile the fd is not read and the kernel
+ * queue absorbs the load.
+ */
+static void readerPause(Notify* ntf)
+{
+    __atomic_store_n(&ntf->reader_paused, 1, __ATOMIC_SEQ_CST);
+    while (handoffOver(ntf, 1)
+           && !__atomic_load_n(&ntf->reader_stop, __ATOMIC_ACQUIRE))
+    {
+        struct pollfd pfd = { ntf->wake_fd, POLLIN, 0 };
+        eventfd_t value;
+        if (poll(&pfd, 1, -1) > 0)
+        {
+            eventfd_read(ntf->wake_fd, &value);
+        }
+    }
+    __atomic_store_n(&ntf->reader_paused, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Threaded mode: drain the inotify fd continuously, run the engine,
+ * and hand finished events to the consumer. ready_fd is bumped once
+ * per batch (whatever the engine can produce without blocking, up to
+ * HANDOFF_BATCH events) rather than once per event.
+ */
+static void* readerMain(void* arg)
+{
+    Notify* ntf = (Notify*)arg;
+    int batched = 0;
+
+    while (!__atomic_load_n(&ntf->reader_stop, __ATOMIC_ACQUIRE))
+    {
+        if (ntf->queue_policy != NOTIFY_QUEUE_DROP
+            && handoffOver(ntf, 0))
+        {
+            if (batched)
+            {
+                eventfd_write(ntf->ready_fd, 1);
+                batched = 0;
+            }
+            readerPause(ntf);
+            continue;
+        }
+
+        char* path = NULL;
+        uint32_t mask = 0;
+        uint32_t cookie = 0;
+        NotifyEventInfo info;
+        int rc = noteFailure(ntf, nextEvent(ntf, &path, &mask, batched ? 0 : -1, &cookie, &info));
+        if (rc == 0)
+        {
+            if (-1 == handoffPush(ntf, path, mask, cookie, &info, 0))
+            {
+                lstRelease(&ntf->mem, path);
+                rc = -1;
+            }
+            else if (++batched < HANDOFF_BATCH)
+            {
+                continue;
+            }
+        }
+
+        int err = (rc == -1) ? errno : 0;
+        if (err && err != EINTR)
+        {
+            handoffPush(ntf, NULL, 0, 0, NULL, err);
+            batched++;
+        }
+        if (batched)
+        {
+            eventfd_write(ntf->ready_fd, 1);
+            batched = 0;
+        }
+        if (err && !readerRecoverable(err))
+        {
+            __atomic_store_n(&ntf->reader_errno, err, __ATOMIC_RELEASE);
+            eventfd_write(ntf->ready_fd, 1);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the reader thread of a Notify whose handoff queue and eventfds
+ * are in place. Signals are blocked in the reader so that they keep
+ * going to the caller's threads.
+ *
+ * Returns 0 on success, -1 with errno set.
+ */
+static int spawnReader(Notify* ntf)
+{
+    /* set before the reader starts: queueOver reads it there */
+    ntf->threaded = 1;
+    sigset_t all;
+    sigset_t saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int rc = pthread_create(&ntf->reader, NULL, readerMain, ntf);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (rc != 0)
+    {
+        ntf->threaded = 0;
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Ask the reader to finish and wait for it. What it handed over stays
+ * queued; spawnReader starts it again.
+ */
+static void stopReader(Notify* ntf)
+{
+    __atomic_store_n(&ntf->reader_stop, 1, __ATOMIC_RELEASE);
+    eventfd_write(ntf->wake_fd, 1);
+    pthread_join(ntf->reader, NULL);
+}
+
+/*
+ * Switch `ntf` to threaded mode and start its reader.
+ *
+ * Returns 0 on success, -1 with errno set. On failure the partially
+ * set up state is left for freeNotify to release.
+ */
+static int startReader(Notify* ntf)
+{
+    ntf->ho_head = (struct handoff*)lstCalloc(&ntf->mem, 1, sizeof(struct handoff));
+    if (ntf->ho_head == NULL)
+    {
+        return -1;
+    }
+    ntf->ho_tail = ntf->ho_head;
+
+    ntf->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == ntf->ready_fd)
+    {
+        return -1;
+    }
+    ntf->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == ntf->wake_fd)
+    {
+        return -1;
+    }
+
+    return spawnReader(ntf);
+}
+
+/*
+ * Threaded-mode waitNotify: take the next handed-off event, waiting
+ * on ready_fd for at most `timeout` milliseconds overall. Same return
+ * convention as nextEvent.
+ */
+static int waitHandoff(Notify* ntf, char** const path, uint32_t* mask, int timeout, uint32_t* cookie, NotifyEventInfo* info)
+{
+    if (mask)
+    {
+        *mask = 0;
+    }
+
+    struct timespec deadline = { 0, 0 };
+    if (timeout > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    for (;;)
+    {
+        /* read before popping: everything the reader queued before it
+         * gave up is visible once its errno is */
+        int dead = __atomic_load_n(&ntf->reader_errno, __ATOMIC_ACQUIRE);
+        int err = 0;
+        if (handoffPop(ntf, path, mask, cookie, info, &err))
+        {
+            if (err)
+            {
+                errno = err;
+                return -1;
+            }
+            return 0;
+        }
+        if (dead)
+        {
+            errno = dead;
+            return -1;
+        }
+
+        int wait_ms = timeout;
+        if (timeout > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long left = (deadline.tv_sec - now.tv_sec) * 1000L
+                + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+            if (left <= 0)
+            {
+                return 1;
+            }
+            wait_ms = (int)left;
+        }
+
+        struct pollfd pfd = { ntf->ready_fd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, wait_ms);
+        if (rc == -1)
+        {
+            return -1;
+        }
+        if (rc == 0)
+        {
+            return 1;
+        }
+        eventfd_t drained;
+        eventfd_read(ntf->ready_fd, &drained);
+    }
+}
+
+/*
+ * The next event for takeEvent: first those notifyImport carried over
+ * finished, then the reader's (threaded mode) or the engine's. Same
+ * return convention as nextEvent.
+ */
+static int takeNext(Notify* ntf, char** const path, uint32_t* mask, int timeout, uint32_t* cookie, NotifyEventInfo* info)
+{
+    struct handoff* node = ntf->resumed;
+    if (node == NULL)
+    {
+        return ntf->threaded
+            ? waitHandoff(ntf, path, mask, timeout, cookie, info)
+            : noteFailure(ntf, nextEvent(ntf, path, mask, timeout, cookie, info));
+    }
+
+    ntf->resumed = node->next;
+    if (ntf->resumed == NULL)
+    {
+        ntf->resumed_tail = NULL;
+    }
+    *path = node->path;
+    if (mask)
+    {
+        *mask = node->mask;
+    }
+    if (cookie)
+    {
+        *cookie = node->cookie;
+    }
+    if (info)
+    {
+        *info = node->info;
+    }
+    int err = node->err;
+    lstRelease(&ntf->mem, node);
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The next event for waitNotify and notifyDispatch, counted by the
+ * activity tracker and appended to the journal on its way out. Same
+ * return convention as nextEvent.
+ */
+static int takeEvent(Notify* ntf, char** const path, uint32_t* mask, int timeout, uint32_t* cookie, NotifyEventInfo* info)
+{
+    uint32_t m = 0;
+    uint32_t c = 0;
+    NotifyEventInfo local;
+    if (info == NULL
+        && ntf->journal != NULL)
+    {
+        info = &local;
+    }
+    int rc = takeNext(ntf, path, &m, timeout, &c, info);
+    if (mask)
+    {
+        *mask = m;
+    }
+    if (cookie)
+    {
+        *cookie = c;
+    }
+    if (rc != 0
+        || *path == NULL)
+    {
+        return rc;
+    }
+    if (ntf->hot != NULL)
+    {
+        hotAdd(ntf->hot, *path, m);
+    }
+    if (ntf->journal != NULL)
+    {
+        int evicted = journalAppend(ntf->journal, *path, m, c, info);
+        if (evicted != -1)
+        {
+            COUNTER_ADD(ntf->stats.journal_events, 1);
+            COUNTER_ADD(ntf->stats.journal_evicted, (unsigned long)evicted);
+        }
+    }
+    return rc;
+}
+
+/*
+ * Public API.
+ *
+ * Wait for the next filesystem event on `ntf`. When an event is
+ * delivered:
+ *   *path   is set to a freshly allocated null-terminated absolute
+ *           path (caller releases it with notifyFree, or free() when
+ *           no NotifyOptions.allocator was given);
+ *   *mask   is set to the inotify mask bits, or IN_Q_OVERFLOW if
+ *           the kernel's queue was lost (synthetic). An overflow is
+ *           delivered with NOTIFY_RESCAN_BEGIN and followed by the
+ *           rescanWatches repair, closed by NOTIFY_RESCAN_END. With
+ *           NotifyOptions.rename_window a paired move comes as
+ *           IN_MOVED_TO | NOTIFY_RENAME, its old path stored after
+ *           *path (notifyRenameSource);
+ *   *cookie is set to the kernel-assigned cookie if non-NULL.
+ *
+ * `mask` and `cookie` may be NULL; `path` must not be.
+ *
+ * `timeout` follows the same -1/0/>0 convention as Select(): -1 is
+ * block forever, 0 is non-blocking poll, >0 is milliseconds.
+ *
+ * Returns:
+ *    0  on event delivered.
+ *  >0   timeout: returns the original `timeout` value unchanged.
+ *   -1  error (errno set). EINVAL for a NULL ntf/path; EPROTO for a
+ *       truncated event; any errno from the underlying read/select.
+ *
+ * The internal recursive-watch bookkeeping (auto-adding watches on
+ * IN_CREATE|IN_ISDIR, renaming on IN_MOVED_TO, retiring on
+ * IN_IGNORED) happens before this call returns, transparent to the
+ * caller. In threaded mode it has already happened on the reader
+ * thread and this call only dequeues; an error the reader hit is
+ * reported here, in order, as -1 with its errno.
+ */
+int waitNotify(Notify* ntf, char** const path, uint32_t* mask, int timeout, uint32_t* cookie)
+{
+    return waitNotifyInfo(ntf, path, mask, timeout, cookie, NULL);
+}
+
+/*
+ * Public API.
+ *
+ * waitNotify, and when an event is delivered and `info` is non-NULL,
+ * what else is known about it (see NotifyEventInfo):
+ *   seq      numbers events as they are queued, from 1. A gap means
+ *            events were dropped under NOTIFY_QUEUE_DROP (excluded
+ *            and coalesced events take no number). Delivery order
+ *            may differ from seq order: with NotifyOptions.priority,
+ *            with rename pairing holding an IN_MOVED_FROM back, and
+ *            after an overflow, whose rescan goes ahead of the events
+ *            read before it.
+ *   time_ns  CLOCK_MONOTONIC when the read that brought the event
+ *            began, or the crawl or rescan that made it; every event
+ *            of one read shares it.
+ *   wd / dir_ino  the watch the event came through and the inode of
+ *            its directory, at delivery; -1 and 0 for markers and
+ *            after the watch was retired.
+ *   origin   NOTIFY_ORIGIN_KERNEL for events read from the fd (and
+ *            IN_Q_OVERFLOW), CRAWL for the IN_CREATE / IN_CLOSE_WRITE
+ *            made up for entries found by the initial scan or in a
+ *            new directory, RESCAN for those of the overflow repair,
+ *            MARKER for NOTIFY_* markers.
+ * Left untouched when nothing is delivered.
+ */
+int waitNotifyInfo(Notify* ntf, char** const path, uint32_t* mask, int timeout, uint32_t* cookie, NotifyEventInfo* info)
+{
+    if (ntf == NULL
+        || path == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int rc = takeEvent(ntf, path, mask, timeout, cookie, info);
+
+    return (rc == 1) ? timeout : rc;
+}
+
+/*
+ * Public API.
+ *
+ * Write the spans recorded for a Notify created with `opts->trace` to
+ * `fd` as Chrome trace-event JSON (chrome://tracing, Perfetto), oldest
+ * first. The ring keeps only the most recent spans. May be called
+ * from any thread while events are being processed.
+ *
+ * Returns the number of spans written, or -1 with errno set: EINVAL
+ * on NULL input or when tracing was not requested, ENOTSUP when the
+ * library was built without RNOTIFY_TRACE, or a write error.
+ */
+int notifyTraceDump(const Notify* ntf, int fd)
+{
+    if (ntf == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef RNOTIFY_TRACE
+    if (ntf->trace == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return traceDump(ntf->trace, fd);
+#else
+    (void)fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/*
+ * Public API.
+ *
+ * Copy the watcher's counters into `*stats`. Safe to call from any
+ * thread, including while another thread is inside waitNotify or the
+ * reader thread is running; each counter is read atomically, the set
+ * as a whole is not a snapshot.
+ *
+ * Returns 0, or -1 with EINVAL on NULL input.
+ */
+int notifyStats(const Notify* ntf, NotifyStats* stats)
+{
+    if (ntf == NULL
+        || stats == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* NotifyStats is all unsigned long */
+    const unsigned long* src = (const unsigned long*)&ntf->stats;
+    unsigned long* dst = (unsigned long*)stats;
+    for (size_t i = 0; i < sizeof(NotifyStats) / sizeof(unsigned long); i++)
+    {
+        dst[i] = COUNTER_GET(src[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * Public API.
+ *
+ * Hand the engine the bytes of one completed read of notifyFd(), for a
+ * Notify created with `external_read`. `buf` must be aligned for
+ * struct inotify_event and hold whole events, as the kernel returns
+ * them. The events are queued, and the directory bookkeeping runs
+ * here, as for a read of the engine's own (trackEvent): a directory
+ * that appeared is watched and crawled, directory moves are applied
+ * to the watch table. Only entry-set upkeep, lazy crawls and the
+ * retirement of a wd on IN_IGNORED wait until the event is delivered
+ * by waitNotify or notifyDispatch, which never block or touch the fd
+ * in this mode. An IN_MOVED_FROM held for rename_window comes out of
+ * the first of them called once notifyTimeout() is 0: no read
+ * announces it.
+ *
+ * Returns 0 on success, -1 with errno set: EINVAL on NULL input or a
+ * Notify without `external_read`, EAGAIN when the queue is at its
+ * NotifyOptions limit and the policy is not NOTIFY_QUEUE_DROP (nothing
+ * was taken: deliver events, then feed the same buffer again), EPROTO
+ * when the buffer ends in the middle of an event (the whole events
+ * before it are kept), ENOMEM.
+ */
+int notifyFeed(Notify* ntf, const void* buf, size_t len)
+{
+    if (ntf == NULL
+        || (buf == NULL && len)
+        || !ntf->external_read)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (queueBlocked(ntf))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    TRACE_BEGIN(ntf, t_parse);
+    int rc = recordCall(ntf, REPLAY_READ, NULL, 0, buf, len);
+    if (rc == 0)
+    {
+        rc = feedEvents(ntf, (const char*)buf, len);
+    }
+    TRACE_END(ntf, t_parse, TRACE_PARSE);
+
+    return noteFailure(ntf, rc);
+}
+
+/*
+ * Public API.
+ *
+ * Register `fn` to be called by notifyDispatch for every event whose
+ * mask shares a bit with `mask` (library marker bits included). A
+ * handler is called at most once per event however many of its bits
+ * match; handlers run in registration order. Not safe to call while
+ * another thread is inside notifyDispatch.
+ *
+ * Returns the registration's index, or -1 with errno set: EINVAL on
+ * NULL input or an empty mask, ENOSPC once NOTIFY_MAX_HANDLERS are
+ * registered.
+ */
+int notifyOn(Notify* ntf, uint32_t mask, NotifyHandler fn, void* arg)
+{
+    if (ntf == NULL
+        || fn == NULL
+        || mask == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ntf->n_handlers == NOTIFY_MAX_HANDLERS)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    unsigned int idx = ntf->n_handlers++;
+    ntf->handlers[idx].mask = mask;
+    ntf->handlers[idx].fn = fn;
+    ntf->handlers[idx].arg = arg;
+    for (int b = 0; b < 32; b++)
+    {
+        if (mask & (1u << b))
+        {
+            ntf->by_bit[b] |= (uint64_t)1 << idx;
+        }
+    }
+
+    return (int)idx;
+}
+
+/*
+ * Public API.
+ *
+ * Wait up to `timeout` milliseconds for an event, then deliver it and
+ * whatever else is ready without waiting, up to `max_events` (<= 0:
+ * no limit), to the handlers registered with notifyOn. Events nobody
+ * registered for are consumed silently. The path passed to a handler
+ * is borrowed: it is valid only during the call and must not be freed.
+ *
+ * Returns the number of events consumed (0 on timeout), or -1 with
+ * errno set, as waitNotify would.
+ */
+int notifyDispatch(Notify* ntf, int max_events, int timeout)
+{
+    if (ntf == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ntf->dispatch_errno)
+    {
+        errno = ntf->dispatch_errno;
+        ntf->dispatch_errno = 0;
+        return -1;
+    }
+
+    int count = 0;
+    while (max_events <= 0 || count < max_events)
+    {
+        char* path = NULL;
+        uint32_t mask = 0;
+        uint32_t cookie = 0;
+        NotifyEventInfo info;
+        int wait = count ? 0 : timeout;
+        int rc = takeEvent(ntf, &path, &mask, wait, &cookie, &info);
+        if (rc == 1)
+        {
+            break;
+        }
+        if (rc == -1)
+        {
+            if (count)
+            {
+                /* report it on the next call, after these events */
+                ntf->dispatch_errno = errno;
+                break;
+            }
+            return -1;
+        }
+        count++;
+
+        uint64_t todo = 0;
+        for (uint32_t bits = mask; bits; bits &= bits - 1)
+        {
+            todo |= ntf->by_bit[__builtin_ctz(bits)];
+        }
+        ntf->dispatching = &info;
+        for (; todo; todo &= todo - 1)
+        {
+            const struct handlerReg* h = &ntf->handlers[__builtin_ctzll(todo)];
+            h->fn(path ? path : "", mask, cookie, h->arg);
+        }
+        ntf->dispatching = NULL;
+        lstRelease(&ntf->mem, path);
+    }
+
+    return count;
+}
+
+/*
+ * Public API.
  *
- * Wait for the next filesystem event on `ntf`. When an event is
- * delivered:
- *   *path   is set to a freshly malloc'd null-terminated absolute
- *           path (caller frees);
- *   *mask   is set to the inotify mask bits, or IN_Q_OVERFLOW if
- *           the kernel's queue was lost (synthetic);
- *   *cookie is set to the kernel-assigned cookie if non-NULL.
+ * Inside a handler called by notifyDispatch: the NotifyEventInfo of
+ * the event being handled (see waitNotifyInfo), valid until the
+ * handler returns. NULL anywhere else.
+ */
+const NotifyEventInfo* notifyEventInfo(const Notify* ntf)
+{
+    return ntf ? ntf->dispatching : NULL;
+}
+
+/*
+ * Public API.
  *
- * `mask` and `cookie` may be NULL; `path` must not be.
+ * With NotifyOptions.hot: the paths of class `cls` (NOTIFY_HOT_*)
+ * that had the most events delivered, hottest first, each with its
+ * estimated count. Every event counts for its path and for the
+ * directory it is in, so a directory full of short-lived files shows
+ * up even when no single file does. Estimates never undercount; they
+ * overcount by what other paths sharing sketch counters added. *hot is
+ * one block: release it with notifyFree. Call it from the thread that
+ * takes events (waitNotify, notifyDispatch, runNotifyPool), not from a
+ * pool worker.
  *
- * `timeout` follows the same -1/0/>0 convention as Select(): -1 is
- * block forever, 0 is non-blocking poll, >0 is milliseconds.
+ * Returns the number of paths in *hot (NULL when 0), or -1 with errno
+ * set: EINVAL on NULL input, a bad class or without NotifyOptions.hot,
+ * ENOMEM.
+ */
+long notifyHotPaths(Notify* ntf, int cls, NotifyHot** hot)
+{
+    if (ntf == NULL
+        || hot == NULL
+        || ntf->hot == NULL
+        || cls < 0
+        || cls >= NOTIFY_HOT_CLASSES)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return hotTop(ntf->hot, cls, hot);
+}
+
+/*
+ * Public API.
  *
- * Returns:
- *    0  on event delivered.
- *  >0   timeout: returns the original `timeout` value unchanged.
- *   -1  error (errno set). EINVAL for a NULL ntf/path; EPROTO for a
- *       truncated event; any errno from the underlying read/select.
+ * With NotifyOptions.hot: divide every count of the activity tracker
+ * by 2^shift, so that what is hot now outranks what was hot before.
+ * NotifyOptions.hot_halflife does this on its own. Same thread rule as
+ * notifyHotPaths.
  *
- * The internal recursive-watch bookkeeping (auto-adding watches on
- * IN_CREATE|IN_ISDIR, renaming on IN_MOVED_TO, retiring on
- * IN_IGNORED) happens before this call returns, transparent to the
- * caller.
+ * Returns 0, or -1 with errno = EINVAL on NULL input or without
+ * NotifyOptions.hot.
+ */
+int notifyHotDecay(Notify* ntf, unsigned int shift)
+{
+    if (ntf == NULL
+        || ntf->hot == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    hotDecay(ntf->hot, shift);
+    return 0;
+}
+
+/*
+ * Run the engine until nothing is pending: what it still delivers
+ * (directory structure, markers) goes into the dirty set as well.
+ * Returns 0, or -1 with errno set.
+ */
+static int dirtyDrain(Notify* ntf)
+{
+    for (;;)
+    {
+        char* path = NULL;
+        uint32_t mask = 0;
+        NotifyEventInfo info;
+        int rc = takeEvent(ntf, &path, &mask, 0, NULL, &info);
+        if (rc != 0)
+        {
+            return (rc == 1) ? 0 : -1;
+        }
+        lstRelease(&ntf->mem, path);
+        struct Watch* watch = (info.wd >= 0) ? watchFind(ntf, info.wd) : NULL;
+        if (watch != NULL
+            && -1 == dirtyMark(ntf, watch, mask))
+        {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Hand the dirty set over as one block, the NotifyDirty array followed
+ * by the paths it points to, and leave the set empty. Returns how many
+ * directories, or -1 on allocation failure (errno set; the set stays).
+ */
+static long dirtyTake(Notify* ntf, NotifyDirty** dirs)
+{
+    size_t n = ntf->dirty_count;
+    if (n == 0)
+    {
+        return 0;
+    }
+    size_t size = n * sizeof(NotifyDirty);
+    for (size_t i = 0; i < n; i++)
+    {
+        size += strlen(ntf->dirty_set[i]->path) + 1;
+    }
+    NotifyDirty* out = (NotifyDirty*)lstAlloc(&ntf->mem, size);
+    if (out == NULL)
+    {
+        return -1;
+    }
+    char* p = (char*)(out + n);
+    for (size_t i = 0; i < n; i++)
+    {
+        struct Watch* watch = ntf->dirty_set[i];
+        size_t len = strlen(watch->path) + 1;
+        memcpy(p, watch->path, len);
+        out[i].path = p;
+        out[i].mask = watch->dirty;
+        watch->dirty = 0;
+        p += len;
+    }
+    ntf->dirty_count = 0;
+    COUNTER_ADD(ntf->stats.dirty_dirs, -(unsigned long)n);
+    *dirs = out;
+    return (long)n;
+}
+
+/*
+ * Public API.
+ *
+ * With NotifyOptions.dirty: read and fold in whatever is pending,
+ * waiting up to `timeout` ms (-1: indefinitely, 0: not at all) while
+ * no directory is dirty, then hand the set of changed directories over
+ * and start a new one. Each directory comes once, under its current
+ * path, with the mask of everything seen in it since the last take.
+ * *dirs is one block: release it with notifyFree. Costs are those of
+ * the changed directories, not of the events: only what the recursion
+ * needs (directory creates, moves and deletes, overflows) still goes
+ * through the event queue, and that is folded in here too.
+ *
+ * Returns the number of directories in *dirs (NULL when 0), or -1 with
+ * errno set: EINVAL on NULL input or without NotifyOptions.dirty, or
+ * an engine error as from waitNotify.
+ */
+long notifyTakeDirty(Notify* ntf, NotifyDirty** dirs, int timeout)
+{
+    if (ntf == NULL
+        || dirs == NULL
+        || !ntf->dirty)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *dirs = NULL;
+
+    uint64_t deadline = (timeout > 0) ? monotonicMs() + (uint64_t)timeout : 0;
+    for (;;)
+    {
+        if (-1 == dirtyDrain(ntf))
+        {
+            return -1;
+        }
+        if (ntf->dirty_count
+            || timeout == 0
+            || ntf->external_read
+            || ntf->replay)
+        {
+            break;
+        }
+        int wait = timeout;
+        if (timeout > 0)
+        {
+            uint64_t now = monotonicMs();
+            if (now >= deadline)
+            {
+                break;
+            }
+            wait = (int)(deadline - now);
+        }
+        int rd = Select(ntf->fd, ntf->wake_fd, wait);
+        if (rd == -1)
+        {
+            return -1;
+        }
+        if (rd == 0)
+        {
+            break;
+        }
+    }
+
+    long n = dirtyTake(ntf, dirs);
+    if (n == -1)
+    {
+        noteFailure(ntf, -1);
+    }
+    return n;
+}
+
+/*
+ * Public API.
+ *
+ * Release `ptr`, a path returned by waitNotify, through the Notify's
+ * allocator. Safe to pass NULL `ptr`; with a NULL `ntf` it calls
+ * free().
+ */
+void notifyFree(const Notify* ntf, void* ptr)
+{
+    lstRelease(ntf ? &ntf->mem : NULL, ptr);
+}
+
+/*
+ * Public API.
+ *
+ * The old path of a NOTIFY_RENAME event: it is stored right after the
+ * terminator of the new one, `path`, in the same allocation, and lives
+ * as long as it. NULL for any other event.
+ */
+const char* notifyRenameSource(const char* path, uint32_t mask)
+{
+    if (path == NULL
+        || !(mask & NOTIFY_RENAME))
+    {
+        return NULL;
+    }
+    return path + strlen(path) + 1;
+}
+
+/*
+ * Handoff state records (rnotify_state.h frames them). Written in this
+ * order; HEAD comes first, STATS before any EVENT, and ENTRY records
+ * belong to the WATCH before them.
+ */
+enum stateType
+{
+    STATE_HEAD = 1,     /* struct stateHead */
+    STATE_EXCLUDE,      /* the exclude pattern, NUL-terminated */
+    STATE_STATS,        /* NotifyStats */
+    STATE_WATCH,        /* struct stateWatch, then the path */
+    STATE_ENTRY,        /* is_dir byte, then the name */
+    STATE_COOKIE,       /* struct stateCookie, then path and name, oldest last */
+    STATE_EVENT,        /* struct stateEvent, then the inotify_event */
+    STATE_MOVE,         /* struct stateMove, then its IN_MOVED_TO once read */
+    STATE_READY,        /* struct stateReady, then the path */
+};
+
+/* What describes the tree and the stream rather than the process. */
+struct stateHead
+{
+    uint32_t mask;
+    int32_t fd;
+    int32_t scan;
+    int32_t scan_done;
+    int32_t drop_marked;
+    int32_t shedding;
+    int32_t rename_window;
+    int32_t pad;
+    int64_t max_name;
+    uint64_t scan_pending;
+    uint64_t scan_dirs;
+    uint64_t scan_entries;
+    uint64_t seq;
+    uint64_t root_dev;
+};
+
+struct stateWatch
+{
+    int32_t wd;
+    uint32_t dirty;     /* NotifyOptions.dirty mask not yet taken */
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int32_t depth;
+    int32_t shallow;
+};
+
+struct stateCookie
+{
+    uint32_t cookie;
+    int32_t wd;
+    uint64_t path_len;  /* with its NUL; the name follows */
+};
+
+struct stateEvent
+{
+    uint32_t flags;     /* CHAIN_* */
+    int32_t prio;
+    uint64_t seq;
+    uint64_t time_ns;
+    int32_t has_stat;
+    int32_t pad;
+    NotifyStat stat;
+};
+
+struct stateMove
+{
+    uint32_t cookie;
+    uint32_t has_to;
+    uint64_t due;       /* CLOCK_MONOTONIC ms, the same clock in every process */
+};
+
+/* A finished event; len 0 for a NULL path. */
+struct stateReady
+{
+    uint32_t mask;
+    uint32_t cookie;
+    int32_t err;
+    uint32_t len;
+    uint64_t seq;
+    uint64_t time_ns;
+    uint64_t dir_ino;
+    int32_t wd;
+    int32_t origin;
+    NotifyStat stat;
+};
+
+/* Bytes of a delivered path: a NOTIFY_RENAME path carries its source. */
+static size_t readyLen(const char* path, uint32_t mask)
+{
+    if (path == NULL)
+    {
+        return 0;
+    }
+    size_t len = strlen(path) + 1;
+    if (mask & NOTIFY_RENAME)
+    {
+        len += strlen(path + len) + 1;
+    }
+    return len;
+}
+
+static int putReady(struct stateLog* log, const struct handoff* h)
+{
+    struct stateReady r = { h->mask, h->cookie, h->err, (uint32_t)readyLen(h->path, h->mask),
+                            h->info.seq, h->info.time_ns, h->info.dir_ino, h->info.wd, h->info.origin,
+                            h->info.stat };
+    struct iovec iov[2] = { { &r, sizeof(r) }, { h->path, r.len } };
+    return statePut(log, STATE_READY, iov, 2);
+}
+
+/*
+ * Write everything `ntf` holds to `log`, in stateType order. The
+ * reader, if any, must be stopped.
+ *
+ * Returns 0, or -1 with errno set.
+ */
+static int writeState(const Notify* ntf, struct stateLog* log)
+{
+    struct stateHead head;
+    memset(&head, 0, sizeof(head));
+    head.mask = ntf->mask;
+    head.fd = ntf->fd;
+    head.scan = ntf->scan;
+    head.scan_done = ntf->scan_done;
+    head.drop_marked = ntf->drop_marked;
+    head.shedding = ntf->shedding;
+    head.rename_window = ntf->rename_window;
+    head.max_name = ntf->max_name;
+    head.scan_pending = ntf->scan_pending;
+    head.scan_dirs = ntf->scan_dirs;
+    head.scan_entries = ntf->scan_entries;
+    head.seq = ntf->seq;
+    head.root_dev = ntf->root_dev;
+    struct iovec iov[3] = { { &head, sizeof(head) } };
+    if (-1 == statePut(log, STATE_HEAD, iov, 1))
+    {
+        return -1;
+    }
+
+    if (ntf->exclude_src)
+    {
+        iov[0].iov_base = ntf->exclude_src;
+        iov[0].iov_len = strlen(ntf->exclude_src) + 1;
+        if (-1 == statePut(log, STATE_EXCLUDE, iov, 1))
+        {
+            return -1;
+        }
+    }
+
+    iov[0].iov_base = (void*)&ntf->stats;
+    iov[0].iov_len = sizeof(NotifyStats);
+    if (-1 == statePut(log, STATE_STATS, iov, 1))
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < ntf->w.cap; i++)
+    {
+        const struct Watch* watch = ntf->w.slots[i];
+        if (watch == NULL)
+        {
+            continue;
+        }
+        struct stateWatch sw = { watch->wd, watch->dirty, watch->dev, watch->ino,
+                                 watch->mtime.tv_sec, watch->mtime.tv_nsec,
+                                 watch->depth, watch->shallow };
+        iov[0].iov_base = &sw;
+        iov[0].iov_len = sizeof(sw);
+        iov[1].iov_base = watch->path;
+        iov[1].iov_len = strlen(watch->path) + 1;
+        if (-1 == statePut(log, STATE_WATCH, iov, 2))
+        {
+            return -1;
+        }
+        for (size_t j = 0; j < watch->entries.cap; j++)
+        {
+            struct Entry* entry = watch->entries.slots[j];
+            if (entry == NULL)
+            {
+                continue;
+            }
+            iov[0].iov_base = &entry->is_dir;
+            iov[0].iov_len = 1;
+            iov[1].iov_base = entry->name;
+            iov[1].iov_len = strlen(entry->name) + 1;
+            if (-1 == statePut(log, STATE_ENTRY, iov, 2))
+            {
+                return -1;
+            }
+        }
+    }
+
+    /* oldest first: notifyImport prepends each, as addCookie did */
+    const struct Cookie* c = ntf->cookies;
+    while (c != NULL
+           && c->next != NULL)
+    {
+        c = c->next;
+    }
+    for (; c != NULL; c = c->prev)
+    {
+        struct stateCookie sc = { c->cookie, c->wd, strlen(c->path) + 1 };
+        iov[0].iov_base = &sc;
+        iov[0].iov_len = sizeof(sc);
+        iov[1].iov_base = c->path;
+        iov[1].iov_len = sc.path_len;
+        iov[2].iov_base = c->name;
+        iov[2].iov_len = strlen(c->name) + 1;
+        if (-1 == statePut(log, STATE_COOKIE, iov, 3))
+        {
+            return -1;
+        }
+    }
+
+    for (int k = 0; k < CHAIN_CLASSES; k++)
+    {
+        for (const struct chainEvent* el = ntf->q[k].head; el != NULL; el = el->next)
+        {
+            struct stateEvent se;
+            memset(&se, 0, sizeof(se));
+            se.flags = el->flags;
+            se.prio = el->prio;
+            se.seq = el->seq;
+            se.time_ns = el->time_ns;
+            if (el->st != NULL)
+            {
+                se.has_stat = 1;
+                se.stat = *el->st;
+            }
+            iov[0].iov_base = &se;
+            iov[0].iov_len = sizeof(se);
+            iov[1].iov_base = el->e;
+            iov[1].iov_len = sizeof(struct inotify_event) + el->e->len;
+            if (-1 == statePut(log, STATE_EVENT, iov, 2))
+            {
+                return -1;
+            }
+        }
+    }
+
+    for (const struct moveWait* m = ntf->moves; m != NULL; m = m->next)
+    {
+        struct stateMove sm = { m->cookie, m->to != NULL, m->due };
+        iov[0].iov_base = &sm;
+        iov[0].iov_len = sizeof(sm);
+        iov[1].iov_base = m->to;
+        iov[1].iov_len = m->to ? sizeof(struct inotify_event) + m->to->len : 0;
+        if (-1 == statePut(log, STATE_MOVE, iov, 2))
+        {
+            return -1;
+        }
+    }
+
+    /* finished events: those carried over from a previous handoff
+     * come before what the reader produced since */
+    for (const struct handoff* h = ntf->resumed; h != NULL; h = h->next)
+    {
+        if (-1 == putReady(log, h))
+        {
+            return -1;
+        }
+    }
+    for (const struct handoff* h = ntf->ho_head ? ntf->ho_head->next : NULL; h != NULL; h = h->next)
+    {
+        if (-1 == putReady(log, h))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * First half of a handoff: stop the reader of a threaded Notify and
+ * write its state to a memfd. Nothing is consumed, so resumeExport or
+ * freeNotify can follow either way.
+ *
+ * Returns the memfd, or -1 with errno set.
  */
-int waitNotify(Notify* ntf, char** const path, uint32_t* mask, int timeout, uint32_t* cookie)
+static int exportState(Notify* ntf)
 {
-    if (ntf == NULL
-        || path == NULL)
+    if (ntf->threaded
+        && !ntf->reader_stop)
     {
-        errno = EINVAL;
+        stopReader(ntf);
+    }
+    struct stateLog* log = stateCreate();
+    if (log == NULL)
+    {
+        return -1;
+    }
+    if (-1 == writeState(ntf, log))
+    {
+        stateAbort(log);
         return -1;
     }
+    return stateFinish(log);
+}
 
-    if (mask)
+/*
+ * The state exported from `ntf` did not get through: carry on as if
+ * nothing happened. A reader that cannot be restarted is reported by
+ * waitNotify, after the events it had handed over. errno is preserved.
+ */
+static void resumeExport(Notify* ntf)
+{
+    int saved_errno = errno;
+    if (ntf->threaded
+        && ntf->reader_stop)
     {
-        *mask = 0;
+        eventfd_t value;
+        eventfd_read(ntf->wake_fd, &value);
+        __atomic_store_n(&ntf->reader_stop, 0, __ATOMIC_RELEASE);
+        if (-1 == spawnReader(ntf))
+        {
+            ntf->threaded = 1;
+            ntf->reader_stop = 1;
+            __atomic_store_n(&ntf->reader_errno, errno, __ATOMIC_RELEASE);
+        }
     }
+    errno = saved_errno;
+}
 
-    int rd = 0;
-    struct inotify_event* e = NULL;
-    while ( 0 < (rd = checkFd(ntf->fd)) || NULL == (e = pullChainEvent(ntf)))
+/* Whether `data` holds a NUL-terminated string of `len` bytes. */
+static int stateString(const char* data, size_t len)
+{
+    return len > 0 && data[len - 1] == '\0';
+}
+
+/* Whether `data` holds one whole inotify_event of `len` bytes. */
+static int stateInotifyEvent(const void* data, size_t len)
+{
+    return len >= sizeof(struct inotify_event)
+        && len - sizeof(struct inotify_event) == ((const struct inotify_event*)data)->len;
+}
+
+/*
+ * Apply one state record to the Notify being imported; `*watch` is the
+ * watch the following STATE_ENTRY records belong to.
+ *
+ * Returns 0, or -1 with errno set: EPROTO for a malformed record.
+ */
+static int readRecord(Notify* ntf, uint32_t type, const char* data, size_t len, struct Watch** watch)
+{
+    switch (type)
     {
-        if (!rd)
+    case STATE_EXCLUDE:
+        if (!stateString(data, len)
+            || ntf->exclude)
         {
-            rd = Select(ntf->fd, timeout);
-            if (!rd)
-            {
-                return timeout;
-            }
+            break;
         }
+        return setExclude(ntf, data);
 
-        if (-1 == rd)
+    case STATE_STATS:
+        memcpy(&ntf->stats, data, (len < sizeof(NotifyStats)) ? len : sizeof(NotifyStats));
+        /* recounted as the queue is rebuilt */
+        ntf->stats.queue_depth = 0;
+        ntf->stats.queue_bytes = 0;
+        return 0;
+
+    case STATE_WATCH:
+    {
+        const struct stateWatch* sw = (const struct stateWatch*)data;
+        if (len <= sizeof(*sw)
+            || !stateString(data + sizeof(*sw), len - sizeof(*sw))
+            || watchFind(ntf, sw->wd) != NULL)
+        {
+            break;
+        }
+        struct Watch* w = (struct Watch*)lstCalloc(&ntf->mem, 1, sizeof(struct Watch));
+        if (w == NULL)
         {
             return -1;
         }
-
-        size_t length = 0;
-        if (-1 == ioctl(ntf->fd, FIONREAD, &length))
+        w->wd = sw->wd;
+        w->dev = (dev_t)sw->dev;
+        w->ino = (ino_t)sw->ino;
+        w->mtime.tv_sec = (time_t)sw->mtime_sec;
+        w->mtime.tv_nsec = (long)sw->mtime_nsec;
+        w->depth = sw->depth;
+        w->shallow = sw->shallow;
+        w->path = lstString(&ntf->mem, "%s", data + sizeof(*sw));
+        if (w->path == NULL
+            || -1 == watchAdd(&ntf->mem, &ntf->w, w))
         {
+            freeWatch(&ntf->mem, w);
             return -1;
         }
+        *watch = w;
+        return (ntf->dirty && sw->dirty) ? dirtyMark(ntf, w, sw->dirty) : 0;
+    }
 
-        if (length == 0)
+    case STATE_ENTRY:
+        if (*watch == NULL
+            || len < 2
+            || !stateString(data + 1, len - 1))
         {
-            /* Spurious wake-up: select() reported readable but the
-             * queue is empty by the time we look. Avoid malloc(0)
-             * (implementation-defined: may return NULL and be mistaken
-             * for an allocation failure) and go back to waiting.
-             */
-            continue;
+            break;
         }
+        return entryAdd(&ntf->mem, &(*watch)->entries, data + 1, data[0]);
 
-        int event_size = sizeof(struct inotify_event);
-        if (length > (ntf->max_queued_events * (event_size + ntf->max_name + 1)))
+    case STATE_COOKIE:
+    {
+        const struct stateCookie* sc = (const struct stateCookie*)data;
+        const char* path = data + sizeof(*sc);
+        if (len <= sizeof(*sc)
+            || sc->path_len == 0
+            || sc->path_len >= len - sizeof(*sc)
+            || !stateString(path, sc->path_len)
+            || !stateString(path + sc->path_len, len - sizeof(*sc) - sc->path_len))
         {
-            errno = EMSGSIZE;
-            return -1;
+            break;
         }
+        return addCookie(&ntf->mem, &ntf->cookies, sc->wd, path, path + sc->path_len, sc->cookie);
+    }
 
-        char* buffer = (char*)malloc(length);
-        if (buffer == NULL)
+    case STATE_EVENT:
+    {
+        const struct stateEvent* se = (const struct stateEvent*)data;
+        if (len < sizeof(*se)
+            || !stateInotifyEvent(data + sizeof(*se), len - sizeof(*se))
+            || se->prio < 0
+            || se->prio >= CHAIN_CLASSES)
+        {
+            break;
+        }
+        /* past the exclude filter and the queue policy already */
+        struct chainEvent* el = chainStore(ntf, (const struct inotify_event*)(data + sizeof(*se)), se->flags,
+                                           ntf->priority ? se->prio : 0);
+        if (el == NULL)
         {
             return -1;
         }
-        memset(buffer, 0, length);
-
-        ssize_t total_read = totalRead(ntf->fd, &buffer, length);
-        if ((ssize_t)length != total_read)
+        el->seq = se->seq;
+        el->time_ns = se->time_ns;
+        if (se->has_stat)
         {
-            int rval = -1;
-            if (errno == EINVAL)
+            el->st = (NotifyStat*)lstAlloc(&ntf->mem, sizeof(NotifyStat));
+            if (el->st == NULL)
             {
-                if (mask)
-                {
-                    *mask = IN_Q_OVERFLOW;
-                }
-                rval = 0;
+                return -1;
             }
+            *el->st = se->stat;
+        }
+        return 0;
+    }
 
-            free(buffer);
-            return rval;
-        }
-
-        /*
-         * Walk packed inotify events. Two invariants keep the
-         * pointer-cast read of e->len safe:
-         *  - malloc(3) returns memory aligned to alignof(max_align_t),
-         *    which is >= alignof(struct inotify_event) (== 4) on every
-         *    Linux ABI;
-         *  - the kernel rounds e->len up so successive events stay
-         *    aligned to alignof(struct inotify_event); see
-         *    fs/notify/inotify/inotify_user.c in the kernel tree.
-         * Bound-check anyway in case the read came back truncated or
-         * the event header was corrupted in flight.
-         */
-        size_t i = 0;
-        while (i + (size_t)event_size <= length)
-        {
-            e = (struct inotify_event*)&buffer[i];
-            if (e->len > length - i - (size_t)event_size)
+    case STATE_MOVE:
+    {
+        const struct stateMove* sm = (const struct stateMove*)data;
+        if (len < sizeof(*sm)
+            || (sm->has_to
+                ? !stateInotifyEvent(data + sizeof(*sm), len - sizeof(*sm))
+                : len != sizeof(*sm)))
+        {
+            break;
+        }
+        struct moveWait* m = (struct moveWait*)lstCalloc(&ntf->mem, 1, sizeof(struct moveWait));
+        if (m == NULL)
+        {
+            return -1;
+        }
+        m->cookie = sm->cookie;
+        m->due = sm->due;
+        if (sm->has_to)
+        {
+            m->to = (struct inotify_event*)lstAlloc(&ntf->mem, len - sizeof(*sm));
+            if (m->to == NULL)
             {
-                errno = EPROTO;
-                free(buffer);
+                lstRelease(&ntf->mem, m);
                 return -1;
             }
-            if (-1 == pushChainEvent(ntf, e))
+            memcpy(m->to, data + sizeof(*sm), len - sizeof(*sm));
+        }
+        if (ntf->moves_tail != NULL)
+        {
+            ntf->moves_tail->next = m;
+        }
+        else
+        {
+            ntf->moves = m;
+        }
+        ntf->moves_tail = m;
+        return 0;
+    }
+
+    case STATE_READY:
+    {
+        const struct stateReady* sr = (const struct stateReady*)data;
+        if (len < sizeof(*sr)
+            || len - sizeof(*sr) != sr->len
+            || (sr->len && !stateString(data + sizeof(*sr), sr->len)))
+        {
+            break;
+        }
+        struct handoff* node = (struct handoff*)lstCalloc(&ntf->mem, 1, sizeof(struct handoff));
+        if (node == NULL)
+        {
+            return -1;
+        }
+        if (sr->len)
+        {
+            node->path = (char*)lstAlloc(&ntf->mem, sr->len);
+            if (node->path == NULL)
             {
-                free(buffer);
+                lstRelease(&ntf->mem, node);
                 return -1;
             }
-            i += (size_t)event_size + e->len;
+            memcpy(node->path, data + sizeof(*sr), sr->len);
+        }
+        node->mask = sr->mask;
+        node->cookie = sr->cookie;
+        node->err = sr->err;
+        node->info.seq = sr->seq;
+        node->info.time_ns = sr->time_ns;
+        node->info.dir_ino = sr->dir_ino;
+        node->info.wd = sr->wd;
+        node->info.origin = sr->origin;
+        node->info.stat = sr->stat;
+        if (ntf->resumed_tail != NULL)
+        {
+            ntf->resumed_tail->next = node;
         }
-        free(buffer);
+        else
+        {
+            ntf->resumed = node;
+        }
+        ntf->resumed_tail = node;
+        return 0;
     }
 
-    *path = malloc(1);
-    if (*path == NULL)
+    default:
+        break;
+    }
+
+    errno = EPROTO;
+    return -1;
+}
+
+/*
+ * Rebuild in `ntf` (from newNotify) the Notify whose state `log`
+ * holds, reading the inotify instance `fd` (-1: the recorded number).
+ *
+ * Returns 0, or -1 with errno set; ntf->fd is only set on success.
+ */
+static int readState(Notify* ntf, struct stateLog* log, int fd)
+{
+    uint32_t type = 0;
+    const void* data = NULL;
+    size_t len = 0;
+    if (1 != stateNext(log, &type, &data, &len)
+        || type != STATE_HEAD
+        || len != sizeof(struct stateHead))
     {
+        errno = EPROTO;
         return -1;
     }
-    (*path)[0] = '\0';
-
-    char* path_watch = watchPath(ntf, e->wd);
-    if (path_watch)
+    const struct stateHead* head = (const struct stateHead*)data;
+    ntf->mask = head->mask;
+    ntf->scan = head->scan;
+    ntf->scan_done = head->scan_done;
+    ntf->drop_marked = head->drop_marked;
+    ntf->shedding = head->shedding;
+    ntf->rename_window = head->rename_window;
+    ntf->max_name = (long)head->max_name;
+    ntf->scan_pending = head->scan_pending;
+    ntf->scan_dirs = head->scan_dirs;
+    ntf->scan_entries = head->scan_entries;
+    if (fd == -1)
     {
-        char* built = e->len
-            ? lstString("%s/%s", path_watch, e->name)
-            : lstString("%s", path_watch);
-        if (built == NULL)
-        {
-            return -1;
-        }
-        free(*path);
-        *path = built;
+        fd = head->fd;
     }
-
-    if (mask)
+    if (-1 == fcntl(fd, F_GETFD))
     {
-        *mask = e->mask;
+        return -1;
     }
 
-    if (e->mask & IN_CREATE
-        && e->mask & IN_ISDIR)
+    struct Watch* watch = NULL;
+    int rc;
+    while (1 == (rc = stateNext(log, &type, &data, &len)))
     {
-        if (-1 == addNotify(ntf, *path, 0))
+        if (-1 == readRecord(ntf, type, (const char*)data, len, &watch))
         {
-            free(*path);
-            freeChainEvent(e);
             return -1;
         }
     }
+    if (rc == -1)
+    {
+        return -1;
+    }
+    /* chainStore numbered the queued events again on the way in */
+    ntf->seq = head->seq;
+    ntf->root_dev = (dev_t)head->root_dev;
+    ntf->fd = fd;
+    return 0;
+}
 
-    if (e->mask & IN_MOVED_FROM
-        && e->mask & IN_ISDIR)
+/*
+ * Public API.
+ *
+ * Hand `ntf` over to another process, or to the program this one is
+ * about to exec: stop its reader thread (threaded mode), write
+ * everything it knows that the kernel does not (the watch table with
+ * each directory's entries, directory moves waiting for their
+ * IN_MOVED_TO, queued and held events, events already finished but not
+ * yet taken, counters, the mask, exclude pattern, scan mode and rename
+ * window) to a memfd, and release `ntf` without removing its watches.
+ * The inotify fd stays open; both it and the returned fd are inherited
+ * across exec. Pass them to notifyImport (-1 for the inotify fd means
+ * the number it had here). Events that arrive in between wait in the
+ * kernel queue, so none are lost as long as it does not overflow.
+ *
+ * Not while another thread is inside waitNotify or notifyDispatch, or
+ * with a NotifyPool running; with `external_read`, stop reading the fd
+ * first.
+ *
+ * Returns the state fd, or -1 with errno set and `ntf` as it was:
+ * EINVAL on NULL input, ENOTSUP for a Notify replaying a capture, or
+ * an error from memfd_create or writing the state.
+ */
+int notifyExport(Notify* ntf)
+{
+    if (ntf == NULL)
     {
-        if (path_watch
-            && -1 == addCookie(&ntf->cookies, e->wd, path_watch, e->name, e->cookie))
-        {
-            freeChainEvent(e);
-            return -1;
-        }
+        errno = EINVAL;
+        return -1;
+    }
+    if (ntf->replay)
+    {
+        errno = ENOTSUP;
+        return -1;
     }
 
-    if (e->mask & IN_MOVED_TO
-        && e->mask & IN_ISDIR)
+    int state_fd = exportState(ntf);
+    if (state_fd == -1
+        || -1 == fcntl(state_fd, F_SETFD, 0)
+        || -1 == fcntl(ntf->fd, F_SETFD, 0))
     {
-        struct Cookie* C = getCookie(&ntf->cookies, e->cookie);
-        if (C && path_watch)
+        if (state_fd != -1)
         {
-            char* oldpath = lstString("%s/%s", C->path, C->name);
-            if (oldpath == NULL)
-            {
-                freeCookie(C);
-                freeChainEvent(e);
-                return -1;
-            }
+            int saved_errno = errno;
+            close(state_fd);
+            errno = saved_errno;
+        }
+        resumeExport(ntf);
+        return -1;
+    }
 
-            char* newpath = lstString("%s/%s", path_watch, e->name);
-            if (newpath == NULL)
-            {
-                free(oldpath);
-                freeCookie(C);
-                freeChainEvent(e);
-                return -1;
-            }
+    /* the watches and the fd now belong to the importer */
+    ntf->fd = -1;
+    freeNotify(ntf);
+    return state_fd;
+}
 
-            if (-1 == renameWatches(ntf, oldpath, newpath))
-            {
-                free(oldpath);
-                free(newpath);
-                freeCookie(C);
-                freeChainEvent(e);
-                return -1;
-            }
+/*
+ * Public API.
+ *
+ * Carry on where the process that called notifyExport left off: a
+ * Notify reading the inotify instance `fd` (-1: the number recorded
+ * in the state) with the watches, queue and counters in `state_fd`.
+ * Events the exporter had finished come first, then the rest in the
+ * order it would have delivered them. `state_fd` stays the caller's
+ * to close; `fd` belongs to the Notify once this succeeds.
+ *
+ * What describes the tree and the stream comes from the state; `opts`
+ * (NULL: defaults) gives the rest, as for initNotifyOpts: threaded,
+ * external_read, queue limits and policy, priority, shed, allocator,
+ * event_pool and trace. Its scan and rename_window are ignored; record
+ * and replay are refused. A state exported while shedding load is
+ * carried on shedding only with `opts->shed`; otherwise the full mask
+ * is restored at once and NOTIFY_SHED_END queued.
+ *
+ * Returns the Notify, or NULL with errno set and `fd` untouched:
+ * EINVAL on bad input or options, EBADF when `fd` is not open, EPROTO
+ * when `state_fd` does not hold a state from this library, or an error
+ * from the allocator or regcomp.
+ */
+Notify* notifyImport(int state_fd, int fd, const NotifyOptions* opts)
+{
+    if (state_fd < 0
+        || badOptions(opts)
+        || (opts && (opts->record || opts->replay)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
 
-            /* DO NOT REMOVE - this is absolutely necessary */
-            if (-1 == addNotify(ntf, newpath, 0))
-            {
-                free(oldpath);
-                free(newpath);
-                freeCookie(C);
-                freeChainEvent(e);
-                return -1;
-            }
+    struct stateLog* log = stateOpen(state_fd);
+    if (log == NULL)
+    {
+        return NULL;
+    }
+    Notify* ntf = newNotify(opts);
+    if (ntf == NULL
+        || -1 == readMaxQueued(&ntf->max_queued_events)
+        || -1 == readState(ntf, log, fd))
+    {
+        stateClose(log);
+        freeNotify(ntf);
+        return NULL;
+    }
+    stateClose(log);
 
-            free(oldpath);
-            free(newpath);
-            freeCookie(C);
-        }
-        else if (C)
-        {
-            /* cookie matched but the wd is no longer valid; drop it */
-            freeCookie(C);
-        }
-        else
+    int rc = 0;
+    if (ntf->shedding
+        && !(ntf->shed && (ntf->mask & SHED_EVENTS)))
+    {
+        ntf->shedding = 0;
+        remaskWatches(ntf);
+        ntf->stats.shed_active = 0;
+        rc = pushSynthetic(ntf, -1, NOTIFY_SHED_END, 0, NULL, 0);
+    }
+#ifdef RNOTIFY_TRACE
+    if (rc == 0
+        && opts && opts->trace)
+    {
+        ntf->trace = traceNew(opts->trace);
+        rc = (ntf->trace == NULL) ? -1 : 0;
+    }
+#endif
+    if (rc == 0
+        && opts && opts->threaded)
+    {
+        rc = startReader(ntf);
+        if (rc == 0
+            && ntf->resumed)
         {
-            if (-1 == addNotify(ntf, *path, 0))
-            {
-                freeChainEvent(e);
-                return -1;
-            }
+            eventfd_write(ntf->ready_fd, 1);
         }
     }
-
-    if (e->mask & IN_IGNORED && path_watch)
+    if (rc == -1)
     {
-        /* Drop any pending cookies tied to this wd before the kernel
-         * recycles it (IDR may hand the same wd back on the next
-         * inotify_add_watch). A stale cookie surviving recycle could
-         * collide on cookie value and produce a phantom rename match. */
-        dropCookiesForWd(&ntf->cookies, e->wd);
-        free(ntf->w[e->wd - 1]);
-        ntf->w[e->wd - 1] = NULL;
+        /* the caller keeps the fd, and the watches on it */
+        ntf->fd = -1;
+        freeNotify(ntf);
+        return NULL;
     }
+    return ntf;
+}
 
-    if (e->mask & IN_Q_OVERFLOW)
+/*
+ * Public API.
+ *
+ * notifyExport straight into the connected Unix socket `sock`: the
+ * state and the inotify fd go over it as SCM_RIGHTS, for notifyRecv at
+ * the other end. On success `ntf` is released and its copy of both fds
+ * closed.
+ *
+ * Returns 0, or -1 with errno set and `ntf` as it was (the reader of
+ * a threaded Notify restarted): EINVAL on NULL input, ENOTSUP for a
+ * replay, or an error from sendmsg or writing the state.
+ */
+int notifySend(Notify* ntf, int sock)
+{
+    if (ntf == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ntf->replay)
     {
+        errno = ENOTSUP;
+        return -1;
     }
 
-    if (cookie)
+    int state_fd = exportState(ntf);
+    if (state_fd == -1
+        || -1 == stateSend(sock, state_fd, ntf->fd))
     {
-        *cookie = e->cookie;
+        if (state_fd != -1)
+        {
+            int saved_errno = errno;
+            close(state_fd);
+            errno = saved_errno;
+        }
+        resumeExport(ntf);
+        return -1;
     }
-    freeChainEvent(e);
 
+    close(state_fd);
+    /* the receiver holds the inotify instance now; closing ours
+     * leaves it and its watches alone */
+    close(ntf->fd);
+    ntf->fd = -1;
+    freeNotify(ntf);
     return 0;
 }
 
+/*
+ * Public API.
+ *
+ * Receive a Notify sent with notifySend on the connected Unix socket
+ * `sock`, and resume it as notifyImport does with `opts`. Blocks until
+ * the message arrives.
+ *
+ * Returns the Notify, or NULL with errno set: ECONNRESET when the peer
+ * closed the socket without sending, EPROTO for anything other than a
+ * notifySend message, or as notifyImport. The received fds are closed
+ * on failure.
+ */
+Notify* notifyRecv(int sock, const NotifyOptions* opts)
+{
+    int state_fd = -1;
+    int fd = -1;
+    if (-1 == stateRecv(sock, &state_fd, &fd))
+    {
+        return NULL;
+    }
+
+    Notify* ntf = notifyImport(state_fd, fd, opts);
+    int saved_errno = errno;
+    close(state_fd);
+    if (ntf == NULL)
+    {
+        close(fd);
+    }
+    errno = saved_errno;
+    return ntf;
+}
+
 /*
  * Public API.
  *
@@ -1042,41 +5764,93 @@ void freeNotify(Notify* ntf)
     }
 
     int safe_errno = errno;
+
+    /* a reader notifyExport stopped is not running any more */
+    if (ntf->threaded
+        && !ntf->reader_stop)
+    {
+        stopReader(ntf);
+    }
+    freeHandoffs(ntf, ntf->ho_head);
+    freeHandoffs(ntf, ntf->resumed);
+    if (ntf->ready_fd != -1)
+    {
+        close(ntf->ready_fd);
+    }
+    if (ntf->wake_fd != -1)
+    {
+        close(ntf->wake_fd);
+    }
+
     struct inotify_event* e = NULL;
-    while (NULL != (e = pullChainEvent(ntf)))
+    while (NULL != (e = pullChainEvent(ntf, NULL, NULL)))
+    {
+        freeChainEvent(ntf, e);
+    }
+    lstRelease(&ntf->mem, ntf->queued.slots);
+    lstRelease(&ntf->mem, ntf->stat_batch);
+    lstRelease(&ntf->mem, ntf->dirty_set);
+    for (int i = 0; i < STAT_DIRS; i++)
+    {
+        if (ntf->stat_dirs[i].fd != -1)
+        {
+            close(ntf->stat_dirs[i].fd);
+        }
+    }
+    statRingClose(ntf->stat_ring);
+    hotFree(ntf->hot);
+    journalClose(ntf->journal);
+    while (ntf->spare != NULL)
     {
-        freeChainEvent(e);
+        struct chainEvent* next = ntf->spare->next;
+        lstRelease(&ntf->mem, ntf->spare);
+        ntf->spare = next;
     }
 
     struct Cookie* c = ntf->cookies;
     while (c != NULL)
     {
         struct Cookie* next = c->next;
-        freeCookie(c);
+        freeCookie(&ntf->mem, c);
         c = next;
     }
     ntf->cookies = NULL;
 
-    unsigned long i = 0;
-    for (i = 0; i < ntf->size_w; i++)
+    while (ntf->moves != NULL)
+    {
+        struct moveWait* next = ntf->moves->next;
+        freeMove(&ntf->mem, ntf->moves);
+        ntf->moves = next;
+    }
+
+    for (size_t i = 0; ntf->fd != -1 && i < ntf->w.cap; i++)
     {
-        if (ntf->w[i] != NULL)
+        if (ntf->w.slots[i] != NULL)
         {
-            free(ntf->w[i]);
+            inotify_rm_watch(ntf->fd, ntf->w.slots[i]->wd);
         }
-        inotify_rm_watch(ntf->fd, i + 1);
     }
+    freeWatches(ntf);
 
-    close(ntf->fd);
+    if (ntf->fd != -1)
+    {
+        close(ntf->fd);
+    }
+    replayClose(ntf->record);
+    replayClose(ntf->replay);
 
     if (ntf->exclude)
     {
         regfree(ntf->exclude);
-        free(ntf->exclude);
+        lstRelease(&ntf->mem, ntf->exclude);
     }
+    lstRelease(&ntf->mem, ntf->exclude_src);
 
-    free(ntf->w);
-    free(ntf);
+#ifdef RNOTIFY_TRACE
+    traceFree(ntf->trace);
+#endif
+    lstAllocator mem = ntf->mem;
+    lstRelease(&mem, ntf);
     errno = safe_errno;
 
     return;
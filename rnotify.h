@@ -5,18 +5,300 @@
 #ifndef LIBRNOTIFY_RNOTIFY_H_
 #define LIBRNOTIFY_RNOTIFY_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/inotify.h>
 
 typedef struct _rnotify Notify;
+typedef struct _notifyPool NotifyPool;
+typedef struct _notifyJournal NotifyJournal;
+typedef struct _notifyClient NotifyClient;
+
+/*
+ * Event handler for the dispatch APIs. `path` is borrowed: it is only
+ * valid for the duration of the call.
+ */
+typedef void (*NotifyHandler)(const char* path, uint32_t mask, uint32_t cookie, void* arg);
+
+/*
+ * Recursion policy for NotifyOptions.recurse, asked before a directory
+ * below the root is watched: `path` is the directory, `depth` how many
+ * levels below the root it is (1 for the root's subdirectories).
+ * Returns a NOTIFY_RECURSE_* verdict; any other value counts as
+ * NOTIFY_RECURSE_ACCEPT. The verdict is remembered for as long as the
+ * directory stays where it is, so the policy is asked once per
+ * directory, not once per event in it. Called on the thread running
+ * the engine, which must not be re-entered from it.
+ */
+typedef int (*NotifyRecurse)(const char* path, int depth, void* arg);
+
+#define NOTIFY_RECURSE_ACCEPT  0   /* watch it and go on below it */
+#define NOTIFY_RECURSE_SKIP    1   /* leave it and everything below it unwatched */
+#define NOTIFY_RECURSE_SHALLOW 2   /* watch it, but none of its subdirectories */
+
+/* Registrations notifyOn accepts per Notify. */
+#define NOTIFY_MAX_HANDLERS 64
+
+/*
+ * Marker bits the library ORs into the delivered mask. They use bits
+ * the kernel never sets in an inotify event mask; marker events carry
+ * an empty path.
+ *
+ * NOTIFY_RESCAN_BEGIN accompanies IN_Q_OVERFLOW: the library is
+ * re-reading the directories that changed while events were lost and
+ * queues the difference as synthetic events. NOTIFY_RESCAN_END
+ * follows the last of them; from there on the stream is consistent
+ * again.
+ */
+#define NOTIFY_RESCAN_BEGIN 0x00010000
+#define NOTIFY_RESCAN_END   0x00020000
+
+/*
+ * NOTIFY_SCAN_DONE is delivered once the tree that existed at init
+ * time has been fully watched and, depending on the scan mode, every
+ * synthetic event for it has been delivered before the marker.
+ */
+#define NOTIFY_SCAN_DONE    0x00040000
+
+/*
+ * NOTIFY_EVENTS_DROPPED is queued where the NOTIFY_QUEUE_DROP policy
+ * first discards an event; events may be missing from there until
+ * the marker is delivered.
+ */
+#define NOTIFY_EVENTS_DROPPED 0x00080000
+
+/*
+ * NOTIFY_SHED_BEGIN and NOTIFY_SHED_END bracket a load-shedding
+ * window (NotifyOptions.shed): in between the watches do not report
+ * IN_ACCESS, IN_OPEN or IN_CLOSE_NOWRITE.
+ */
+#define NOTIFY_SHED_BEGIN   0x00100000
+#define NOTIFY_SHED_END     0x00200000
+
+/*
+ * NOTIFY_RENAME marks a move paired by NotifyOptions.rename_window:
+ * one IN_MOVED_TO | NOTIFY_RENAME event (IN_ISDIR for a directory)
+ * whose path is the new one; notifyRenameSource gives the old one.
+ */
+#define NOTIFY_RENAME       0x00400000
+
+/* Where an event came from, see NotifyEventInfo.origin. */
+#define NOTIFY_ORIGIN_KERNEL 0   /* read from the inotify fd */
+#define NOTIFY_ORIGIN_CRAWL  1   /* found reading a directory: initial scan or new directory */
+#define NOTIFY_ORIGIN_RESCAN 2   /* the repair after IN_Q_OVERFLOW */
+#define NOTIFY_ORIGIN_MARKER 3   /* a NOTIFY_* marker */
+
+/* Metadata lookups, see NotifyOptions.stat. */
+#define NOTIFY_STAT_OFF   0
+#define NOTIFY_STAT_SYNC  1   /* one statx per event */
+#define NOTIFY_STAT_URING 2   /* statx through an io_uring, one submission per read; SYNC without io_uring */
+
+/*
+ * The metadata of an event's entry with NotifyOptions.stat, from a
+ * statx made once the event was read (lstat, never following a
+ * symlink), or from the lstat the crawl already made for the events it
+ * makes up. The fields are only set when `err` is 0.
+ */
+typedef struct
+{
+    int err;            /* 0; the lookup's errno (ENOENT: gone since); ENODATA: none made */
+    uint32_t mode;      /* st_mode: type and permissions */
+    uint64_t size;
+    uint64_t ino;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+} NotifyStat;
+
+/*
+ * What waitNotifyInfo reports about an event besides path, mask and
+ * cookie.
+ */
+typedef struct
+{
+    uint64_t seq;       /* from 1, per Notify, in the order events were queued; see waitNotifyInfo */
+    uint64_t time_ns;   /* CLOCK_MONOTONIC when its kernel batch was read (or it was made) */
+    uint64_t dir_ino;   /* inode of the watched directory it is in; 0 without one */
+    int wd;             /* that directory's watch descriptor; -1 without one */
+    int origin;         /* NOTIFY_ORIGIN_* */
+    NotifyStat stat;    /* NotifyOptions.stat; err ENODATA without it */
+} NotifyEventInfo;
+
+/*
+ * One changed directory from notifyTakeDirty. `mask` ORs the events
+ * seen in it since the last take: on its entries (IN_ISDIR when one of
+ * them was a directory) and on the directory itself.
+ */
+typedef struct
+{
+    const char* path;
+    uint32_t mask;
+} NotifyDirty;
+
+/* Event classes of the activity tracker, see notifyHotPaths. */
+#define NOTIFY_HOT_CHANGE  0   /* IN_MODIFY, IN_ATTRIB, IN_CLOSE_WRITE */
+#define NOTIFY_HOT_ACCESS  1   /* IN_ACCESS, IN_OPEN, IN_CLOSE_NOWRITE */
+#define NOTIFY_HOT_NAMES   2   /* creates, deletes and moves */
+#define NOTIFY_HOT_CLASSES 3
+
+/* Largest NotifyOptions.hot. */
+#define NOTIFY_HOT_MAX 256
+
+/* One path from notifyHotPaths and its estimated event count. */
+typedef struct
+{
+    const char* path;
+    uint64_t count;
+} NotifyHot;
+
+/* Where notifyJournalOpen starts reading, besides a saved offset. */
+#define NOTIFY_JOURNAL_OLDEST UINT64_MAX         /* the oldest event still in the journal */
+#define NOTIFY_JOURNAL_NEWEST (UINT64_MAX - 1)   /* the next event appended */
+
+/* Initial scan modes, see NotifyOptions.scan. */
+#define NOTIFY_SCAN_BACKGROUND 0   /* crawl as the consumer drains events */
+#define NOTIFY_SCAN_FULL       1   /* watch everything before initNotify returns */
+#define NOTIFY_SCAN_WATCHES    2   /* like FULL, without synthetic events */
+
+/*
+ * What happens when the library's own event queue reaches
+ * NotifyOptions.queue_events / queue_bytes. Events the recursion
+ * depends on (directory create, move and delete, IN_IGNORED,
+ * IN_MOVE_SELF, IN_DELETE_SELF, overflow and markers) are queued
+ * whatever the policy.
+ */
+#define NOTIFY_QUEUE_BLOCK    0   /* stop reading the fd until the queue drains */
+#define NOTIFY_QUEUE_COALESCE 1   /* fold content events into the path's queued event, else block */
+#define NOTIFY_QUEUE_DROP     2   /* drop other events, see NOTIFY_EVENTS_DROPPED */
+
+/*
+ * Memory hooks for NotifyOptions.allocator. `alloc` and `realloc`
+ * return memory aligned as malloc's, or NULL on failure; `free` is
+ * never passed NULL; `ud` is handed to each. Set all three or none. In threaded mode, and with a
+ * NotifyPool, memory allocated on one thread is freed on another.
+ */
+typedef struct
+{
+    void* (*alloc)(void* ud, size_t size);
+    void* (*realloc)(void* ud, void* ptr, size_t size);
+    void (*free)(void* ud, void* ptr);
+    void* ud;
+} NotifyAllocator;
+
+/*
+ * Optional settings for initNotifyOpts. Zero-initialise and set only
+ * the fields you need; zero always means the initNotify default.
+ */
+typedef struct
+{
+    int scan;           /* NOTIFY_SCAN_* */
+    int threaded;       /* non-zero: drain the fd on a library-owned thread */
+    int external_read;  /* non-zero: the caller reads notifyFd(), see notifyFeed */
+    unsigned int trace; /* spans to keep for notifyTraceDump (RNOTIFY_TRACE builds) */
+    const char* record; /* capture file to write, see initNotifyOpts */
+    const char* replay; /* capture file to play back instead of the kernel */
+    unsigned long queue_events; /* queued events allowed, 0: unbounded */
+    unsigned long queue_bytes;  /* queued bytes allowed, 0: unbounded */
+    int queue_policy;           /* NOTIFY_QUEUE_* */
+    int priority;       /* non-zero: structural events first, access/open last */
+    int shed;           /* kernel queue fill (percent) that starts load shedding, 0: never */
+    const NotifyAllocator* allocator; /* copied; NULL: malloc/realloc/free */
+    unsigned int event_pool;          /* event records kept for reuse, 0: none */
+    int rename_window;  /* ms an IN_MOVED_FROM waits for its IN_MOVED_TO, see NOTIFY_RENAME; 0: off */
+    int stat;           /* NOTIFY_STAT_*: look up each event's entry for NotifyEventInfo.stat */
+    int dirty;          /* non-zero: fold events into a set of changed directories, see notifyTakeDirty */
+    unsigned int hot;   /* paths the activity tracker keeps per class, see notifyHotPaths; 0: off */
+    int hot_halflife;   /* ms after which the tracker's counts halve; 0: only by notifyHotDecay */
+    const char* journal;        /* file to append delivered events to, see notifyJournalOpen */
+    unsigned long journal_size; /* bytes of events the journal keeps, 0: 1 MiB */
+    int max_depth;      /* levels of directories watched below the root, 0: no limit */
+    int same_dev;       /* non-zero: do not watch directories on another st_dev than the root */
+    NotifyRecurse recurse;      /* asked before each directory below the root is watched, NULL: watch all */
+    void* recurse_arg;          /* passed to `recurse` */
+} NotifyOptions;
+
+/*
+ * Counters returned by notifyStats. The gauges (queue_depth, watches,
+ * cookies_pending, queue_bytes, shed_active, dirty_dirs) are current values,
+ * everything else counts up from initNotify. Event counts are taken
+ * before the exclude filter.
+ */
+typedef struct
+{
+    unsigned long bytes_read;        /* read from the inotify fd (or fed) */
+    unsigned long events_read;       /* kernel events parsed */
+    unsigned long events_synthetic;  /* made by the library: scan, rescan, markers */
+    unsigned long events_excluded;   /* dropped by the exclude regex */
+    unsigned long queue_depth;       /* events queued inside the library */
+    unsigned long queue_peak;
+    unsigned long watches;           /* directories watched */
+    unsigned long watches_added;
+    unsigned long watches_retired;
+    unsigned long cookies_pending;   /* directory moves waiting for their IN_MOVED_TO */
+    unsigned long renames;           /* directory renames applied to the watch table */
+    unsigned long overflows;         /* IN_Q_OVERFLOW from the kernel */
+    unsigned long alloc_failures;    /* engine calls that failed with ENOMEM */
+    unsigned long events_dropped;    /* discarded by NOTIFY_QUEUE_DROP */
+    unsigned long events_coalesced;  /* folded by NOTIFY_QUEUE_COALESCE */
+    unsigned long queue_bytes;       /* memory held by queue_depth events */
+    unsigned long shed_windows;      /* load-shedding windows entered */
+    unsigned long shed_active;       /* 1 while load shedding */
+    unsigned long moves_paired;      /* rename_window: delivered as NOTIFY_RENAME */
+    unsigned long moves_unpaired;    /* rename_window: delivered as IN_DELETE or IN_CREATE */
+    unsigned long stat_lookups;      /* NotifyOptions.stat: statx calls made */
+    unsigned long stat_uring;        /* of which through io_uring */
+    unsigned long stat_crawl;        /* NotifyOptions.stat: taken from the crawl's lstat instead */
+    unsigned long events_folded;     /* NotifyOptions.dirty: folded into a directory's mask */
+    unsigned long dirty_dirs;        /* NotifyOptions.dirty: directories waiting for notifyTakeDirty */
+    unsigned long journal_events;    /* NotifyOptions.journal: events appended */
+    unsigned long journal_evicted;   /* NotifyOptions.journal: overwritten to make room */
+    unsigned long dirs_skipped;      /* left unwatched by the recursion policy (max_depth, same_dev, recurse) */
+} NotifyStats;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
     Notify* initNotify(const char* path, const uint32_t mask, const char* exclude);
+    Notify* initNotifyOpts(const char* path, const uint32_t mask, const char* exclude, const NotifyOptions* opts);
     int     waitNotify(Notify* ntf, char** const path, uint32_t* mask, const int timeout, uint32_t* cookie);
+    int     waitNotifyInfo(Notify* ntf, char** const path, uint32_t* mask, const int timeout, uint32_t* cookie, NotifyEventInfo* info);
     int     notifyFd(const Notify* ntf);
+    int     notifyTimeout(const Notify* ntf);
+    int     notifyScanProgress(const Notify* ntf, unsigned long* dirs, unsigned long* entries);
+    int     notifyStats(const Notify* ntf, NotifyStats* stats);
+    int     notifyTraceDump(const Notify* ntf, int fd);
     void    freeNotify(Notify* ntf);
+    void    notifyFree(const Notify* ntf, void* ptr);
+    const char* notifyRenameSource(const char* path, uint32_t mask);
+
+    int     notifyExport(Notify* ntf);
+    Notify* notifyImport(int state_fd, int fd, const NotifyOptions* opts);
+    int     notifySend(Notify* ntf, int sock);
+    Notify* notifyRecv(int sock, const NotifyOptions* opts);
+
+    int     notifyFeed(Notify* ntf, const void* buf, size_t len);
+    int     notifyOn(Notify* ntf, uint32_t mask, NotifyHandler fn, void* arg);
+    int     notifyDispatch(Notify* ntf, int max_events, int timeout);
+    const NotifyEventInfo* notifyEventInfo(const Notify* ntf);
+    long    notifyTakeDirty(Notify* ntf, NotifyDirty** dirs, int timeout);
+    long    notifyHotPaths(Notify* ntf, int cls, NotifyHot** hot);
+    int     notifyHotDecay(Notify* ntf, unsigned int shift);
+
+    NotifyJournal* notifyJournalOpen(const char* file, uint64_t offset);
+    int            notifyJournalRead(NotifyJournal* j, const char** path, uint32_t* mask, int timeout, uint32_t* cookie, NotifyEventInfo* info);
+    uint64_t       notifyJournalOffset(const NotifyJournal* j);
+    void           notifyJournalClose(NotifyJournal* j);
+
+    NotifyClient* notifyConnect(const char* sock, const char* prefix, uint32_t mask, const char* filter);
+    int           notifyClientWait(NotifyClient* c, char** const path, uint32_t* mask, int timeout, uint32_t* cookie);
+    int           notifyClientFd(const NotifyClient* c);
+    void          notifyClientClose(NotifyClient* c);
+
+    NotifyPool* initNotifyPool(Notify* ntf, int threads, NotifyHandler handler, void* arg);
+    long        runNotifyPool(NotifyPool* pool, int timeout);
+    void        freeNotifyPool(NotifyPool* pool);
 #ifdef __cplusplus
 }
 #endif
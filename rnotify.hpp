@@ -0,0 +1,513 @@
+/**
+  * https://github.com/zmushko/librnotify
+  * use it as you want but keep this header (if you want)
+  */
+#ifndef LIBRNOTIFY_RNOTIFY_HPP_
+#define LIBRNOTIFY_RNOTIFY_HPP_
+
+/*
+ * C++20 interface to librnotify. Header only, over the C API in
+ * rnotify.h:
+ *
+ *   rnotify::Watcher  move-only owner of a Notify;
+ *   rnotify::Event    one event, its path a std::string_view borrowed
+ *                     from the library (no copy);
+ *   rnotify::Batch    the events taken by one Watcher::take call, as a
+ *                     contiguous range; it owns their paths;
+ *   Watcher::next(ex) an awaitable that suspends until notifyFd() is
+ *                     readable, in an executor the caller supplies.
+ *
+ * Errors are thrown as std::system_error carrying the errno of the C
+ * call. A std::pmr::memory_resource passed to the Watcher backs every
+ * allocation the library makes (NotifyOptions.allocator), returned
+ * paths included; one passed to take() holds the Batch's event array.
+ *
+ *     rnotify::Watcher w("/srv/data", IN_CREATE | IN_MOVED_TO);
+ *     for (;;)
+ *     {
+ *         for (const rnotify::Event& ev : w.take(64, -1))
+ *         {
+ *             use(ev.path, ev.mask);
+ *         }
+ *     }
+ */
+
+#if __cplusplus < 202002L
+#error "rnotify.hpp needs C++20"
+#endif
+
+#include <cerrno>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "rnotify.h"
+
+namespace rnotify
+{
+
+/*
+ * One delivered event. `path` is empty for markers; `from` is the old
+ * path of a NOTIFY_RENAME event (NotifyOptions.rename_window), empty
+ * otherwise; `info` is what waitNotifyInfo reports.
+ */
+struct Event
+{
+    std::string_view path;
+    uint32_t mask = 0;
+    uint32_t cookie = 0;
+    std::string_view from;
+    NotifyEventInfo info{};
+
+    static Event make(const char* path, uint32_t mask, uint32_t cookie, const NotifyEventInfo& info) noexcept
+    {
+        const char* from = notifyRenameSource(path, mask);
+        return Event{ std::string_view(path), mask, cookie,
+                      from ? std::string_view(from) : std::string_view(), info };
+    }
+
+    bool has(uint32_t bits) const noexcept
+    {
+        return (mask & bits) != 0;
+    }
+};
+
+namespace detail
+{
+
+[[noreturn]] inline void fail(const char* what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+/*
+ * NotifyAllocator hooks over a std::pmr::memory_resource (the `ud`).
+ * deallocate needs the size back, so each block starts with it.
+ */
+struct alignas(std::max_align_t) BlockHead
+{
+    std::size_t size;
+};
+
+inline void* pmrAlloc(void* ud, std::size_t size) noexcept
+{
+    try
+    {
+        auto* mr = static_cast<std::pmr::memory_resource*>(ud);
+        auto* h = static_cast<BlockHead*>(mr->allocate(sizeof(BlockHead) + size, alignof(BlockHead)));
+        h->size = size;
+        return h + 1;
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+inline void pmrFree(void* ud, void* ptr) noexcept
+{
+    auto* mr = static_cast<std::pmr::memory_resource*>(ud);
+    BlockHead* h = static_cast<BlockHead*>(ptr) - 1;
+    mr->deallocate(h, sizeof(BlockHead) + h->size, alignof(BlockHead));
+}
+
+inline void* pmrRealloc(void* ud, void* ptr, std::size_t size) noexcept
+{
+    void* p = pmrAlloc(ud, size);
+    if (p != nullptr && ptr != nullptr)
+    {
+        std::size_t old = (static_cast<BlockHead*>(ptr) - 1)->size;
+        std::memcpy(p, ptr, old < size ? old : size);
+        pmrFree(ud, ptr);
+    }
+    return p;
+}
+
+/*
+ * What an executor is handed to call once the fd is readable: a plain
+ * copyable callable, so executors need no knowledge of the awaitable.
+ */
+struct ReadyCallback
+{
+    void* self;
+    void (*fn)(void*);
+
+    void operator()() const
+    {
+        fn(self);
+    }
+};
+
+} // namespace detail
+
+/*
+ * Anything that can call `cb()` once `fd` is readable or `timeout` ms
+ * have passed (-1: no limit), e.g. on an epoll or io_uring loop. It
+ * may call it from inside waitReadable when the fd is readable
+ * already. A spurious call is fine: the awaitable re-arms itself.
+ */
+template <class E>
+concept Executor = requires(E& ex, int fd, int timeout, detail::ReadyCallback cb)
+{
+    ex.waitReadable(fd, timeout, cb);
+};
+
+/*
+ * Events taken in one go. Owns their paths, released through the
+ * Notify's allocator when the Batch goes away; the Watcher must
+ * outlive it.
+ */
+class Batch
+{
+public:
+    using value_type = Event;
+    using iterator = const Event*;
+    using const_iterator = const Event*;
+
+    Batch(Notify* ntf, std::pmr::memory_resource* mr)
+        : ntf_(ntf), events_(mr)
+    {
+    }
+
+    Batch(Batch&& other) noexcept
+        : ntf_(other.ntf_), events_(std::move(other.events_))
+    {
+        other.events_.clear();
+    }
+
+    Batch& operator=(Batch&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            ntf_ = other.ntf_;
+            events_ = std::move(other.events_);
+            other.events_.clear();
+        }
+        return *this;
+    }
+
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+
+    ~Batch()
+    {
+        release();
+    }
+
+    const Event* begin() const noexcept { return events_.data(); }
+    const Event* end() const noexcept { return events_.data() + events_.size(); }
+    std::size_t size() const noexcept { return events_.size(); }
+    bool empty() const noexcept { return events_.empty(); }
+    const Event& operator[](std::size_t i) const noexcept { return events_[i]; }
+
+private:
+    friend class Watcher;
+
+    /* Takes ownership of `path`, also when it throws. */
+    void push(char* path, uint32_t mask, uint32_t cookie, const NotifyEventInfo& info)
+    {
+        try
+        {
+            events_.push_back(Event::make(path, mask, cookie, info));
+        }
+        catch (...)
+        {
+            notifyFree(ntf_, path);
+            throw;
+        }
+    }
+
+    void release() noexcept
+    {
+        for (const Event& ev : events_)
+        {
+            /* the view starts at the pointer waitNotify returned */
+            notifyFree(ntf_, const_cast<char*>(ev.path.data()));
+        }
+        events_.clear();
+    }
+
+    Notify* ntf_;
+    std::pmr::vector<Event> events_;
+};
+
+template <Executor E>
+class NextEvent;
+
+/*
+ * Move-only owner of a Notify. Not thread-safe: one thread (or one
+ * executor) at a time, as with the C API.
+ */
+class Watcher
+{
+public:
+    /*
+     * initNotifyOpts(path, mask, exclude, &opts). With `mr` every
+     * allocation of the library comes from it (it overrides
+     * opts.allocator) and it must outlive the Watcher; in threaded mode
+     * it must be thread-safe, e.g. std::pmr::synchronized_pool_resource.
+     */
+    explicit Watcher(const std::string& path, uint32_t mask = IN_ALL_EVENTS,
+                     const char* exclude = nullptr, NotifyOptions opts = {},
+                     std::pmr::memory_resource* mr = nullptr)
+    {
+        NotifyAllocator hooks = { detail::pmrAlloc, detail::pmrRealloc, detail::pmrFree, mr };
+        if (mr != nullptr)
+        {
+            opts.allocator = &hooks;
+        }
+        ntf_ = initNotifyOpts(path.c_str(), mask, exclude, &opts);
+        if (ntf_ == nullptr)
+        {
+            detail::fail("initNotifyOpts");
+        }
+    }
+
+    Watcher(Watcher&& other) noexcept
+        : ntf_(std::exchange(other.ntf_, nullptr)),
+          last_(std::exchange(other.last_, nullptr)),
+          pending_(std::exchange(other.pending_, 0))
+    {
+    }
+
+    Watcher& operator=(Watcher&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            ntf_ = std::exchange(other.ntf_, nullptr);
+            last_ = std::exchange(other.last_, nullptr);
+            pending_ = std::exchange(other.pending_, 0);
+        }
+        return *this;
+    }
+
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    ~Watcher()
+    {
+        close();
+    }
+
+    Notify* nativeHandle() const noexcept
+    {
+        return ntf_;
+    }
+
+    /* notifyFd: what to poll for readiness. */
+    int fd() const
+    {
+        int fd = notifyFd(ntf_);
+        if (fd == -1)
+        {
+            detail::fail("notifyFd");
+        }
+        return fd;
+    }
+
+    /* notifyTimeout: how long to wait on fd() at most, -1: no limit. */
+    int timeout() const noexcept
+    {
+        return notifyTimeout(ntf_);
+    }
+
+    NotifyStats stats() const
+    {
+        NotifyStats st;
+        if (notifyStats(ntf_, &st) == -1)
+        {
+            detail::fail("notifyStats");
+        }
+        return st;
+    }
+
+    /*
+     * Wait up to `timeout` ms (-1: for ever, 0: poll) for one event.
+     * Its path is valid until the next call on this Watcher.
+     */
+    std::optional<Event> tryNext(int timeout = -1)
+    {
+        notifyFree(ntf_, std::exchange(last_, nullptr));
+        throwPending();
+        uint32_t mask = 0;
+        uint32_t cookie = 0;
+        NotifyEventInfo info{};
+        if (waitNotifyInfo(ntf_, &last_, &mask, timeout, &cookie, &info) == -1)
+        {
+            detail::fail("waitNotify");
+        }
+        if (last_ == nullptr)
+        {
+            return std::nullopt;
+        }
+        return Event::make(last_, mask, cookie, info);
+    }
+
+    /*
+     * Up to `max` events: waits up to `timeout` ms for the first, then
+     * takes what is ready without blocking. An error after the first
+     * event ends the batch and is thrown by the next call instead, so
+     * no event is lost. Event storage comes from `mr`, e.g. a
+     * std::pmr::monotonic_buffer_resource reset between batches.
+     */
+    Batch take(std::size_t max, int timeout = 0,
+               std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+    {
+        throwPending();
+        Batch batch(ntf_, mr);
+        batch.events_.reserve(max < 256 ? max : 256);
+        while (batch.size() < max)
+        {
+            char* path = nullptr;
+            uint32_t mask = 0;
+            uint32_t cookie = 0;
+            NotifyEventInfo info{};
+            if (waitNotifyInfo(ntf_, &path, &mask, batch.empty() ? timeout : 0, &cookie, &info) == -1)
+            {
+                if (batch.empty())
+                {
+                    detail::fail("waitNotify");
+                }
+                pending_ = errno;
+                break;
+            }
+            if (path == nullptr)
+            {
+                break;
+            }
+            batch.push(path, mask, cookie, info);
+        }
+        return batch;
+    }
+
+    /*
+     *     rnotify::Event ev = co_await w.next(loop);
+     *
+     * Completes at once when an event is ready; otherwise hands the
+     * executor a callback for notifyFd() readiness, bounded by
+     * notifyTimeout() while a move is held, and resumes the coroutine
+     * from it. The path is valid until the next call on this
+     * Watcher. Not for replay, which has no fd.
+     */
+    template <Executor E>
+    NextEvent<E> next(E& ex)
+    {
+        return NextEvent<E>(*this, ex);
+    }
+
+private:
+    void throwPending()
+    {
+        if (pending_)
+        {
+            errno = std::exchange(pending_, 0);
+            detail::fail("waitNotify");
+        }
+    }
+
+    void close() noexcept
+    {
+        if (ntf_ != nullptr)
+        {
+            notifyFree(ntf_, std::exchange(last_, nullptr));
+            freeNotify(std::exchange(ntf_, nullptr));
+        }
+    }
+
+    Notify* ntf_ = nullptr;
+    char* last_ = nullptr;
+    int pending_ = 0;
+};
+
+/* The awaitable returned by Watcher::next. */
+template <Executor E>
+class NextEvent
+{
+public:
+    NextEvent(Watcher& w, E& ex)
+        : w_(w), ex_(ex)
+    {
+    }
+
+    bool await_ready()
+    {
+        return poll();
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle_ = h;
+        arm();
+    }
+
+    Event await_resume()
+    {
+        if (error_)
+        {
+            std::rethrow_exception(error_);
+        }
+        return *event_;
+    }
+
+private:
+    /* Whether the coroutine can go on: an event, or an error to throw. */
+    bool poll() noexcept
+    {
+        try
+        {
+            event_ = w_.tryNext(0);
+            return event_.has_value();
+        }
+        catch (...)
+        {
+            error_ = std::current_exception();
+            return true;
+        }
+    }
+
+    void arm()
+    {
+        ex_.waitReadable(w_.fd(), w_.timeout(), detail::ReadyCallback{ this, &NextEvent::ready });
+    }
+
+    static void ready(void* self)
+    {
+        auto* a = static_cast<NextEvent*>(self);
+        if (a->poll())
+        {
+            a->handle_.resume();
+            return;
+        }
+        try
+        {
+            a->arm();
+        }
+        catch (...)
+        {
+            a->error_ = std::current_exception();
+            a->handle_.resume();
+        }
+    }
+
+    Watcher& w_;
+    E& ex_;
+    std::coroutine_handle<> handle_;
+    std::optional<Event> event_;
+    std::exception_ptr error_;
+};
+
+} // namespace rnotify
+
+#endif // LIBRNOTIFY_RNOTIFY_HPP_
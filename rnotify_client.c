@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rnotify.h"
+#include "rnotify_daemon.h"
+
+/*
+ * A subscription to rnotifyd. `buf[pos..len)` is what was received
+ * and not parsed yet; while inside a DAEMON_EVENTS frame, `frame_end`
+ * is where its payload ends (0 between frames).
+ */
+struct _notifyClient
+{
+    int fd;
+    char* buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    size_t frame_end;
+};
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Write all of buf, or -1 with errno set. */
+static int sendAll(int fd, const char* buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Receive what the daemon sent, waiting up to `timeout` ms for it.
+ * Returns 1 when bytes came, 0 on timeout, -1 with errno set:
+ * ECONNRESET when the daemon went away, ENOMEM.
+ */
+static int clientFill(NotifyClient* c, int timeout)
+{
+    if (c->pos == c->len)
+    {
+        c->pos = c->len = 0;
+        c->frame_end = 0;
+    }
+    if (c->len == c->cap)
+    {
+        if (c->pos > 0)
+        {
+            memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+            c->len -= c->pos;
+            if (c->frame_end)
+            {
+                c->frame_end -= c->pos;
+            }
+            c->pos = 0;
+        }
+        else
+        {
+            size_t cap = c->cap ? c->cap * 2 : 65536;
+            char* buf = (char*)realloc(c->buf, cap);
+            if (buf == NULL)
+            {
+                return -1;
+            }
+            c->buf = buf;
+            c->cap = cap;
+        }
+    }
+
+    struct pollfd p = { c->fd, POLLIN, 0 };
+    int rc = poll(&p, 1, timeout);
+    if (rc <= 0)
+    {
+        return rc;
+    }
+    ssize_t n = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+    if (n == -1)
+    {
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+    if (n == 0)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+    c->len += (size_t)n;
+    return 1;
+}
+
+/*
+ * Copy the header of the frame at c->pos to `f` (records are not
+ * aligned in the buffer). Returns 1 when all of the frame has
+ * arrived, 0 when more is needed, -1 with EPROTO when it is larger
+ * than DAEMON_FRAME_MAX.
+ */
+static int clientFrame(const NotifyClient* c, struct daemonFrame* f)
+{
+    if (c->len - c->pos < sizeof(*f))
+    {
+        return 0;
+    }
+    memcpy(f, c->buf + c->pos, sizeof(*f));
+    if (f->len > DAEMON_FRAME_MAX)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return c->len - c->pos - sizeof(*f) >= f->len;
+}
+
+/*
+ * Public API.
+ *
+ * Connect to the rnotifyd listening on the Unix socket `sock` and
+ * subscribe to the events under `prefix` (the path itself and every
+ * path below it; NULL or "": all of the daemon's tree) with a bit of
+ * `mask`, whose path matches the POSIX extended regex `filter` (NULL:
+ * any). Events without a path (IN_Q_OVERFLOW, the library's markers)
+ * reach every subscriber.
+ *
+ * Returns NULL with errno set on failure: EINVAL for a NULL or too
+ * long socket path, or a filter the daemon could not compile; any
+ * errno from socket, connect or the exchange with the daemon
+ * (ECONNRESET when it hung up, EPROTO when it did not answer as
+ * rnotifyd).
+ */
+NotifyClient* notifyConnect(const char* sock, const char* prefix, uint32_t mask, const char* filter)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sock == NULL
+        || strlen(sock) >= sizeof(addr.sun_path))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    strcpy(addr.sun_path, sock);
+    prefix = prefix ? prefix : "";
+    filter = filter ? filter : "";
+
+    NotifyClient* c = (NotifyClient*)calloc(1, sizeof(NotifyClient));
+    if (c == NULL)
+    {
+        return NULL;
+    }
+    c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd == -1)
+    {
+        free(c);
+        return NULL;
+    }
+
+    struct daemonSub sub = { mask, (uint32_t)strlen(prefix), (uint32_t)strlen(filter) };
+    struct daemonFrame f = { (uint32_t)(sizeof(sub) + sub.prefix_len + sub.filter_len), DAEMON_SUBSCRIBE };
+    int err = 0;
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || sendAll(c->fd, (const char*)&f, sizeof(f)) == -1
+        || sendAll(c->fd, (const char*)&sub, sizeof(sub)) == -1
+        || sendAll(c->fd, prefix, sub.prefix_len) == -1
+        || sendAll(c->fd, filter, sub.filter_len) == -1)
+    {
+        err = errno;
+    }
+
+    struct daemonFrame ack;
+    int got = 0;
+    while (!err
+           && 0 == (got = clientFrame(c, &ack)))
+    {
+        if (clientFill(c, -1) == -1)
+        {
+            err = errno;
+        }
+    }
+    if (!err
+        && (got == -1 || ack.type != DAEMON_ACK || ack.len != sizeof(int32_t)))
+    {
+        err = EPROTO;
+    }
+    if (!err)
+    {
+        int32_t rc = 0;
+        memcpy(&rc, c->buf + c->pos + sizeof(ack), sizeof(rc));
+        err = rc;
+        c->pos += sizeof(ack) + ack.len;
+    }
+    if (err)
+    {
+        notifyClientClose(c);
+        errno = err;
+        return NULL;
+    }
+    return c;
+}
+
+/*
+ * Public API.
+ *
+ * waitNotify for a subscription: the same `path`, `mask`, `cookie`
+ * and `timeout` conventions and return values. *path is allocated
+ * with malloc; release it with free(), and NULL when nothing was
+ * delivered. The daemon sends events in batches, so several may be
+ * delivered without touching the socket: before waiting on
+ * notifyClientFd, call this with timeout 0 until *path comes back
+ * NULL (a timeout of 0 returns 0, as an event does).
+ *
+ * Returns 0 on an event, `timeout` on timeout, -1 with errno set:
+ * EINVAL on NULL input, ECONNRESET when the daemon went away, EPROTO
+ * for a malformed frame, ENOMEM, or any errno from poll or recv.
+ */
+int notifyClientWait(NotifyClient* c, char** const path, uint32_t* mask, int timeout, uint32_t* cookie)
+{
+    if (c == NULL
+        || path == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *path = NULL;
+
+    uint64_t deadline = (timeout > 0) ? nowMs() + (uint64_t)timeout : 0;
+    for (;;)
+    {
+        if (c->frame_end)
+        {
+            struct daemonEvent ev;
+            if (c->frame_end - c->pos < sizeof(ev))
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(&ev, c->buf + c->pos, sizeof(ev));
+            if (ev.path_len > c->frame_end - c->pos - sizeof(ev))
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            char* p = (char*)malloc(ev.path_len + 1);
+            if (p == NULL)
+            {
+                return -1;
+            }
+            memcpy(p, c->buf + c->pos + sizeof(ev), ev.path_len);
+            p[ev.path_len] = '\0';
+            c->pos += sizeof(ev) + ev.path_len;
+            if (c->pos == c->frame_end)
+            {
+                c->frame_end = 0;
+            }
+            *path = p;
+            if (mask)
+            {
+                *mask = ev.mask;
+            }
+            if (cookie)
+            {
+                *cookie = ev.cookie;
+            }
+            return 0;
+        }
+
+        struct daemonFrame f;
+        int got = clientFrame(c, &f);
+        if (got == -1)
+        {
+            return -1;
+        }
+        if (got)
+        {
+            if (f.type != DAEMON_EVENTS)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            c->pos += sizeof(f);
+            c->frame_end = f.len ? c->pos + f.len : 0;
+            continue;
+        }
+
+        int wait = timeout;
+        if (timeout > 0)
+        {
+            uint64_t now = nowMs();
+            wait = (now < deadline) ? (int)(deadline - now) : 0;
+        }
+        int rc = clientFill(c, wait);
+        if (rc == -1)
+        {
+            return -1;
+        }
+        if (rc == 0
+            && wait >= 0)
+        {
+            return timeout;
+        }
+    }
+}
+
+/*
+ * Public API.
+ *
+ * The subscription's socket, readable when the daemon sent more, for
+ * the caller's own poll loop; see notifyClientWait. -1 with EINVAL
+ * for a NULL client.
+ */
+int notifyClientFd(const NotifyClient* c)
+{
+    if (c == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return c->fd;
+}
+
+/*
+ * Public API.
+ *
+ * Hang up and release a subscription. Safe to pass NULL.
+ */
+void notifyClientClose(NotifyClient* c)
+{
+    if (c == NULL)
+    {
+        return;
+    }
+    int saved_errno = errno;
+    close(c->fd);
+    free(c->buf);
+    free(c);
+    errno = saved_errno;
+}
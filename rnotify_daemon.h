@@ -0,0 +1,55 @@
+/*
+ * Internal: the wire protocol between rnotifyd (daemon/rnotifyd.c) and
+ * NotifyClient (rnotify_client.c), over a SOCK_STREAM Unix socket.
+ *
+ * Everything is a frame: a struct daemonFrame, then `len` payload
+ * bytes. Native byte order, both ends are on the same machine.
+ *
+ *     client -> daemon   DAEMON_SUBSCRIBE   struct daemonSub, prefix, filter
+ *     daemon -> client   DAEMON_ACK         int32 errno (0: subscribed)
+ *     daemon -> client   DAEMON_EVENTS      (struct daemonEvent, path)*
+ *
+ * A client sends one DAEMON_SUBSCRIBE right after connecting and gets
+ * one DAEMON_ACK; after a successful one only DAEMON_EVENTS follow.
+ * The daemon batches: one DAEMON_EVENTS frame carries every event it
+ * had for the client when it last wrote to it. An event's path bytes
+ * are NUL-terminated and, for NOTIFY_RENAME, followed by the old path,
+ * as from waitNotify; they are not padded.
+ */
+#ifndef LIBRNOTIFY_RNOTIFY_DAEMON_H_
+#define LIBRNOTIFY_RNOTIFY_DAEMON_H_
+
+#include <stdint.h>
+
+enum daemonType
+{
+    DAEMON_SUBSCRIBE = 1,
+    DAEMON_ACK,
+    DAEMON_EVENTS,
+};
+
+struct daemonFrame
+{
+    uint32_t len;
+    uint32_t type;
+};
+
+/* A subscription: `prefix_len` and `filter_len` bytes follow, no NULs. */
+struct daemonSub
+{
+    uint32_t mask;
+    uint32_t prefix_len;
+    uint32_t filter_len;
+};
+
+struct daemonEvent
+{
+    uint32_t mask;
+    uint32_t cookie;
+    uint32_t path_len;
+};
+
+/* Largest frame either side accepts. */
+#define DAEMON_FRAME_MAX (16u << 20)
+
+#endif // LIBRNOTIFY_RNOTIFY_DAEMON_H_
@@ -0,0 +1,377 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include "rnotify_hot.h"
+
+/* A path the heap keeps: its sketch estimate when last seen. */
+struct hotEntry
+{
+    uint64_t hash;
+    uint64_t count;
+    char* path;
+};
+
+/* One event class: its sketch and the min-heap of its top paths. */
+struct hotClass
+{
+    uint32_t cms[HOT_DEPTH][HOT_WIDTH];
+    struct hotEntry* heap;
+    unsigned int n;
+};
+
+/*
+ * `decayed_ms` is the CLOCK_MONOTONIC time up to which the counts have
+ * been halved; 0 halflife_ms: they never are on their own.
+ */
+struct hotTracker
+{
+    const lstAllocator* mem;
+    unsigned int k;
+    uint64_t halflife_ms;
+    uint64_t decayed_ms;
+    struct hotClass cls[NOTIFY_HOT_CLASSES];
+};
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a over path[0..len). */
+static uint64_t hashPath(const char* path, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* The class an event mask counts in, or -1 for none. */
+static int hotClassOf(uint32_t mask)
+{
+    if (mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        return NOTIFY_HOT_NAMES;
+    }
+    if (mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE))
+    {
+        return NOTIFY_HOT_CHANGE;
+    }
+    if (mask & (IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE))
+    {
+        return NOTIFY_HOT_ACCESS;
+    }
+    return -1;
+}
+
+/*
+ * Count one event for `hash` and return the new estimate. Conservative
+ * update: only the counters at the minimum go up, which is all the
+ * estimate needs and keeps the others from drifting.
+ */
+static uint64_t sketchAdd(struct hotClass* c, uint64_t hash)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    uint32_t* cell[HOT_DEPTH];
+    uint32_t min = UINT32_MAX;
+    for (uint32_t i = 0; i < HOT_DEPTH; i++)
+    {
+        cell[i] = &c->cms[i][(h1 + i * h2) & (HOT_WIDTH - 1)];
+        if (*cell[i] < min)
+        {
+            min = *cell[i];
+        }
+    }
+    if (min == UINT32_MAX)
+    {
+        return min;
+    }
+    for (int i = 0; i < HOT_DEPTH; i++)
+    {
+        if (*cell[i] == min)
+        {
+            *cell[i] = min + 1;
+        }
+    }
+    return (uint64_t)min + 1;
+}
+
+static void heapSwap(struct hotEntry* heap, unsigned int a, unsigned int b)
+{
+    struct hotEntry t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+}
+
+static void siftUp(struct hotEntry* heap, unsigned int i)
+{
+    while (i > 0
+           && heap[(i - 1) / 2].count > heap[i].count)
+    {
+        heapSwap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void siftDown(struct hotEntry* heap, unsigned int n, unsigned int i)
+{
+    for (;;)
+    {
+        unsigned int min = i;
+        unsigned int l = 2 * i + 1;
+        unsigned int r = l + 1;
+        if (l < n && heap[l].count < heap[min].count)
+        {
+            min = l;
+        }
+        if (r < n && heap[r].count < heap[min].count)
+        {
+            min = r;
+        }
+        if (min == i)
+        {
+            return;
+        }
+        heapSwap(heap, i, min);
+        i = min;
+    }
+}
+
+/*
+ * Count one event for path[0..len) in `c`, and keep the path if it is
+ * now among the top `k`. Best effort: a path that cannot be copied is
+ * only counted.
+ */
+static void hotCount(struct hotTracker* t, struct hotClass* c, const char* path, size_t len)
+{
+    uint64_t hash = hashPath(path, len);
+    uint64_t est = sketchAdd(c, hash);
+
+    for (unsigned int i = 0; i < c->n; i++)
+    {
+        struct hotEntry* e = &c->heap[i];
+        if (e->hash == hash
+            && !strncmp(e->path, path, len)
+            && e->path[len] == '\0')
+        {
+            e->count = est;
+            siftDown(c->heap, c->n, i);
+            return;
+        }
+    }
+
+    unsigned int at = c->n;
+    if (at == t->k)
+    {
+        if (est <= c->heap[0].count)
+        {
+            return;
+        }
+        at = 0;
+    }
+    char* copy = (char*)lstAlloc(t->mem, len + 1);
+    if (copy == NULL)
+    {
+        return;
+    }
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    struct hotEntry* e = &c->heap[at];
+    if (at == 0 && c->n == t->k)
+    {
+        lstRelease(t->mem, e->path);
+    }
+    e->hash = hash;
+    e->count = est;
+    e->path = copy;
+    if (at == c->n)
+    {
+        c->n++;
+        siftUp(c->heap, at);
+    }
+    else
+    {
+        siftDown(c->heap, c->n, 0);
+    }
+}
+
+/* Halve the counts for every half-life that has passed. */
+static void hotAge(struct hotTracker* t)
+{
+    if (t->halflife_ms == 0)
+    {
+        return;
+    }
+    uint64_t now = nowMs();
+    if (now - t->decayed_ms < t->halflife_ms)
+    {
+        return;
+    }
+    uint64_t periods = (now - t->decayed_ms) / t->halflife_ms;
+    hotDecay(t, (periods > 64) ? 64 : (unsigned int)periods);
+    t->decayed_ms += periods * t->halflife_ms;
+}
+
+/*
+ * A tracker keeping the top `k` paths of each class, its counts halved
+ * every `halflife_ms` (0: only by hotDecay). Returns NULL on allocation
+ * failure (errno set).
+ */
+struct hotTracker* hotNew(const lstAllocator* mem, unsigned int k, int halflife_ms)
+{
+    struct hotTracker* t = (struct hotTracker*)lstCalloc(mem, 1, sizeof(struct hotTracker));
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    t->mem = mem;
+    t->k = k;
+    t->halflife_ms = (halflife_ms > 0) ? (uint64_t)halflife_ms : 0;
+    t->decayed_ms = nowMs();
+    for (int i = 0; i < NOTIFY_HOT_CLASSES; i++)
+    {
+        t->cls[i].heap = (struct hotEntry*)lstCalloc(mem, k, sizeof(struct hotEntry));
+        if (t->cls[i].heap == NULL)
+        {
+            hotFree(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+/* Release a tracker. Safe to pass NULL. */
+void hotFree(struct hotTracker* t)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < NOTIFY_HOT_CLASSES; i++)
+    {
+        for (unsigned int j = 0; j < t->cls[i].n; j++)
+        {
+            lstRelease(t->mem, t->cls[i].heap[j].path);
+        }
+        lstRelease(t->mem, t->cls[i].heap);
+    }
+    lstRelease(t->mem, t);
+}
+
+/*
+ * Count a delivered event: once for `path` and once for the directory
+ * it is in. Markers (empty path) and events of no class are ignored.
+ */
+void hotAdd(struct hotTracker* t, const char* path, uint32_t mask)
+{
+    int cls = hotClassOf(mask);
+    if (cls == -1
+        || path[0] == '\0')
+    {
+        return;
+    }
+    hotAge(t);
+    struct hotClass* c = &t->cls[cls];
+    hotCount(t, c, path, strlen(path));
+    const char* slash = strrchr(path, '/');
+    if (slash != NULL
+        && slash != path)
+    {
+        hotCount(t, c, path, (size_t)(slash - path));
+    }
+}
+
+/*
+ * Shift every count right by `shift`. Order is kept, so the heaps
+ * stay valid.
+ */
+void hotDecay(struct hotTracker* t, unsigned int shift)
+{
+    if (shift == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < NOTIFY_HOT_CLASSES; i++)
+    {
+        struct hotClass* c = &t->cls[i];
+        for (int r = 0; r < HOT_DEPTH; r++)
+        {
+            for (int j = 0; j < HOT_WIDTH; j++)
+            {
+                c->cms[r][j] = (shift >= 32) ? 0 : c->cms[r][j] >> shift;
+            }
+        }
+        for (unsigned int j = 0; j < c->n; j++)
+        {
+            c->heap[j].count = (shift >= 64) ? 0 : c->heap[j].count >> shift;
+        }
+    }
+}
+
+static int byCount(const void* a, const void* b)
+{
+    uint64_t x = ((const NotifyHot*)a)->count;
+    uint64_t y = ((const NotifyHot*)b)->count;
+    return (x < y) - (x > y);
+}
+
+/*
+ * The kept paths of class `cls` with a count left, hottest first, as
+ * one block: the NotifyHot array followed by the paths. Returns how
+ * many, or -1 on allocation failure (errno set).
+ */
+long hotTop(struct hotTracker* t, int cls, NotifyHot** out)
+{
+    hotAge(t);
+    const struct hotClass* c = &t->cls[cls];
+    size_t n = 0;
+    size_t size = 0;
+    for (unsigned int i = 0; i < c->n; i++)
+    {
+        if (c->heap[i].count)
+        {
+            n++;
+            size += sizeof(NotifyHot) + strlen(c->heap[i].path) + 1;
+        }
+    }
+    *out = NULL;
+    if (n == 0)
+    {
+        return 0;
+    }
+    NotifyHot* hot = (NotifyHot*)lstAlloc(t->mem, size);
+    if (hot == NULL)
+    {
+        return -1;
+    }
+    size_t j = 0;
+    for (unsigned int i = 0; i < c->n; i++)
+    {
+        if (c->heap[i].count)
+        {
+            hot[j].path = c->heap[i].path;
+            hot[j].count = c->heap[i].count;
+            j++;
+        }
+    }
+    qsort(hot, n, sizeof(NotifyHot), byCount);
+    char* p = (char*)(hot + n);
+    for (j = 0; j < n; j++)
+    {
+        size_t len = strlen(hot[j].path) + 1;
+        memcpy(p, hot[j].path, len);
+        hot[j].path = p;
+        p += len;
+    }
+    *out = hot;
+    return (long)n;
+}
@@ -0,0 +1,34 @@
+/*
+ * Internal: the activity tracker behind NotifyOptions.hot.
+ *
+ * Per event class, a count-min sketch (HOT_DEPTH rows of HOT_WIDTH
+ * saturating counters, conservative update) estimates how many events
+ * each path has had, and a min-heap of the `k` paths with the highest
+ * estimates keeps their names. Memory is fixed once created: the
+ * sketches, plus at most `k` path copies per class. Counts only ever
+ * overestimate, by at most what paths sharing all their counters
+ * contributed.
+ *
+ * Not thread safe: the engine feeds it from the thread that takes
+ * events (takeEvent), and the query functions run there too.
+ */
+#ifndef LIBRNOTIFY_RNOTIFY_HOT_H_
+#define LIBRNOTIFY_RNOTIFY_HOT_H_
+
+#include <stdint.h>
+
+#include "liblst.h"
+#include "rnotify.h"
+
+#define HOT_DEPTH 4
+#define HOT_WIDTH 1024      /* a power of two */
+
+struct hotTracker;
+
+struct hotTracker* hotNew(const lstAllocator* mem, unsigned int k, int halflife_ms);
+void hotFree(struct hotTracker* t);
+void hotAdd(struct hotTracker* t, const char* path, uint32_t mask);
+void hotDecay(struct hotTracker* t, unsigned int shift);
+long hotTop(struct hotTracker* t, int cls, NotifyHot** out);
+
+#endif // LIBRNOTIFY_RNOTIFY_HOT_H_
@@ -0,0 +1,647 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "rnotify_journal.h"
+
+#define PAD8(n) (((n) + 7) & ~(uint64_t)7)
+
+/* The producer's side: the mapping, and the ring inside it. */
+struct journalWriter
+{
+    struct journalHdr* hdr;
+    char* ring;
+    uint64_t cap;
+    size_t size;
+};
+
+/*
+ * A reader: its own mapping of `file` and its cursor, a logical
+ * offset. `path` holds the last record's path bytes, handed out by
+ * notifyJournalRead.
+ */
+struct _notifyJournal
+{
+    char* file;
+    struct journalHdr* hdr;
+    const char* ring;
+    uint64_t cap;
+    size_t size;
+    uint64_t cursor;
+    char* path;
+    size_t path_cap;
+};
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Tell readers waiting on `hdr` that something changed. */
+static void journalWake(struct journalHdr* hdr)
+{
+    __atomic_add_fetch(&hdr->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST))
+    {
+        syscall(SYS_futex, &hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Map the journal `file` read-write. With `cap` non-zero only a journal
+ * of that capacity is accepted. Returns the header, or NULL with errno
+ * set: EPROTO when the file is not a journal (of that capacity).
+ */
+static struct journalHdr* journalMap(const char* file, uint64_t cap, size_t* size)
+{
+    int fd = open(file, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if ((size_t)sb.st_size < JOURNAL_HDR + JOURNAL_MIN)
+    {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    void* map = mmap(NULL, (size_t)sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        errno = saved_errno;
+        return NULL;
+    }
+    struct journalHdr* hdr = (struct journalHdr*)map;
+    if (memcmp(hdr->magic, JOURNAL_MAGIC, 8)
+        || hdr->capacity % 8
+        || JOURNAL_HDR + hdr->capacity != (uint64_t)sb.st_size
+        || (cap && hdr->capacity != cap))
+    {
+        munmap(map, (size_t)sb.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+    *size = (size_t)sb.st_size;
+    return hdr;
+}
+
+/*
+ * Write a new, empty journal of `cap` bytes whose offsets start at
+ * `start`, and move it into place as `file` in one rename, so that a
+ * reader opening `file` never sees half a header.
+ * Returns its header, or NULL with errno set.
+ */
+static struct journalHdr* journalFresh(const char* file, uint64_t cap, uint64_t start, size_t* size)
+{
+    size_t len = strlen(file) + 32;
+    char* tmp = (char*)malloc(len);
+    if (tmp == NULL)
+    {
+        return NULL;
+    }
+    snprintf(tmp, len, "%s.%ld", file, (long)getpid());
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1)
+    {
+        free(tmp);
+        return NULL;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)(JOURNAL_HDR + cap)) == 0)
+    {
+        map = mmap(NULL, JOURNAL_HDR + cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    struct journalHdr* hdr = (struct journalHdr*)map;
+    memcpy(hdr->magic, JOURNAL_MAGIC, 8);
+    hdr->capacity = cap;
+    hdr->head = start;
+    hdr->tail = start;
+    if (rename(tmp, file) == -1)
+    {
+        saved_errno = errno;
+        munmap(map, JOURNAL_HDR + cap);
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+        return NULL;
+    }
+    free(tmp);
+    *size = JOURNAL_HDR + cap;
+    return hdr;
+}
+
+/*
+ * Open `file` for appending, `size` bytes of ring (0: JOURNAL_DEFAULT;
+ * rounded up to whole pages and to at least JOURNAL_MIN). A journal of
+ * that size already there is carried on from its head; anything else
+ * is replaced by a new one, whose offsets start where the old one's
+ * ended, and the old one is marked retired.
+ * Returns NULL with errno set on failure.
+ */
+struct journalWriter* journalCreate(const char* file, unsigned long size)
+{
+    uint64_t cap = size ? ((uint64_t)size + JOURNAL_HDR - 1) / JOURNAL_HDR * JOURNAL_HDR : JOURNAL_DEFAULT;
+    if (cap < JOURNAL_MIN)
+    {
+        cap = JOURNAL_MIN;
+    }
+    struct journalWriter* jw = (struct journalWriter*)calloc(1, sizeof(struct journalWriter));
+    if (jw == NULL)
+    {
+        return NULL;
+    }
+    jw->cap = cap;
+
+    jw->hdr = journalMap(file, cap, &jw->size);
+    if (jw->hdr != NULL)
+    {
+        /* a producer that died mid-append never moved head; only a
+         * damaged file has them out of order */
+        struct journalHdr* hdr = jw->hdr;
+        if (hdr->tail > hdr->head
+            || hdr->head - hdr->tail > cap)
+        {
+            hdr->tail = hdr->head;
+        }
+        hdr->retired = 0;
+        jw->ring = (char*)hdr + JOURNAL_HDR;
+        return jw;
+    }
+    if (errno != ENOENT
+        && errno != EPROTO)
+    {
+        free(jw);
+        return NULL;
+    }
+
+    size_t old_size = 0;
+    struct journalHdr* old = journalMap(file, 0, &old_size);
+    uint64_t start = old ? PAD8(__atomic_load_n(&old->head, __ATOMIC_ACQUIRE)) : 0;
+    jw->hdr = journalFresh(file, cap, start, &jw->size);
+    if (old != NULL)
+    {
+        if (jw->hdr != NULL)
+        {
+            __atomic_store_n(&old->retired, 1, __ATOMIC_SEQ_CST);
+            journalWake(old);
+        }
+        int saved_errno = errno;
+        munmap(old, old_size);
+        errno = saved_errno;
+    }
+    if (jw->hdr == NULL)
+    {
+        free(jw);
+        return NULL;
+    }
+    jw->ring = (char*)jw->hdr + JOURNAL_HDR;
+    return jw;
+}
+
+/*
+ * Append one delivered event (`info` NULL: none known), overwriting
+ * the oldest records as needed, and wake the readers.
+ * Returns how many event records were overwritten, or -1 with
+ * EMSGSIZE for a record larger than the whole ring.
+ */
+int journalAppend(struct journalWriter* jw, const char* path, uint32_t mask, uint32_t cookie, const NotifyEventInfo* info)
+{
+    struct journalHdr* hdr = jw->hdr;
+    uint64_t cap = jw->cap;
+    uint64_t path_len = strlen(path) + 1;
+    if (mask & NOTIFY_RENAME)
+    {
+        path_len += strlen(path + path_len) + 1;
+    }
+    uint64_t n = PAD8(sizeof(struct journalRec) + path_len);
+    if (n > cap)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint64_t head = hdr->head;
+    uint64_t pos = head % cap;
+    uint64_t pad = (cap - pos < n) ? cap - pos : 0;
+    uint64_t end = head + pad + n;
+
+    /* make room: move tail past every record the new one will cover */
+    uint64_t tail = hdr->tail;
+    int evicted = 0;
+    while (end - tail > cap)
+    {
+        const struct journalRec* old = (const struct journalRec*)(jw->ring + tail % cap);
+        if (old->len < 8
+            || old->len % 8
+            || old->len > cap - tail % cap)
+        {
+            tail = head;
+            break;
+        }
+        evicted += (old->type == JOURNAL_EVENT);
+        tail += old->len;
+    }
+    if (tail != hdr->tail)
+    {
+        __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    if (pad)
+    {
+        struct journalRec* p = (struct journalRec*)(jw->ring + pos);
+        p->len = (uint32_t)pad;
+        p->type = JOURNAL_PAD;
+        pos = 0;
+    }
+    struct journalRec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.len = (uint32_t)n;
+    rec.type = JOURNAL_EVENT;
+    rec.at = head + pad;
+    rec.mask = mask;
+    rec.cookie = cookie;
+    rec.wd = -1;
+    rec.stat.err = ENODATA;
+    if (info)
+    {
+        rec.seq = info->seq;
+        rec.time_ns = info->time_ns;
+        rec.dir_ino = info->dir_ino;
+        rec.wd = info->wd;
+        rec.origin = info->origin;
+        rec.stat = info->stat;
+    }
+    rec.path_len = (uint32_t)path_len;
+    char* at = jw->ring + pos;
+    memcpy(at, &rec, sizeof(rec));
+    memcpy(at + sizeof(rec), path, path_len);
+    memset(at + sizeof(rec) + path_len, 0, n - sizeof(rec) - path_len);
+
+    __atomic_store_n(&hdr->head, end, __ATOMIC_RELEASE);
+    journalWake(hdr);
+    return evicted;
+}
+
+/* Unmap a producer's journal. The file stays. Safe to pass NULL. */
+void journalClose(struct journalWriter* jw)
+{
+    if (jw == NULL)
+    {
+        return;
+    }
+    munmap(jw->hdr, jw->size);
+    free(jw);
+}
+
+/*
+ * Public API.
+ *
+ * Open the journal a Notify with NotifyOptions.journal writes to
+ * `file`, for reading from `offset`: what notifyJournalOffset returned
+ * in an earlier run, NOTIFY_JOURNAL_OLDEST for the oldest event still
+ * in it, or NOTIFY_JOURNAL_NEWEST for only what comes next. Readers
+ * are independent of each other and of the producer, which never
+ * waits for them; the file must be writable, waiting goes through it.
+ *
+ * Returns NULL with errno set on failure: EINVAL for a NULL file,
+ * EPROTO when it is not a journal, or any errno from open or mmap.
+ */
+NotifyJournal* notifyJournalOpen(const char* file, uint64_t offset)
+{
+    if (file == NULL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    NotifyJournal* j = (NotifyJournal*)calloc(1, sizeof(NotifyJournal));
+    if (j == NULL)
+    {
+        return NULL;
+    }
+    j->file = strdup(file);
+    if (j->file == NULL)
+    {
+        free(j);
+        return NULL;
+    }
+    j->hdr = journalMap(file, 0, &j->size);
+    if (j->hdr == NULL)
+    {
+        int saved_errno = errno;
+        free(j->file);
+        free(j);
+        errno = saved_errno;
+        return NULL;
+    }
+    j->ring = (const char*)j->hdr + JOURNAL_HDR;
+    j->cap = j->hdr->capacity;
+    j->cursor = (offset == NOTIFY_JOURNAL_OLDEST)
+        ? __atomic_load_n(&j->hdr->tail, __ATOMIC_ACQUIRE)
+        : (offset == NOTIFY_JOURNAL_NEWEST)
+            ? __atomic_load_n(&j->hdr->head, __ATOMIC_ACQUIRE)
+            : offset;
+    return j;
+}
+
+/*
+ * Move over to the journal that replaced a retired one. The cursor
+ * carries over: the new journal starts where the old one ended.
+ */
+static int journalReopen(NotifyJournal* j)
+{
+    size_t size = 0;
+    struct journalHdr* hdr = journalMap(j->file, 0, &size);
+    if (hdr == NULL)
+    {
+        return -1;
+    }
+    munmap(j->hdr, j->size);
+    j->hdr = hdr;
+    j->size = size;
+    j->ring = (const char*)hdr + JOURNAL_HDR;
+    j->cap = hdr->capacity;
+    return 0;
+}
+
+/*
+ * Sleep until the producer appends (its `wake` moves on from `seen`)
+ * or `timeout` ms pass. Returns 0 either way, -1 with EINTR.
+ */
+static int journalWait(NotifyJournal* j, uint32_t seen, int timeout)
+{
+    struct timespec ts = { timeout / 1000, (long)(timeout % 1000) * 1000000 };
+    __atomic_add_fetch(&j->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+    long rc = syscall(SYS_futex, &j->hdr->wake, FUTEX_WAIT, seen, (timeout < 0) ? NULL : &ts, NULL, 0);
+    int saved_errno = errno;
+    __atomic_sub_fetch(&j->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+    if (rc == -1
+        && saved_errno == EINTR)
+    {
+        errno = EINTR;
+        return -1;
+    }
+    return 0;
+}
+
+/* Keep room for `len` path bytes in j->path. */
+static int journalPathRoom(NotifyJournal* j, size_t len)
+{
+    if (len <= j->path_cap)
+    {
+        return 0;
+    }
+    char* p = (char*)realloc(j->path, len);
+    if (p == NULL)
+    {
+        return -1;
+    }
+    j->path = p;
+    j->path_cap = len;
+    return 0;
+}
+
+/*
+ * Copy the record at the cursor out of the ring into `rec` and
+ * j->path and step over it (and over a JOURNAL_PAD before it).
+ * Returns 0, 1 when the producer overwrote it meanwhile (the cursor
+ * is left alone), or -1 with errno set: EPROTO when the cursor is not
+ * at a record, ENOMEM.
+ */
+static int journalCopy(NotifyJournal* j, struct journalRec* rec)
+{
+    uint64_t cursor = j->cursor;
+    uint64_t pos = cursor % j->cap;
+    uint64_t avail = j->cap - pos;
+    memcpy(rec, j->ring + pos, 8);
+    if (rec->type == JOURNAL_PAD
+        && rec->len == avail)
+    {
+        cursor += avail;
+        pos = 0;
+        avail = j->cap;
+        memcpy(rec, j->ring, 8);
+    }
+    int bad = 0;
+    if (avail < sizeof(*rec))
+    {
+        bad = 1;
+    }
+    else
+    {
+        memcpy(rec, j->ring + pos, sizeof(*rec));
+        bad = rec->type != JOURNAL_EVENT
+            || rec->at != cursor
+            || rec->len % 8
+            || rec->len < sizeof(*rec)
+            || rec->len > avail
+            || rec->path_len == 0
+            || rec->path_len > rec->len - sizeof(*rec);
+    }
+    if (!bad
+        && journalPathRoom(j, rec->path_len) == -1)
+    {
+        return -1;
+    }
+    if (!bad)
+    {
+        memcpy(j->path, j->ring + pos + sizeof(*rec), rec->path_len);
+    }
+
+    /* whatever was read, it only counts if tail has not passed it */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&j->hdr->tail, __ATOMIC_RELAXED) > j->cursor)
+    {
+        return 1;
+    }
+    if (bad)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    j->path[rec->path_len - 1] = '\0';
+    j->cursor = cursor + rec->len;
+    return 0;
+}
+
+/*
+ * Public API.
+ *
+ * Wait for the next event in the journal, with waitNotify's
+ * conventions for `mask`, `cookie` (may be NULL), `timeout` and the
+ * return value; `info` (may be NULL) gets what the producer's
+ * waitNotifyInfo said. `*path` is borrowed: valid until the next call
+ * or notifyJournalClose, NULL when nothing is delivered. A
+ * NOTIFY_RENAME event carries its old path after the new one, as from
+ * waitNotify.
+ *
+ * A reader that fell so far behind that the producer overwrote events
+ * it had not read yet is said to be lapped: it gets one IN_Q_OVERFLOW
+ * (empty path, origin NOTIFY_ORIGIN_MARKER) and goes on from the
+ * oldest event left. So does one whose offset is past the journal's
+ * end, as after the file was recreated from scratch. When the producer
+ * replaced the journal (another size), the reader follows it to the
+ * new file once it has read the old one to its end.
+ *
+ * Returns 0 on an event, `timeout` on timeout, -1 with errno set:
+ * EINVAL on NULL input, EPROTO when the offset is not that of an
+ * event, EINTR, ENOMEM, or any errno from reopening the file.
+ */
+int notifyJournalRead(NotifyJournal* j, const char** path, uint32_t* mask, int timeout, uint32_t* cookie, NotifyEventInfo* info)
+{
+    if (j == NULL
+        || path == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *path = NULL;
+
+    uint64_t deadline = (timeout > 0) ? nowMs() + (uint64_t)timeout : 0;
+    struct journalRec rec;
+    for (;;)
+    {
+        uint32_t seen = __atomic_load_n(&j->hdr->wake, __ATOMIC_SEQ_CST);
+        uint64_t tail = __atomic_load_n(&j->hdr->tail, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&j->hdr->head, __ATOMIC_ACQUIRE);
+        if (j->cursor >= tail
+            && j->cursor < head)
+        {
+            int rc = journalCopy(j, &rec);
+            if (rc == -1)
+            {
+                return -1;
+            }
+            if (rc == 0)
+            {
+                break;
+            }
+        }
+        else if (j->cursor == head)
+        {
+            if (__atomic_load_n(&j->hdr->retired, __ATOMIC_SEQ_CST))
+            {
+                if (journalReopen(j) == -1)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            int wait = timeout;
+            if (timeout > 0)
+            {
+                uint64_t now = nowMs();
+                wait = (now < deadline) ? (int)(deadline - now) : 0;
+            }
+            if (wait == 0)
+            {
+                return timeout;
+            }
+            if (journalWait(j, seen, wait) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        /* lapped */
+        if (journalPathRoom(j, 1) == -1)
+        {
+            return -1;
+        }
+        j->path[0] = '\0';
+        j->cursor = __atomic_load_n(&j->hdr->tail, __ATOMIC_ACQUIRE);
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        memset(&rec, 0, sizeof(rec));
+        rec.mask = IN_Q_OVERFLOW;
+        rec.time_ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+        rec.wd = -1;
+        rec.origin = NOTIFY_ORIGIN_MARKER;
+        rec.stat.err = ENODATA;
+        break;
+    }
+
+    *path = j->path;
+    if (mask)
+    {
+        *mask = rec.mask;
+    }
+    if (cookie)
+    {
+        *cookie = rec.cookie;
+    }
+    if (info)
+    {
+        info->seq = rec.seq;
+        info->time_ns = rec.time_ns;
+        info->dir_ino = rec.dir_ino;
+        info->wd = rec.wd;
+        info->origin = rec.origin;
+        info->stat = rec.stat;
+    }
+    return 0;
+}
+
+/*
+ * Public API.
+ *
+ * The reader's position: the offset of the next event it will read.
+ * Keep it to carry on from there with notifyJournalOpen after a
+ * restart. 0 for a NULL reader.
+ */
+uint64_t notifyJournalOffset(const NotifyJournal* j)
+{
+    return j ? j->cursor : 0;
+}
+
+/*
+ * Public API.
+ *
+ * Release a reader. Safe to pass NULL.
+ */
+void notifyJournalClose(NotifyJournal* j)
+{
+    if (j == NULL)
+    {
+        return;
+    }
+    munmap(j->hdr, j->size);
+    free(j->path);
+    free(j->file);
+    free(j);
+}
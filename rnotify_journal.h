@@ -0,0 +1,87 @@
+/*
+ * Internal: the shared-memory event journal behind NotifyOptions.journal
+ * and the NotifyJournal reader.
+ *
+ * One producer (the Notify that delivers the events) appends a record
+ * per delivered event to a ring in a file every reader maps shared;
+ * each reader keeps its own cursor. Positions are byte offsets into
+ * the stream of everything ever appended ("logical" offsets, only ever
+ * growing), so a reader's position survives both its own restart and
+ * the producer's: a producer reopening a journal carries on from its
+ * head, and one that has to recreate it (another size, a damaged file)
+ * starts the new file at the old head and marks the old one retired
+ * for readers to move over.
+ *
+ * Layout (native byte order, like the capture):
+ *
+ *     struct journalHdr       padded to JOURNAL_HDR bytes
+ *     ring                    `capacity` bytes of records
+ *
+ * A record is a struct journalRec, then the path bytes (the old path
+ * follows the new one's terminator for NOTIFY_RENAME), padded to 8.
+ * A record never wraps: when the ring's end is too close the producer
+ * fills it with a JOURNAL_PAD record (only its `len` and `type`) and
+ * starts again at offset 0 of the ring.
+ *
+ * `head` is the end of the last complete record, `tail` the start of
+ * the oldest one not yet overwritten. The producer moves `tail` past
+ * what it is about to overwrite before writing, and `head` once done;
+ * a reader copies a record out and then checks `tail` again, so a
+ * record overwritten under it is detected rather than delivered.
+ */
+#ifndef LIBRNOTIFY_RNOTIFY_JOURNAL_H_
+#define LIBRNOTIFY_RNOTIFY_JOURNAL_H_
+
+#include <stdint.h>
+
+#include "rnotify.h"
+
+#define JOURNAL_MAGIC "RNOTJRN1"
+#define JOURNAL_HDR 4096
+#define JOURNAL_MIN (64 * 1024)
+#define JOURNAL_DEFAULT (1024 * 1024)
+
+/* The shared header. `wake` is the futex readers wait on. */
+struct journalHdr
+{
+    char magic[8];
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t wake;
+    uint32_t waiters;
+    uint32_t retired;
+    uint32_t pad;
+};
+
+enum journalType
+{
+    JOURNAL_EVENT = 1,
+    JOURNAL_PAD,
+};
+
+/* One delivered event; `path_len` path bytes follow. */
+struct journalRec
+{
+    uint32_t len;       /* the whole record, padded to 8 */
+    uint32_t type;      /* enum journalType */
+    uint64_t at;        /* its own logical offset */
+    uint64_t seq;
+    uint64_t time_ns;
+    uint64_t dir_ino;
+    uint32_t mask;
+    uint32_t cookie;
+    int32_t wd;
+    int32_t origin;
+    NotifyStat stat;
+    uint32_t path_len;
+    uint32_t pad;
+};
+
+struct journalWriter;
+
+struct journalWriter* journalCreate(const char* file, unsigned long size);
+int journalAppend(struct journalWriter* jw, const char* path, uint32_t mask, uint32_t cookie, const NotifyEventInfo* info);
+void journalClose(struct journalWriter* jw);
+
+#endif // LIBRNOTIFY_RNOTIFY_JOURNAL_H_
@@ -0,0 +1,533 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "rnotify.h"
+
+/*
+ * Worker-pool dispatch on top of waitNotify.
+ *
+ * The calling thread pulls events and hands each one to the shard that
+ * owns its parent directory, so all events inside one directory run
+ * on one worker, in order. Two kinds of cross-shard ordering are added
+ * on top:
+ *
+ *   - a directory's IN_CREATE runs on its parent's shard, while the
+ *     events inside it run on its own shard. Each job therefore may
+ *     carry a ticket (shard, sequence) of the CREATE it depends on,
+ *     and the worker waits for that ticket before running the
+ *     handler;
+ *   - everything that reshapes the tree more than one entry at a time
+ *     (directory moves and deletes, self events, library markers,
+ *     IN_Q_OVERFLOW) is a barrier: all shards are drained and the
+ *     handler runs on the calling thread.
+ */
+
+/* Jobs a shard may hold before the dispatcher waits for it. */
+#define POOL_QUEUE_MAX 4096
+
+/* Buckets in the table of directory CREATEs still in flight. */
+#define POOL_DEP_BUCKETS 1024
+
+struct job
+{
+    char* path;
+    uint32_t mask;
+    uint32_t cookie;
+    int dep_shard;              /* -1: no dependency */
+    unsigned long dep_ticket;
+    struct job* next;
+};
+
+/*
+ * One worker and its FIFO. `issued` counts jobs queued, `done` jobs
+ * finished; the ticket of a job is the value of `issued` after it was
+ * queued, so it is done once `done` has reached it.
+ */
+struct shard
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* queue became non-empty, or stop */
+    pthread_cond_t progress;    /* `done` advanced and somebody waits */
+    struct job* head;
+    struct job* tail;
+    unsigned long issued;
+    unsigned long done;
+    int waiters;
+    int stop;
+    struct _notifyPool* pool;
+};
+
+/*
+ * A directory whose IN_CREATE was queued and may not have run yet,
+ * keyed by the directory's path.
+ */
+struct dep
+{
+    char* path;
+    int shard;
+    unsigned long ticket;
+    struct dep* next;
+};
+
+struct _notifyPool
+{
+    Notify* ntf;
+    NotifyHandler handler;
+    void* arg;
+    unsigned int nshards;
+    struct shard* shards;
+    struct dep* deps[POOL_DEP_BUCKETS];
+};
+
+static uint32_t hashPath(const char* s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Length of the parent-directory prefix of `path` (0 if none). */
+static size_t parentLen(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return slash ? (size_t)(slash - path) : 0;
+}
+
+static int ticketDone(struct shard* s, unsigned long ticket)
+{
+    pthread_mutex_lock(&s->lock);
+    int done = s->done >= ticket;
+    pthread_mutex_unlock(&s->lock);
+    return done;
+}
+
+/* Block until shard `s` has finished every job up to `ticket`. */
+static void waitTicket(struct shard* s, unsigned long ticket)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->done < ticket)
+    {
+        s->waiters++;
+        pthread_cond_wait(&s->progress, &s->lock);
+        s->waiters--;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void freeDep(struct dep* d)
+{
+    free(d->path);
+    free(d);
+}
+
+static void clearDeps(NotifyPool* pool)
+{
+    for (size_t i = 0; i < POOL_DEP_BUCKETS; i++)
+    {
+        struct dep* d = pool->deps[i];
+        while (d != NULL)
+        {
+            struct dep* next = d->next;
+            freeDep(d);
+            d = next;
+        }
+        pool->deps[i] = NULL;
+    }
+}
+
+/*
+ * Find the pending CREATE of directory path[0..len). Entries whose
+ * ticket is already done are dropped from the bucket on the way.
+ */
+static struct dep* findDep(NotifyPool* pool, const char* path, size_t len)
+{
+    struct dep** link = &pool->deps[hashPath(path, len) % POOL_DEP_BUCKETS];
+    while (*link != NULL)
+    {
+        struct dep* d = *link;
+        if (ticketDone(&pool->shards[d->shard], d->ticket))
+        {
+            *link = d->next;
+            freeDep(d);
+            continue;
+        }
+        if (strlen(d->path) == len
+            && !memcmp(d->path, path, len))
+        {
+            return d;
+        }
+        link = &d->next;
+    }
+    return NULL;
+}
+
+/*
+ * Remember that directory `path` is created by (shard, ticket). Takes
+ * ownership of `path`, which is a copy: the job's own path belongs to
+ * the worker as soon as it is queued.
+ */
+static int addDep(NotifyPool* pool, char* path, int shard, unsigned long ticket)
+{
+    size_t len = strlen(path);
+    struct dep* d = findDep(pool, path, len);
+    if (d != NULL)
+    {
+        free(path);
+    }
+    else
+    {
+        d = (struct dep*)malloc(sizeof(struct dep));
+        if (d == NULL)
+        {
+            free(path);
+            return -1;
+        }
+        d->path = path;
+        size_t b = hashPath(path, len) % POOL_DEP_BUCKETS;
+        d->next = pool->deps[b];
+        pool->deps[b] = d;
+    }
+    d->shard = shard;
+    d->ticket = ticket;
+    return 0;
+}
+
+/*
+ * Events that cannot be ordered by the parent shard alone: they move
+ * or remove whole subtrees, concern a watched directory itself, carry
+ * no path at all, or rename a file from one directory to another.
+ */
+static int isBarrier(const char* path, uint32_t mask)
+{
+    if (path == NULL
+        || path[0] == '\0')
+    {
+        return 1;
+    }
+    if (mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        return 1;
+    }
+    if (mask & NOTIFY_RENAME)
+    {
+        const char* from = notifyRenameSource(path, mask);
+        size_t len = parentLen(path);
+        if (len != parentLen(from)
+            || strncmp(path, from, len))
+        {
+            return 1;
+        }
+    }
+    return (mask & IN_ISDIR)
+        && (mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO));
+}
+
+/* Wait until every shard has run every job queued so far. */
+static void drainShards(NotifyPool* pool)
+{
+    for (unsigned int i = 0; i < pool->nshards; i++)
+    {
+        struct shard* s = &pool->shards[i];
+        pthread_mutex_lock(&s->lock);
+        unsigned long issued = s->issued;
+        pthread_mutex_unlock(&s->lock);
+        waitTicket(s, issued);
+    }
+    clearDeps(pool);
+}
+
+static void* workerMain(void* arg)
+{
+    struct shard* s = (struct shard*)arg;
+    NotifyPool* pool = s->pool;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;)
+    {
+        while (s->head == NULL
+            && !s->stop)
+        {
+            pthread_cond_wait(&s->work, &s->lock);
+        }
+        if (s->head == NULL)
+        {
+            break;
+        }
+        struct job* j = s->head;
+        s->head = j->next;
+        if (s->head == NULL)
+        {
+            s->tail = NULL;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (j->dep_shard != -1)
+        {
+            waitTicket(&pool->shards[j->dep_shard], j->dep_ticket);
+        }
+        pool->handler(j->path, j->mask, j->cookie, pool->arg);
+        notifyFree(pool->ntf, j->path);
+        free(j);
+
+        pthread_mutex_lock(&s->lock);
+        s->done++;
+        if (s->waiters)
+        {
+            pthread_cond_broadcast(&s->progress);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/*
+ * Queue one event on the shard owning its parent directory. Takes
+ * ownership of `path`.
+ */
+static int dispatchJob(NotifyPool* pool, char* path, uint32_t mask, uint32_t cookie)
+{
+    struct job* j = (struct job*)malloc(sizeof(struct job));
+    if (j == NULL)
+    {
+        return -1;
+    }
+    j->path = path;
+    j->mask = mask;
+    j->cookie = cookie;
+    j->dep_shard = -1;
+    j->dep_ticket = 0;
+    j->next = NULL;
+
+    size_t plen = parentLen(path);
+    struct dep* d = findDep(pool, path, plen);
+    if (d != NULL)
+    {
+        j->dep_shard = d->shard;
+        j->dep_ticket = d->ticket;
+    }
+
+    unsigned int idx = hashPath(path, plen) % pool->nshards;
+    struct shard* s = &pool->shards[idx];
+    if (j->dep_shard == (int)idx)
+    {
+        /* same FIFO: ordered already */
+        j->dep_shard = -1;
+    }
+
+    int is_mkdir = (mask & IN_ISDIR) && (mask & IN_CREATE);
+    char* dep_path = is_mkdir ? strdup(path) : NULL;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->issued - s->done >= POOL_QUEUE_MAX)
+    {
+        s->waiters++;
+        pthread_cond_wait(&s->progress, &s->lock);
+        s->waiters--;
+    }
+    if (s->tail)
+    {
+        s->tail->next = j;
+    }
+    else
+    {
+        s->head = j;
+    }
+    s->tail = j;
+    unsigned long ticket = ++s->issued;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+
+    if (is_mkdir
+        && (dep_path == NULL
+            || -1 == addDep(pool, dep_path, (int)idx, ticket)))
+    {
+        /* cannot track it: fall back to ordering by draining */
+        waitTicket(s, ticket);
+    }
+
+    return 0;
+}
+
+/*
+ * Public API.
+ *
+ * Create a pool of `threads` workers that will run `handler` for the
+ * events of `ntf` (threads <= 0 means one). The pool does not own
+ * `ntf`; free the pool first. Events only start flowing once
+ * runNotifyPool is called.
+ *
+ * Returns the pool, or NULL with errno set.
+ */
+NotifyPool* initNotifyPool(Notify* ntf, int threads, NotifyHandler handler, void* arg)
+{
+    if (ntf == NULL
+        || handler == NULL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (threads <= 0)
+    {
+        threads = 1;
+    }
+
+    NotifyPool* pool = (NotifyPool*)calloc(1, sizeof(NotifyPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->shards = (struct shard*)calloc((size_t)threads, sizeof(struct shard));
+    if (pool->shards == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->ntf = ntf;
+    pool->handler = handler;
+    pool->arg = arg;
+
+    /* workers inherit a full signal mask: signals stay with the caller */
+    sigset_t all;
+    sigset_t saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int rc = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        struct shard* s = &pool->shards[i];
+        s->pool = pool;
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->work, NULL);
+        pthread_cond_init(&s->progress, NULL);
+        rc = pthread_create(&s->thread, NULL, workerMain, s);
+        if (rc != 0)
+        {
+            pthread_cond_destroy(&s->progress);
+            pthread_cond_destroy(&s->work);
+            pthread_mutex_destroy(&s->lock);
+            break;
+        }
+        pool->nshards++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (rc != 0)
+    {
+        freeNotifyPool(pool);
+        errno = rc;
+        return NULL;
+    }
+
+    return pool;
+}
+
+/*
+ * Public API.
+ *
+ * Pull events from the pool's Notify and dispatch them until no event
+ * arrives for `timeout` milliseconds (-1: until an error; 0: dispatch
+ * what is ready and return). Before
+ * returning, every dispatched event has been handled.
+ *
+ * Events inside one directory are handled in delivery order, on one
+ * worker. A directory's IN_CREATE is handled before any event inside
+ * it. Directory moves and deletes, self events, IN_Q_OVERFLOW and the
+ * library markers are handled on the calling thread once everything
+ * before them is done, and before anything after them starts.
+ *
+ * The handler gets a path that is only valid during the call.
+ *
+ * Returns the number of events dispatched, or -1 with errno set.
+ */
+long runNotifyPool(NotifyPool* pool, int timeout)
+{
+    if (pool == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    long count = 0;
+    for (;;)
+    {
+        char* path = NULL;
+        uint32_t mask = 0;
+        uint32_t cookie = 0;
+        int rc = waitNotify(pool->ntf, &path, &mask, timeout, &cookie);
+        if (rc == -1)
+        {
+            int safe_errno = errno;
+            drainShards(pool);
+            errno = safe_errno;
+            return -1;
+        }
+        /* a timeout of 0 comes back as 0 too, with no path */
+        if (rc != 0
+            || path == NULL)
+        {
+            break;
+        }
+        count++;
+
+        if (isBarrier(path, mask))
+        {
+            drainShards(pool);
+            pool->handler(path ? path : "", mask, cookie, pool->arg);
+            notifyFree(pool->ntf, path);
+            continue;
+        }
+        if (-1 == dispatchJob(pool, path, mask, cookie))
+        {
+            /* out of memory: keep order by running it here */
+            drainShards(pool);
+            pool->handler(path, mask, cookie, pool->arg);
+            notifyFree(pool->ntf, path);
+        }
+    }
+
+    drainShards(pool);
+    return count;
+}
+
+/*
+ * Public API.
+ *
+ * Stop and join the workers (after they finish what is queued) and
+ * release the pool. The Notify is left alone. Safe to pass NULL.
+ */
+void freeNotifyPool(NotifyPool* pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    for (unsigned int i = 0; i < pool->nshards; i++)
+    {
+        struct shard* s = &pool->shards[i];
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->work);
+        pthread_mutex_unlock(&s->lock);
+    }
+    for (unsigned int i = 0; i < pool->nshards; i++)
+    {
+        struct shard* s = &pool->shards[i];
+        pthread_join(s->thread, NULL);
+        pthread_cond_destroy(&s->progress);
+        pthread_cond_destroy(&s->work);
+        pthread_mutex_destroy(&s->lock);
+    }
+    clearDeps(pool);
+    free(pool->shards);
+    free(pool);
+}
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rnotify_replay.h"
+
+#define REPLAY_MAGIC "RNOTREC1"
+
+/* Record header; key and data follow, each padded to 8 bytes. */
+struct replayHdr
+{
+    uint32_t type;
+    int32_t rc;
+    uint32_t key_len;
+    uint32_t data_len;
+    uint64_t at;
+};
+
+/*
+ * An open capture: `out` while recording; while replaying the whole
+ * file is mapped at `map` and `pos` is the offset of the next record.
+ */
+struct replayLog
+{
+    FILE* out;
+    const char* map;
+    size_t size;
+    size_t pos;
+};
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+static const char zeros[8];
+
+/*
+ * Create (truncate) `file` and write the capture header.
+ * Returns NULL with errno set on failure.
+ */
+struct replayLog* replayCreate(const char* file, unsigned long max_queued_events)
+{
+    struct replayLog* log = (struct replayLog*)calloc(1, sizeof(struct replayLog));
+    if (log == NULL)
+    {
+        return NULL;
+    }
+    log->out = fopen(file, "w");
+    if (log->out == NULL)
+    {
+        free(log);
+        return NULL;
+    }
+    /* captures get big; fewer, larger writes */
+    setvbuf(log->out, NULL, _IOFBF, 1 << 20);
+
+    uint64_t mqe = max_queued_events;
+    if (1 != fwrite(REPLAY_MAGIC, 8, 1, log->out)
+        || 1 != fwrite(&mqe, sizeof(mqe), 1, log->out))
+    {
+        int saved_errno = errno;
+        fclose(log->out);
+        free(log);
+        errno = saved_errno;
+        return NULL;
+    }
+    return log;
+}
+
+/*
+ * Map `file` for replay and check its header.
+ * Returns NULL with errno set on failure: EPROTO when it is not a
+ * capture.
+ */
+struct replayLog* replayOpen(const char* file, unsigned long* max_queued_events)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if ((size_t)sb.st_size < 16)
+    {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    void* map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        errno = saved_errno;
+        return NULL;
+    }
+    if (memcmp(map, REPLAY_MAGIC, 8))
+    {
+        munmap(map, (size_t)sb.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    struct replayLog* log = (struct replayLog*)calloc(1, sizeof(struct replayLog));
+    if (log == NULL)
+    {
+        munmap(map, (size_t)sb.st_size);
+        return NULL;
+    }
+    log->map = (const char*)map;
+    log->size = (size_t)sb.st_size;
+    log->pos = 16;
+
+    uint64_t mqe = 0;
+    memcpy(&mqe, log->map + 8, sizeof(mqe));
+    *max_queued_events = (unsigned long)mqe;
+    return log;
+}
+
+/*
+ * Flush and close a capture being written, or unmap one being
+ * replayed. Safe to pass NULL.
+ * Returns 0, or -1 with errno set when the final flush failed.
+ */
+int replayClose(struct replayLog* log)
+{
+    if (log == NULL)
+    {
+        return 0;
+    }
+    int rc = 0;
+    if (log->out)
+    {
+        rc = fclose(log->out) ? -1 : 0;
+    }
+    if (log->map)
+    {
+        munmap((void*)log->map, log->size);
+    }
+    int saved_errno = errno;
+    free(log);
+    errno = saved_errno;
+    return rc;
+}
+
+/*
+ * Append one record. `key` may be NULL (reads).
+ * Returns 0, or -1 with errno set on a write error.
+ */
+int replayPut(struct replayLog* log, enum replayType type, uint64_t at, int32_t rc, const char* key, const void* data, size_t len)
+{
+    size_t key_len = key ? strlen(key) : 0;
+    if (key_len > UINT32_MAX
+        || len > UINT32_MAX)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct replayHdr hdr = { (uint32_t)type, rc, (uint32_t)key_len, (uint32_t)len, at };
+    if (1 != fwrite(&hdr, sizeof(hdr), 1, log->out)
+        || (key_len && 1 != fwrite(key, key_len, 1, log->out))
+        || (PAD8(key_len) != key_len && 1 != fwrite(zeros, PAD8(key_len) - key_len, 1, log->out))
+        || (len && 1 != fwrite(data, len, 1, log->out))
+        || (PAD8(len) != len && 1 != fwrite(zeros, PAD8(len) - len, 1, log->out)))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Header of the record at log->pos, after checking the whole record
+ * lies inside the file. NULL with EPROTO when it does not.
+ */
+static const struct replayHdr* nextRecord(const struct replayLog* log)
+{
+    const struct replayHdr* hdr = (const struct replayHdr*)(log->map + log->pos);
+    if (log->size - log->pos < sizeof(*hdr)
+        || log->size - log->pos - sizeof(*hdr) < PAD8(hdr->key_len) + PAD8(hdr->data_len))
+    {
+        errno = EPROTO;
+        return NULL;
+    }
+    return hdr;
+}
+
+/*
+ * Type and position of the next record without consuming it: 0 at the
+ * end of the capture, -1 with EPROTO when the capture is truncated.
+ */
+int replayPeek(struct replayLog* log, uint64_t* at)
+{
+    if (log->pos == log->size)
+    {
+        return 0;
+    }
+    const struct replayHdr* hdr = nextRecord(log);
+    if (hdr == NULL)
+    {
+        return -1;
+    }
+    *at = hdr->at;
+    return (int)hdr->type;
+}
+
+/*
+ * Consume the next record, which must be of `type`, made at `at` and
+ * on `key` (NULL: no key). `*data` points into the mapping and stays
+ * valid until replayClose; it is 8-byte aligned.
+ *
+ * Returns 0, or -1 with errno set: ENODATA at the end of the capture,
+ * EPROTO when the record is torn or is not the call being replayed.
+ */
+int replayGet(struct replayLog* log, enum replayType type, uint64_t at, const char* key, int32_t* rc, const void** data, size_t* len)
+{
+    if (log->pos == log->size)
+    {
+        errno = ENODATA;
+        return -1;
+    }
+    const struct replayHdr* hdr = nextRecord(log);
+    if (hdr == NULL)
+    {
+        return -1;
+    }
+
+    const char* rec_key = (const char*)(hdr + 1);
+    size_t key_len = key ? strlen(key) : 0;
+    if (hdr->type != (uint32_t)type
+        || hdr->at != at
+        || hdr->key_len != key_len
+        || memcmp(rec_key, key ? key : "", key_len))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    *rc = hdr->rc;
+    if (data)
+    {
+        *data = rec_key + PAD8(hdr->key_len);
+    }
+    if (len)
+    {
+        *len = hdr->data_len;
+    }
+    log->pos += sizeof(*hdr) + PAD8(hdr->key_len) + PAD8(hdr->data_len);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Internal: capture file for NotifyOptions.record / NotifyOptions.replay.
+ *
+ * A capture is the ordered log of everything the event engine learnt
+ * from the kernel and the filesystem: each read of the inotify fd (or
+ * buffer passed to notifyFeed) and the outcome of every
+ * inotify_add_watch, inotify_rm_watch, lstat and readdir it issued.
+ * The engine is deterministic given those answers, so replaying them
+ * in order drives the very same parsing and bookkeeping code without
+ * any kernel involvement; a record whose type or path differs from
+ * the call the engine is making means the two runs diverged.
+ *
+ * Layout (native byte order, the capture is not portable between
+ * architectures):
+ *
+ *     "RNOTREC1"  uint64 max_queued_events
+ *     record*     struct replayHdr, key, data, each padded to 8 bytes
+ *
+ * The key is the path a call was made on (empty for reads); `rc` is
+ * the call's result, or -errno when it failed; `at` is the number of
+ * events the engine had dequeued when it made the call. Reads are
+ * replayed at exactly that point, so the queue evolves as it did live.
+ */
+#ifndef LIBRNOTIFY_RNOTIFY_REPLAY_H_
+#define LIBRNOTIFY_RNOTIFY_REPLAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum replayType
+{
+    REPLAY_READ = 1,    /* data: the bytes read; rc 0 or -errno */
+    REPLAY_WATCH,       /* rc: wd from inotify_add_watch */
+    REPLAY_UNWATCH,     /* rc: inotify_rm_watch result */
+    REPLAY_STAT,        /* data: struct replayStat; rc 0 or -errno */
+    REPLAY_READDIR,     /* data: NUL-terminated names; rc 1, or -errno for no list */
+};
+
+/* The part of struct stat the engine looks at. */
+struct replayStat
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t mode;
+    uint32_t pad;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct replayLog;
+
+struct replayLog* replayCreate(const char* file, unsigned long max_queued_events);
+struct replayLog* replayOpen(const char* file, unsigned long* max_queued_events);
+int replayClose(struct replayLog* log);
+int replayPut(struct replayLog* log, enum replayType type, uint64_t at, int32_t rc, const char* key, const void* data, size_t len);
+int replayPeek(struct replayLog* log, uint64_t* at);
+int replayGet(struct replayLog* log, enum replayType type, uint64_t at, const char* key, int32_t* rc, const void** data, size_t* len);
+
+#endif // LIBRNOTIFY_RNOTIFY_REPLAY_H_
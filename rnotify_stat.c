@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "rnotify_stat.h"
+
+#define STAT_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_MTIME | STATX_INO | STATX_SIZE)
+
+/*
+ * A private io_uring with one statx buffer per submission slot. Each
+ * round fills at most `entries` slots and waits for all of them, so a
+ * buffer is never reused while the kernel may still write it.
+ * `broken` is set when io_uring_enter failed with lookups in flight:
+ * the ring is not used again and its buffers are never freed.
+ */
+struct statRing
+{
+    int fd;
+    unsigned int entries;
+    int broken;
+    void* sq;
+    size_t sq_len;
+    void* cq;
+    size_t cq_len;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    struct statx* bufs;
+};
+
+static void fromStatx(NotifyStat* out, const struct statx* stx)
+{
+    out->err = 0;
+    out->mode = stx->stx_mode;
+    out->size = stx->stx_size;
+    out->ino = stx->stx_ino;
+    out->mtime_sec = stx->stx_mtime.tv_sec;
+    out->mtime_nsec = stx->stx_mtime.tv_nsec;
+    out->nlink = stx->stx_nlink;
+    out->uid = stx->stx_uid;
+    out->gid = stx->stx_gid;
+}
+
+/*
+ * An O_PATH fd on the directory `path`, if it is still the inode
+ * `dev`/`ino` (not checked when `ino` is 0). Returns -1 with errno
+ * set: ENOENT when it is gone or something else took its place.
+ */
+int statOpenDir(const char* path, dev_t dev, ino_t ino)
+{
+    int fd = open(path, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    struct stat sb;
+    if (-1 == fstat(fd, &sb)
+        || (ino
+            && (sb.st_dev != dev || sb.st_ino != ino)))
+    {
+        close(fd);
+        errno = ENOENT;
+        return -1;
+    }
+    return fd;
+}
+
+/* What the crawl's lstat found, as a lookup would have. */
+void statFromStat(NotifyStat* out, const struct stat* sb)
+{
+    out->err = 0;
+    out->mode = sb->st_mode;
+    out->size = (uint64_t)sb->st_size;
+    out->ino = (uint64_t)sb->st_ino;
+    out->mtime_sec = sb->st_mtim.tv_sec;
+    out->mtime_nsec = (uint32_t)sb->st_mtim.tv_nsec;
+    out->nlink = (uint32_t)sb->st_nlink;
+    out->uid = sb->st_uid;
+    out->gid = sb->st_gid;
+}
+
+static int statFlags(const struct statReq* req)
+{
+    return AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT | (req->name[0] ? 0 : AT_EMPTY_PATH);
+}
+
+static void statOne(struct statReq* req)
+{
+    struct statx stx;
+    if (-1 == statx(req->dirfd, req->name, statFlags(req), STAT_MASK, &stx))
+    {
+        req->out->err = errno;
+        return;
+    }
+    fromStatx(req->out, &stx);
+}
+
+/*
+ * Set up a ring of `entries` slots (a power of two). Returns NULL with
+ * errno set when the kernel has no io_uring or refuses it.
+ */
+struct statRing* statRingOpen(unsigned int entries)
+{
+    struct statRing* r = (struct statRing*)calloc(1, sizeof(struct statRing));
+    if (r == NULL)
+    {
+        return NULL;
+    }
+    r->sq = MAP_FAILED;
+    r->cq = MAP_FAILED;
+    r->sqes = (struct io_uring_sqe*)MAP_FAILED;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    r->bufs = (struct statx*)calloc(r->entries, sizeof(struct statx));
+    if (r->sq == MAP_FAILED
+        || r->cq == MAP_FAILED
+        || r->sqes == MAP_FAILED
+        || r->bufs == NULL)
+    {
+        int saved_errno = errno;
+        statRingClose(r);
+        errno = saved_errno;
+        return NULL;
+    }
+    char* sq = (char*)r->sq;
+    char* cq = (char*)r->cq;
+    r->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+}
+
+/* Release a ring. Safe to pass NULL. */
+void statRingClose(struct statRing* r)
+{
+    if (r == NULL)
+    {
+        return;
+    }
+    if (r->sqes != MAP_FAILED)
+    {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq != MAP_FAILED)
+    {
+        munmap(r->cq, r->cq_len);
+    }
+    if (r->sq != MAP_FAILED)
+    {
+        munmap(r->sq, r->sq_len);
+    }
+    close(r->fd);
+    if (!r->broken)
+    {
+        free(r->bufs);
+    }
+    free(r);
+}
+
+/*
+ * Run `k` <= entries lookups through the ring and wait for all of
+ * them. Returns 0, or -1 with errno set when io_uring_enter failed;
+ * then `done[i]` tells which ones completed.
+ */
+static int ringRound(struct statRing* r, struct statReq* reqs, unsigned int k, unsigned char* done)
+{
+    unsigned int tail = *r->sq_tail;
+    for (unsigned int j = 0; j < k; j++)
+    {
+        unsigned int idx = (tail + j) & *r->sq_mask;
+        struct io_uring_sqe* sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = reqs[j].dirfd;
+        sqe->addr = (uint64_t)(uintptr_t)reqs[j].name;
+        sqe->len = STAT_MASK;
+        sqe->off = (uint64_t)(uintptr_t)&r->bufs[j];
+        sqe->statx_flags = (uint32_t)statFlags(&reqs[j]);
+        sqe->user_data = j;
+        r->sq_array[idx] = idx;
+        done[j] = 0;
+    }
+    __atomic_store_n(r->sq_tail, tail + k, __ATOMIC_RELEASE);
+
+    unsigned int submit = k;
+    unsigned int reaped = 0;
+    for (;;)
+    {
+        unsigned int head = *r->cq_head;
+        unsigned int ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++)
+        {
+            const struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            unsigned int j = (unsigned int)cqe->user_data;
+            if (j < k && !done[j])
+            {
+                if (cqe->res < 0)
+                {
+                    reqs[j].out->err = -cqe->res;
+                }
+                else
+                {
+                    fromStatx(reqs[j].out, &r->bufs[j]);
+                }
+                done[j] = 1;
+                reaped++;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (reaped == k)
+        {
+            return 0;
+        }
+
+        int rc = (int)syscall(__NR_io_uring_enter, r->fd, submit, k - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc >= 0)
+        {
+            submit -= (unsigned int)rc < submit ? (unsigned int)rc : submit;
+        }
+        else if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Run the `n` lookups, through `ring` when there is a usable one.
+ * Every request's `out` is filled, with the errno of a failed lookup
+ * in `err`. Returns how many went through the ring.
+ */
+size_t statRun(struct statRing* ring, struct statReq* reqs, size_t n)
+{
+    size_t via_ring = 0;
+    size_t i = 0;
+    unsigned char done[ring ? ring->entries : 1];
+    while (i < n
+           && ring != NULL
+           && !ring->broken)
+    {
+        unsigned int k = (n - i < ring->entries) ? (unsigned int)(n - i) : ring->entries;
+        if (-1 == ringRound(ring, reqs + i, k, done))
+        {
+            /* whatever is still in flight may yet land in bufs */
+            ring->broken = 1;
+            for (unsigned int j = 0; j < k; j++)
+            {
+                if (!done[j])
+                {
+                    statOne(&reqs[i + j]);
+                }
+            }
+            i += k;
+            break;
+        }
+        via_ring += k;
+        i += k;
+    }
+    for (; i < n; i++)
+    {
+        statOne(&reqs[i]);
+    }
+    return via_ring;
+}
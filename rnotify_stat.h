@@ -0,0 +1,36 @@
+/*
+ * Internal: the lookups behind NotifyOptions.stat.
+ *
+ * The engine collects one request per event of a read (the entry's
+ * name relative to an O_PATH fd on its directory) and runs them here
+ * in one go: statx(2) one after the other, or, with a statRing, as
+ * IORING_OP_STATX entries through an io_uring of our own, one
+ * io_uring_enter per ring's worth. No liburing: the ring is set up
+ * with the raw syscalls against <linux/io_uring.h>.
+ */
+#ifndef LIBRNOTIFY_RNOTIFY_STAT_H_
+#define LIBRNOTIFY_RNOTIFY_STAT_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "rnotify.h"
+
+/* One lookup; `name` is "" for the directory itself. */
+struct statReq
+{
+    int dirfd;
+    const char* name;
+    NotifyStat* out;
+};
+
+struct statRing;
+
+struct statRing* statRingOpen(unsigned int entries);
+size_t statRun(struct statRing* ring, struct statReq* reqs, size_t n);
+void statRingClose(struct statRing* ring);
+
+int statOpenDir(const char* path, dev_t dev, ino_t ino);
+void statFromStat(NotifyStat* out, const struct stat* sb);
+
+#endif // LIBRNOTIFY_RNOTIFY_STAT_H_
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "rnotify_state.h"
+
+#define STATE_MAGIC "RNOTSTA1"
+
+/* Record header; `len` payload bytes follow, padded to 8. */
+struct stateHdr
+{
+    uint32_t type;
+    uint32_t pad;
+    uint64_t len;
+};
+
+/*
+ * A state being written to the memfd `fd` through `out`, or one being
+ * read: the whole memfd mapped at `map`, `pos` the next record.
+ */
+struct stateLog
+{
+    int fd;
+    FILE* out;
+    const char* map;
+    size_t size;
+    size_t pos;
+};
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+static const char zeros[8];
+
+/*
+ * Start a state in a new memfd.
+ * Returns NULL with errno set on failure.
+ */
+struct stateLog* stateCreate(void)
+{
+    struct stateLog* log = (struct stateLog*)calloc(1, sizeof(struct stateLog));
+    if (log == NULL)
+    {
+        return NULL;
+    }
+    log->fd = memfd_create("rnotify-state", MFD_CLOEXEC);
+    if (log->fd == -1)
+    {
+        free(log);
+        return NULL;
+    }
+    int out_fd = dup(log->fd);
+    log->out = (out_fd == -1) ? NULL : fdopen(out_fd, "w");
+    if (log->out == NULL)
+    {
+        int saved_errno = errno;
+        if (out_fd != -1)
+        {
+            close(out_fd);
+        }
+        close(log->fd);
+        free(log);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (1 != fwrite(STATE_MAGIC, 8, 1, log->out))
+    {
+        stateAbort(log);
+        return NULL;
+    }
+    return log;
+}
+
+/*
+ * Append one record whose payload is the `n` pieces of `iov`, in
+ * order.
+ * Returns 0, or -1 with errno set on a write error.
+ */
+int statePut(struct stateLog* log, uint32_t type, const struct iovec* iov, int n)
+{
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    struct stateHdr hdr = { type, 0, len };
+    if (1 != fwrite(&hdr, sizeof(hdr), 1, log->out))
+    {
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (iov[i].iov_len
+            && 1 != fwrite(iov[i].iov_base, iov[i].iov_len, 1, log->out))
+        {
+            return -1;
+        }
+    }
+    if (PAD8(len) != len
+        && 1 != fwrite(zeros, PAD8(len) - len, 1, log->out))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Flush a state being written and hand over its memfd, rewound.
+ * Returns the fd, or -1 with errno set (the state is released either
+ * way).
+ */
+int stateFinish(struct stateLog* log)
+{
+    int fd = log->fd;
+    int rc = fclose(log->out);
+    free(log);
+    if (rc != 0
+        || -1 == lseek(fd, 0, SEEK_SET))
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+/* Drop a state being written. errno is preserved. */
+void stateAbort(struct stateLog* log)
+{
+    int saved_errno = errno;
+    fclose(log->out);
+    close(log->fd);
+    free(log);
+    errno = saved_errno;
+}
+
+/*
+ * Map the state in `fd` (which stays the caller's) and check its
+ * header. Returns NULL with errno set on failure: EPROTO when it is
+ * not a state.
+ */
+struct stateLog* stateOpen(int fd)
+{
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        return NULL;
+    }
+    if ((size_t)sb.st_size < 8)
+    {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    void* map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (memcmp(map, STATE_MAGIC, 8))
+    {
+        munmap(map, (size_t)sb.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    struct stateLog* log = (struct stateLog*)calloc(1, sizeof(struct stateLog));
+    if (log == NULL)
+    {
+        munmap(map, (size_t)sb.st_size);
+        return NULL;
+    }
+    log->fd = -1;
+    log->map = (const char*)map;
+    log->size = (size_t)sb.st_size;
+    log->pos = 8;
+    return log;
+}
+
+/*
+ * The next record. `*data` points into the mapping, 8-byte aligned,
+ * and stays valid until stateClose.
+ * Returns 1 for a record, 0 at the end, -1 with EPROTO when the state
+ * is torn.
+ */
+int stateNext(struct stateLog* log, uint32_t* type, const void** data, size_t* len)
+{
+    if (log->pos == log->size)
+    {
+        return 0;
+    }
+    const struct stateHdr* hdr = (const struct stateHdr*)(log->map + log->pos);
+    if (log->size - log->pos < sizeof(*hdr)
+        || log->size - log->pos - sizeof(*hdr) < PAD8(hdr->len))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    *type = hdr->type;
+    *data = hdr + 1;
+    *len = (size_t)hdr->len;
+    log->pos += sizeof(*hdr) + PAD8(hdr->len);
+    return 1;
+}
+
+/* Unmap a state being read. Safe to pass NULL. */
+void stateClose(struct stateLog* log)
+{
+    if (log == NULL)
+    {
+        return;
+    }
+    munmap((void*)log->map, log->size);
+    free(log);
+}
+
+/*
+ * Pass `state_fd` and `fd` over the connected Unix socket `sock`.
+ * Returns 0, or -1 with errno set.
+ */
+int stateSend(int sock, int state_fd, int fd)
+{
+    char byte = 'S';
+    struct iovec iov = { &byte, 1 };
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { state_fd, fd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t rc;
+    do
+    {
+        rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (rc == -1 && errno == EINTR);
+    return (rc == 1) ? 0 : -1;
+}
+
+/*
+ * Receive what stateSend passed; both fds are close-on-exec.
+ * Returns 0, or -1 with errno set: EPROTO when the message did not
+ * carry exactly two fds, ECONNRESET when the peer closed first.
+ */
+int stateRecv(int sock, int* state_fd, int* fd)
+{
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    ssize_t rc;
+    do
+    {
+        rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == -1)
+    {
+        return -1;
+    }
+
+    int fds[2] = { -1, -1 };
+    size_t got = 0;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL
+        && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), (got < 2 ? got : 2) * sizeof(int));
+    }
+    if (rc != 1
+        || got != 2
+        || (msg.msg_flags & MSG_CTRUNC))
+    {
+        for (size_t i = 0; i < got && i < 2; i++)
+        {
+            close(fds[i]);
+        }
+        errno = (rc == 0) ? ECONNRESET : EPROTO;
+        return -1;
+    }
+    *state_fd = fds[0];
+    *fd = fds[1];
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Internal: the handoff state of a Notify (notifyExport, notifyImport,
+ * notifySend, notifyRecv).
+ *
+ * Everything a Notify knows that the kernel does not: the watch table
+ * with each directory's entry set, pending directory-move cookies,
+ * queued events, moves waiting to be paired, events already finished
+ * but not yet taken, and the counters. It is written to a memfd, which
+ * travels next to the inotify fd itself, so a new process carries on
+ * reading the same fd with the same watches.
+ *
+ * Layout (native byte order; only meant to move between processes on
+ * one machine, built from the same library):
+ *
+ *     "RNOTSTA1"
+ *     record*     struct stateHdr, then `len` bytes padded to 8
+ *
+ * The record types and their payloads are the engine's business; this
+ * file only frames them and moves the two fds over a Unix socket.
+ */
+#ifndef LIBRNOTIFY_RNOTIFY_STATE_H_
+#define LIBRNOTIFY_RNOTIFY_STATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct stateLog;
+
+struct stateLog* stateCreate(void);
+int stateFinish(struct stateLog* log);
+int statePut(struct stateLog* log, uint32_t type, const struct iovec* iov, int n);
+void stateAbort(struct stateLog* log);
+
+struct stateLog* stateOpen(int fd);
+int stateNext(struct stateLog* log, uint32_t* type, const void** data, size_t* len);
+void stateClose(struct stateLog* log);
+
+int stateSend(int sock, int state_fd, int fd);
+int stateRecv(int sock, int* state_fd, int* fd);
+
+#endif // LIBRNOTIFY_RNOTIFY_STATE_H_
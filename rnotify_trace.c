@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "rnotify_trace.h"
+
+#ifdef RNOTIFY_TRACE
+
+/*
+ * One completed span. `begin` and `end` are CLOCK_MONOTONIC
+ * nanoseconds; `end` is written last and doubles as the "record is
+ * complete" flag for a concurrent dump.
+ */
+struct traceRec
+{
+    uint64_t begin;
+    uint64_t end;
+    uint32_t phase;
+    uint32_t tid;
+};
+
+/*
+ * Fixed-size ring of spans. Writers claim a slot with one atomic
+ * increment of `next` and overwrite the oldest record once the ring
+ * has wrapped; nothing ever blocks. `mask` is capacity - 1, capacity
+ * a power of two.
+ */
+struct traceRing
+{
+    unsigned long next;
+    size_t mask;
+    struct traceRec recs[];
+};
+
+static const char* const phaseNames[TRACE_PHASES] = {
+    "wait", "read", "parse", "exclude", "path", "rename", "crawl", "rescan",
+};
+
+static __thread uint32_t traceTid;
+
+/*
+ * Allocate a ring for at least `spans` records (rounded up to a power
+ * of two). Returns NULL with errno set on failure.
+ */
+struct traceRing* traceNew(size_t spans)
+{
+    size_t cap = 64;
+    while (cap < spans)
+    {
+        if (cap > ((size_t)-1 - sizeof(struct traceRing)) / sizeof(struct traceRec) / 2)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+        cap *= 2;
+    }
+
+    struct traceRing* ring = (struct traceRing*)calloc(1, sizeof(struct traceRing) + cap * sizeof(struct traceRec));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->mask = cap - 1;
+    return ring;
+}
+
+void traceFree(struct traceRing* ring)
+{
+    free(ring);
+}
+
+/* Start of a span: 0 (nothing recorded later) when tracing is off. */
+uint64_t traceNow(const struct traceRing* ring)
+{
+    if (ring == NULL)
+    {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void traceRecord(struct traceRing* ring, enum tracePhase phase, uint64_t begin)
+{
+    if (ring == NULL
+        || begin == 0)
+    {
+        return;
+    }
+    uint64_t end = traceNow(ring);
+    if (traceTid == 0)
+    {
+        traceTid = (uint32_t)syscall(SYS_gettid);
+    }
+
+    unsigned long slot = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+    struct traceRec* r = &ring->recs[slot & ring->mask];
+    /* end doubles as a sequence: 0 while the fields change */
+    __atomic_store_n(&r->end, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&r->begin, begin, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->phase, (uint32_t)phase, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->tid, traceTid, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->end, end, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the ring, oldest span first, as Chrome trace-event JSON
+ * ("X" complete events, microsecond timestamps) to `fd`. Records
+ * being overwritten while we read are skipped.
+ *
+ * Returns the number of spans written, or -1 with errno set.
+ */
+int traceDump(const struct traceRing* ring, int fd)
+{
+    unsigned long next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+    size_t cap = ring->mask + 1;
+    unsigned long first = (next > cap) ? next - cap : 0;
+    int pid = (int)getpid();
+    int written = 0;
+
+    if (dprintf(fd, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[") < 0)
+    {
+        return -1;
+    }
+    for (unsigned long i = first; i < next; i++)
+    {
+        const struct traceRec* r = &ring->recs[i & ring->mask];
+        uint64_t end = __atomic_load_n(&r->end, __ATOMIC_ACQUIRE);
+        uint64_t begin = __atomic_load_n(&r->begin, __ATOMIC_RELAXED);
+        uint32_t phase = __atomic_load_n(&r->phase, __ATOMIC_RELAXED);
+        uint32_t tid = __atomic_load_n(&r->tid, __ATOMIC_RELAXED);
+        /* a writer got to the record while we copied it: end changed */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (end == 0
+            || end != __atomic_load_n(&r->end, __ATOMIC_RELAXED)
+            || end < begin
+            || phase >= TRACE_PHASES)
+        {
+            continue;
+        }
+        if (dprintf(fd, "%s\n{\"name\":\"%s\",\"cat\":\"rnotify\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u}",
+                written ? "," : "",
+                phaseNames[phase], pid, tid,
+                (unsigned long long)(begin / 1000), (unsigned int)(begin % 1000),
+                (unsigned long long)((end - begin) / 1000), (unsigned int)((end - begin) % 1000)) < 0)
+        {
+            return -1;
+        }
+        written++;
+    }
+    if (dprintf(fd, "\n]}\n") < 0)
+    {
+        return -1;
+    }
+
+    return written;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Internal: per-phase timing spans for the event engine.
+ *
+ * Built only with -DRNOTIFY_TRACE (make TRACE=1). Without it every
+ * TRACE_* macro expands to nothing and the engine carries no trace
+ * state at all. With it, spans are recorded only for a Notify whose
+ * NotifyOptions.trace asked for a ring, so a trace build still costs
+ * a single pointer test per span when tracing is off at runtime.
+ *
+ * Usage around a phase:
+ *
+ *     TRACE_BEGIN(ntf, t);
+ *     ...phase...
+ *     TRACE_END(ntf, t, TRACE_READ);
+ */
+#ifndef LIBRNOTIFY_RNOTIFY_TRACE_H_
+#define LIBRNOTIFY_RNOTIFY_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Phases, in the order they are named in the dump. */
+enum tracePhase
+{
+    TRACE_WAIT,     /* select() on the inotify fd */
+    TRACE_READ,     /* read() of the pending bytes */
+    TRACE_PARSE,    /* splitting a read into queued events */
+    TRACE_EXCLUDE,  /* exclude regex on one name */
+    TRACE_PATH,     /* building the delivered path */
+    TRACE_RENAME,   /* renameWatches over the watch table */
+    TRACE_CRAWL,    /* addNotify: add_watch plus readdir of one directory */
+    TRACE_RESCAN,   /* overflow recovery */
+    TRACE_PHASES
+};
+
+struct traceRing;
+
+#ifdef RNOTIFY_TRACE
+
+struct traceRing* traceNew(size_t spans);
+void traceFree(struct traceRing* ring);
+uint64_t traceNow(const struct traceRing* ring);
+void traceRecord(struct traceRing* ring, enum tracePhase phase, uint64_t begin);
+int traceDump(const struct traceRing* ring, int fd);
+
+#define TRACE_BEGIN(ntf, var)        uint64_t var = traceNow((ntf)->trace)
+#define TRACE_END(ntf, var, phase)   traceRecord((ntf)->trace, (phase), var)
+
+#else
+
+#define TRACE_BEGIN(ntf, var)        do { } while (0)
+#define TRACE_END(ntf, var, phase)   do { } while (0)
+
+#endif
+
+#endif // LIBRNOTIFY_RNOTIFY_TRACE_H_
@@ -0,0 +1,81 @@
+/**
+  * https://github.com/zmushko/librnotify
+  * use it as you want but keep this header (if you want)
+  */
+#ifndef LIBRNOTIFY_RNOTIFY_URING_H_
+#define LIBRNOTIFY_RNOTIFY_URING_H_
+
+/*
+ * Helpers for reading a Notify through the caller's io_uring. Header
+ * only, and written against the kernel's <linux/io_uring.h> so that
+ * they work with liburing's rings as well as hand-rolled ones; the
+ * library itself does not depend on io_uring (NOTIFY_STAT_URING sets
+ * up a private ring only when the kernel offers one).
+ *
+ * Create the Notify with NotifyOptions.external_read, then for each
+ * batch:
+ *
+ *     sqe = io_uring_get_sqe(&ring);
+ *     notifyPrepRead(sqe, ntf, buf, len, buf_index, tag);
+ *     ... submit, reap the cqe tagged `tag` ...
+ *     notifyCompleteRead(ntf, cqe->res, buf);
+ *     notifyDispatch(ntf, 0, 0);
+ *
+ * `len` should be at least sizeof(struct inotify_event) + NAME_MAX + 1
+ * (the kernel fails shorter reads with EINVAL); a few pages is typical.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+#include "rnotify.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Prepare `sqe` to read the inotify fd of `ntf` into buf[0..len).
+ * With buf_index >= 0 the read uses that registered buffer
+ * (IORING_OP_READ_FIXED; `buf` must lie inside it), otherwise a plain
+ * IORING_OP_READ.
+ */
+static inline void notifyPrepRead(struct io_uring_sqe* sqe, const Notify* ntf, void* buf, unsigned int len, int buf_index, uint64_t user_data)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (buf_index >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = notifyFd(ntf);
+    sqe->off = (uint64_t)-1;    /* the fd is a stream: current position */
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    if (buf_index >= 0)
+    {
+        sqe->buf_index = (uint16_t)buf_index;
+    }
+    sqe->user_data = user_data;
+}
+
+/*
+ * Complete a read prepared by notifyPrepRead: `res` is the cqe's
+ * result. Feeds the bytes to the engine (see notifyFeed).
+ *
+ * Returns 0 on success, -1 with errno set (from the read itself when
+ * res < 0). EAGAIN means a bounded queue is full: dispatch, then
+ * complete again with the same buffer before reusing it.
+ */
+static inline int notifyCompleteRead(Notify* ntf, int res, const void* buf)
+{
+    if (res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    return notifyFeed(ntf, buf, (size_t)res);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBRNOTIFY_RNOTIFY_URING_H_
@@ -8,6 +8,21 @@
 
 #define MAX_MEMORY_SIZE 1000*1024
 
+static void onEvent(const char* path, uint32_t mask, uint32_t cookie, void* arg)
+{
+    (void)mask;
+    printf("%s \t%s cookie=%d\n", (const char*)arg, path, cookie);
+}
+
+static void onOverflow(const char* path, uint32_t mask, uint32_t cookie, void* arg)
+{
+    (void)path;
+    (void)mask;
+    (void)cookie;
+    (void)arg;
+    printf("overflow\n");
+}
+
 int main(int argc, char* argv[])
 {
     if (argc != 2)
@@ -33,12 +48,16 @@ int main(int argc, char* argv[])
         exit(EXIT_FAILURE);
     }
 
+    notifyOn(ntf, IN_CREATE, onEvent, "create");
+    notifyOn(ntf, IN_DELETE, onEvent, "delete");
+    notifyOn(ntf, IN_MOVED_FROM, onEvent, "moved from");
+    notifyOn(ntf, IN_MOVED_TO, onEvent, "moved to");
+    notifyOn(ntf, IN_Q_OVERFLOW, onOverflow, NULL);
+    //notifyOn(ntf, IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY, onEvent, "changed");
+
     for (;;)
     {
-        char* path = NULL;
-        uint32_t mask = 0;
-        uint32_t cookie = 0;
-        if (-1 == waitNotify(ntf, &path, &mask, -1, &cookie))
+        if (-1 == notifyDispatch(ntf, 0, -1))
         {
             if (errno == ENOSPC)
             {
@@ -50,77 +69,6 @@ int main(int argc, char* argv[])
             }
             exit(EXIT_FAILURE);
         }
-        if (path == NULL)
-        {
-            printf("path=NULL\n");
-            //exit(EXIT_FAILURE);
-        }
-        if (mask & IN_ATTRIB)
-        {
-            //printf("attrib \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_CLOSE_WRITE)
-        {
-            //printf("close write \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_CLOSE_NOWRITE)
-        {
-            //printf("close nowrite \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_ACCESS)
-        {
-            //printf("access \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_MODIFY)
-        {
-            //printf("modify \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_OPEN)
-        {
-            //printf("open \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_CREATE)
-        {
-            printf("create \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_DELETE)
-        {
-            printf("delete \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_DELETE_SELF)
-        {
-            //printf("delete self %s\n", path);
-        }
-        if (mask & IN_MOVE_SELF)
-        {
-            //printf("move self %s\n", path);
-        }
-        if (mask & IN_MOVED_FROM)
-        {
-            printf("moved from \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_MOVED_TO)
-        {
-            printf("moved to \t%s cookie=%d\n", path, cookie);
-        }
-        if (mask & IN_Q_OVERFLOW)
-        {
-            printf("overflow\n");
-            //exit(-1);
-        }
-        if (!strlen(path))
-        {
-            printf("path=0\n");
-            exit(-1);
-        }
-        /*
-        if (strstr(path, "000000"))
-        {
-            free(path);
-            break;
-        }
-        */
-        free(path);
     }
 
     freeNotify(ntf);
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Allocator hooks: with NotifyOptions.allocator every block the library
+# allocates, paths handed to the consumer included, must come back
+# through the same hooks. The reporter's counting allocator tags its
+# blocks and aborts on a foreign one, so a stray malloc or free kills
+# the run; at exit nothing may be left live. Covered with the default
+# consumer, threaded mode, a pool, and an overflow rescan. The event
+# record pool must cut allocations for the same workload.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== alloc_hooks =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP" "${EVENTS_LOG:-}" "${READY_LOG:-}"' EXIT
+
+alloc() {
+    sed -n "s/^ALLOC.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+# workload <dir>: files, a directory tree, a rename and a delete
+workload() {
+    mkdir -p "$1/d/e"
+    (cd "$1/d" && seq -f "f%g" 1 200 | xargs touch)
+    echo data >"$1/d/e/long-name-that-does-not-fit-in-an-event-record.txt"
+    mv "$1/d" "$1/moved"
+    rm -rf "$1/moved/e"
+    touch "$1/moved/last"
+}
+
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+
+# run <label> [reporter options...]: the workload, then the checks.
+# With FLOOD=1 the kernel queue overflows first (pass -w to stall).
+run() {
+    label=$1
+    shift
+    rm -f "${EVENTS_LOG:-}" "${READY_LOG:-}"
+    rm -rf "$TMP/watch"
+    mkdir -p "$TMP/watch/pre/sub"
+    touch "$TMP/watch/pre/sub/old"
+    start_reporter "$TMP/watch" -A "$@"
+    if [ "${FLOOD:-0}" = 1 ]; then
+        # only the root is watched before the first read
+        (cd "$TMP/watch" && seq -f "flood%g" 1 $((queued / 2 + 1000)) | xargs touch)
+    fi
+    workload "$TMP/watch"
+    wait_for_event "CLOSE_WRITE 0 $TMP/watch/moved/last" 300 || true
+    stop_reporter
+
+    assert_event "CLOSE_WRITE 0 $TMP/watch/moved/last" "$label: events delivered"
+    allocs=$(alloc allocs)
+    live=$(alloc live)
+    if [ -n "$allocs" ] && [ "$allocs" -gt 0 ] && [ "$live" = 0 ]; then
+        echo "  PASS  $label: every block released through the hooks ($allocs allocations)"
+    else
+        echo "  FAIL  $label: allocs=${allocs:-missing} live=${live:-missing}"
+        cat "$READY_LOG"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+run default
+plain=$allocs
+run pooled -E 256
+pooled=$allocs
+run threaded -t
+run workers -p 2
+FLOOD=1 run rescan -w 3000 -x '^nothing$'
+assert_event "RESCAN_END" "rescan: overflow repaired"
+
+if [ -n "$plain" ] && [ -n "$pooled" ] && [ "$pooled" -lt "$plain" ]; then
+    echo "  PASS  event pool saves allocations ($plain -> $pooled)"
+else
+    echo "  FAIL  event pool did not save allocations (${plain:-?} -> ${pooled:-?})"
+    FAILED=$((FAILED + 1))
+fi
+
+exit $FAILED
@@ -0,0 +1,357 @@
+/*
+ * Checks for rnotify.hpp, the C++20 interface.
+ *
+ * Watches the scratch directory and, each printed as a PASS/FAIL line:
+ *   - tryNext hands out events whose path views the library's string;
+ *   - take() returns a contiguous range whose event array lives in a
+ *     monotonic buffer, numbered in order by Event::info;
+ *   - a coroutine awaiting Watcher::next on a poll(2) loop suspends on
+ *     an idle fd and is resumed by that loop with the next events, in
+ *     plain and threaded mode;
+ *   - a moved-from Watcher is empty and the moved-to one works;
+ *   - with rename_window a rename's old path is in Event::from, and a
+ *     coroutine awaiting a move out of the tree is resumed once the
+ *     window ends although the fd stays quiet;
+ *   - with a memory_resource the library allocates through it and has
+ *     returned everything once the Watchers are gone.
+ *
+ * Usage: cxx_api <scratch-dir>
+ *
+ * Exits 0 when every check passed, 1 otherwise.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <ranges>
+#include <string>
+#include <vector>
+
+#include "rnotify.hpp"
+
+/* changes only: the library's own readdir would show up otherwise */
+#define CXX_MASK (IN_ALL_EVENTS & ~(IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE))
+
+static_assert(std::ranges::contiguous_range<rnotify::Batch>);
+
+static int g_failed = 0;
+
+static void check(bool ok, const std::string& what)
+{
+    std::printf("  %s  %s\n", ok ? "PASS" : "FAIL", what.c_str());
+    if (!ok)
+    {
+        g_failed++;
+    }
+}
+
+static void touch(const std::string& path)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+/* Counts what goes through it; backed by new/delete. */
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+    long allocs = 0;
+    long live = 0;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        allocs++;
+        live++;
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t align) override
+    {
+        live--;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+/* A one-fd event loop: the smallest thing that satisfies rnotify::Executor. */
+class PollLoop
+{
+public:
+    void waitReadable(int fd, int timeout, rnotify::detail::ReadyCallback cb)
+    {
+        fd_ = fd;
+        timeout_ = timeout;
+        cb_ = cb;
+        armed_ = true;
+    }
+
+    /* Run callbacks until nothing is armed or `ms` pass without readiness. */
+    bool run(int ms)
+    {
+        while (armed_)
+        {
+            struct pollfd pfd = { fd_, POLLIN, 0 };
+            int wait = (timeout_ >= 0 && timeout_ < ms) ? timeout_ : ms;
+            int rc = poll(&pfd, 1, wait);
+            if (rc < 0
+                || (rc == 0 && wait == ms))
+            {
+                return false;
+            }
+            armed_ = false;
+            cb_();
+        }
+        return true;
+    }
+
+    bool armed() const
+    {
+        return armed_;
+    }
+
+private:
+    int fd_ = -1;
+    int timeout_ = -1;
+    rnotify::detail::ReadyCallback cb_ = { nullptr, nullptr };
+    bool armed_ = false;
+};
+
+/* Eager, fire-and-forget coroutine. */
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/* Collect events until CLOSE_WRITE of `last` has been seen. */
+static Task collect(rnotify::Watcher& w, PollLoop& loop, std::string last,
+                    std::vector<std::string>& seen, bool& done)
+{
+    for (;;)
+    {
+        rnotify::Event ev = co_await w.next(loop);
+        seen.emplace_back(ev.path);
+        if (ev.has(IN_CLOSE_WRITE) && ev.path == last)
+        {
+            break;
+        }
+    }
+    done = true;
+}
+
+/* Await a single event and keep a copy of it. */
+static Task one(rnotify::Watcher& w, PollLoop& loop, std::string& path, uint32_t& mask)
+{
+    rnotify::Event ev = co_await w.next(loop);
+    path = ev.path;
+    mask = ev.mask;
+}
+
+/* Drain until the scan marker, so that the fd starts out idle. */
+static void settle(rnotify::Watcher& w)
+{
+    while (auto ev = w.tryNext(1000))
+    {
+        if (ev->has(NOTIFY_SCAN_DONE))
+        {
+            break;
+        }
+    }
+}
+
+static void coroutineCase(const std::string& dir, bool threaded)
+{
+    const char* label = threaded ? "threaded" : "plain";
+    NotifyOptions opts = {};
+    opts.threaded = threaded;
+    rnotify::Watcher w(dir, CXX_MASK, nullptr, opts);
+    settle(w);
+
+    PollLoop loop;
+    std::vector<std::string> seen;
+    bool done = false;
+    collect(w, loop, dir + "/c2", seen, done);
+    check(loop.armed() && !done, std::string(label) + ": coroutine suspends on an idle fd");
+
+    touch(dir + "/c1");
+    touch(dir + "/c2");
+    loop.run(5000);
+    check(done, std::string(label) + ": the loop resumes it until the last event");
+    check(std::find(seen.begin(), seen.end(), dir + "/c1") != seen.end(),
+          std::string(label) + ": earlier events delivered on the way");
+
+    unlink((dir + "/c1").c_str());
+    unlink((dir + "/c2").c_str());
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        std::fprintf(stderr, "usage: %s <scratch-dir>\n", argv[0]);
+        return 1;
+    }
+    const std::string dir = argv[1];
+    std::printf("== cxx_api ==\n");
+
+    CountingResource counting;
+    try
+    {
+        rnotify::Watcher w(dir, CXX_MASK, nullptr, {}, &counting);
+        settle(w);
+
+        touch(dir + "/a");
+        std::optional<rnotify::Event> ev;
+        while ((ev = w.tryNext(2000)) && !ev->has(IN_CREATE))
+        {
+        }
+        check(ev && ev->path == dir + "/a", "tryNext: CREATE with the full path");
+        check(ev && ev->info.seq > 0 && ev->info.wd >= 0 && ev->info.origin == NOTIFY_ORIGIN_KERNEL,
+              "tryNext: the event carries its info");
+        check(counting.allocs > 0, "the library allocates through the memory_resource");
+
+        for (int i = 0; i < 10; i++)
+        {
+            touch(dir + "/b" + std::to_string(i));
+        }
+        std::array<std::byte, 4096> buf;
+        std::pmr::monotonic_buffer_resource arena(buf.data(), buf.size(), std::pmr::null_memory_resource());
+        long closes = 0;
+        bool in_arena = true;
+        uint64_t last_seq = ev ? ev->info.seq : 0;
+        bool numbered = true;
+        for (int tries = 0; closes < 10 && tries < 50; tries++)
+        {
+            rnotify::Batch batch = w.take(8, 200, &arena);
+            in_arena = in_arena && (batch.empty()
+                || ((const std::byte*)batch.begin() >= buf.data()
+                    && (const std::byte*)batch.end() <= buf.data() + buf.size()));
+            closes += std::ranges::count_if(batch, [](const rnotify::Event& e)
+            {
+                return e.has(IN_CLOSE_WRITE) && e.path.find("/b") != std::string_view::npos;
+            });
+            for (const rnotify::Event& e : batch)
+            {
+                numbered = numbered && e.info.seq > last_seq;
+                last_seq = e.info.seq;
+            }
+            if (batch.empty())
+            {
+                arena.release();
+            }
+        }
+        check(closes == 10, "take: every CLOSE_WRITE comes in batches (" + std::to_string(closes) + ")");
+        check(in_arena, "take: batch storage lives in the monotonic buffer");
+        check(numbered, "take: sequence numbers increase");
+
+        rnotify::Watcher moved(std::move(w));
+        check(w.nativeHandle() == nullptr && moved.nativeHandle() != nullptr, "move leaves the source empty");
+        touch(dir + "/m");
+        while ((ev = moved.tryNext(2000)) && !ev->has(IN_CLOSE_WRITE))
+        {
+        }
+        check(ev && ev->path == dir + "/m", "moved-to Watcher keeps delivering");
+
+        unlink((dir + "/a").c_str());
+        unlink((dir + "/m").c_str());
+        for (int i = 0; i < 10; i++)
+        {
+            unlink((dir + "/b" + std::to_string(i)).c_str());
+        }
+    }
+    catch (const std::system_error& e)
+    {
+        check(false, std::string("unexpected error: ") + e.what());
+    }
+    check(counting.allocs > 0 && counting.live == 0,
+          "everything returned to the memory_resource (" + std::to_string(counting.live) + " live)");
+
+    try
+    {
+        coroutineCase(dir, false);
+        coroutineCase(dir, true);
+    }
+    catch (const std::system_error& e)
+    {
+        check(false, std::string("unexpected error: ") + e.what());
+    }
+
+    try
+    {
+        NotifyOptions opts = {};
+        opts.rename_window = 200;
+        rnotify::Watcher w(dir, CXX_MASK, nullptr, opts);
+        touch(dir + "/old");
+        settle(w);
+        rename((dir + "/old").c_str(), (dir + "/new").c_str());
+        std::optional<rnotify::Event> ev;
+        while ((ev = w.tryNext(2000)) && !ev->has(NOTIFY_RENAME))
+        {
+        }
+        check(ev && ev->path == dir + "/new" && ev->from == dir + "/old", "a paired rename carries its old path");
+        unlink((dir + "/new").c_str());
+    }
+    catch (const std::system_error& e)
+    {
+        check(false, std::string("unexpected error: ") + e.what());
+    }
+
+    try
+    {
+        /* the IN_MOVED_FROM is held and nothing more comes on the fd */
+        const std::string tree = dir + "/tree";
+        mkdir(tree.c_str(), 0755);
+        touch(tree + "/out");
+        NotifyOptions opts = {};
+        opts.rename_window = 200;
+        rnotify::Watcher w(tree, CXX_MASK, nullptr, opts);
+        settle(w);
+
+        PollLoop loop;
+        std::string path;
+        uint32_t mask = 0;
+        one(w, loop, path, mask);
+        check(loop.armed() && path.empty(), "lone move: coroutine suspends on an idle fd");
+        rename((tree + "/out").c_str(), (dir + "/away").c_str());
+        loop.run(5000);
+        check(path == tree + "/out" && (mask & IN_DELETE),
+              "lone move: next() resumes with IN_DELETE once the window ends");
+        unlink((dir + "/away").c_str());
+        rmdir(tree.c_str());
+    }
+    catch (const std::system_error& e)
+    {
+        check(false, std::string("unexpected error: ") + e.what());
+    }
+
+    try
+    {
+        rnotify::Watcher missing(dir + "/does-not-exist");
+        check(false, "a missing root throws");
+    }
+    catch (const std::system_error& e)
+    {
+        check(e.code() == std::errc::no_such_file_or_directory, "a missing root throws ENOENT");
+    }
+
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+# C++20 interface (rnotify.hpp): RAII Watcher, string_view events, take()
+# batches in a pmr buffer, the awaitable on a poll(2) loop, and a
+# memory_resource backing the library's allocations. The checks live in
+# the cxx_api driver.
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+"$(dirname "$0")/cxx_api" "$TMP"
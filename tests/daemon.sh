@@ -0,0 +1,149 @@
+#!/bin/sh
+# daemon/rnotifyd and its clients (reporter -C):
+#   - a client gets the events under its prefix and nothing else, in
+#     the order they happened;
+#   - a mask and a filter narrow a subscription down;
+#   - events travel in batches (fewer frames than events), which a
+#     client drains with notifyClientWait and timeout 0 until the path
+#     comes back NULL;
+#   - a filter the daemon cannot compile is refused with EINVAL;
+#   - a client that stops reading gets one IN_Q_OVERFLOW once it reads
+#     again and then the events that follow, while another one misses
+#     nothing.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== daemon =="
+FAILED=0
+TMP=$(mktemp -d)
+DAEMON=$TESTS_DIR/../daemon/rnotifyd
+[ -x "$DAEMON" ] || { echo "build the daemon first: cd .. && make daemon"; exit 2; }
+PIDS=""
+DAEMON_PID=""
+trap 'for p in $PIDS $DAEMON_PID; do kill $p 2>/dev/null || true; done; rm -rf "$TMP"' EXIT
+
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# wait_in <file> <fixed string>
+wait_in() {
+    waited=0
+    while [ $waited -lt 100 ] && ! grep -Fq "$2" "$1" 2>/dev/null; do
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+}
+
+# start_daemon [options...]: rnotifyd on $TMP/sock for $TMP/watch
+start_daemon() {
+    "$DAEMON" "$@" "$TMP/sock" "$TMP/watch" 2>"$TMP/daemon.err" &
+    DAEMON_PID=$!
+    wait_in "$TMP/daemon.err" "READY"
+}
+
+# stop_daemon: stop it, its STATS line is in $TMP/daemon.err
+stop_daemon() {
+    kill -TERM "$DAEMON_PID" 2>/dev/null || true
+    wait "$DAEMON_PID" 2>/dev/null || true
+    DAEMON_PID=""
+}
+
+# client <name> <prefix> [options...]: a subscriber in the background,
+# its events in $TMP/<name>.out
+client() {
+    name=$1
+    prefix=$2
+    shift 2
+    "$REPORTER" -C "$TMP/sock" "$@" "$prefix" >"$TMP/$name.out" 2>"$TMP/$name.err" &
+    PIDS="$PIDS $!"
+    eval "PID_$name=$!"
+    wait_in "$TMP/$name.err" "READY"
+}
+
+stop() {
+    pid=$(eval echo "\$PID_$1")
+    kill -TERM "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+}
+
+# value of one counter in the daemon's STATS line
+stat_of() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$TMP/daemon.err"
+}
+
+# prefixes, mask, filter
+mkdir -p "$TMP/watch/a" "$TMP/watch/b"
+start_daemon
+client a "$TMP/watch/a"
+client b "$TMP/watch/b"
+client all "$TMP/watch" -M 0x100
+client txt "$TMP/watch" -f '\.txt$'
+i=0
+while [ $i -lt 200 ]; do
+    echo $i >"$TMP/watch/a/f$i"
+    i=$((i + 1))
+done
+touch "$TMP/watch/b/one" "$TMP/watch/b/two.txt" "$TMP/watch/ab"
+touch "$TMP/watch/a/last" "$TMP/watch/b/last"
+wait_in "$TMP/a.out" "CLOSE_WRITE 0 $TMP/watch/a/last"
+wait_in "$TMP/b.out" "CLOSE_WRITE 0 $TMP/watch/b/last"
+wait_in "$TMP/all.out" "CREATE 0 $TMP/watch/b/last"
+wait_in "$TMP/txt.out" "CLOSE_WRITE 0 $TMP/watch/b/two.txt"
+for c in a b all txt; do stop $c; done
+stop_daemon
+
+check "prefix: every write under a/" [ "$(grep -c "^EVENT CLOSE_WRITE 0 $TMP/watch/a/f" "$TMP/a.out")" = 200 ]
+check "prefix: in order" sh -c "grep '^EVENT CREATE 0 $TMP/watch/a/f' '$TMP/a.out' | sed 's/.*f//' | sort -nc"
+check "prefix: nothing from elsewhere" [ "$(grep -vc " $TMP/watch/a/" "$TMP/a.out")" = 0 ]
+check "prefix: b/ only has its own" [ "$(grep -vc " $TMP/watch/b/" "$TMP/b.out")" = 0 ]
+check "prefix: a sibling sharing its name start is not under it" [ "$(grep -c " $TMP/watch/ab$" "$TMP/a.out")" = 0 ]
+check "mask: IN_CREATE only" [ "$(grep -vc "^EVENT CREATE " "$TMP/all.out")" = 0 ]
+check "mask: from the whole tree" grep -Fq "CREATE 0 $TMP/watch/ab" "$TMP/all.out"
+check "filter: only .txt paths" [ "$(grep -vc '\.txt$' "$TMP/txt.out")" = 0 ]
+check "filter: the .txt path" grep -Fq "CREATE 0 $TMP/watch/b/two.txt" "$TMP/txt.out"
+check "batching: fewer frames ($(stat_of frames)) than events ($(stat_of events))" \
+    [ "$(stat_of frames)" -lt "$(stat_of events)" ]
+check "drain: timeout 0 clears the path once the batch is out" \
+    sh -c "! grep -q 'left the path set' '$TMP/a.err' '$TMP/b.err' '$TMP/all.err' '$TMP/txt.err'"
+
+# a filter that does not compile
+start_daemon
+if "$REPORTER" -C "$TMP/sock" -f '(' "$TMP/watch" >/dev/null 2>"$TMP/bad.err"; then
+    check "bad filter: refused" false
+else
+    check "bad filter: refused" grep -q "Invalid argument" "$TMP/bad.err"
+fi
+stop_daemon
+
+# a stalled client with little room overflows; a reading one does not
+start_daemon -b 4096
+client slow "$TMP/watch" -w 2000
+client fast "$TMP/watch"
+i=0
+while [ $i -lt 1000 ]; do
+    touch "$TMP/watch/s$i"
+    i=$((i + 1))
+done
+touch "$TMP/watch/final"
+wait_in "$TMP/fast.out" "CLOSE_WRITE 0 $TMP/watch/final"
+wait_in "$TMP/slow.out" "OVERFLOW"
+touch "$TMP/watch/after"
+wait_in "$TMP/slow.out" "CLOSE_WRITE 0 $TMP/watch/after"
+stop slow
+stop fast
+stop_daemon
+check "slow: one IN_Q_OVERFLOW" [ "$(grep -c "^EVENT OVERFLOW" "$TMP/slow.out")" = 1 ]
+check "slow: then the events that came after" grep -Fq "CLOSE_WRITE 0 $TMP/watch/after" "$TMP/slow.out"
+check "fast: no overflow" [ "$(grep -c "OVERFLOW" "$TMP/fast.out")" = 0 ]
+check "fast: every event" [ "$(grep -c "^EVENT CREATE 0 $TMP/watch/s" "$TMP/fast.out")" = 1000 ]
+check "slow: counted ($(stat_of overflows))" [ "$(stat_of overflows)" = 1 ]
+
+exit $FAILED
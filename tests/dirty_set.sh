@@ -0,0 +1,103 @@
+#!/bin/sh
+# NotifyOptions.dirty (reporter -D): events fold into a set of changed
+# directories that notifyTakeDirty hands over.
+#   - thousands of writes come out as a line or two for their
+#     directory (one per take), with the merged mask, and no directory
+#     twice in a take;
+#   - a new directory is watched and reported, a renamed one under its
+#     new path, a removed one not at all (its parent says DELETE|ISDIR);
+#   - the mode does not combine with threaded reading.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== dirty_set =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# value of one counter in the STATS line
+stat_of() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+# dirty_lines <dir>: DIRTY lines for exactly that directory
+dirty_lines() {
+    awk -v d="$1" '/^DIRTY / && $3 == d' "$EVENTS_LOG"
+}
+
+# has_dirty <dir> <flag regex>: a DIRTY line for <dir> with such flags
+has_dirty() {
+    dirty_lines "$1" | grep -q "^DIRTY [^ ]*$2"
+}
+
+# no_repeats: no directory twice between two TAKE lines
+no_repeats() {
+    awk '/^DIRTY / { if (seen[$3]++) bad = 1 } /^TAKE / { delete seen } END { exit bad }' "$EVENTS_LOG"
+}
+
+# burst: the reporter stalls while the writes pile up, then takes once
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/d"
+start_reporter "$TMP/watch" -D 200 -w 1500 -s watches
+i=0
+while [ $i -lt 2000 ]; do
+    echo $i >"$TMP/watch/d/f$((i % 20))"
+    i=$((i + 1))
+done
+touch "$TMP/watch/done"
+wait_for_event "TAKE" 50 || true
+sleep 0.5
+stop_reporter
+d_lines=$(dirty_lines "$TMP/watch/d" | wc -l)
+takes=$(grep -c "^TAKE" "$EVENTS_LOG" || true)
+check "burst: 2000 writes, one line for the directory per take ($d_lines in $takes)" \
+    [ "$d_lines" -ge 1 -a "$d_lines" -le "$takes" -a "$takes" -le 20 ]
+check "burst: its mask merges the writes" \
+    has_dirty "$TMP/watch/d" "MODIFY.*CLOSE_WRITE"
+check "burst: the events were folded ($(stat_of events_folded))" [ "$(stat_of events_folded)" -ge 2000 ]
+check "burst: none went through the queue ($(stat_of queue_peak))" [ "$(stat_of queue_peak)" -lt 10 ]
+rm -f "$EVENTS_LOG" "$READY_LOG"
+
+# structure: new, renamed and removed directories, all in one take
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/a/b" "$TMP/watch/gone"
+start_reporter "$TMP/watch" -D 100 -w 1000 -s watches
+mkdir "$TMP/watch/new"
+touch "$TMP/watch/new/f"
+mv "$TMP/watch/a" "$TMP/watch/z"
+touch "$TMP/watch/z/b/f"
+touch "$TMP/watch/gone/f"
+rm -rf "$TMP/watch/gone"
+wait_for_event "TAKE" 50 || true
+stop_reporter
+check "structure: no directory twice in a take" no_repeats
+check "structure: the new directory is watched" \
+    has_dirty "$TMP/watch/new" CREATE
+check "structure: the renamed directory under its new path" \
+    has_dirty "$TMP/watch/z/b" CREATE
+check "structure: the removed directory is not reported" \
+    [ -z "$(dirty_lines "$TMP/watch/gone")" ]
+check "structure: its parent says so" \
+    has_dirty "$TMP/watch" "DELETE.*ISDIR"
+check "structure: nothing left in the set ($(stat_of dirty_dirs))" [ "$(stat_of dirty_dirs)" = 0 ]
+rm -f "$EVENTS_LOG" "$READY_LOG"
+
+# not with threaded reading
+if "$REPORTER" -D 100 -t "$TMP" >/dev/null 2>"$TMP/err"; then
+    check "threaded: rejected" false
+else
+    check "threaded: rejected" grep -q "Invalid argument" "$TMP/err"
+fi
+
+exit $FAILED
@@ -0,0 +1,66 @@
+#!/bin/sh
+# notifyOn / notifyDispatch routing. The reporter registers a catch-all
+# handler and then one handler per flag. Each event must reach exactly
+# the handlers whose bits it carries, once each, in registration order.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== dispatch_routing =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -o
+
+mkdir "$TMP/watch/dir"
+touch "$TMP/watch/file"
+rm "$TMP/watch/file"
+
+drain
+
+# the lines a single event produced: its EVENT line and the ON lines
+# that follow it (the SCAN progress line is not a handler's)
+lines_for() {
+    awk -v ev="$1" '
+        $0 == ev { on = 1; print; next }
+        /^EVENT / { on = 0 }
+        on && /^ON / { print }' "$EVENTS_LOG"
+}
+
+expect_lines() {
+    desc=$1
+    got=$2
+    want=$3
+    if [ "$got" = "$want" ]; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        echo "        want: $(echo "$want" | tr '\n' '/')"
+        echo "        got:  $(echo "$got" | tr '\n' '/')"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+expect_lines "CREATE|ISDIR reaches CREATE then ISDIR handlers" \
+    "$(lines_for "EVENT CREATE|ISDIR 0 $TMP/watch/dir")" \
+    "EVENT CREATE|ISDIR 0 $TMP/watch/dir
+ON CREATE $TMP/watch/dir
+ON ISDIR $TMP/watch/dir"
+
+expect_lines "plain CREATE reaches only the CREATE handler" \
+    "$(lines_for "EVENT CREATE 0 $TMP/watch/file")" \
+    "EVENT CREATE 0 $TMP/watch/file
+ON CREATE $TMP/watch/file"
+
+expect_lines "DELETE reaches only the DELETE handler" \
+    "$(lines_for "EVENT DELETE 0 $TMP/watch/file")" \
+    "EVENT DELETE 0 $TMP/watch/file
+ON DELETE $TMP/watch/file"
+
+expect_lines "library markers are routed like kernel bits" \
+    "$(lines_for "EVENT SCAN_DONE 0 " | head -n 2)" \
+    "EVENT SCAN_DONE 0 
+ON SCAN_DONE "
+
+exit $FAILED
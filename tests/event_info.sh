@@ -0,0 +1,109 @@
+#!/bin/sh
+# What waitNotifyInfo / notifyEventInfo report with each event
+# (reporter -i prints it on an INFO line after the EVENT line):
+#   - sequence numbers increase with every event, plain and threaded,
+#     and timestamps are set;
+#   - entries found by the initial scan are CRAWL, changes read from
+#     the fd are KERNEL and carry the directory's wd and inode, the
+#     SCAN_DONE marker is MARKER;
+#   - a drop under NOTIFY_QUEUE_DROP leaves a gap in the numbers;
+#   - what the overflow rescan makes up is RESCAN (it is queued ahead of
+#     what was read before the overflow, so numbers go back there).
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== event_info =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# info_of <fixed string>: the INFO line after the first EVENT line
+# containing it.
+info_of() {
+    awk -v p="$1" 'found && /^INFO / { print; exit } /^EVENT / { found = index($0, p) > 0 }' "$EVENTS_LOG"
+}
+
+# field <INFO line> <name>
+field() {
+    echo "$1" | sed -n "s/.* $2=\([^ ]*\).*/\1/p"
+}
+
+# seqs_increase: every INFO seq is above the one before it.
+seqs_increase() {
+    sed -n 's/^INFO seq=\([0-9]*\) .*/\1/p' "$EVENTS_LOG" \
+        | awk 'NR > 1 && $1 <= last { bad = 1 } { last = $1 } END { exit bad || NR == 0 }'
+}
+
+# seqs_gap: some INFO seq skips a number.
+seqs_gap() {
+    sed -n 's/^INFO seq=\([0-9]*\) .*/\1/p' "$EVENTS_LOG" \
+        | awk 'NR > 1 && $1 > last + 1 { gap = 1 } { last = $1 } END { exit !gap }'
+}
+
+for mode in plain threaded; do
+    rm -rf "$TMP/watch"
+    mkdir -p "$TMP/watch/sub"
+    echo old >"$TMP/watch/sub/old"
+    opt=
+    [ $mode = threaded ] && opt=-t
+    start_reporter "$TMP/watch" -i -s full $opt
+    wait_for_event "SCAN_DONE" 50 || true
+    echo new >"$TMP/watch/sub/new"
+    wait_for_event "CLOSE_WRITE 0 $TMP/watch/sub/new" 50 || true
+    stop_reporter
+
+    crawl=$(info_of "CLOSE_WRITE 0 $TMP/watch/sub/old")
+    live=$(info_of "CLOSE_WRITE 0 $TMP/watch/sub/new")
+    marker=$(info_of "SCAN_DONE")
+    check "$mode: sequence numbers increase" seqs_increase
+    check "$mode: scanned entry is CRAWL" [ "$(field "$crawl" origin)" = CRAWL ]
+    check "$mode: change read from the fd is KERNEL" [ "$(field "$live" origin)" = KERNEL ]
+    check "$mode: SCAN_DONE is MARKER with no watch" \
+        [ "$(field "$marker" origin)" = MARKER -a "$(field "$marker" wd)" = -1 ]
+    check "$mode: event carries its directory's inode" \
+        [ "$(field "$live" ino)" = "$(stat -c %i "$TMP/watch/sub")" ]
+    check "$mode: event carries a watch descriptor" [ "$(field "$live" wd)" -ge 0 ]
+    check "$mode: event carries a timestamp" [ "$(field "$live" time)" -gt 0 ]
+    check "$mode: scan happened before the change" \
+        [ "$(field "$crawl" seq)" -lt "$(field "$live" seq)" -a "$(field "$crawl" time)" -le "$(field "$live" time)" ]
+    rm -f "$EVENTS_LOG" "$READY_LOG"
+done
+
+# drop
+rm -rf "$TMP/watch"
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -i -q 50:drop -w 1500
+(cd "$TMP/watch" && seq -f "f%g" 1 200 | xargs touch)
+touch "$TMP/watch/after"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/after" 50 || true
+stop_reporter
+check "drop: marker delivered" grep -q "^EVENT EVENTS_DROPPED" "$EVENTS_LOG"
+check "drop: sequence numbers still increase" seqs_increase
+check "drop: dropped events leave a gap" seqs_gap
+rm -f "$EVENTS_LOG" "$READY_LOG"
+
+# overflow: the kernel drops the tail of the flood, the rescan finds it
+rm -rf "$TMP/watch"
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -i -w 8000
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+(cd "$TMP/watch" && seq -f "f%g" 1 $((queued / 2 + 1000)) | xargs touch)
+wait_for_event "RESCAN_END" 150 || true
+stop_reporter
+check "overflow: the overflow is KERNEL" [ "$(field "$(info_of "OVERFLOW|RESCAN_BEGIN")" origin)" = KERNEL ]
+rescanned=$(sed -n '/^EVENT .*RESCAN_BEGIN/,/^EVENT RESCAN_END/p' "$EVENTS_LOG" | grep -c "^INFO .* origin=RESCAN" || true)
+check "overflow: what the rescan found is RESCAN ($rescanned)" [ "$rescanned" -gt 0 ]
+check "overflow: its end marker is MARKER" [ "$(field "$(info_of "RESCAN_END")" origin)" = MARKER ]
+
+exit $FAILED
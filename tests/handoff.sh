@@ -0,0 +1,124 @@
+#!/bin/sh
+# Handing a live watcher over (notifySend / notifyRecv over a Unix
+# socket, reporter -H / -I; notifyExport / notifyImport across exec,
+# reporter -e): a slow consumer is told to hand over in the middle of
+# a burst, more files are written while it does, and between the two
+# processes every file's CLOSE_WRITE comes out exactly once. The new
+# process reports events the old one had already read, keeps the
+# watches it installed (no second scan) and watches what is created
+# after the handoff.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== handoff =="
+FAILED=0
+TMP=$(mktemp -d)
+B_PID=
+trap 'stop_reporter; [ -n "$B_PID" ] && kill -TERM "$B_PID" 2>/dev/null; rm -rf "$TMP" "${EVENTS_LOG:-}" "${READY_LOG:-}"' EXIT
+
+# check <description> <command...>: PASS when the command succeeds.
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# wait_for <file> <fixed string> [tenths]
+wait_for() {
+    waited=0
+    while [ $waited -lt "${3:-100}" ]; do
+        grep -Fq "$2" "$1" && return 0
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+    return 1
+}
+
+burst() {
+    for i in $(seq "$1" "$2"); do
+        echo x >"$TMP/watch/sub/f$i"
+    done
+}
+
+# check_stream <label> <log>: f1..f150 once each, some of the first
+# burst delivered by the new process (after its RESUMED line).
+check_stream() {
+    total=$(grep -c "^EVENT CLOSE_WRITE 0 $TMP/watch/sub/f[0-9]*\$" "$2" || true)
+    unique=$(grep "^EVENT CLOSE_WRITE 0 $TMP/watch/sub/f[0-9]*\$" "$2" | sort -u | wc -l)
+    check "$1: every file once across the handoff ($total events, $unique files)" \
+        [ "$total" = 150 -a "$unique" = 150 ]
+    carried=$(sed -n '/^RESUMED/,$p' "$2" | grep "^EVENT CLOSE_WRITE 0 $TMP/watch/sub/f[0-9]*\$" \
+        | sed 's/.*f//' | awk '$1 <= 100' | wc -l)
+    check "$1: events read before the handoff delivered after it ($carried)" [ "$carried" -gt 0 ]
+    check "$1: directory created before the handoff still watched" \
+        grep -Fq "CLOSE_WRITE 0 $TMP/watch/new/late" "$2"
+}
+
+for mode in plain threaded-to-plain plain-to-threaded; do
+    rm -rf "$TMP/watch" "$TMP/b.log" "$TMP/b.err"
+    mkdir -p "$TMP/watch/sub"
+    a_opt=
+    b_opt=
+    case $mode in
+        threaded-to-plain) a_opt=-t ;;
+        plain-to-threaded) b_opt=-t ;;
+    esac
+
+    "$REPORTER" -s full $b_opt -I "$TMP/sock" "$TMP/watch" >"$TMP/b.log" 2>"$TMP/b.err" &
+    B_PID=$!
+    wait_for "$TMP/b.err" LISTENING 50 || true
+    start_reporter "$TMP/watch" -s full -d 3000 $a_opt -H "$TMP/sock"
+
+    mkdir "$TMP/watch/new"
+    burst 1 100
+    kill -USR1 "$REPORTER_PID"
+    burst 101 150
+    wait "$REPORTER_PID" || true
+    echo x >"$TMP/watch/new/late"
+    check "$mode: the old process handed over and left" grep -q "^HANDOFF" "$READY_LOG"
+
+    wait_for "$TMP/b.log" "CLOSE_WRITE 0 $TMP/watch/new/late" 100 || true
+    kill -TERM "$B_PID"
+    wait "$B_PID" || true
+    B_PID=
+
+    cat "$EVENTS_LOG" "$TMP/b.log" >"$TMP/all.log"
+    check_stream "$mode" "$TMP/all.log"
+    check "$mode: no second scan" [ "$(grep -c SCAN_DONE "$TMP/b.log")" = 0 ]
+    check "$mode: watch table carried over" grep -q " watches=3 " "$TMP/b.err"
+    rm -f "$EVENTS_LOG" "$READY_LOG"
+done
+
+for mode in exec exec-threaded; do
+    rm -rf "$TMP/watch"
+    mkdir -p "$TMP/watch/sub"
+    opt=
+    [ $mode = exec-threaded ] && opt=-t
+    start_reporter "$TMP/watch" -s full -d 3000 $opt -e
+
+    mkdir "$TMP/watch/new"
+    burst 1 100
+    kill -USR1 "$REPORTER_PID"
+    burst 101 150
+    waited=0
+    while [ "$(grep -c '^READY' "$READY_LOG")" -lt 2 ] && [ $waited -lt 50 ]; do
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+    echo x >"$TMP/watch/new/late"
+    check "$mode: exported and ran again" grep -q "^HANDOFF" "$READY_LOG"
+
+    wait_for_event "CLOSE_WRITE 0 $TMP/watch/new/late" 100 || true
+    stop_reporter
+    check_stream "$mode" "$EVENTS_LOG"
+    check "$mode: no second scan" [ "$(grep -c SCAN_DONE "$EVENTS_LOG")" = 1 ]
+    check "$mode: watch table carried over" grep -q " watches=3 " "$READY_LOG"
+    rm -f "$EVENTS_LOG" "$READY_LOG"
+done
+
+exit $FAILED
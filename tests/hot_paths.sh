@@ -0,0 +1,92 @@
+#!/bin/sh
+# NotifyOptions.hot (reporter -K, HOT lines on exit):
+#   - a file written in a loop is the hottest CHANGE path, its count
+#     never below the events it had;
+#   - a directory of short-lived files is the hottest NAMES path,
+#     though none of the files is;
+#   - no class lists more than k paths;
+#   - with a half-life the counts fade once the burst is over;
+#   - k above NOTIFY_HOT_MAX is refused.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== hot_paths =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# hot <class> <n>: the path of the n-th hottest entry of the class
+hot() {
+    awk -v c="$1" -v n="$2" '$1 == "HOT" && $2 == c && ++i == n { print $4 }' "$EVENTS_LOG"
+}
+
+# hot_count <class> <path>
+hot_count() {
+    awk -v c="$1" -v p="$2" '$1 == "HOT" && $2 == c && $4 == p { print $3 }' "$EVENTS_LOG"
+}
+
+# workload: 300 appends to one log, 100 files come and go in a cache
+workload() {
+    i=0
+    while [ $i -lt 300 ]; do
+        echo $i >>"$TMP/watch/logs/app.log"
+        i=$((i + 1))
+    done
+    i=0
+    while [ $i -lt 100 ]; do
+        touch "$TMP/watch/cache/c$i"
+        rm "$TMP/watch/cache/c$i"
+        i=$((i + 1))
+    done
+    touch "$TMP/watch/done"
+}
+
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/logs" "$TMP/watch/cache"
+start_reporter "$TMP/watch" -K 4 -s watches
+workload
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/done" 100 || true
+stop_reporter
+log_count=$(hot_count CHANGE "$TMP/watch/logs/app.log")
+check "the log is tracked ($log_count)" [ "${log_count:-0}" -ge 600 ]
+first=$(hot CHANGE 1)
+check "the log or its directory is the hottest CHANGE path" \
+    [ "$first" = "$TMP/watch/logs/app.log" -o "$first" = "$TMP/watch/logs" ]
+check "the cache directory is the hottest NAMES path" [ "$(hot NAMES 1)" = "$TMP/watch/cache" ]
+check "its count covers every create and delete ($(hot_count NAMES "$TMP/watch/cache"))" \
+    [ "$(hot_count NAMES "$TMP/watch/cache")" -ge 200 ]
+for c in CHANGE ACCESS NAMES; do
+    check "$c keeps at most 4 paths" [ "$(grep -c "^HOT $c " "$EVENTS_LOG")" -le 4 ]
+done
+rm -f "$EVENTS_LOG" "$READY_LOG"
+
+# half-life 200 ms: a second after the burst the counts are a fraction
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/logs" "$TMP/watch/cache"
+start_reporter "$TMP/watch" -K 4:200 -s watches
+workload
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/done" 100 || true
+sleep 1.2
+stop_reporter
+faded=$(hot_count CHANGE "$TMP/watch/logs/app.log")
+check "decay: the log's count faded (${faded:-gone} of $log_count)" [ "${faded:-0}" -lt 150 ]
+rm -f "$EVENTS_LOG" "$READY_LOG"
+
+if "$REPORTER" -K 1000 "$TMP" >/dev/null 2>"$TMP/err"; then
+    check "k above NOTIFY_HOT_MAX is refused" false
+else
+    check "k above NOTIFY_HOT_MAX is refused" grep -q "Invalid argument" "$TMP/err"
+fi
+
+exit $FAILED
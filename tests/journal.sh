@@ -0,0 +1,148 @@
+#!/bin/sh
+# NotifyOptions.journal (reporter -J) and its readers (reporter -j):
+#   - two readers each get every event the producer delivered, in
+#     its order;
+#   - a reader restarted at the offset it stopped at gets what came
+#     since, and nothing twice;
+#   - a reader the producer lapped gets one IN_Q_OVERFLOW and carries
+#     on with the newest events;
+#   - a producer restarted with another size replaces the journal, and
+#     a reader left running follows it to the new one;
+#   - the mode does not combine with dirty mode.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== journal =="
+FAILED=0
+TMP=$(mktemp -d)
+READERS=""
+trap 'stop_reporter; for p in $READERS; do kill $p 2>/dev/null || true; done; rm -rf "$TMP"' EXIT
+
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# reader <name> [options...]: a journal reader in the background, its
+# events in $TMP/<name>.out
+reader() {
+    name=$1
+    shift
+    "$REPORTER" "$@" "$TMP/watch" >"$TMP/$name.out" 2>"$TMP/$name.err" &
+    READERS="$READERS $!"
+    eval "PID_$name=$!"
+    waited=0
+    while [ $waited -lt 50 ] && ! grep -q "^READY" "$TMP/$name.err"; do
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+}
+
+# stop <name>: stop a reader and print the offset it reports
+stop() {
+    pid=$(eval echo "\$PID_$1")
+    kill -TERM "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+    sed -n 's/^OFFSET //p' "$TMP/$1.err"
+}
+
+# wait_in <file> <fixed string>
+wait_in() {
+    waited=0
+    while [ $waited -lt 100 ] && ! grep -Fq "$2" "$1"; do
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+}
+
+# value of one counter in the STATS line
+stat_of() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+# fan-out: the producer's EVENT lines, as two readers saw them
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/sub"
+start_reporter "$TMP/watch" -J "$TMP/j" -s watches
+reader a -j "$TMP/j"
+reader b -j "$TMP/j:oldest"
+i=0
+while [ $i -lt 50 ]; do
+    echo $i >"$TMP/watch/sub/f$i"
+    i=$((i + 1))
+done
+mv "$TMP/watch/sub" "$TMP/watch/moved"
+touch "$TMP/watch/done"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/done" 100 || true
+wait_in "$TMP/a.out" "CLOSE_WRITE 0 $TMP/watch/done"
+wait_in "$TMP/b.out" "CLOSE_WRITE 0 $TMP/watch/done"
+offset=$(stop a)
+stop b >/dev/null
+grep "^EVENT" "$EVENTS_LOG" >"$TMP/producer"
+check "fan-out: the first reader saw what the producer delivered" cmp -s "$TMP/producer" "$TMP/a.out"
+check "fan-out: so did the second" cmp -s "$TMP/producer" "$TMP/b.out"
+check "fan-out: a reader reports its offset ($offset)" [ "${offset:-0}" -gt 0 ]
+
+# resume: the reader comes back at its offset
+touch "$TMP/watch/later"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/later" 50 || true
+reader r -j "$TMP/j:$offset"
+wait_in "$TMP/r.out" "CLOSE_WRITE 0 $TMP/watch/later"
+stop r >/dev/null
+check "resume: what came since is there" grep -Fq "CREATE 0 $TMP/watch/later" "$TMP/r.out"
+check "resume: nothing from before" [ "$(grep -c "$TMP/watch/moved\|$TMP/watch/done" "$TMP/r.out")" = 0 ]
+check "resume: no overflow" [ "$(grep -c "OVERFLOW" "$TMP/r.out")" = 0 ]
+
+# newest: only what is appended after the open
+reader n -j "$TMP/j:newest"
+touch "$TMP/watch/newer"
+wait_in "$TMP/n.out" "CLOSE_WRITE 0 $TMP/watch/newer"
+stop n >/dev/null
+check "newest: no event from before the open" \
+    [ "$(grep -vc "$TMP/watch/newer" "$TMP/n.out")" = 0 ]
+check "newest: the event after it" grep -Fq "CREATE 0 $TMP/watch/newer" "$TMP/n.out"
+
+# restart: the producer comes back with a smaller journal; a reader
+# left running moves over to it
+reader f -j "$TMP/j:newest"
+stop_reporter
+rm -f "$EVENTS_LOG" "$READY_LOG"
+start_reporter "$TMP/watch" -J "$TMP/j:65536" -s watches
+touch "$TMP/watch/restarted"
+wait_in "$TMP/f.out" "CLOSE_WRITE 0 $TMP/watch/restarted"
+stop f >/dev/null
+check "restart: the reader followed the new journal" grep -Fq "CREATE 0 $TMP/watch/restarted" "$TMP/f.out"
+check "restart: without an overflow" [ "$(grep -c "OVERFLOW" "$TMP/f.out")" = 0 ]
+check "restart: the journal has its new size" [ "$(stat -c %s "$TMP/j")" = $((4096 + 65536)) ]
+
+# lapped: 64 KiB hold a few hundred events; a reader that stalls
+# through thousands hears about it and goes on with the newest
+reader l -j "$TMP/j:newest" -w 2000
+i=0
+while [ $i -lt 500 ]; do
+    touch "$TMP/watch/s$i"
+    i=$((i + 1))
+done
+touch "$TMP/watch/last"
+wait_in "$TMP/l.out" "CLOSE_WRITE 0 $TMP/watch/last"
+stop l >/dev/null
+stop_reporter
+check "lapped: one IN_Q_OVERFLOW" [ "$(grep -c "^EVENT OVERFLOW" "$TMP/l.out")" = 1 ]
+check "lapped: then the newest events" grep -Fq "CLOSE_WRITE 0 $TMP/watch/last" "$TMP/l.out"
+check "lapped: the producer overwrote events ($(stat_of journal_evicted))" [ "$(stat_of journal_evicted)" -gt 0 ]
+rm -f "$EVENTS_LOG" "$READY_LOG"
+
+# not with dirty mode
+if "$REPORTER" -D 100 -J "$TMP/j" "$TMP" >/dev/null 2>"$TMP/err"; then
+    check "dirty: rejected" false
+else
+    check "dirty: rejected" grep -q "Invalid argument" "$TMP/err"
+fi
+
+exit $FAILED
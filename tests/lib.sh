@@ -22,11 +22,13 @@ TESTS_DIR=$(cd -- "$(dirname -- "$0")" && pwd)
 REPORTER=$TESTS_DIR/reporter
 [ -x "$REPORTER" ] || { echo "build reporter first: cd .. && make check"; exit 2; }
 
+# start_reporter <dir> [reporter options...]
 start_reporter() {
     watchdir=$1
+    shift
     EVENTS_LOG=$(mktemp)
     READY_LOG=$(mktemp)
-    "$REPORTER" "$watchdir" >"$EVENTS_LOG" 2>"$READY_LOG" &
+    "$REPORTER" "$@" "$watchdir" >"$EVENTS_LOG" 2>"$READY_LOG" &
     REPORTER_PID=$!
     # Poll up to ~5s for the READY token.
     waited=0
@@ -58,6 +60,23 @@ drain() {
     sleep 1
 }
 
+# wait_for_event <pattern> [tenths]: poll the log until a fixed-string
+# pattern shows up (default ~10s). For tests whose workload takes
+# longer to process than `drain` allows.
+wait_for_event() {
+    pattern=$1
+    limit=${2:-100}
+    waited=0
+    while [ $waited -lt "$limit" ]; do
+        if grep -Fq "$pattern" "$EVENTS_LOG"; then
+            return 0
+        fi
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+    return 1
+}
+
 # Substring-style assertion; pattern is matched as a fixed string.
 assert_event() {
     pattern=$1
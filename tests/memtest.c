@@ -0,0 +1,372 @@
+/*
+ * Memory-footprint regression test for librnotify.
+ *
+ * Builds a synthetic tree of <dirs> directories (fanout 16) under the
+ * scratch directory, watches it, then runs <rounds> rounds of churn
+ * inside it: create directory pairs, rename them within the tree, move
+ * half of them out of the tree (and delete them there), delete the
+ * rest. After each round every change has been undone, so the library
+ * must be back where it was after round 1.
+ *
+ * Checks, each printed as a PASS/FAIL line:
+ *   - heap bytes per watch after the initial scan <= -b (default 512);
+ *   - heap growth from round 1 to the last round <= -g KiB (default 16);
+ *   - RSS growth over the same span <= -G KiB (default 1024);
+ *   - watches and pending cookies back at their post-scan values.
+ * Heap figures come from mallinfo2, so they are exact for glibc malloc
+ * and independent of what the allocator hands back to the kernel.
+ *
+ * Usage: memtest [-n dirs] [-r rounds] [-c churn] [-b bytes] [-g kib]
+ *                [-G kib] <scratch-dir>
+ *
+ * Exits 0 when every check passed, 1 on a failed check or error, and
+ * 77 (skip) when <dirs> exceeds what fs.inotify.max_user_watches
+ * allows.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rnotify.h"
+
+/* operations between two drains: well inside max_queued_events */
+#define BATCH 512
+
+/* changes only: the crawl's own opens and reads would flood the queue */
+#define MEMTEST_MASK (IN_ALL_EVENTS & ~(IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE))
+
+static int g_failed = 0;
+
+static void check(int ok, const char* what)
+{
+    printf("  %s  %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+    {
+        g_failed++;
+    }
+}
+
+static size_t heapInUse(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static long rssKb(void)
+{
+    long pages = 0;
+    long resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    if (2 != fscanf(f, "%ld %ld", &pages, &resident))
+    {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long readLong(const char* file)
+{
+    long v = 0;
+    FILE* f = fopen(file, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    if (1 != fscanf(f, "%ld", &v))
+    {
+        v = 0;
+    }
+    fclose(f);
+    return v;
+}
+
+/* Deliver and drop events until none came for 200 ms. */
+static int drain(Notify* ntf)
+{
+    for (;;)
+    {
+        char* path = NULL;
+        uint32_t mask = 0;
+        int rc = waitNotify(ntf, &path, &mask, 200, NULL);
+        free(path);
+        if (rc == -1)
+        {
+            fprintf(stderr, "waitNotify: %s\n", strerror(errno));
+            return -1;
+        }
+        if (rc != 0)
+        {
+            return 0;
+        }
+    }
+}
+
+/* Run `op` on items [0, count), draining every BATCH of them. */
+static int batched(Notify* ntf, unsigned long count, int (*op)(const char*, unsigned long), const char* base)
+{
+    for (unsigned long i = 0; i < count; i++)
+    {
+        if (op(base, i) == -1)
+        {
+            fprintf(stderr, "churn %lu: %s\n", i, strerror(errno));
+            return -1;
+        }
+        if ((i + 1) % BATCH == 0
+            && drain(ntf) == -1)
+        {
+            return -1;
+        }
+    }
+    return drain(ntf);
+}
+
+static int opCreate(const char* base, unsigned long i)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/tree/churn/n%lu", base, i);
+    if (mkdir(path, 0755) == -1)
+    {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/tree/churn/n%lu/sub", base, i);
+    return mkdir(path, 0755);
+}
+
+static int opRename(const char* base, unsigned long i)
+{
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    snprintf(from, sizeof(from), "%s/tree/churn/n%lu", base, i);
+    snprintf(to, sizeof(to), "%s/tree/churn/m%lu", base, i);
+    return rename(from, to);
+}
+
+/* even items leave the tree, odd ones are deleted in place */
+static int opLeave(const char* base, unsigned long i)
+{
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    snprintf(from, sizeof(from), "%s/tree/churn/m%lu", base, i);
+    if (i % 2)
+    {
+        snprintf(to, sizeof(to), "%s/tree/churn/m%lu/sub", base, i);
+        return (rmdir(to) == -1) ? -1 : rmdir(from);
+    }
+    snprintf(to, sizeof(to), "%s/outside/o%lu", base, i);
+    return rename(from, to);
+}
+
+static int opPurge(const char* base, unsigned long i)
+{
+    char path[PATH_MAX];
+    if (i % 2)
+    {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/outside/o%lu/sub", base, i);
+    if (rmdir(path) == -1)
+    {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/outside/o%lu", base, i);
+    return rmdir(path);
+}
+
+/* Directory i of the synthetic tree; its parent is (i - 1) / 16. */
+static void treePath(char* buf, size_t size, const char* base, unsigned long i)
+{
+    unsigned long chain[32];
+    int n = 0;
+    while (i > 0 && n < 32)
+    {
+        chain[n++] = i;
+        i = (i - 1) / 16;
+    }
+    size_t len = (size_t)snprintf(buf, size, "%s/tree", base);
+    while (n > 0 && len < size)
+    {
+        len += (size_t)snprintf(buf + len, size - len, "/d%lu", chain[--n]);
+    }
+}
+
+static int removeAll(const char* path, const struct stat* sb, int type, struct FTW* ftw)
+{
+    (void)sb;
+    (void)ftw;
+    return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long dirs = 10000;
+    unsigned long rounds = 5;
+    unsigned long churn = 0;
+    unsigned long max_per_watch = 512;
+    unsigned long max_growth_kb = 16;
+    unsigned long max_rss_kb = 1024;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:c:b:g:G:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            dirs = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            churn = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            max_per_watch = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            max_growth_kb = strtoul(optarg, NULL, 10);
+            break;
+        case 'G':
+            max_rss_kb = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1
+        || dirs == 0
+        || rounds < 2)
+    {
+        fprintf(stderr, "usage: %s [-n dirs] [-r rounds>=2] [-c churn] [-b bytes] [-g kib] [-G kib] <scratch-dir>\n", argv[0]);
+        return 2;
+    }
+    if (churn == 0)
+    {
+        churn = (dirs / 10 < 100) ? 100 : (dirs / 10 > 10000) ? 10000 : dirs / 10;
+    }
+
+    printf("== memtest dirs=%lu rounds=%lu churn=%lu ==\n", dirs, rounds, churn);
+
+    /* each churn item holds two watches at its peak */
+    long limit = readLong("/proc/sys/fs/inotify/max_user_watches");
+    if (limit > 0
+        && (unsigned long)limit < dirs + 2 * churn + 64)
+    {
+        printf("  SKIP  needs %lu watches, fs.inotify.max_user_watches is %ld\n", dirs + 2 * churn + 64, limit);
+        return 77;
+    }
+
+    char base[PATH_MAX / 2];
+    snprintf(base, sizeof(base), "%s/memtest.XXXXXX", argv[optind]);
+    if (mkdtemp(base) == NULL)
+    {
+        perror(base);
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    for (unsigned long i = 0; i < dirs; i++)
+    {
+        treePath(path, sizeof(path), base, i);
+        if (mkdir(path, 0755) == -1)
+        {
+            perror(path);
+            nftw(base, removeAll, 64, FTW_DEPTH | FTW_PHYS);
+            return 1;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/tree/churn", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/outside", base);
+    mkdir(path, 0755);
+
+    size_t heap0 = heapInUse();
+    NotifyOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.scan = NOTIFY_SCAN_WATCHES;
+    snprintf(path, sizeof(path), "%s/tree", base);
+    Notify* ntf = initNotifyOpts(path, MEMTEST_MASK, NULL, &opts);
+    if (ntf == NULL)
+    {
+        fprintf(stderr, "initNotify(%s): %s\n", path, strerror(errno));
+        nftw(base, removeAll, 64, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+    if (drain(ntf) == -1)
+    {
+        freeNotify(ntf);
+        nftw(base, removeAll, 64, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+
+    NotifyStats base_st;
+    notifyStats(ntf, &base_st);
+    size_t heap1 = heapInUse();
+    unsigned long per_watch = (heap1 - heap0) / (base_st.watches ? base_st.watches : 1);
+    printf("MEM scan watches=%lu heap=%zu per_watch=%lu rss_kb=%ld\n",
+           base_st.watches, heap1 - heap0, per_watch, rssKb());
+
+    size_t heap_first = 0;
+    long rss_first = 0;
+    NotifyStats st;
+    for (unsigned long r = 1; r <= rounds; r++)
+    {
+        if (batched(ntf, churn, opCreate, base) == -1
+            || batched(ntf, churn, opRename, base) == -1
+            || batched(ntf, churn, opLeave, base) == -1
+            || batched(ntf, churn, opPurge, base) == -1)
+        {
+            g_failed++;
+            break;
+        }
+        notifyStats(ntf, &st);
+        size_t heap = heapInUse();
+        long rss = rssKb();
+        printf("MEM round=%lu heap=%zu rss_kb=%ld watches=%lu cookies=%lu overflows=%lu\n",
+               r, heap - heap0, rss, st.watches, st.cookies_pending, st.overflows);
+        if (r == 1)
+        {
+            heap_first = heap;
+            rss_first = rss;
+        }
+    }
+
+    char what[256];
+    snprintf(what, sizeof(what), "heap per watch %lu <= %lu bytes", per_watch, max_per_watch);
+    check(per_watch <= max_per_watch, what);
+    if (g_failed == 0)
+    {
+        size_t heap_last = heapInUse();
+        long rss_last = rssKb();
+        long growth = (long)heap_last - (long)heap_first;
+        snprintf(what, sizeof(what), "heap growth after round 1: %ld <= %lu bytes", growth, max_growth_kb * 1024);
+        check(growth <= (long)(max_growth_kb * 1024), what);
+        snprintf(what, sizeof(what), "RSS growth after round 1: %ld <= %lu KiB", rss_last - rss_first, max_rss_kb);
+        check(rss_last - rss_first <= (long)max_rss_kb, what);
+        snprintf(what, sizeof(what), "watches back to %lu (have %lu)", base_st.watches, st.watches);
+        check(st.watches == base_st.watches, what);
+        snprintf(what, sizeof(what), "no cookie left pending (have %lu)", st.cookies_pending);
+        check(st.cookies_pending == 0, what);
+        if (st.overflows)
+        {
+            printf("  NOTE  %lu overflows during churn\n", st.overflows);
+        }
+    }
+
+    freeNotify(ntf);
+    nftw(base, removeAll, 64, FTW_DEPTH | FTW_PHYS);
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Recovery after IN_Q_OVERFLOW. The reporter stalls before its first
+# waitNotify while we flood the kernel queue past max_queued_events,
+# then make changes whose events are certainly lost. The overflow must
+# come out bracketed by RESCAN_BEGIN / RESCAN_END, and the rescan in
+# between must report exactly what was lost: the tail of the flood,
+# a directory created (with its contents), a file deleted, and every
+# entry of a watched directory emptied.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== overflow_rescan =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+mkdir "$TMP/watch"
+echo "old" >"$TMP/watch/old.txt"
+
+start_reporter "$TMP/watch" -w 3000
+
+# Flood the root: it is the only directory watched before the
+# reporter's first waitNotify (subdirectories are watched as their
+# IN_CREATE is delivered). Each touch costs at least CREATE and
+# CLOSE_WRITE.
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+count=$((queued / 2 + 1000))
+(cd "$TMP/watch" && seq -f "f%g" 1 "$count" | xargs touch)
+
+mkdir "$TMP/watch/late"
+echo "inner" >"$TMP/watch/late/inner.txt"
+rm "$TMP/watch/old.txt"
+
+wait_for_event "RESCAN_END" 150 || true
+drain
+
+assert_event "OVERFLOW|RESCAN_BEGIN"              "overflow opens a rescan"
+assert_event "RESCAN_END"                         "rescan is closed by an end marker"
+assert_event "$TMP/watch/f$count"                 "lost tail of the flood is reported"
+assert_event "CREATE|ISDIR 0 $TMP/watch/late"     "directory created during overflow"
+assert_event "$TMP/watch/late/inner.txt"          "its contents are crawled"
+assert_event "DELETE 0 $TMP/watch/old.txt"        "file deleted during overflow"
+
+# A directory watched from the start (-s watches) and emptied while
+# events are lost: an empty listing still yields the deletes.
+stop_reporter
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/emptied"
+touch "$TMP/watch/emptied/a.txt" "$TMP/watch/emptied/b.txt"
+
+start_reporter "$TMP/watch" -w 3000 -s watches
+(cd "$TMP/watch" && seq -f "f%g" 1 "$count" | xargs touch)
+rm "$TMP/watch/emptied/a.txt" "$TMP/watch/emptied/b.txt"
+
+wait_for_event "RESCAN_END" 150 || true
+drain
+
+assert_event "OVERFLOW|RESCAN_BEGIN"              "emptied: overflow opens a rescan"
+assert_event "DELETE 0 $TMP/watch/emptied/a.txt"  "emptied: first entry deleted"
+assert_event "DELETE 0 $TMP/watch/emptied/b.txt"  "emptied: second entry deleted"
+
+exit $FAILED
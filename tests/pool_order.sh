@@ -0,0 +1,80 @@
+#!/bin/sh
+# Ordering guarantees of runNotifyPool. Events are handled on four
+# workers, each slowed down so that shards genuinely run out of step.
+# Whatever the interleaving, a directory's CREATE must come out before
+# anything inside it, and the events of one file keep their order.
+# With a timeout of 0 runNotifyPool dispatches what is ready and
+# returns, and an idle watcher dispatches nothing.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== pool_order =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -p 4 -d 2000
+
+dirs=12
+for i in $(seq 1 $dirs); do
+    mkdir -p "$TMP/watch/d$i/sub"
+    for j in 1 2 3; do
+        echo x >"$TMP/watch/d$i/f$j"
+        echo x >"$TMP/watch/d$i/sub/g$j"
+    done
+done
+mv "$TMP/watch/d1" "$TMP/watch/moved"
+echo x >"$TMP/watch/moved/after"
+
+wait_for_event "$TMP/watch/moved/after" 300 || true
+drain
+
+# first line number of a fixed-string match, or 0 if absent
+first_line() {
+    grep -nF "$1" "$EVENTS_LOG" | head -n 1 | cut -d: -f1
+}
+
+bad=0
+for i in $(seq 2 $dirs); do
+    for d in "d$i" "d$i/sub"; do
+        created=$(first_line "CREATE|ISDIR 0 $TMP/watch/$d")
+        inside=$(first_line " $TMP/watch/$d/")
+        if [ -z "$created" ] || [ -z "$inside" ] || [ "$created" -gt "$inside" ]; then
+            echo "        $d: CREATE at line ${created:-none}, first child at ${inside:-none}"
+            bad=$((bad + 1))
+        fi
+    done
+    for f in "d$i/f1" "d$i/sub/g3"; do
+        created=$(first_line "CREATE 0 $TMP/watch/$f")
+        closed=$(first_line "CLOSE_WRITE 0 $TMP/watch/$f")
+        if [ -z "$created" ] || [ -z "$closed" ] || [ "$created" -gt "$closed" ]; then
+            echo "        $f: CREATE at line ${created:-none}, CLOSE_WRITE at ${closed:-none}"
+            bad=$((bad + 1))
+        fi
+    done
+done
+if [ $bad -eq 0 ]; then
+    echo "  PASS  parents before children, per-file order kept"
+else
+    echo "  FAIL  $bad ordering violations"
+    FAILED=$((FAILED + 1))
+fi
+
+assert_event "MOVED_TO|ISDIR"                  "directory move is delivered"
+assert_event "CREATE 0 $TMP/watch/moved/after" "events follow the move under the new name"
+assert_event "CLOSE_WRITE 0 $TMP/watch/d$dirs/sub/g3" "last file of the workload"
+stop_reporter
+
+# timeout 0: polled in a loop, idle most of the time
+rm -rf "$TMP/watch"
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -p 2:0
+sleep 0.5
+touch "$TMP/watch/polled"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/polled" 50 || true
+stop_reporter
+assert_event "CLOSE_WRITE 0 $TMP/watch/polled" "timeout 0: ready events are dispatched"
+assert_no_event "0x00000000" "timeout 0: no empty event while idle"
+
+exit $FAILED
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Structural events must not wait behind a crawl's backlog. A slow
+# consumer is still draining the thousands of events the crawl of a
+# moved-in directory produced when that directory's parent is renamed.
+# The rename must reach the watch table as soon as it is read, so the
+# backlog's remaining events already come out under the new path; with
+# priority classes (-c) the move itself is delivered ahead of them too,
+# while one file's events stay in order.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== priority =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+count=2000
+
+# line_of <pattern>: number of the first log line holding it, or 0
+line_of() {
+    n=$(grep -nF "$1" "$EVENTS_LOG" | head -1 | cut -d: -f1)
+    echo "${n:-0}"
+}
+
+check() {
+    if [ "$1" -eq 1 ]; then
+        echo "  PASS  $2"
+    else
+        echo "  FAIL  $2"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+for mode in fifo classes; do
+    rm -rf "$TMP/watch" "$TMP/out"
+    mkdir -p "$TMP/watch/a/sub" "$TMP/out/big"
+    (cd "$TMP/out/big" && seq -f "f%g" 1 "$count" | xargs touch)
+    if [ $mode = classes ]; then
+        start_reporter "$TMP/watch" -c -d 1000
+    else
+        start_reporter "$TMP/watch" -d 1000
+    fi
+
+    mv "$TMP/out/big" "$TMP/watch/a/big"
+    sleep 1
+    mv "$TMP/watch/a" "$TMP/watch/b"
+    touch "$TMP/watch/b/sub/x"
+
+    wait_for_event "CLOSE_WRITE 0 $TMP/watch/b/sub/x" 300 || true
+
+    moved=$(grep -nF "MOVED_TO|ISDIR" "$EVENTS_LOG" | grep -F " $TMP/watch/b" | head -1 | cut -d: -f1)
+    moved=${moved:-0}
+    renamed=$(line_of "$TMP/watch/b/big/f")
+    before=$(head -n "$moved" "$EVENTS_LOG" | grep -c "/big/f" || true)
+
+    assert_event "CLOSE_WRITE 0 $TMP/watch/b/sub/x" "$mode: file event under the new path"
+    check $([ "$moved" -gt 0 ] && echo 1 || echo 0) "$mode: directory move delivered"
+    if [ $mode = fifo ]; then
+        check $([ "$renamed" -gt 0 ] && [ "$renamed" -lt "$moved" ] && echo 1 || echo 0) \
+            "fifo: backlog queued before the move comes out under the new path"
+        check $([ "$before" -eq $((2 * count)) ] && echo 1 || echo 0) \
+            "fifo: move delivered after the whole backlog ($before events ahead)"
+    else
+        check $([ "$before" -lt $((2 * count)) ] && echo 1 || echo 0) \
+            "classes: move delivered ahead of the backlog ($before events ahead)"
+        create=$(line_of "CREATE 0 $TMP/watch/b/sub/x")
+        open=$(line_of "OPEN 0 $TMP/watch/b/sub/x")
+        close=$(line_of "CLOSE_WRITE 0 $TMP/watch/b/sub/x")
+        check $([ "$create" -gt 0 ] && [ "$create" -lt "$open" ] && [ "$open" -lt "$close" ] && echo 1 || echo 0) \
+            "classes: one file's events keep their order"
+    fi
+
+    stop_reporter
+    rm -f "$EVENTS_LOG" "$READY_LOG"
+done
+
+exit $FAILED
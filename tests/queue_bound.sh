@@ -0,0 +1,95 @@
+#!/bin/sh
+# Bounded library queue (NotifyOptions.queue_events). Each reporter
+# stalls before its first read so the whole workload arrives in one go
+# and overruns the bound:
+#   drop      file events past the bound are dropped behind an
+#             EVENTS_DROPPED marker; directory creates are not, and the
+#             recursion still covers what they contain;
+#   coalesce  repeated writes to one file fold into few events;
+#   block     in threaded mode the reader stops at the bound, so a
+#             flood that an unbounded reader would absorb overflows the
+#             kernel queue instead, and the rescan repairs it.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== queue_bound =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+stat() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+expect_stat() {
+    got=$(stat "$1")
+    if [ -n "$got" ] && [ "$got" "$2" "$3" ]; then
+        echo "  PASS  $4 ($1=$got)"
+    else
+        echo "  FAIL  $4 ($1=${got:-missing}, expected $2 $3)"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# drop
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -q 50:drop -w 1500
+mkdir "$TMP/watch/d"
+(cd "$TMP/watch" && seq -f "f%g" 1 200 | xargs touch)
+mkdir -p "$TMP/watch/d2/sub"
+touch "$TMP/watch/d2/sub/inner"
+wait_for_event "CREATE 0 $TMP/watch/d2/sub/inner" 50 || true
+touch "$TMP/watch/d2/after"
+drain
+stop_reporter
+
+assert_event "EVENTS_DROPPED 0 " "drop: marker queued"
+assert_event "CREATE|ISDIR 0 $TMP/watch/d" "drop: directory create kept"
+assert_event "CREATE 0 $TMP/watch/d2/sub/inner" "drop: recursion covers the kept directory"
+assert_event "CREATE 0 $TMP/watch/d2/after" "drop: events flow again after the backlog"
+assert_no_event "CREATE 0 $TMP/watch/f200" "drop: the tail of the file flood is gone"
+expect_stat events_dropped -gt 0 "drop: drops counted"
+expect_stat queue_peak -le 60 "drop: queue held at the bound"
+
+# coalesce
+rm -rf "$TMP/watch" "$EVENTS_LOG" "$READY_LOG"
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -q 20:coalesce -w 1500
+i=0
+while [ $i -lt 300 ]; do
+    echo $i >>"$TMP/watch/f"
+    i=$((i + 1))
+done
+touch "$TMP/watch/g"
+wait_for_event "$TMP/watch/g" 50 || true
+drain
+stop_reporter
+
+lines=$(grep -c " $TMP/watch/f\$" "$EVENTS_LOG" || true)
+if [ "$lines" -lt 100 ]; then
+    echo "  PASS  coalesce: 900 writes to f delivered as $lines events"
+else
+    echo "  FAIL  coalesce: 900 writes to f delivered as $lines events"
+    FAILED=$((FAILED + 1))
+fi
+assert_event "MODIFY|CLOSE_WRITE|OPEN 0 $TMP/watch/f" "coalesce: folded events carry every bit"
+assert_event "CREATE 0 $TMP/watch/g" "coalesce: other events still delivered"
+expect_stat events_coalesced -gt 0 "coalesce: folds counted"
+
+# block, threaded
+rm -rf "$TMP/watch" "$EVENTS_LOG" "$READY_LOG"
+mkdir "$TMP/watch"
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+count=$((queued / 2 + 1000))
+start_reporter "$TMP/watch" -t -q 100 -w 3000 -d 50
+(cd "$TMP/watch" && seq -f "f%g" 1 "$count" | xargs touch)
+wait_for_event "CREATE 0 $TMP/watch/f$count" 300 || true
+wait_for_event "RESCAN_END" 100 || true
+drain
+stop_reporter
+
+assert_event "OVERFLOW" "block: the backlog stayed in the kernel"
+assert_event "CREATE 0 $TMP/watch/f$count" "block: rescan reports the end of the flood"
+expect_stat events_dropped -eq 0 "block: nothing dropped"
+
+exit $FAILED
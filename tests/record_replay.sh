@@ -0,0 +1,76 @@
+#!/bin/sh
+# Record and replay. A run recorded with -R and played back with -P
+# must deliver exactly the same events and end with the same counters,
+# without the watched tree: it is deleted before the replay. The
+# workload covers cookie pairing on a directory rename and, in a
+# second run, overflow recovery.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== record_replay =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+# replay_matches <capture> <description>: replay once the tree is gone
+# and compare with the live run's output
+replay_matches() {
+    cp "$EVENTS_LOG" "$TMP/live.out"
+    grep "^STATS" "$READY_LOG" >"$TMP/live.stats" || true
+    rm -rf "$TMP/watch"
+    if "$REPORTER" -P "$1" "$TMP/watch" >"$TMP/replay.out" 2>"$TMP/replay.err" \
+        && grep "^STATS" "$TMP/replay.err" >"$TMP/replay.stats" \
+        && cmp -s "$TMP/live.out" "$TMP/replay.out" \
+        && cmp -s "$TMP/live.stats" "$TMP/replay.stats"; then
+        echo "  PASS  $2"
+    else
+        echo "  FAIL  $2"
+        diff "$TMP/live.out" "$TMP/replay.out" | head -5
+        diff "$TMP/live.stats" "$TMP/replay.stats" | head -5
+        cat "$TMP/replay.err"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+mkdir -p "$TMP/watch/pre/deep"
+start_reporter "$TMP/watch" -R "$TMP/live.cap"
+
+mkdir -p "$TMP/watch/a/b/c"
+wait_for_event "CREATE|ISDIR 0 $TMP/watch/a/b/c" || true
+echo x >"$TMP/watch/a/b/c/file"
+mv "$TMP/watch/a" "$TMP/watch/z"
+echo y >"$TMP/watch/z/b/c/moved"
+echo draft >"$TMP/watch/.doc.tmp" && mv "$TMP/watch/.doc.tmp" "$TMP/watch/doc"
+rm -rf "$TMP/watch/pre"
+
+drain
+stop_reporter
+
+assert_event "$TMP/watch/z/b/c/moved" "live run followed the rename"
+replay_matches "$TMP/live.cap" "replay delivers the recorded events"
+
+if "$REPORTER" -P "$TMP/live.cap" "$TMP/elsewhere" >/dev/null 2>"$TMP/other.err"; then
+    echo "  FAIL  replay of another path succeeded"
+    FAILED=$((FAILED + 1))
+else
+    echo "  PASS  replay of another path is refused"
+fi
+
+# overflow: the rescan's lstat/readdir answers come from the capture too
+mkdir "$TMP/watch"
+echo "old" >"$TMP/watch/old.txt"
+start_reporter "$TMP/watch" -w 3000 -R "$TMP/overflow.cap"
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+count=$((queued / 2 + 1000))
+(cd "$TMP/watch" && seq -f "f%g" 1 "$count" | xargs touch)
+mkdir "$TMP/watch/late"
+echo "inner" >"$TMP/watch/late/inner.txt"
+rm "$TMP/watch/old.txt"
+wait_for_event "RESCAN_END" 150 || true
+drain
+stop_reporter
+
+assert_event "OVERFLOW|RESCAN_BEGIN" "live run overflowed"
+replay_matches "$TMP/overflow.cap" "replay reproduces the overflow rescan"
+
+exit $FAILED
@@ -0,0 +1,115 @@
+#!/bin/sh
+# The recursion policy (NotifyOptions.max_depth, same_dev, recurse;
+# reporter -Z, -N, -B, -G):
+#   - nothing deeper than max_depth is watched, at the scan or later;
+#   - a directory the callback skips is not watched, nor anything in
+#     it, though its own IN_CREATE still comes;
+#   - a shallow directory is watched, its subdirectories are not;
+#   - the callback is asked once per directory, and again only after
+#     the directory was deleted;
+#   - a mount point below the root is left alone with same_dev;
+#   - a negative depth is refused.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== recurse_policy =="
+FAILED=0
+TMP=$(mktemp -d)
+MOUNTED=""
+trap 'stop_reporter; [ -z "$MOUNTED" ] || umount "$MOUNTED" 2>/dev/null; rm -rf "$TMP"' EXIT
+
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# value of one counter in the STATS line
+stat_of() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+# POLICY lines for one path
+asked() {
+    grep -c "^POLICY [0-9]* $1\$" "$READY_LOG" || true
+}
+
+# max_depth: the root and two levels below it
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/a/b/c"
+start_reporter "$TMP/watch" -Z 2 -s watches
+touch "$TMP/watch/a/b/f" "$TMP/watch/a/b/c/g"
+mkdir "$TMP/watch/a/b/new"
+touch "$TMP/watch/a/b/new/h" "$TMP/watch/done"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/done" 50 || true
+drain
+stop_reporter
+assert_event "CREATE 0 $TMP/watch/a/b/f" "depth: two levels down is watched"
+assert_no_event "$TMP/watch/a/b/c/g" "depth: three levels down is not"
+assert_event "CREATE|ISDIR 0 $TMP/watch/a/b/new" "depth: a new directory there is still reported"
+assert_no_event "$TMP/watch/a/b/new/h" "depth: but not watched"
+check "depth: three watches ($(stat_of watches))" [ "$(stat_of watches)" = 3 ]
+check "depth: two skipped ($(stat_of dirs_skipped))" [ "$(stat_of dirs_skipped)" = 2 ]
+
+# the callback: skip node_modules wherever it is, build is shallow
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/node_modules/pkg" "$TMP/watch/src" "$TMP/watch/build/out"
+start_reporter "$TMP/watch" -B node_modules -G build
+wait_for_event "SCAN_DONE" 50 || true
+touch "$TMP/watch/node_modules/pkg/index.js" "$TMP/watch/src/main.c"
+touch "$TMP/watch/build/f" "$TMP/watch/build/out/g"
+mkdir "$TMP/watch/src/node_modules" "$TMP/watch/build/new"
+touch "$TMP/watch/src/node_modules/x" "$TMP/watch/build/new/y"
+touch "$TMP/watch/src/done"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/src/done" 50 || true
+drain
+assert_no_event "$TMP/watch/node_modules/pkg/index.js" "skip: nothing under a skipped directory"
+assert_event "CREATE 0 $TMP/watch/src/main.c" "skip: its sibling is watched"
+assert_event "CREATE|ISDIR 0 $TMP/watch/src/node_modules" "skip: a new one is reported by its parent"
+assert_no_event "$TMP/watch/src/node_modules/x" "skip: and not watched"
+assert_event "CREATE 0 $TMP/watch/build/f" "shallow: the directory is watched"
+assert_no_event "$TMP/watch/build/out/g" "shallow: its subdirectories are not"
+assert_no_event "$TMP/watch/build/new/y" "shallow: nor new ones"
+check "cache: each directory asked once" \
+    [ -z "$(sed -n 's/^POLICY [0-9]* //p' "$READY_LOG" | sort | uniq -d)" ]
+check "cache: a shallow directory's children are not asked" [ "$(asked "$TMP/watch/build/out")" = 0 ]
+check "cache: depth given" grep -q "^POLICY 2 $TMP/watch/src/node_modules\$" "$READY_LOG"
+rmdir "$TMP/watch/src/node_modules/x" 2>/dev/null || rm "$TMP/watch/src/node_modules/x"
+rmdir "$TMP/watch/src/node_modules"
+mkdir "$TMP/watch/src/node_modules"
+touch "$TMP/watch/src/again"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/src/again" 50 || true
+stop_reporter
+check "cache: asked again once deleted and made anew" [ "$(asked "$TMP/watch/src/node_modules")" = 2 ]
+
+# same_dev: a filesystem mounted below the root is left alone
+rm -rf "$TMP/watch"
+mkdir -p "$TMP/watch/mnt" "$TMP/watch/local"
+if mount -t tmpfs none "$TMP/watch/mnt" 2>/dev/null; then
+    MOUNTED="$TMP/watch/mnt"
+    start_reporter "$TMP/watch" -N -s watches
+    touch "$TMP/watch/mnt/f" "$TMP/watch/local/f" "$TMP/watch/done"
+    wait_for_event "CLOSE_WRITE 0 $TMP/watch/done" 50 || true
+    drain
+    stop_reporter
+    umount "$MOUNTED"
+    MOUNTED=""
+    assert_no_event "$TMP/watch/mnt/f" "same_dev: the mount is not watched"
+    assert_event "CREATE 0 $TMP/watch/local/f" "same_dev: the rest is"
+else
+    echo "  SKIP  same_dev: cannot mount a tmpfs here"
+fi
+
+# a negative depth
+if "$REPORTER" -Z -1 "$TMP" >/dev/null 2>"$TMP/err"; then
+    check "depth: negative refused" false
+else
+    check "depth: negative refused" grep -q "Invalid argument" "$TMP/err"
+fi
+
+exit $FAILED
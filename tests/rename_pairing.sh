@@ -0,0 +1,62 @@
+#!/bin/sh
+# Paired renames (NotifyOptions.rename_window, reporter -m): a move
+# within the tree, of a file or a directory, across directories too,
+# is one MOVED_TO|RENAME event carrying the old path; nothing is left
+# of its two halves. A file moved out comes out as a DELETE once the
+# window has passed, one moved in as a CREATE. Plain, threaded and
+# with a worker pool, where a rename across directories is a barrier.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== rename_pairing =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP" "${EVENTS_LOG:-}" "${READY_LOG:-}"' EXIT
+
+stat_of() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+for mode in plain threaded pool; do
+    rm -f "${EVENTS_LOG:-}" "${READY_LOG:-}"
+    rm -rf "$TMP/watch" "$TMP/out"
+    mkdir -p "$TMP/watch/a" "$TMP/watch/b" "$TMP/watch/dir/sub" "$TMP/out"
+    echo x >"$TMP/watch/a/f"
+    echo x >"$TMP/watch/a/g"
+    echo x >"$TMP/watch/gone"
+    echo x >"$TMP/out/new"
+    case $mode in
+        plain)    start_reporter "$TMP/watch" -s full -m 300 ;;
+        threaded) start_reporter "$TMP/watch" -s full -m 300 -t ;;
+        pool)     start_reporter "$TMP/watch" -s full -m 300 -p 2 ;;
+    esac
+
+    mv "$TMP/watch/a/f" "$TMP/watch/a/f2"
+    mv "$TMP/watch/a/g" "$TMP/watch/b/g"
+    mv "$TMP/watch/dir" "$TMP/watch/dir2"
+    mv "$TMP/watch/gone" "$TMP/out/gone"
+    mv "$TMP/out/new" "$TMP/watch/new"
+    touch "$TMP/watch/dir2/sub/last"
+    wait_for_event "CLOSE_WRITE 0 $TMP/watch/dir2/sub/last" 100 || true
+    stop_reporter
+
+    assert_event "$TMP/watch/a/f2 FROM $TMP/watch/a/f" "$mode: rename in one directory"
+    assert_event "$TMP/watch/b/g FROM $TMP/watch/a/g" "$mode: rename across directories"
+    assert_event "MOVED_TO|ISDIR|RENAME" "$mode: directory rename flagged"
+    assert_event "$TMP/watch/dir2 FROM $TMP/watch/dir" "$mode: directory rename paired"
+    assert_event "DELETE 0 $TMP/watch/gone" "$mode: moved out comes as DELETE"
+    assert_event "CREATE 0 $TMP/watch/new" "$mode: moved in comes as CREATE"
+    assert_no_event "MOVED_FROM" "$mode: no half-moves left"
+    assert_event "CLOSE_WRITE 0 $TMP/watch/dir2/sub/last" "$mode: renamed directory still watched"
+
+    paired=$(stat_of moves_paired)
+    unpaired=$(stat_of moves_unpaired)
+    if [ "$paired" = 3 ] && [ "$unpaired" = 2 ]; then
+        echo "  PASS  $mode: counted 3 paired, 2 unpaired"
+    else
+        echo "  FAIL  $mode: moves_paired=${paired:-missing} moves_unpaired=${unpaired:-missing}"
+        FAILED=$((FAILED + 1))
+    fi
+done
+
+exit $FAILED
@@ -13,21 +13,120 @@
  * "READY" is written to stderr after initNotify succeeds; tests can
  * poll the stderr file for that token before starting their workload.
  *
+ * Options:
+ *     -w <ms>   stall that long after READY before reading the first
+ *               event, so a test can overflow the kernel queue.
+ *     -s <mode> initial scan mode: background (default), full or
+ *               watches. NOTIFY_SCAN_DONE is followed by a
+ *               "SCAN dirs=<n> entries=<n>" line from
+ *               notifyScanProgress.
+ *     -t        threaded mode (NotifyOptions.threaded).
+ *     -d <us>   sleep that long after each event, to play a slow
+ *               consumer.
+ *     -p <n>[:<ms>] handle events on a pool of n workers (runNotifyPool,
+ *               called with timeout <ms>, default 200; with 0 the
+ *               reporter sleeps 10 ms whenever a call dispatched
+ *               nothing).
+ *     -o        also register one handler per flag with notifyOn;
+ *               each prints "ON <FLAG> <path>" after the EVENT line.
+ *     -u        read the inotify fd through an io_uring with a
+ *               registered buffer (NotifyOptions.external_read). Exits
+ *               77 if the kernel refuses io_uring.
+ *     -x <re>   exclude regex passed to initNotifyOpts.
+ *     -T <file> record phase timings (NotifyOptions.trace) and write
+ *               them to <file> as Chrome trace JSON on exit; prints
+ *               "TRACE <n> spans" or "TRACE error: ..." to stderr.
+ *     -R <file> record a capture of the run (NotifyOptions.record).
+ *     -P <file> replay a capture instead of watching (NotifyOptions.replay);
+ *               exits 0 by itself at the end of the capture.
+ *     -q <n>[:policy] bound the library queue to n events
+ *               (NotifyOptions.queue_events); policy is block (default),
+ *               coalesce or drop.
+ *     -c        deliver by priority class (NotifyOptions.priority).
+ *     -L <pct>  shed load at that kernel queue fill (NotifyOptions.shed).
+ *     -A        allocate through counting hooks (NotifyOptions.allocator)
+ *               that tag each block, so memory freed through the wrong
+ *               allocator aborts; "ALLOC allocs=<n> frees=<n> live=<n>"
+ *               goes to stderr after freeNotify.
+ *     -E <n>    keep n event records for reuse (NotifyOptions.event_pool).
+ *     -m <ms>   pair moves into one event (NotifyOptions.rename_window);
+ *               a NOTIFY_RENAME line ends in "FROM <old path>".
+ *     -H <sock> on SIGUSR1, connect to the Unix socket <sock>, hand the
+ *               watcher over with notifySend, write "HANDOFF" to
+ *               stderr and exit 0.
+ *     -I <sock> instead of watching <dir> (still required, unused),
+ *               listen on <sock> (writing "LISTENING" to stderr) and
+ *               carry on with the watcher received by notifyRecv.
+ *     -e        on SIGUSR1, notifyExport and exec this program again
+ *               with the same arguments plus -F.
+ *     -F <fd>   instead of watching <dir>, notifyImport the state in
+ *               <fd> (what -e passes).
+ *               With -I or -F the first line on stdout is "RESUMED".
+ *     -i        follow each EVENT line with "INFO seq=<n> time=<ns>
+ *               wd=<n> ino=<n> origin=<KERNEL|CRAWL|RESCAN|MARKER>
+ *               stat=<errno>", plus " mode=<octal> size=<n>" when
+ *               stat is 0, from notifyEventInfo. Not with -p.
+ *     -S <mode> look up each event's entry (NotifyOptions.stat): sync
+ *               or uring.
+ *     -D <ms>   NotifyOptions.dirty: instead of EVENT lines, every <ms>
+ *               print what notifyTakeDirty hands over, one
+ *               "DIRTY <FLAGS> <dir>" line per directory and then
+ *               "TAKE <n>". Not with -p or -u.
+ *     -K <k>[:<ms>] keep the <k> hottest paths per class
+ *               (NotifyOptions.hot, half-life <ms>) and print them on
+ *               exit as "HOT <CHANGE|ACCESS|NAMES> <count> <path>",
+ *               hottest first.
+ *     -J <file>[:<size>] append the delivered events to the journal
+ *               <file> (NotifyOptions.journal, journal_size).
+ *     -j <file>[:<offset>] instead of watching <dir> (still required,
+ *               unused), read the journal <file> with notifyJournalRead
+ *               from <offset> (a number, oldest or newest; default
+ *               oldest) and print its events as above. On exit
+ *               "OFFSET <n>" goes to stderr instead of STATS.
+ *     -C <sock> instead of watching <dir>, subscribe to the events
+ *               under it from the rnotifyd listening on <sock>
+ *               (notifyConnect) and print them as above, draining
+ *               each batch with timeout 0 before polling
+ *               notifyClientFd; no STATS.
+ *     -M <mask> with -C, the mask to subscribe with (default
+ *               IN_ALL_EVENTS; 0x-prefixed hex is fine).
+ *     -f <re>   with -C, the filter to subscribe with.
+ *     -Z <n>    watch at most n levels below <dir> (NotifyOptions.max_depth).
+ *     -N        do not watch other filesystems (NotifyOptions.same_dev).
+ *     -B <name> skip directories called <name> (NotifyOptions.recurse);
+ *               each time the policy is asked, "POLICY <depth> <path>"
+ *               goes to stderr.
+ *     -G <name> watch directories called <name> without their
+ *               subdirectories (NOTIFY_RECURSE_SHALLOW); as -B.
+ *
+ * On exit a "STATS name=value ..." line with the notifyStats counters
+ * goes to stderr.
+ *
  * Exits 0 on SIGTERM (clean shutdown by the test), nonzero on error.
  */
 
 #include <errno.h>
+#include <stddef.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "rnotify.h"
+#include "rnotify_uring.h"
 
 static volatile sig_atomic_t g_stop = 0;
 static void on_term(int sig) { (void)sig; g_stop = 1; }
+static volatile sig_atomic_t g_handoff = 0;
+static void on_usr1(int sig) { (void)sig; g_handoff = 1; }
 
 struct flag { uint32_t bit; const char* name; };
 static const struct flag g_flags[] = {
@@ -46,33 +145,727 @@ static const struct flag g_flags[] = {
     { IN_ISDIR,         "ISDIR" },
     { IN_IGNORED,       "IGNORED" },
     { IN_Q_OVERFLOW,    "OVERFLOW" },
+    { NOTIFY_RESCAN_BEGIN, "RESCAN_BEGIN" },
+    { NOTIFY_RESCAN_END,   "RESCAN_END" },
+    { NOTIFY_SCAN_DONE,    "SCAN_DONE" },
+    { NOTIFY_EVENTS_DROPPED, "EVENTS_DROPPED" },
+    { NOTIFY_SHED_BEGIN,   "SHED_BEGIN" },
+    { NOTIFY_SHED_END,     "SHED_END" },
+    { NOTIFY_RENAME,       "RENAME" },
+};
+
+static void report_flag(const char* path, uint32_t mask, uint32_t cookie, void* arg)
+{
+    (void)mask;
+    (void)cookie;
+    printf("ON %s %s\n", (const char*)arg, path);
+}
+
+#define STAT(name) { offsetof(NotifyStats, name), #name }
+static const struct { size_t off; const char* name; } g_stats[] = {
+    STAT(bytes_read), STAT(events_read), STAT(events_synthetic),
+    STAT(events_excluded), STAT(queue_depth), STAT(queue_peak),
+    STAT(watches), STAT(watches_added), STAT(watches_retired),
+    STAT(cookies_pending), STAT(renames), STAT(overflows),
+    STAT(alloc_failures), STAT(events_dropped), STAT(events_coalesced),
+    STAT(queue_bytes), STAT(shed_windows), STAT(shed_active),
+    STAT(moves_paired), STAT(moves_unpaired),
+    STAT(stat_lookups), STAT(stat_uring), STAT(stat_crawl),
+    STAT(events_folded), STAT(dirty_dirs),
+    STAT(journal_events), STAT(journal_evicted), STAT(dirs_skipped),
+};
+
+static void print_stats(const Notify* ntf)
+{
+    NotifyStats st;
+    if (notifyStats(ntf, &st) == -1)
+    {
+        return;
+    }
+    fputs("STATS", stderr);
+    for (size_t i = 0; i < sizeof(g_stats)/sizeof(g_stats[0]); i++)
+    {
+        fprintf(stderr, " %s=%lu", g_stats[i].name,
+                *(const unsigned long*)((const char*)&st + g_stats[i].off));
+    }
+    fputc('\n', stderr);
+}
+
+/*
+ * Counting allocator for -A. Every block starts with a tag so a free
+ * of memory the hooks did not hand out is caught here, and one of
+ * theirs released with free() trips the C library's own checks.
+ */
+#define ALLOC_TAG 0x726e6f74u
+struct allocHead
+{
+    uint32_t tag;
+    max_align_t align[];
 };
+static unsigned long g_allocs = 0;
+static unsigned long g_frees = 0;
 
-static void print_mask(uint32_t mask)
+static void* tagged(struct allocHead* h)
 {
-    int first = 1;
+    if (h == NULL)
+    {
+        return NULL;
+    }
+    h->tag = ALLOC_TAG;
+    return h->align;
+}
+
+static struct allocHead* untag(void* ptr)
+{
+    struct allocHead* h = (struct allocHead*)((char*)ptr - offsetof(struct allocHead, align));
+    if (h->tag != ALLOC_TAG)
+    {
+        fprintf(stderr, "ALLOC foreign block %p\n", ptr);
+        abort();
+    }
+    return h;
+}
+
+static void* count_alloc(void* ud, size_t size)
+{
+    (void)ud;
+    __atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED);
+    return tagged((struct allocHead*)malloc(sizeof(struct allocHead) + size));
+}
+
+static void* count_realloc(void* ud, void* ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return count_alloc(ud, size);
+    }
+    return tagged((struct allocHead*)realloc(untag(ptr), sizeof(struct allocHead) + size));
+}
+
+static void count_free(void* ud, void* ptr)
+{
+    (void)ud;
+    __atomic_add_fetch(&g_frees, 1, __ATOMIC_RELAXED);
+    free(untag(ptr));
+}
+
+static const NotifyAllocator g_counting = { count_alloc, count_realloc, count_free, NULL };
+
+static Notify* g_ntf = NULL;
+static int g_delay_us = 0;
+static int g_info = 0;
+static NotifyEventInfo g_journal_info;
+
+static const char* g_skip_name = NULL;
+static const char* g_shallow_name = NULL;
+
+static const char* const g_origins[] = { "KERNEL", "CRAWL", "RESCAN", "MARKER" };
+static const char* const g_hot_classes[] = { "CHANGE", "ACCESS", "NAMES" };
+
+/*
+ * Print one EVENT line. The line is assembled first and written with
+ * a single call so that pool workers never interleave their output.
+ */
+static void flag_names(uint32_t mask, char* flags, size_t size)
+{
+    flags[0] = '\0';
     for (size_t i = 0; i < sizeof(g_flags)/sizeof(g_flags[0]); i++)
     {
         if (mask & g_flags[i].bit)
         {
-            if (!first) fputc('|', stdout);
-            fputs(g_flags[i].name, stdout);
-            first = 0;
+            if (flags[0]) strcat(flags, "|");
+            strcat(flags, g_flags[i].name);
         }
     }
-    if (first)
+    if (!flags[0])
+    {
+        snprintf(flags, size, "0x%08x", mask);
+    }
+}
+
+static void report(const char* path, uint32_t mask, uint32_t cookie, void* arg)
+{
+    (void)arg;
+    char flags[256];
+    flag_names(mask, flags, sizeof(flags));
+    if (mask & NOTIFY_RENAME)
+    {
+        printf("EVENT %s %u %s FROM %s\n", flags, cookie, path, notifyRenameSource(path, mask));
+    }
+    else
+    {
+        printf("EVENT %s %u %s\n", flags, cookie, path ? path : "");
+    }
+    const NotifyEventInfo* info = !g_info ? NULL : g_ntf ? notifyEventInfo(g_ntf) : &g_journal_info;
+    if (info)
+    {
+        char st[64] = "";
+        if (info->stat.err == 0)
+        {
+            snprintf(st, sizeof(st), " mode=%o size=%llu",
+                     (unsigned int)info->stat.mode, (unsigned long long)info->stat.size);
+        }
+        printf("INFO seq=%llu time=%llu wd=%d ino=%llu origin=%s stat=%d%s\n",
+               (unsigned long long)info->seq, (unsigned long long)info->time_ns,
+               info->wd, (unsigned long long)info->dir_ino,
+               (info->origin >= 0 && info->origin <= NOTIFY_ORIGIN_MARKER) ? g_origins[info->origin] : "?",
+               info->stat.err, st);
+    }
+    if ((mask & NOTIFY_SCAN_DONE) && g_ntf)
+    {
+        unsigned long dirs = 0, entries = 0;
+        notifyScanProgress(g_ntf, &dirs, &entries);
+        printf("SCAN dirs=%lu entries=%lu\n", dirs, entries);
+    }
+    if (g_delay_us > 0)
+    {
+        usleep((useconds_t)g_delay_us);
+    }
+}
+
+/*
+ * Just enough of an io_uring for one read in flight: no liburing here,
+ * which is also what keeps rnotify_uring.h honest about not needing it.
+ */
+struct ring
+{
+    int fd;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_sqe* sqes;
+};
+
+static int ring_init(struct ring* r, void* buf, size_t len)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, 2, &p);
+    if (r->fd < 0)
+    {
+        return -1;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char* sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    char* cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED)
     {
-        printf("0x%08x", mask);
+        return -1;
     }
+    r->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    struct iovec iov = { buf, len };
+    return (int)syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+/* Read into the registered buffer and wait for it; returns cqe->res. */
+static int ring_read(struct ring* r, Notify* ntf, void* buf, unsigned int len)
+{
+    unsigned int tail = *r->sq_tail;
+    unsigned int idx = tail & *r->sq_mask;
+    notifyPrepRead(&r->sqes[idx], ntf, buf, len, 0, 1);
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    unsigned int submit = 1;
+    for (;;)
+    {
+        unsigned int head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            int res = r->cqes[head & *r->cq_mask].res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return res;
+        }
+        if (g_stop)
+        {
+            return -EINTR;
+        }
+        if (syscall(__NR_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0)
+        {
+            submit = 0;
+        }
+        else if (errno != EINTR)
+        {
+            return -errno;
+        }
+    }
+}
+
+static int unix_socket(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+/* -H: hand `ntf` to whoever listens on `path`. */
+static int send_handoff(Notify* ntf, const char* path)
+{
+    struct sockaddr_un addr;
+    int sock = unix_socket(path, &addr);
+    if (sock == -1
+        || -1 == connect(sock, (struct sockaddr*)&addr, sizeof(addr))
+        || -1 == notifySend(ntf, sock))
+    {
+        fprintf(stderr, "notifySend(%s) failed: %s\n", path, strerror(errno));
+        if (sock != -1)
+        {
+            close(sock);
+        }
+        return -1;
+    }
+    close(sock);
+    return 0;
+}
+
+/* -I: wait on `path` for a watcher handed over with -H. */
+static Notify* recv_handoff(const char* path, const NotifyOptions* opts)
+{
+    struct sockaddr_un addr;
+    int sock = unix_socket(path, &addr);
+    unlink(path);
+    if (sock == -1
+        || -1 == bind(sock, (struct sockaddr*)&addr, sizeof(addr))
+        || -1 == listen(sock, 1))
+    {
+        fprintf(stderr, "listen(%s) failed: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    fprintf(stderr, "LISTENING\n");
+    fflush(stderr);
+
+    Notify* ntf = NULL;
+    int conn = accept(sock, NULL, NULL);
+    if (conn != -1)
+    {
+        ntf = notifyRecv(conn, opts);
+    }
+    if (ntf == NULL)
+    {
+        fprintf(stderr, "notifyRecv(%s) failed: %s\n", path, strerror(errno));
+    }
+    if (conn != -1)
+    {
+        close(conn);
+    }
+    close(sock);
+    unlink(path);
+    return ntf;
+}
+
+/*
+ * -e: export `ntf` and run this program again with the state fd. Only
+ * returns on failure.
+ */
+static void exec_handoff(Notify* ntf, int argc, char** argv)
+{
+    int state_fd = notifyExport(ntf);
+    if (state_fd == -1)
+    {
+        fprintf(stderr, "notifyExport failed: %s\n", strerror(errno));
+        return;
+    }
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", state_fd);
+    char** args = (char**)calloc((size_t)argc + 3, sizeof(char*));
+    if (args == NULL)
+    {
+        return;
+    }
+    int n = 0;
+    args[n++] = argv[0];
+    args[n++] = "-F";
+    args[n++] = fd_arg;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-F"))
+        {
+            i++;
+            continue;
+        }
+        args[n++] = argv[i];
+    }
+    fprintf(stderr, "HANDOFF\n");
+    fflush(stderr);
+    fflush(stdout);
+    execv("/proc/self/exe", args);
+    fprintf(stderr, "exec failed: %s\n", strerror(errno));
+    free(args);
+}
+
+/*
+ * -B / -G: NotifyOptions.recurse, by the directory's name.
+ */
+static int recurse_policy(const char* path, int depth, void* arg)
+{
+    (void)arg;
+    fprintf(stderr, "POLICY %d %s\n", depth, path);
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (g_skip_name && !strcmp(name, g_skip_name))
+    {
+        return NOTIFY_RECURSE_SKIP;
+    }
+    if (g_shallow_name && !strcmp(name, g_shallow_name))
+    {
+        return NOTIFY_RECURSE_SHALLOW;
+    }
+    return NOTIFY_RECURSE_ACCEPT;
+}
+
+/*
+ * -C: print the events the daemon at `sock` sends for `dir` until
+ * SIGTERM, the way the README suggests: drain each batch with timeout
+ * 0, then poll notifyClientFd. Returns the exit code.
+ */
+static int read_daemon(const char* sock, const char* dir, uint32_t mask, const char* filter, int stall_ms)
+{
+    NotifyClient* c = notifyConnect(sock, dir, mask, filter);
+    if (c == NULL)
+    {
+        fprintf(stderr, "notifyConnect(%s) failed: %s\n", sock, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "READY\n");
+    fflush(stderr);
+    if (stall_ms > 0)
+    {
+        usleep((useconds_t)stall_ms * 1000);
+    }
+
+    int exitcode = 0;
+    while (!g_stop)
+    {
+        /* not NULL: a call that delivers nothing must clear it */
+        char* path = (char*)sock;
+        uint32_t m = 0;
+        uint32_t cookie = 0;
+        if (notifyClientWait(c, &path, &m, 0, &cookie) == -1)
+        {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "notifyClientWait error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+        if (path == sock)
+        {
+            fprintf(stderr, "notifyClientWait left the path set\n");
+            exitcode = 1;
+            break;
+        }
+        if (path)
+        {
+            report(path, m, cookie, NULL);
+            free(path);
+            continue;
+        }
+        if (poll(&(struct pollfd){ notifyClientFd(c), POLLIN, 0 }, 1, 200) == -1
+            && errno != EINTR)
+        {
+            fprintf(stderr, "poll error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+    }
+    notifyClientClose(c);
+    return exitcode;
+}
+
+/*
+ * -j: print the events of the journal named in `spec` until SIGTERM,
+ * then its offset. Returns the exit code.
+ */
+static int read_journal(const char* spec, int stall_ms)
+{
+    char file[4096];
+    snprintf(file, sizeof(file), "%s", spec);
+    uint64_t offset = NOTIFY_JOURNAL_OLDEST;
+    char* colon = strrchr(file, ':');
+    if (colon)
+    {
+        *colon = '\0';
+        if (!strcmp(colon + 1, "newest"))
+        {
+            offset = NOTIFY_JOURNAL_NEWEST;
+        }
+        else if (strcmp(colon + 1, "oldest"))
+        {
+            offset = strtoull(colon + 1, NULL, 10);
+        }
+    }
+    NotifyJournal* j = notifyJournalOpen(file, offset);
+    if (j == NULL)
+    {
+        fprintf(stderr, "notifyJournalOpen(%s) failed: %s\n", file, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "READY\n");
+    fflush(stderr);
+    if (stall_ms > 0)
+    {
+        usleep((useconds_t)stall_ms * 1000);
+    }
+
+    int exitcode = 0;
+    while (!g_stop)
+    {
+        const char* path = NULL;
+        uint32_t mask = 0;
+        uint32_t cookie = 0;
+        if (notifyJournalRead(j, &path, &mask, 200, &cookie, &g_journal_info) == -1)
+        {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "notifyJournalRead error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+        if (path)
+        {
+            report(path, mask, cookie, NULL);
+        }
+    }
+    fprintf(stderr, "OFFSET %llu\n", (unsigned long long)notifyJournalOffset(j));
+    notifyJournalClose(j);
+    return exitcode;
 }
 
 int main(int argc, char** argv)
 {
-    if (argc != 2)
+    int stall_ms = 0;
+    int dirty_ms = 0;
+    int pool_threads = 0;
+    int pool_ms = 200;
+    int per_flag = 0;
+    int uring = 0;
+    const char* exclude = NULL;
+    const char* trace_file = NULL;
+    int replay = 0;
+    const char* send_sock = NULL;
+    const char* recv_sock = NULL;
+    int exec_self = 0;
+    int state_fd = -1;
+    const char* journal_read = NULL;
+    const char* daemon_sock = NULL;
+    uint32_t daemon_mask = IN_ALL_EVENTS;
+    const char* daemon_filter = NULL;
+    NotifyOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    int opt;
+    while ((opt = getopt(argc, argv, "w:s:td:p:oux:T:R:P:q:cL:AE:m:H:I:eF:iS:D:K:J:j:C:M:f:Z:NB:G:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            stall_ms = atoi(optarg);
+            break;
+        case 's':
+            if (!strcmp(optarg, "full"))
+            {
+                opts.scan = NOTIFY_SCAN_FULL;
+            }
+            else if (!strcmp(optarg, "watches"))
+            {
+                opts.scan = NOTIFY_SCAN_WATCHES;
+            }
+            else if (strcmp(optarg, "background"))
+            {
+                optind = argc + 1;
+            }
+            break;
+        case 't':
+            opts.threaded = 1;
+            break;
+        case 'd':
+            g_delay_us = atoi(optarg);
+            break;
+        case 'p':
+        {
+            char* ms = NULL;
+            pool_threads = (int)strtol(optarg, &ms, 10);
+            if (*ms == ':')
+            {
+                pool_ms = atoi(ms + 1);
+            }
+            else if (*ms)
+            {
+                optind = argc + 1;
+            }
+            break;
+        }
+        case 'o':
+            per_flag = 1;
+            break;
+        case 'u':
+            uring = 1;
+            opts.external_read = 1;
+            break;
+        case 'x':
+            exclude = optarg;
+            break;
+        case 'T':
+            trace_file = optarg;
+            opts.trace = 65536;
+            break;
+        case 'R':
+            opts.record = optarg;
+            break;
+        case 'P':
+            opts.replay = optarg;
+            replay = 1;
+            break;
+        case 'q':
+        {
+            char* policy = NULL;
+            opts.queue_events = strtoul(optarg, &policy, 10);
+            if (!strcmp(policy, ":coalesce"))
+            {
+                opts.queue_policy = NOTIFY_QUEUE_COALESCE;
+            }
+            else if (!strcmp(policy, ":drop"))
+            {
+                opts.queue_policy = NOTIFY_QUEUE_DROP;
+            }
+            else if (*policy && strcmp(policy, ":block"))
+            {
+                optind = argc + 1;
+            }
+            break;
+        }
+        case 'c':
+            opts.priority = 1;
+            break;
+        case 'L':
+            opts.shed = atoi(optarg);
+            break;
+        case 'A':
+            opts.allocator = &g_counting;
+            break;
+        case 'E':
+            opts.event_pool = (unsigned int)atoi(optarg);
+            break;
+        case 'm':
+            opts.rename_window = atoi(optarg);
+            break;
+        case 'H':
+            send_sock = optarg;
+            break;
+        case 'I':
+            recv_sock = optarg;
+            break;
+        case 'e':
+            exec_self = 1;
+            break;
+        case 'F':
+            state_fd = atoi(optarg);
+            break;
+        case 'i':
+            g_info = 1;
+            break;
+        case 'S':
+            if (!strcmp(optarg, "sync"))
+            {
+                opts.stat = NOTIFY_STAT_SYNC;
+            }
+            else if (!strcmp(optarg, "uring"))
+            {
+                opts.stat = NOTIFY_STAT_URING;
+            }
+            else
+            {
+                optind = argc + 1;
+            }
+            break;
+        case 'D':
+            opts.dirty = 1;
+            dirty_ms = atoi(optarg);
+            break;
+        case 'K':
+        {
+            char* halflife = NULL;
+            opts.hot = (unsigned int)strtoul(optarg, &halflife, 10);
+            if (*halflife == ':')
+            {
+                opts.hot_halflife = atoi(halflife + 1);
+            }
+            else if (*halflife)
+            {
+                optind = argc + 1;
+            }
+            break;
+        }
+        case 'J':
+        {
+            /* a copy: -e execs again with argv as it was */
+            static char journal[4096];
+            snprintf(journal, sizeof(journal), "%s", optarg);
+            char* size = strrchr(journal, ':');
+            if (size)
+            {
+                *size = '\0';
+                opts.journal_size = strtoul(size + 1, NULL, 10);
+            }
+            opts.journal = journal;
+            break;
+        }
+        case 'j':
+            journal_read = optarg;
+            break;
+        case 'C':
+            daemon_sock = optarg;
+            break;
+        case 'M':
+            daemon_mask = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            daemon_filter = optarg;
+            break;
+        case 'Z':
+            opts.max_depth = atoi(optarg);
+            break;
+        case 'N':
+            opts.same_dev = 1;
+            break;
+        case 'B':
+            g_skip_name = optarg;
+            opts.recurse = recurse_policy;
+            break;
+        case 'G':
+            g_shallow_name = optarg;
+            opts.recurse = recurse_policy;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1
+        || (uring && (pool_threads || opts.threaded || replay))
+        || (uring && (send_sock || exec_self))
+        || (recv_sock && state_fd != -1)
+        || (g_info && pool_threads)
+        || (opts.dirty && (pool_threads || uring))
+        || (journal_read && (recv_sock || state_fd != -1))
+        || (daemon_sock && (journal_read || recv_sock || state_fd != -1))
+        || (g_info && daemon_sock))
     {
-        fprintf(stderr, "usage: %s <dir>\n", argv[0]);
+        fprintf(stderr, "usage: %s [-w ms] [-s mode] [-t] [-d us] [-p n[:ms]] [-o] [-u] [-x re] [-T file] [-R file | -P file] [-q n[:policy]] [-c] [-L pct] [-A] [-E n] [-m ms] [-H sock | -e] [-I sock | -F fd | -j file[:offset] | -C sock [-M mask] [-f re]] [-i] [-S mode] [-D ms] [-K k[:ms]] [-J file[:size]] [-Z n] [-N] [-B name] [-G name] <dir>\n", argv[0]);
         return 2;
     }
+    const char* dir = argv[optind];
 
     /* line-buffered so each EVENT flushes immediately */
     setvbuf(stdout, NULL, _IOLBF, 0);
@@ -80,42 +873,218 @@ int main(int argc, char** argv)
     struct sigaction sa = { .sa_handler = on_term };
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGINT,  &sa, NULL);
+    struct sigaction su = { .sa_handler = on_usr1 };
+    sigaction(SIGUSR1, &su, NULL);
+
+    if (journal_read)
+    {
+        return read_journal(journal_read, stall_ms);
+    }
+    if (daemon_sock)
+    {
+        return read_daemon(daemon_sock, dir, daemon_mask, daemon_filter, stall_ms);
+    }
 
-    Notify* ntf = initNotify(argv[1], IN_ALL_EVENTS, NULL);
+    Notify* ntf = NULL;
+    if (recv_sock)
+    {
+        ntf = recv_handoff(recv_sock, &opts);
+    }
+    else if (state_fd != -1)
+    {
+        ntf = notifyImport(state_fd, -1, &opts);
+        if (ntf == NULL)
+        {
+            fprintf(stderr, "notifyImport failed: %s\n", strerror(errno));
+        }
+        close(state_fd);
+    }
+    else
+    {
+        ntf = initNotifyOpts(dir, IN_ALL_EVENTS, exclude, &opts);
+        if (ntf == NULL)
+        {
+            fprintf(stderr, "initNotify(%s) failed: %s\n", dir, strerror(errno));
+        }
+    }
     if (ntf == NULL)
     {
-        fprintf(stderr, "initNotify(%s) failed: %s\n", argv[1], strerror(errno));
         return 1;
     }
+    if (recv_sock || state_fd != -1)
+    {
+        printf("RESUMED\n");
+    }
+    g_ntf = ntf;
+
+    NotifyPool* pool = NULL;
+    if (pool_threads == 0)
+    {
+        notifyOn(ntf, 0xffffffff, report, NULL);
+        for (size_t i = 0; per_flag && i < sizeof(g_flags)/sizeof(g_flags[0]); i++)
+        {
+            notifyOn(ntf, g_flags[i].bit, report_flag, (void*)g_flags[i].name);
+        }
+    }
+    else
+    {
+        pool = initNotifyPool(ntf, pool_threads, report, NULL);
+        if (pool == NULL)
+        {
+            fprintf(stderr, "initNotifyPool failed: %s\n", strerror(errno));
+            freeNotify(ntf);
+            return 1;
+        }
+    }
+
+    struct ring r;
+    static char ring_buf[65536] __attribute__((aligned(8)));
+    if (uring
+        && -1 == ring_init(&r, ring_buf, sizeof(ring_buf)))
+    {
+        fprintf(stderr, "io_uring unavailable: %s\n", strerror(errno));
+        freeNotify(ntf);
+        return 77;
+    }
 
     fprintf(stderr, "READY\n");
     fflush(stderr);
 
+    if (stall_ms > 0)
+    {
+        usleep((useconds_t)stall_ms * 1000);
+    }
+
     int exitcode = 0;
-    while (!g_stop)
+    while (pool && !g_stop && !g_handoff)
     {
-        char*    path   = NULL;
-        uint32_t mask   = 0;
-        uint32_t cookie = 0;
-        int rc = waitNotify(ntf, &path, &mask, 200, &cookie);
-        if (rc == 0)
+        long n = runNotifyPool(pool, pool_ms);
+        if (n == 0
+            && pool_ms == 0)
         {
-            fputs("EVENT ", stdout);
-            print_mask(mask);
-            printf(" %u %s\n", cookie, path ? path : "");
-            free(path);
+            usleep(10000);
         }
-        else if (rc == -1)
+        if (n == -1
+            && errno != EINTR)
+        {
+            if (replay && errno == ENODATA) break;
+            fprintf(stderr, "runNotifyPool error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+    }
+    while (uring && !g_stop)
+    {
+        /* deliver what is queued (the initial scan, the last read),
+         * then wait for the ring to bring more; a held IN_MOVED_FROM
+         * is released by the dispatch once its window ends */
+        if (notifyDispatch(ntf, 0, 0) == -1)
         {
             if (errno == EINTR) continue;
-            fprintf(stderr, "waitNotify error: %s\n", strerror(errno));
-            free(path);
+            fprintf(stderr, "io_uring feed error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+        int hold = notifyTimeout(ntf);
+        if (hold >= 0
+            && poll(&(struct pollfd){ notifyFd(ntf), POLLIN, 0 }, 1, hold) == 0)
+        {
+            continue;
+        }
+        if (-1 == notifyCompleteRead(ntf, ring_read(&r, ntf, ring_buf, sizeof(ring_buf)), ring_buf))
+        {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "io_uring feed error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+    }
+    while (opts.dirty && !g_stop && !g_handoff)
+    {
+        NotifyDirty* dirs = NULL;
+        long n = notifyTakeDirty(ntf, &dirs, 200);
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            if (replay && errno == ENODATA) break;
+            fprintf(stderr, "notifyTakeDirty error: %s\n", strerror(errno));
+            exitcode = 1;
+            break;
+        }
+        for (long i = 0; i < n; i++)
+        {
+            char flags[256];
+            flag_names(dirs[i].mask, flags, sizeof(flags));
+            printf("DIRTY %s %s\n", flags, dirs[i].path);
+        }
+        if (n > 0)
+        {
+            printf("TAKE %ld\n", n);
+            usleep((useconds_t)dirty_ms * 1000);
+        }
+        notifyFree(ntf, dirs);
+    }
+    while (!pool && !uring && !opts.dirty && !g_stop && !g_handoff)
+    {
+        /* 0 on timeout: loop and check g_stop */
+        if (notifyDispatch(ntf, 64, 200) == -1)
+        {
+            if (errno == EINTR) continue;
+            if (replay && errno == ENODATA) break;
+            fprintf(stderr, "notifyDispatch error: %s\n", strerror(errno));
             exitcode = 1;
             break;
         }
-        /* rc > 0: timeout, loop and check g_stop */
     }
 
+    freeNotifyPool(pool);
+    if (g_handoff && !g_stop && send_sock)
+    {
+        if (0 == send_handoff(ntf, send_sock))
+        {
+            fprintf(stderr, "HANDOFF\n");
+            return 0;
+        }
+        exitcode = 1;
+    }
+    else if (g_handoff && !g_stop && exec_self)
+    {
+        exec_handoff(ntf, argc, argv);
+        return 1;
+    }
+    for (int c = 0; opts.hot && c < NOTIFY_HOT_CLASSES; c++)
+    {
+        NotifyHot* hot = NULL;
+        long n = notifyHotPaths(ntf, c, &hot);
+        for (long i = 0; i < n; i++)
+        {
+            printf("HOT %s %llu %s\n", g_hot_classes[c], (unsigned long long)hot[i].count, hot[i].path);
+        }
+        notifyFree(ntf, hot);
+    }
+    print_stats(ntf);
+    if (trace_file)
+    {
+        FILE* f = fopen(trace_file, "w");
+        int spans = f ? notifyTraceDump(ntf, fileno(f)) : -1;
+        if (spans == -1)
+        {
+            fprintf(stderr, "TRACE error: %s\n", strerror(errno));
+        }
+        else
+        {
+            fprintf(stderr, "TRACE %d spans\n", spans);
+        }
+        if (f)
+        {
+            fclose(f);
+        }
+    }
     freeNotify(ntf);
+    if (opts.allocator)
+    {
+        fprintf(stderr, "ALLOC allocs=%lu frees=%lu live=%lu\n",
+                g_allocs, g_frees, g_allocs - g_frees);
+    }
     return exitcode;
 }
@@ -13,7 +13,14 @@ passed=0
 failed=0
 failed_names=""
 
-for t in deep_mkdir.sh atomic_save.sh symlink_no_follow.sh recursive_move.sh; do
+for t in deep_mkdir.sh atomic_save.sh symlink_no_follow.sh recursive_move.sh \
+         overflow_rescan.sh scan_modes.sh slow_consumer.sh pool_order.sh \
+         dispatch_routing.sh uring_feed.sh stats.sh trace.sh \
+         record_replay.sh memory.sh queue_bound.sh priority.sh \
+         shedding.sh alloc_hooks.sh cxx_api.sh \
+         rename_pairing.sh handoff.sh event_info.sh stat_enrich.sh \
+         dirty_set.sh hot_paths.sh journal.sh daemon.sh \
+         recurse_policy.sh; do
     if [ ! -x "$t" ]; then
         echo "skip $t (not executable)"
         continue
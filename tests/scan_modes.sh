@@ -0,0 +1,53 @@
+#!/bin/sh
+# Initial scan modes. A small tree exists before the reporter starts.
+# Every mode must end its initial scan with SCAN_DONE and report the
+# same progress counts; "background" and "full" surface every
+# pre-existing entry before the marker, "watches" surfaces none of
+# them yet still watches the whole tree.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== scan_modes =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+mkdir -p "$TMP/watch/a/b/c"
+echo "1" >"$TMP/watch/a/b/c/f1"
+echo "2" >"$TMP/watch/a/b/c/f2"
+
+# line number of the first log line containing a fixed string
+line_of() {
+    grep -Fn "$1" "$EVENTS_LOG" | head -n 1 | cut -d: -f1
+}
+
+for mode in background full watches; do
+    echo "-- $mode"
+    start_reporter "$TMP/watch" -s "$mode"
+    drain
+
+    assert_event "SCAN_DONE"                  "$mode: SCAN_DONE delivered"
+    assert_event "SCAN dirs=4 entries=5"      "$mode: progress counts the whole tree"
+
+    if [ "$mode" = "watches" ]; then
+        assert_no_event "CREATE"              "$mode: no events for existing entries"
+    else
+        done_at=$(line_of "SCAN_DONE")
+        leaf_at=$(line_of "CREATE 0 $TMP/watch/a/b/c/f2")
+        if [ -n "$leaf_at" ] && [ -n "$done_at" ] && [ "$leaf_at" -lt "$done_at" ]; then
+            echo "  PASS  $mode: deepest entry precedes SCAN_DONE"
+        else
+            echo "  FAIL  $mode: deepest entry precedes SCAN_DONE (leaf=$leaf_at done=$done_at)"
+            FAILED=$((FAILED + 1))
+        fi
+    fi
+
+    echo "$mode" >"$TMP/watch/a/b/c/live.$mode"
+    drain
+    assert_event "$TMP/watch/a/b/c/live.$mode" "$mode: deepest directory is watched"
+
+    stop_reporter
+    rm -f "$TMP/watch/a/b/c/live.$mode"
+done
+
+exit $FAILED
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Load shedding: a stalled consumer finds a quarter-full kernel queue
+# on its first read, so the watches lose IN_ACCESS/IN_OPEN/
+# IN_CLOSE_NOWRITE until a quiet read brings them back. Reading a file
+# inside that window must go unreported, reading it after the window
+# must not, and the window is bracketed by markers and counted.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== shedding =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+stat() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+expect_stat() {
+    got=$(stat "$1")
+    if [ -n "$got" ] && [ "$got" "$2" "$3" ]; then
+        echo "  PASS  $4 ($1=$got)"
+    else
+        echo "  FAIL  $4 ($1=${got:-missing}, expected $2 $3)"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+count=$((queued / 8))
+
+mkdir -p "$TMP/watch/sub"
+echo data >"$TMP/watch/sub/g"
+start_reporter "$TMP/watch" -L 25 -w 3000
+
+# CREATE, OPEN, ATTRIB and CLOSE_WRITE each: about half the queue
+(cd "$TMP/watch" && seq -f "f%g" 1 "$count" | xargs touch)
+
+wait_for_event "CREATE 0 $TMP/watch/f$count" 300 || true
+drain
+assert_event "SHED_BEGIN" "window opens on a quarter-full queue"
+assert_no_event "SHED_END" "window still open while nothing is read"
+
+cat "$TMP/watch/sub/g" >/dev/null
+touch "$TMP/watch/sub/probe"
+wait_for_event "SHED_END" 50 || true
+cat "$TMP/watch/sub/g" >/dev/null
+drain
+stop_reporter
+
+assert_event "SHED_END" "a quiet read closes the window"
+opens=$(grep -c "^EVENT OPEN 0 $TMP/watch/sub/g\$" "$EVENTS_LOG" || true)
+if [ "$opens" -eq 1 ]; then
+    echo "  PASS  read inside the window shed, read after it reported"
+else
+    echo "  FAIL  expected exactly one OPEN of sub/g, got $opens"
+    FAILED=$((FAILED + 1))
+fi
+assert_event "CREATE 0 $TMP/watch/sub/probe" "changes still reported while shedding"
+expect_stat shed_windows -eq 1 "one window counted"
+expect_stat shed_active -eq 0 "not shedding at exit"
+
+exit $FAILED
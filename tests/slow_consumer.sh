@@ -0,0 +1,52 @@
+#!/bin/sh
+# A consumer that stalls must not make the kernel queue overflow in
+# threaded mode. Both reporters stall before their first waitNotify
+# and then sleep after every event while we flood the root past
+# max_queued_events. The plain one is expected to overflow (and
+# recover); the threaded one must see every create with no overflow,
+# because its reader keeps draining the fd meanwhile.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== slow_consumer =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+count=$((queued / 2 + 1000))
+
+for mode in plain threaded; do
+    rm -rf "$TMP/watch"
+    mkdir "$TMP/watch"
+    if [ $mode = threaded ]; then
+        start_reporter "$TMP/watch" -t -w 3000 -d 50
+    else
+        start_reporter "$TMP/watch" -w 3000 -d 50
+    fi
+
+    (cd "$TMP/watch" && seq -f "f%g" 1 "$count" | xargs touch)
+
+    wait_for_event "CREATE 0 $TMP/watch/f$count" 300 || true
+    drain
+
+    overflows=$(grep -c "OVERFLOW" "$EVENTS_LOG" || true)
+    creates=$(grep -c "^EVENT CREATE 0 " "$EVENTS_LOG" || true)
+    echo "  $mode: $creates creates, $overflows overflows"
+
+    assert_event "CREATE 0 $TMP/watch/f$count" "$mode: end of the flood is reported"
+    if [ $mode = threaded ]; then
+        assert_no_event "OVERFLOW" "threaded: reader keeps the kernel queue drained"
+        if [ "$creates" -eq "$count" ]; then
+            echo "  PASS  threaded: every create delivered once"
+        else
+            echo "  FAIL  threaded: expected $count creates"
+            FAILED=$((FAILED + 1))
+        fi
+    fi
+
+    stop_reporter
+    rm -f "$EVENTS_LOG" "$READY_LOG"
+done
+
+exit $FAILED
@@ -0,0 +1,108 @@
+#!/bin/sh
+# NotifyOptions.stat (reporter -S, fields on the -i INFO line):
+#   - entries found by the initial scan reuse the crawl's lstat;
+#   - a change read from the fd is looked up once the read is in: a
+#     file's size and a directory's mode are what stat(1) says;
+#   - an entry gone by the time of the lookup reports ENOENT;
+#   - without the option every event says ENODATA;
+#   - uring mode gives the same answers, through io_uring when the
+#     kernel lets us have one.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== stat_enrich =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+check() {
+    desc=$1
+    shift
+    if "$@"; then
+        echo "  PASS  $desc"
+    else
+        echo "  FAIL  $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# info_of <fixed string>: the INFO line after the first EVENT line
+# containing it.
+info_of() {
+    awk -v p="$1" 'found && /^INFO / { print; exit } /^EVENT / { found = index($0, p) > 0 }' "$EVENTS_LOG"
+}
+
+# field <INFO line> <name>
+field() {
+    echo "$1" | sed -n "s/.* $2=\([^ ]*\).*/\1/p"
+}
+
+# value of one counter in the STATS line
+stat_of() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+ENOENT=2
+ENODATA=61
+
+for mode in sync uring; do
+    rm -rf "$TMP/watch"
+    mkdir -p "$TMP/watch/sub"
+    printf 12345 >"$TMP/watch/old"
+    start_reporter "$TMP/watch" -i -s full -S $mode
+    wait_for_event "SCAN_DONE" 50 || true
+    printf 1234567 >"$TMP/watch/sub/new"
+    mkdir "$TMP/watch/dir"
+    wait_for_event "CREATE|ISDIR 0 $TMP/watch/dir" 50 || true
+    stop_reporter
+
+    crawl=$(info_of "CLOSE_WRITE 0 $TMP/watch/old")
+    live=$(info_of "CLOSE_WRITE 0 $TMP/watch/sub/new")
+    dir=$(info_of "CREATE|ISDIR 0 $TMP/watch/dir")
+    check "$mode: scanned file has its size" \
+        [ "$(field "$crawl" stat)" = 0 -a "$(field "$crawl" size)" = 5 ]
+    check "$mode: scanned entries reuse the crawl's lstat ($(stat_of stat_crawl))" \
+        [ "$(stat_of stat_crawl)" -gt 0 ]
+    check "$mode: written file has its size" \
+        [ "$(field "$live" stat)" = 0 -a "$(field "$live" size)" = 7 ]
+    check "$mode: new directory has its mode" \
+        [ "$(field "$dir" mode)" = "$(printf '%o' "0x$(stat -c %f "$TMP/watch/dir")")" ]
+    check "$mode: live events were looked up ($(stat_of stat_lookups))" \
+        [ "$(stat_of stat_lookups)" -gt 0 ]
+    if [ $mode = uring ]; then
+        if [ "$(stat_of stat_uring)" -gt 0 ]; then
+            check "uring: lookups went through io_uring" \
+                [ "$(stat_of stat_uring)" -eq "$(stat_of stat_lookups)" ]
+        else
+            echo "  SKIP  uring: no io_uring here, looked up with statx"
+        fi
+    else
+        check "sync: no io_uring" [ "$(stat_of stat_uring)" = 0 ]
+    fi
+    rm -f "$EVENTS_LOG" "$READY_LOG"
+done
+
+# gone before the lookup: the reporter stalls, the file comes and goes
+rm -rf "$TMP/watch"
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -i -S sync -w 1000
+touch "$TMP/watch/brief"
+rm "$TMP/watch/brief"
+wait_for_event "DELETE 0 $TMP/watch/brief" 50 || true
+stop_reporter
+check "gone: lookup reports ENOENT" \
+    [ "$(field "$(info_of "CREATE 0 $TMP/watch/brief")" stat)" = $ENOENT ]
+rm -f "$EVENTS_LOG" "$READY_LOG"
+
+# off
+rm -rf "$TMP/watch"
+mkdir "$TMP/watch"
+start_reporter "$TMP/watch" -i
+touch "$TMP/watch/plain"
+wait_for_event "CLOSE_WRITE 0 $TMP/watch/plain" 50 || true
+stop_reporter
+check "off: no lookup, ENODATA" \
+    [ "$(field "$(info_of "CLOSE_WRITE 0 $TMP/watch/plain")" stat)" = $ENODATA ]
+check "off: nothing counted" [ "$(stat_of stat_lookups)" = 0 -a "$(stat_of stat_crawl)" = 0 ]
+
+exit $FAILED
@@ -0,0 +1,60 @@
+#!/bin/sh
+# notifyStats counters, as dumped by the reporter on exit. A small
+# known workload must leave every counter where it can be predicted:
+# watches added and retired, one directory rename applied, no cookie
+# left pending, excluded names counted rather than delivered.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== stats =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+mkdir -p "$TMP/watch/pre"
+start_reporter "$TMP/watch" -x '^skip'
+
+mkdir -p "$TMP/watch/a/b"
+wait_for_event "CREATE|ISDIR 0 $TMP/watch/a/b" || true
+mv "$TMP/watch/a" "$TMP/watch/z"
+touch "$TMP/watch/skip1" "$TMP/watch/skip2"
+rmdir "$TMP/watch/pre"
+
+drain
+stop_reporter
+
+# value of one counter in the STATS line
+stat() {
+    sed -n "s/^STATS.* $1=\([0-9]*\).*/\1/p" "$READY_LOG"
+}
+
+expect_stat() {
+    name=$1
+    op=$2
+    want=$3
+    got=$(stat "$name")
+    if [ -n "$got" ] && [ "$got" "$op" "$want" ]; then
+        echo "  PASS  $name=$got ($op $want)"
+    else
+        echo "  FAIL  $name=${got:-missing}, expected $op $want"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+expect_stat watches_added    -eq 4     # root, pre, a, a/b
+expect_stat watches_retired  -eq 1     # pre
+expect_stat watches          -eq 3
+expect_stat renames          -eq 1
+expect_stat cookies_pending  -eq 0
+expect_stat events_excluded  -ge 4     # at least CREATE and CLOSE_WRITE per skip file
+expect_stat events_synthetic -ge 2     # pre's CREATE from the scan, SCAN_DONE
+expect_stat events_read      -ge 10
+expect_stat bytes_read       -ge 160
+expect_stat queue_depth      -eq 0
+expect_stat queue_peak       -ge 1
+expect_stat overflows        -eq 0
+expect_stat alloc_failures   -eq 0
+
+assert_no_event "$TMP/watch/skip" "excluded names are not delivered"
+
+exit $FAILED
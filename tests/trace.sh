@@ -0,0 +1,65 @@
+#!/bin/sh
+# Per-phase tracing. With the tracer compiled in (reporter_trace), a
+# workload touching every phase must come out as valid Chrome trace
+# JSON naming each of them. The regular build must refuse to dump,
+# proving the hooks are compiled out rather than merely idle.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== trace =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+PLAIN_REPORTER=$REPORTER
+REPORTER=$TESTS_DIR/reporter_trace
+[ -x "$REPORTER" ] || { echo "build reporter_trace first: cd .. && make check"; exit 2; }
+
+mkdir -p "$TMP/watch/pre"
+start_reporter "$TMP/watch" -x '^skip' -T "$TMP/trace.json"
+
+mkdir -p "$TMP/watch/a/b"
+echo x >"$TMP/watch/a/b/f"
+touch "$TMP/watch/skip"
+wait_for_event "$TMP/watch/a/b/f" || true
+mv "$TMP/watch/a" "$TMP/watch/z"
+
+drain
+stop_reporter
+
+if grep -q "^TRACE [0-9]* spans" "$READY_LOG"; then
+    echo "  PASS  trace dumped: $(grep -o 'TRACE [0-9]* spans' "$READY_LOG")"
+else
+    echo "  FAIL  trace dump: $(grep '^TRACE' "$READY_LOG" || echo none)"
+    FAILED=$((FAILED + 1))
+fi
+
+if command -v python3 >/dev/null 2>&1; then
+    if python3 -c 'import json, sys; d = json.load(open(sys.argv[1])); assert all(e["ph"] == "X" and e["dur"] >= 0 for e in d["traceEvents"])' "$TMP/trace.json"; then
+        echo "  PASS  output parses as trace-event JSON"
+    else
+        echo "  FAIL  output is not valid trace-event JSON"
+        FAILED=$((FAILED + 1))
+    fi
+fi
+
+for phase in wait read parse exclude path rename crawl; do
+    if grep -q "\"name\":\"$phase\"" "$TMP/trace.json"; then
+        echo "  PASS  phase $phase recorded"
+    else
+        echo "  FAIL  phase $phase missing"
+        FAILED=$((FAILED + 1))
+    fi
+done
+
+REPORTER=$PLAIN_REPORTER
+start_reporter "$TMP/watch" -T "$TMP/plain.json"
+stop_reporter
+if grep -q "^TRACE error: " "$READY_LOG"; then
+    echo "  PASS  regular build has no tracer"
+else
+    echo "  FAIL  regular build: $(grep '^TRACE' "$READY_LOG" || echo no TRACE line)"
+    FAILED=$((FAILED + 1))
+fi
+
+exit $FAILED
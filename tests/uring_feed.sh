@@ -0,0 +1,60 @@
+#!/bin/sh
+# Reading the inotify fd through the caller's io_uring. The reporter
+# owns a ring with one registered buffer, reads with notifyPrepRead
+# and feeds completions back with notifyCompleteRead; the library
+# never reads the fd. Recursive bookkeeping (new subtrees, directory
+# renames) and overflow recovery must work exactly as with waitNotify.
+
+. "$(dirname "$0")/lib.sh"
+
+echo "== uring_feed =="
+FAILED=0
+TMP=$(mktemp -d)
+trap 'stop_reporter; rm -rf "$TMP"' EXIT
+
+mkdir "$TMP/watch"
+"$REPORTER" -u "$TMP/watch" >/dev/null 2>&1 &
+probe=$!
+sleep 0.5
+if ! kill -0 $probe 2>/dev/null; then
+    wait $probe || rc=$?
+    if [ "${rc:-0}" -eq 77 ]; then
+        echo "  SKIP  io_uring not available"
+        exit 0
+    fi
+fi
+kill -TERM $probe 2>/dev/null || true
+wait $probe 2>/dev/null || true
+
+start_reporter "$TMP/watch" -u
+
+mkdir -p "$TMP/watch/a/b/c"
+echo x >"$TMP/watch/a/b/c/leaf.txt"
+wait_for_event "$TMP/watch/a/b/c/leaf.txt" || true
+mv "$TMP/watch/a" "$TMP/watch/z"
+echo y >"$TMP/watch/z/b/c/after.txt"
+
+drain
+
+assert_event "CREATE|ISDIR 0 $TMP/watch/a/b/c"    "nested directory is crawled"
+assert_event "CREATE 0 $TMP/watch/a/b/c/leaf.txt" "file inside it is reported"
+assert_event "MOVED_TO|ISDIR"                     "directory rename is delivered"
+assert_event "CREATE 0 $TMP/watch/z/b/c/after.txt" "renamed subtree is still watched"
+
+stop_reporter
+rm -rf "$TMP/watch"
+mkdir "$TMP/watch"
+
+start_reporter "$TMP/watch" -u -w 3000
+queued=$(cat /proc/sys/fs/inotify/max_queued_events)
+count=$((queued / 2 + 1000))
+(cd "$TMP/watch" && seq -f "f%g" 1 "$count" | xargs touch)
+
+wait_for_event "RESCAN_END" 150 || true
+drain
+
+assert_event "OVERFLOW|RESCAN_BEGIN"  "overflow arrives through the ring"
+assert_event "RESCAN_END"             "and is recovered"
+assert_event "$TMP/watch/f$count"     "lost tail of the flood is reported"
+
+exit $FAILED